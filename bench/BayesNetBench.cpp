@@ -0,0 +1,274 @@
+#include "BayesNet.h"
+#include "NetworkGenerator.h"
+#include "Diagnostics.h"
+#include "Benchmark.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdlib>
+#include <functional>
+
+using namespace std;
+
+// Benchmark options; each shape option takes a comma-separated list and
+// every combination of the lists is measured
+struct Options
+{
+	Options() :
+		nodes(1, 200), fan_in(1, 3), depth(1, 10), cardinality(1, 2),
+		samples(20000), burn_in(1000), warmup(2), trials(10), seed(1),
+		format("csv") {}
+
+	vector<unsigned> nodes;
+	vector<unsigned> fan_in;
+	vector<unsigned> depth;
+	vector<unsigned> cardinality;
+	unsigned samples;
+	unsigned burn_in;
+	unsigned warmup;
+	unsigned trials;
+	uint64_t seed;
+	string format;
+	string out;
+};
+
+void usage() {
+	cerr << "usage: bayes_bench [--nodes N,..] [--fan-in F,..] [--depth D,..] [--cardinality K,..]\n"
+		"                   [--samples S] [--burn-in B] [--warmup W] [--trials T] [--seed X]\n"
+		"                   [--format csv|json|text] [--out FILE]" << endl;
+}
+
+vector<unsigned> parse_list(const string& text) {
+	vector<unsigned> values;
+	istringstream in(text);
+	string item;
+	while (getline(in, item, ','))
+		values.push_back(strtoul(item.c_str(), nullptr, 10));
+	return values;
+}
+
+bool parse_options(int argc, char* argv[], Options& options) {
+	for (int i = 1; i < argc; i++) {
+		string flag = argv[i];
+		if (flag == "--help" || i + 1 >= argc)
+			return false;
+		string value = argv[++i];
+		if (flag == "--nodes")
+			options.nodes = parse_list(value);
+		else if (flag == "--fan-in")
+			options.fan_in = parse_list(value);
+		else if (flag == "--depth")
+			options.depth = parse_list(value);
+		else if (flag == "--cardinality")
+			options.cardinality = parse_list(value);
+		else if (flag == "--samples")
+			options.samples = strtoul(value.c_str(), nullptr, 10);
+		else if (flag == "--burn-in")
+			options.burn_in = strtoul(value.c_str(), nullptr, 10);
+		else if (flag == "--warmup")
+			options.warmup = strtoul(value.c_str(), nullptr, 10);
+		else if (flag == "--trials")
+			options.trials = strtoul(value.c_str(), nullptr, 10);
+		else if (flag == "--seed")
+			options.seed = strtoull(value.c_str(), nullptr, 10);
+		else if (flag == "--format")
+			options.format = value;
+		else if (flag == "--out")
+			options.out = value;
+		else
+			return false;
+	}
+	return options.format == "csv" || options.format == "json" || options.format == "text";
+}
+
+template <typename T>
+string str(const T& value) {
+	ostringstream oss;
+	oss << value;
+	return oss.str();
+}
+
+Benchmark make_benchmark(const string& name, const NetworkShape& shape, const Options& options) {
+	Benchmark bm(name);
+	bm.set_param("nodes", str(shape.nodes));
+	bm.set_param("fan_in", str(shape.fan_in));
+	bm.set_param("depth", str(shape.depth));
+	bm.set_param("cardinality", str(shape.cardinality));
+	bm.set_param("samples", str(options.samples));
+	return bm;
+}
+
+// Time one MCMC strategy, counting retained samples, single-site updates
+// and the effective sample size of the query indicator in each trial. A
+// step of a sweeping chain redraws several nodes.
+void time_chain(Benchmark& bm, function<void(function<void(const vector<unsigned>&)>&)> sampler,
+	unsigned query, const Options& options, double updates_per_step = 1) {
+	vector<double> series;
+	series.reserve(options.samples);
+	function<void(const vector<unsigned>&)> record = [&series, query](const vector<unsigned>& state) {
+		series.push_back(state[query] == 0);
+	};
+	for (unsigned i = 0; i < options.warmup + options.trials; i++) {
+		series.clear();
+		if (i < options.warmup) {
+			sampler(record);
+			continue;
+		}
+		bm.start();
+		sampler(record);
+		bm.stop();
+		bm.add_work("samples", options.samples);
+		bm.add_work("node_updates", (options.samples + options.burn_in) * updates_per_step);
+		bm.add_work("effective_samples", effective_sample_size(series));
+	}
+}
+
+// Run one chain type directly on a compiled network, outside BayesNet's
+// choice of chain
+template <typename ChainType>
+void run_chain(const CompiledNet<>& net, const vector<int>& clamp, const Options& options,
+	function<void(const vector<unsigned>&)>& record) {
+	ChainType chain(net, clamp, Xoshiro256(options.seed));
+	for (unsigned i = 0; i < options.burn_in; i++)
+		chain.step();
+	for (unsigned i = 0; i < options.samples; i++) {
+		chain.step();
+		record(chain.state());
+	}
+}
+
+void bench_shape(const NetworkShape& shape, const Options& options, BenchmarkReport& report) {
+	Xoshiro256 engine(options.seed);
+	CompiledNet<> net = generate_network(shape, engine);
+	unsigned n = net.size();
+	unsigned evidence = n - 1;
+	unsigned query = n / 2;
+
+	// Generating the network is itself measured, as the cost of a load
+	{
+		Benchmark bm = make_benchmark("generate", shape, options);
+		bm.run([&shape, &options]() {
+			Xoshiro256 engine(options.seed);
+			generate_network(shape, engine);
+		}, options.warmup, options.trials);
+		bm.add_work("nodes", double(n) * options.trials);
+		report.add(bm);
+	}
+
+	BayesNet<> bn(net);
+	bn.seed(options.seed);
+	bn.set_chains(1);
+	bn.set_cache_capacity(0);
+
+	{
+		Benchmark bm = make_benchmark("forward", shape, options);
+		bm.run([&bn, &options]() { bn.sample_batch(options.samples); },
+			options.warmup, options.trials);
+		bm.add_work("samples", double(options.samples) * options.trials);
+		bm.add_work("node_updates", double(options.samples) * n * options.trials);
+		report.add(bm);
+	}
+
+	bn.observe(net.label(evidence), 0);
+
+	{
+		Benchmark bm = make_benchmark("gibbs", shape, options);
+		time_chain(bm, [&bn, &options](function<void(const vector<unsigned>&)>& record) {
+			bn.gibbs_sample(options.samples, options.burn_in, record);
+		}, query, options);
+		report.add(bm);
+	}
+
+	{
+		// gibbs_sample picks the fixed-cardinality chain on binary
+		// networks; this is the chain it falls back on otherwise
+		vector<int> clamp(n, -1);
+		clamp[evidence] = 0;
+		Benchmark bm = make_benchmark("gibbs_runtime_k", shape, options);
+		time_chain(bm, [&net, &clamp, &options](function<void(const vector<unsigned>&)>& record) {
+			run_chain<GibbsChain<int, int, Xoshiro256>>(net, clamp, options, record);
+		}, query, options);
+		report.add(bm);
+	}
+
+	{
+		Benchmark bm = make_benchmark("chromatic_gibbs", shape, options);
+		time_chain(bm, [&bn, &options](function<void(const vector<unsigned>&)>& record) {
+			bn.chromatic_sample(options.samples, options.burn_in, record);
+		}, query, options, n - 1);
+		report.add(bm);
+	}
+
+	{
+		Benchmark bm = make_benchmark("metropolis", shape, options);
+		time_chain(bm, [&bn, &options](function<void(const vector<unsigned>&)>& record) {
+			bn.metropolis_sample(options.samples, options.burn_in, record);
+		}, query, options);
+		report.add(bm);
+	}
+
+	{
+		// Importance weights shrink the effective size instead of
+		// autocorrelation
+		Benchmark bm = make_benchmark("likelihood_weighting", shape, options);
+		for (unsigned i = 0; i < options.warmup + options.trials; i++) {
+			WeightedStats stats;
+			auto record = [&stats, query](const vector<unsigned>& state, double log_weight) {
+				stats.push(state[query] == 0, log_weight);
+			};
+			if (i < options.warmup) {
+				bn.weighted_sample(options.samples, record);
+				continue;
+			}
+			bm.start();
+			bn.weighted_sample(options.samples, record);
+			bm.stop();
+			bm.add_work("samples", options.samples);
+			bm.add_work("node_updates", double(options.samples) * n);
+			bm.add_work("effective_samples", stats.effective_size());
+		}
+		report.add(bm);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	Options options;
+	if (!parse_options(argc, argv, options)) {
+		usage();
+		return 1;
+	}
+
+	BenchmarkReport report;
+	for (unsigned nodes : options.nodes)
+		for (unsigned fan_in : options.fan_in)
+			for (unsigned depth : options.depth)
+				for (unsigned cardinality : options.cardinality) {
+					NetworkShape shape(nodes, fan_in, depth, cardinality);
+					cerr << "nodes " << nodes << ", fan-in " << fan_in << ", depth " << depth
+						<< ", cardinality " << cardinality << endl;
+					bench_shape(shape, options, report);
+				}
+
+	ofstream file;
+	if (!options.out.empty()) {
+		file.open(options.out.c_str());
+		if (!file) {
+			cerr << "cannot write " << options.out << endl;
+			return 1;
+		}
+	}
+	ostream& out = options.out.empty() ? cout : file;
+	if (options.format == "csv")
+		report.write_csv(out);
+	else if (options.format == "json")
+		report.write_json(out);
+	else
+		for (const Benchmark& bm : report.results())
+			out << bm << endl;
+	return 0;
+}
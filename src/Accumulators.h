@@ -0,0 +1,355 @@
+#ifndef ACCUMULATORS_H
+#define ACCUMULATORS_H
+
+#include "CompiledNet.h"
+#include "Diagnostics.h"
+
+#include <vector>
+#include <map>
+#include <utility>
+
+// Online consumers of chain states. A sampler calls an accumulator with
+// each retained state, as a vector of value indices over the compiled
+// network; the accumulator keeps O(1) memory in the chain length.
+// Accumulators of independent chains are combined with merge().
+
+// Counts of each value of one node
+template <
+	typename NodeType = int,
+	typename ValueType = int
+>
+class Histogram
+{
+public:
+	Histogram(const CompiledNet<NodeType, ValueType>& net, NodeType node_id);
+
+	void operator()(const std::vector<unsigned>& state);
+	void merge(const Histogram& other);
+
+	unsigned long count() const;
+	unsigned long count(unsigned value_index) const;
+
+	// Relative frequency of each value
+	std::map<ValueType, double> distribution() const;
+private:
+	const CompiledNet<NodeType, ValueType>* net_;
+	unsigned node_;
+	std::vector<unsigned long> counts_;
+	unsigned long count_;
+};
+
+// Number of states in which every node of a query holds its value
+template <
+	typename NodeType = int,
+	typename ValueType = int
+>
+class IndicatorCounter
+{
+public:
+	// A query naming an unknown node or value never holds
+	IndicatorCounter(const CompiledNet<NodeType, ValueType>& net,
+		const std::map<NodeType, ValueType>& q);
+
+	void operator()(const std::vector<unsigned>& state);
+	void merge(const IndicatorCounter& other);
+
+	unsigned long hits() const;
+	unsigned long count() const;
+	double estimate() const;
+
+	// Mean and variance of the indicator series
+	const RunningStats& stats() const;
+
+	// Batch means of the indicator series, for its autocorrelation
+	const BatchMeans& batches() const;
+private:
+	std::vector<std::pair<unsigned, unsigned>> query_;
+	bool possible_;
+	unsigned long hits_;
+	RunningStats stats_;
+	BatchMeans batches_;
+};
+
+// Running mean and variance of a node's value
+template <
+	typename NodeType = int,
+	typename ValueType = int
+>
+class RunningMean
+{
+public:
+	RunningMean(const CompiledNet<NodeType, ValueType>& net, NodeType node_id);
+
+	void operator()(const std::vector<unsigned>& state);
+	void merge(const RunningMean& other);
+
+	const RunningStats& stats() const;
+private:
+	unsigned node_;
+	std::vector<double> values_;
+	RunningStats stats_;
+};
+
+// Weighted accumulators consume states together with the log of their
+// importance weight, as produced by likelihood weighting, and report
+// self-normalized estimates.
+
+// Weighted probability that every node of a query holds its value
+template <
+	typename NodeType = int,
+	typename ValueType = int
+>
+class WeightedIndicator
+{
+public:
+	// A query naming an unknown node or value never holds
+	WeightedIndicator(const CompiledNet<NodeType, ValueType>& net,
+		const std::map<NodeType, ValueType>& q);
+
+	void operator()(const std::vector<unsigned>& state, double log_weight);
+	void merge(const WeightedIndicator& other);
+
+	// Samples satisfying the query, regardless of weight
+	unsigned long hits() const;
+	unsigned long count() const;
+	double estimate() const;
+
+	const WeightedStats& stats() const;
+private:
+	IndicatorCounter<NodeType, ValueType> indicator_;
+	WeightedStats stats_;
+};
+
+// Weighted mean and variance of a node's value
+template <
+	typename NodeType = int,
+	typename ValueType = int
+>
+class WeightedMean
+{
+public:
+	WeightedMean(const CompiledNet<NodeType, ValueType>& net, NodeType node_id);
+
+	void operator()(const std::vector<unsigned>& state, double log_weight);
+	void merge(const WeightedMean& other);
+
+	const WeightedStats& stats() const;
+private:
+	unsigned node_;
+	std::vector<double> values_;
+	WeightedStats stats_;
+};
+
+// Accumulators of one type fed the same states, so that many queries
+// share a single pass over a chain. Sets of independent chains merge
+// member by member.
+template <typename Accumulator>
+class AccumulatorSet
+{
+public:
+	explicit AccumulatorSet(const std::vector<Accumulator>& members);
+
+	void operator()(const std::vector<unsigned>& state);
+	void operator()(const std::vector<unsigned>& state, double log_weight);
+	void merge(const AccumulatorSet& other);
+
+	std::size_t size() const;
+	const Accumulator& operator[](std::size_t member) const;
+private:
+	std::vector<Accumulator> members_;
+};
+
+template <typename NodeType, typename ValueType>
+Histogram<NodeType, ValueType>::Histogram(const CompiledNet<NodeType, ValueType>& net,
+	NodeType node_id) :
+	net_(&net),
+	node_(net.index_of(node_id)),
+	counts_(net.cardinality(node_)),
+	count_(0)
+{}
+
+template <typename NodeType, typename ValueType>
+void Histogram<NodeType, ValueType>::operator()(const std::vector<unsigned>& state) {
+	++counts_[state[node_]];
+	++count_;
+}
+
+template <typename NodeType, typename ValueType>
+void Histogram<NodeType, ValueType>::merge(const Histogram& other) {
+	for (unsigned v = 0; v < counts_.size(); v++)
+		counts_[v] += other.counts_[v];
+	count_ += other.count_;
+}
+
+template <typename NodeType, typename ValueType>
+unsigned long Histogram<NodeType, ValueType>::count() const { return count_; }
+
+template <typename NodeType, typename ValueType>
+unsigned long Histogram<NodeType, ValueType>::count(unsigned value_index) const {
+	return counts_[value_index];
+}
+
+template <typename NodeType, typename ValueType>
+std::map<ValueType, double> Histogram<NodeType, ValueType>::distribution() const {
+	std::map<ValueType, double> dist;
+	for (unsigned v = 0; v < counts_.size(); v++)
+		dist[net_->value(node_, v)] = count_ ? counts_[v] / (double)count_ : 0;
+	return dist;
+}
+
+template <typename NodeType, typename ValueType>
+IndicatorCounter<NodeType, ValueType>::IndicatorCounter(const CompiledNet<NodeType, ValueType>& net,
+	const std::map<NodeType, ValueType>& q) :
+	possible_(true),
+	hits_(0) {
+	for (std::pair<NodeType, ValueType> p : q) {
+		if (!net.contains(p.first) || !net.in_domain(net.index_of(p.first), p.second)) {
+			possible_ = false;
+			break;
+		}
+		unsigned node = net.index_of(p.first);
+		query_.push_back(std::make_pair(node, net.value_index(node, p.second)));
+	}
+}
+
+template <typename NodeType, typename ValueType>
+void IndicatorCounter<NodeType, ValueType>::operator()(const std::vector<unsigned>& state) {
+	bool hit = possible_;
+	for (unsigned i = 0; hit && i < query_.size(); i++)
+		hit = state[query_[i].first] == query_[i].second;
+	hits_ += hit;
+	stats_.push(hit);
+	batches_.push(hit);
+}
+
+template <typename NodeType, typename ValueType>
+void IndicatorCounter<NodeType, ValueType>::merge(const IndicatorCounter& other) {
+	hits_ += other.hits_;
+	stats_.merge(other.stats_);
+	batches_.merge(other.batches_);
+}
+
+template <typename NodeType, typename ValueType>
+unsigned long IndicatorCounter<NodeType, ValueType>::hits() const { return hits_; }
+
+template <typename NodeType, typename ValueType>
+unsigned long IndicatorCounter<NodeType, ValueType>::count() const { return stats_.count(); }
+
+template <typename NodeType, typename ValueType>
+double IndicatorCounter<NodeType, ValueType>::estimate() const {
+	return count() ? hits_ / (double)count() : 0;
+}
+
+template <typename NodeType, typename ValueType>
+const RunningStats& IndicatorCounter<NodeType, ValueType>::stats() const { return stats_; }
+
+template <typename NodeType, typename ValueType>
+const BatchMeans& IndicatorCounter<NodeType, ValueType>::batches() const { return batches_; }
+
+template <typename NodeType, typename ValueType>
+RunningMean<NodeType, ValueType>::RunningMean(const CompiledNet<NodeType, ValueType>& net,
+	NodeType node_id) :
+	node_(net.index_of(node_id)) {
+	for (unsigned v = 0; v < net.cardinality(node_); v++)
+		values_.push_back(static_cast<double>(net.value(node_, v)));
+}
+
+template <typename NodeType, typename ValueType>
+void RunningMean<NodeType, ValueType>::operator()(const std::vector<unsigned>& state) {
+	stats_.push(values_[state[node_]]);
+}
+
+template <typename NodeType, typename ValueType>
+void RunningMean<NodeType, ValueType>::merge(const RunningMean& other) {
+	stats_.merge(other.stats_);
+}
+
+template <typename NodeType, typename ValueType>
+const RunningStats& RunningMean<NodeType, ValueType>::stats() const { return stats_; }
+
+template <typename NodeType, typename ValueType>
+WeightedIndicator<NodeType, ValueType>::WeightedIndicator(const CompiledNet<NodeType, ValueType>& net,
+	const std::map<NodeType, ValueType>& q) :
+	indicator_(net, q)
+{}
+
+template <typename NodeType, typename ValueType>
+void WeightedIndicator<NodeType, ValueType>::operator()(const std::vector<unsigned>& state,
+	double log_weight) {
+	unsigned long hits = indicator_.hits();
+	indicator_(state);
+	stats_.push(indicator_.hits() != hits, log_weight);
+}
+
+template <typename NodeType, typename ValueType>
+void WeightedIndicator<NodeType, ValueType>::merge(const WeightedIndicator& other) {
+	indicator_.merge(other.indicator_);
+	stats_.merge(other.stats_);
+}
+
+template <typename NodeType, typename ValueType>
+unsigned long WeightedIndicator<NodeType, ValueType>::hits() const { return indicator_.hits(); }
+
+template <typename NodeType, typename ValueType>
+unsigned long WeightedIndicator<NodeType, ValueType>::count() const { return stats_.count(); }
+
+template <typename NodeType, typename ValueType>
+double WeightedIndicator<NodeType, ValueType>::estimate() const { return stats_.mean(); }
+
+template <typename NodeType, typename ValueType>
+const WeightedStats& WeightedIndicator<NodeType, ValueType>::stats() const { return stats_; }
+
+template <typename NodeType, typename ValueType>
+WeightedMean<NodeType, ValueType>::WeightedMean(const CompiledNet<NodeType, ValueType>& net,
+	NodeType node_id) :
+	node_(net.index_of(node_id)) {
+	for (unsigned v = 0; v < net.cardinality(node_); v++)
+		values_.push_back(static_cast<double>(net.value(node_, v)));
+}
+
+template <typename NodeType, typename ValueType>
+void WeightedMean<NodeType, ValueType>::operator()(const std::vector<unsigned>& state,
+	double log_weight) {
+	stats_.push(values_[state[node_]], log_weight);
+}
+
+template <typename NodeType, typename ValueType>
+void WeightedMean<NodeType, ValueType>::merge(const WeightedMean& other) {
+	stats_.merge(other.stats_);
+}
+
+template <typename NodeType, typename ValueType>
+const WeightedStats& WeightedMean<NodeType, ValueType>::stats() const { return stats_; }
+
+template <typename Accumulator>
+AccumulatorSet<Accumulator>::AccumulatorSet(const std::vector<Accumulator>& members) :
+	members_(members)
+{}
+
+template <typename Accumulator>
+void AccumulatorSet<Accumulator>::operator()(const std::vector<unsigned>& state) {
+	for (Accumulator& member : members_)
+		member(state);
+}
+
+template <typename Accumulator>
+void AccumulatorSet<Accumulator>::operator()(const std::vector<unsigned>& state, double log_weight) {
+	for (Accumulator& member : members_)
+		member(state, log_weight);
+}
+
+template <typename Accumulator>
+void AccumulatorSet<Accumulator>::merge(const AccumulatorSet& other) {
+	for (std::size_t i = 0; i < members_.size(); i++)
+		members_[i].merge(other.members_[i]);
+}
+
+template <typename Accumulator>
+std::size_t AccumulatorSet<Accumulator>::size() const { return members_.size(); }
+
+template <typename Accumulator>
+const Accumulator& AccumulatorSet<Accumulator>::operator[](std::size_t member) const {
+	return members_[member];
+}
+
+#endif
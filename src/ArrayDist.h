@@ -0,0 +1,101 @@
+#ifndef ARRAY_DIST_H
+#define ARRAY_DIST_H
+
+#include <array>
+#include <map>
+#include <utility>
+#include <iterator>
+#include <cstddef>
+#include <initializer_list>
+
+// Distribution over the values 0..K-1 held in a std::array, for use as the
+// DistType of CondProb and BayesNet when every node takes the same K
+// values. It offers the parts of the std::map interface the library uses,
+// iterating (value, probability) pairs in value order, so it drops in for
+// a map; every value is always present, with probability zero unless set.
+// Values outside 0..K-1 are not checked.
+template <
+	unsigned K,
+	typename ValueType = int
+>
+class ArrayDist
+{
+public:
+	typedef ValueType key_type;
+	typedef double mapped_type;
+	typedef std::pair<ValueType, double> value_type;
+	typedef std::size_t size_type;
+
+	static const unsigned cardinality = K;
+
+	class const_iterator
+	{
+	public:
+		typedef std::forward_iterator_tag iterator_category;
+		typedef std::pair<ValueType, double> value_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef const value_type* pointer;
+		typedef value_type reference;
+
+		const_iterator() : dist_(nullptr), value_(0) {}
+		const_iterator(const ArrayDist* dist, unsigned value) : dist_(dist), value_(value) {}
+
+		value_type operator*() const { return value_type(ValueType(value_), dist_->p_[value_]); }
+		const_iterator& operator++() { ++value_; return *this; }
+		const_iterator operator++(int) { const_iterator before(*this); ++value_; return before; }
+		bool operator==(const const_iterator& other) const { return value_ == other.value_; }
+		bool operator!=(const const_iterator& other) const { return value_ != other.value_; }
+	private:
+		const ArrayDist* dist_;
+		unsigned value_;
+	};
+	typedef const_iterator iterator;
+
+	ArrayDist() { p_.fill(0.0); }
+	ArrayDist(std::initializer_list<std::pair<const ValueType, double>> entries) {
+		p_.fill(0.0);
+		for (const std::pair<const ValueType, double>& entry : entries)
+			p_[static_cast<unsigned>(entry.first)] = entry.second;
+	}
+
+	double& operator[](ValueType value) { return p_[static_cast<unsigned>(value)]; }
+	double at(ValueType value) const { return p_[static_cast<unsigned>(value)]; }
+
+	const_iterator begin() const { return const_iterator(this, 0); }
+	const_iterator end() const { return const_iterator(this, K); }
+	const_iterator find(ValueType value) const {
+		return in_range(value) ? const_iterator(this, static_cast<unsigned>(value)) : end();
+	}
+	size_type count(ValueType value) const { return in_range(value) ? 1 : 0; }
+	size_type size() const { return K; }
+	bool empty() const { return K == 0; }
+
+	const std::array<double, K>& probabilities() const { return p_; }
+
+	bool operator==(const ArrayDist& other) const { return p_ == other.p_; }
+	bool operator!=(const ArrayDist& other) const { return p_ != other.p_; }
+	bool operator<(const ArrayDist& other) const { return p_ < other.p_; }
+private:
+	static bool in_range(ValueType value) { return !(value < ValueType(0)) && value < ValueType(K); }
+
+	std::array<double, K> p_;
+};
+
+template <unsigned K, typename ValueType>
+const unsigned ArrayDist<K, ValueType>::cardinality;
+
+// Number of values a distribution type fixes at compile time, or 0 when
+// it is only known once the network is compiled
+template <typename DistType>
+struct fixed_cardinality
+{
+	static const unsigned value = 0;
+};
+
+template <unsigned K, typename ValueType>
+struct fixed_cardinality<ArrayDist<K, ValueType>>
+{
+	static const unsigned value = K;
+};
+
+#endif
@@ -0,0 +1,250 @@
+#ifndef BATCH_SAMPLER_H
+#define BATCH_SAMPLER_H
+
+#include "CompiledNet.h"
+#include "Random.h"
+#include "Errors.h"
+#include "Instrument.h"
+
+#include <vector>
+#include <map>
+#include <cstdint>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// Forward samples of many particles in structure-of-arrays layout: one
+// contiguous column of value indices per node. Columns are padded to a
+// multiple of four particles so the samplers never need a remainder loop;
+// the padding particles are sampled like the others and simply ignored.
+template <
+	typename NodeType = int,
+	typename ValueType = int
+>
+class SampleBatch
+{
+public:
+	typedef std::uint16_t lane_type;
+
+	SampleBatch(const CompiledNet<NodeType, ValueType>& net, unsigned size);
+
+	// number of particles
+	unsigned size() const;
+
+	// length of each column including padding
+	unsigned padded_size() const;
+
+	const lane_type* column(unsigned node) const;
+	lane_type* column(unsigned node);
+
+	// Labelled assignment of one particle
+	std::map<NodeType, ValueType> assignment(unsigned particle) const;
+private:
+	const CompiledNet<NodeType, ValueType>* net_;
+	unsigned size_;
+	unsigned padded_;
+	std::vector<lane_type> lanes_;
+};
+
+// Draws batches of forward samples. Nodes are visited in topological
+// order; for each node the CPT row of every particle is gathered from its
+// parents' columns through the mixed-radix strides, and the value is drawn
+// through the row's alias table. With AVX2 four particles are handled per
+// instruction, using 64-bit gathers for the alias tables; otherwise the
+// same arithmetic runs one particle at a time and yields identical batches.
+// Sparse CPTs and the compact forms are sampled one particle at a time.
+template <
+	typename NodeType = int,
+	typename ValueType = int
+>
+class BatchSampler
+{
+public:
+	BatchSampler(const CompiledNet<NodeType, ValueType>& net,
+		const std::vector<int>& clamp);
+
+	void sample(SampleBatch<NodeType, ValueType>& batch, Xoshiro256x4& engine) const;
+
+	// Log likelihood of the clamped nodes of each particle given its
+	// sampled parents, one entry per padded particle; minus infinity where
+	// the evidence is impossible
+	void log_likelihood(const SampleBatch<NodeType, ValueType>& batch,
+		std::vector<double>& log_weights) const;
+private:
+	typedef typename SampleBatch<NodeType, ValueType>::lane_type lane_type;
+
+	void sample_dense(unsigned node, SampleBatch<NodeType, ValueType>& batch,
+		Xoshiro256x4& engine) const;
+	void sample_sparse(unsigned node, SampleBatch<NodeType, ValueType>& batch,
+		Xoshiro256x4& engine) const;
+
+	const CompiledNet<NodeType, ValueType>& net_;
+	std::vector<int> clamp_;
+};
+
+template <typename NodeType, typename ValueType>
+SampleBatch<NodeType, ValueType>::SampleBatch(const CompiledNet<NodeType, ValueType>& net,
+	unsigned size) :
+	net_(&net),
+	size_(size),
+	padded_((size + 3) / 4 * 4),
+	lanes_(static_cast<std::size_t>(padded_) * net.size(), 0) {
+	for (unsigned node = 0; node < net.size(); node++)
+		if (net.cardinality(node) > 65536)
+			throw CardinalityException();
+}
+
+template <typename NodeType, typename ValueType>
+unsigned SampleBatch<NodeType, ValueType>::size() const { return size_; }
+
+template <typename NodeType, typename ValueType>
+unsigned SampleBatch<NodeType, ValueType>::padded_size() const { return padded_; }
+
+template <typename NodeType, typename ValueType>
+const typename SampleBatch<NodeType, ValueType>::lane_type*
+SampleBatch<NodeType, ValueType>::column(unsigned node) const {
+	return lanes_.data() + static_cast<std::size_t>(node) * padded_;
+}
+
+template <typename NodeType, typename ValueType>
+typename SampleBatch<NodeType, ValueType>::lane_type*
+SampleBatch<NodeType, ValueType>::column(unsigned node) {
+	return lanes_.data() + static_cast<std::size_t>(node) * padded_;
+}
+
+template <typename NodeType, typename ValueType>
+std::map<NodeType, ValueType> SampleBatch<NodeType, ValueType>::assignment(unsigned particle) const {
+	std::vector<unsigned> state(net_->size());
+	for (unsigned node = 0; node < state.size(); node++)
+		state[node] = column(node)[particle];
+	return net_->assignment(state);
+}
+
+template <typename NodeType, typename ValueType>
+BatchSampler<NodeType, ValueType>::BatchSampler(const CompiledNet<NodeType, ValueType>& net,
+	const std::vector<int>& clamp) :
+	net_(net), clamp_(clamp)
+{}
+
+template <typename NodeType, typename ValueType>
+void BatchSampler<NodeType, ValueType>::sample(SampleBatch<NodeType, ValueType>& batch,
+	Xoshiro256x4& engine) const {
+	for (unsigned node : net_.topological_order()) {
+		if (clamp_[node] >= 0)
+			std::fill(batch.column(node), batch.column(node) + batch.padded_size(),
+				static_cast<lane_type>(clamp_[node]));
+		else if (net_.dense(node))
+			sample_dense(node, batch, engine);
+		else
+			sample_sparse(node, batch, engine);
+		BN_COUNT_N(DRAWS, clamp_[node] < 0 ? batch.padded_size() : 0);
+	}
+}
+
+template <typename NodeType, typename ValueType>
+void BatchSampler<NodeType, ValueType>::sample_dense(unsigned node,
+	SampleBatch<NodeType, ValueType>& batch,
+	Xoshiro256x4& engine) const {
+	unsigned k = net_.cardinality(node);
+	if (k == 0)
+		throw SampleError();
+	std::vector<const lane_type*> columns;
+	for (const unsigned* p = net_.parents_begin(node); p != net_.parents_end(node); ++p)
+		columns.push_back(batch.column(*p));
+	const std::size_t* strides = net_.strides_begin(node);
+	const double* cutoffs = net_.cutoffs();
+	const unsigned* aliases = net_.aliases();
+	std::size_t offset = net_.cpt_offset(node);
+	lane_type* out = batch.column(node);
+
+	double u[4];
+	for (unsigned i = 0; i < batch.padded_size(); i += 4) {
+		engine.uniform(u);
+#if defined(__AVX2__)
+		__m256i row = _mm256_setzero_si256();
+		for (unsigned p = 0; p < columns.size(); p++) {
+			__m256i values = _mm256_cvtepu16_epi64(_mm_loadl_epi64((const __m128i*)(columns[p] + i)));
+			row = _mm256_add_epi64(row, _mm256_mul_epu32(values, _mm256_set1_epi64x(strides[p])));
+		}
+		__m256d x = _mm256_mul_pd(_mm256_loadu_pd(u), _mm256_set1_pd(k));
+		__m128i column = _mm_min_epu32(_mm256_cvttpd_epi32(x), _mm_set1_epi32(k - 1));
+		__m256d fraction = _mm256_sub_pd(x, _mm256_cvtepi32_pd(column));
+		__m256i index = _mm256_add_epi64(_mm256_set1_epi64x(offset),
+			_mm256_add_epi64(_mm256_mul_epu32(row, _mm256_set1_epi64x(k)), _mm256_cvtepu32_epi64(column)));
+		__m256d cutoff = _mm256_i64gather_pd(cutoffs, index, 8);
+		__m128i alias = _mm256_i64gather_epi32((const int*)aliases, index, 4);
+		__m256i keep = _mm256_castpd_si256(_mm256_cmp_pd(fraction, cutoff, _CMP_LT_OQ));
+		keep = _mm256_permutevar8x32_epi32(keep, _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7));
+		__m128i value = _mm_blendv_epi8(alias, column, _mm256_castsi256_si128(keep));
+
+		// Rows without mass alias to k
+		if (_mm_movemask_epi8(_mm_cmpgt_epi32(value, _mm_set1_epi32(k - 1))))
+			throw SampleError();
+		_mm_storel_epi64((__m128i*)(out + i), _mm_packus_epi32(value, value));
+#else
+		for (unsigned j = 0; j < 4; j++) {
+			std::size_t row = 0;
+			for (unsigned p = 0; p < columns.size(); p++)
+				row += columns[p][i + j] * strides[p];
+			double x = u[j] * k;
+			unsigned column = std::min(static_cast<unsigned>(x), k - 1);
+			std::size_t index = offset + row * k + column;
+			unsigned value = x - column < cutoffs[index] ? column : aliases[index];
+
+			// Rows without mass alias to k
+			if (value >= k)
+				throw SampleError();
+			out[i + j] = value;
+		}
+#endif
+	}
+}
+
+template <typename NodeType, typename ValueType>
+void BatchSampler<NodeType, ValueType>::sample_sparse(unsigned node,
+	SampleBatch<NodeType, ValueType>& batch,
+	Xoshiro256x4& engine) const {
+	std::vector<const lane_type*> columns;
+	for (const unsigned* p = net_.parents_begin(node); p != net_.parents_end(node); ++p)
+		columns.push_back(batch.column(*p));
+	lane_type* out = batch.column(node);
+
+	double u[4];
+	std::vector<unsigned> values(columns.size());
+	for (unsigned i = 0; i < batch.padded_size(); i += 4) {
+		engine.uniform(u);
+		for (unsigned j = 0; j < 4; j++) {
+			for (unsigned p = 0; p < columns.size(); p++)
+				values[p] = columns[p][i + j];
+			out[i + j] = net_.sample_of(node, values.data(), u[j]);
+		}
+	}
+}
+
+template <typename NodeType, typename ValueType>
+void BatchSampler<NodeType, ValueType>::log_likelihood(const SampleBatch<NodeType, ValueType>& batch,
+	std::vector<double>& log_weights) const {
+	log_weights.assign(batch.padded_size(), 0);
+	std::vector<const lane_type*> columns;
+	std::vector<unsigned> values;
+	for (unsigned node = 0; node < net_.size(); node++) {
+		if (clamp_[node] < 0)
+			continue;
+		columns.clear();
+		for (const unsigned* p = net_.parents_begin(node); p != net_.parents_end(node); ++p)
+			columns.push_back(batch.column(*p));
+		values.resize(columns.size());
+		for (unsigned i = 0; i < batch.padded_size(); i++) {
+			for (unsigned p = 0; p < columns.size(); p++)
+				values[p] = columns[p][i];
+			double prob = net_.conditional_of(node, values.data(), clamp_[node]);
+			log_weights[i] += prob > 0 ? std::log(prob) : -std::numeric_limits<double>::infinity();
+		}
+	}
+}
+
+#endif
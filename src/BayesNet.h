@@ -2,11 +2,28 @@
 #define BAYES_NET_H
 
 #include "CondProb.h"
+#include "CompiledNet.h"
+#include "Errors.h"
+#include "Random.h"
+#include "Chain.h"
+#include "ArrayDist.h"
+#include "ChainExecutor.h"
+#include "ChainStore.h"
+#include "BatchSampler.h"
+#include "Weighting.h"
+#include "JunctionTree.h"
+#include "QueryCache.h"
+#include "QueryTypes.h"
+#include "Relevance.h"
+#include "Evidence.h"
+#include "NetSnapshot.h"
+#include "Instrument.h"
 
 #include <vector>
 #include <map>
 #include <set>
 #include <tuple>
+#include <cstdint>
 
 #include <iostream>
 #include <cassert>
@@ -14,27 +31,28 @@
 #include <random>
 #include <algorithm>
 #include <functional>
+#include <memory>
+#include <limits>
+#include <cmath>
 
-// Potential errors
-class SampleError {};
-class DuplicateNodeException {};
-
-// Sampling strategies for methods that use
-// stochastic processes
-enum class SampleStrategy { GIBBS, MH };
-
-// Templated Bayesian network as a graph
+// Templated Bayesian network as a graph. EngineType is any engine from
+// Random.h, or one with the same (seed, stream) constructor.
 template <
 	typename NodeType = int,
 	typename ValueType = int,
-	typename DistType = std::map<ValueType, double>
+	typename DistType = std::map<ValueType, double>,
+	typename EngineType = Xoshiro256
 >
 class BayesNet
 {
 public:
-	// constructor
+	// constructor, seeded from std::random_device
 	BayesNet();
 
+	// Start from an already compiled network, such as one mapped from a
+	// file. Its CPTs are only turned back into tables when a node is added.
+	explicit BayesNet(const CompiledNet<NodeType, ValueType>& net);
+
 	// mutators
 	
 	// Add a node with a specified label and conditional probability table
@@ -53,58 +71,282 @@ public:
 	// Clamp a set of nodes to a value
 	void observe(const std::map<NodeType, ValueType> evidence);
 
+	// Release a clamped node
+	void unobserve(NodeType node_id);
+
+	// Release every clamped node
+	void clear_evidence();
+
+	// Freeze the network into its flat sampling form. The samplers call
+	// this lazily whenever a node has been added since the last compile.
+	void compile();
+
+	// Reseed the network's engine so that sampling is reproducible
+	void seed(std::uint64_t seed);
+
+	// Number of independent chains used by stochastic queries. Defaults
+	// to one per hardware thread.
+	void set_chains(unsigned chains);
+
+	// Largest treewidth answered exactly by SampleStrategy::EXACT
+	void set_treewidth_limit(unsigned limit);
+
+	// Number of results kept by each query cache; 0 disables caching
+	void set_cache_capacity(std::size_t capacity);
+
+	// Sample each query on its relevant subnetwork only; on by default
+	void set_pruning(bool pruning);
+
 	// accessors
 	std::set<ValueType> markov_blanket(NodeType node_id);
+	const CompiledNet<NodeType, ValueType>& compiled();
+
+	// Nodes a query on the given nodes depends on under the current
+	// evidence, found by Bayes-ball over the graph: the nodes whose CPDs it
+	// needs and the observed nodes it conditions on. Barren nodes and nodes
+	// d-separated from the query by the evidence are left out.
+	std::set<NodeType> relevant_nodes(const std::set<NodeType>& query);
+
+	// Junction tree of the compiled network, built on first use
+	JunctionTree<NodeType, ValueType>& junction_tree();
+
+	// Immutable snapshot of the network and its settings for concurrent
+	// queries, each with its own evidence. It shares the compiled network
+	// rather than copying it, and the same snapshot is handed out until a
+	// node is added or a setting changes; the network's own evidence is
+	// not part of it.
+	std::shared_ptr<const NetSnapshot<NodeType, ValueType, DistType, EngineType>> snapshot();
+
+	// Engine driving the samplers; it is stream 0 of the current seed
+	EngineType& engine();
+
+	// Independent engine for a chain or thread, reproducible from the seed
+	EngineType stream(std::uint64_t stream_id) const;
+
+	// Cross-chain report of the last stochastic query
+	const ChainReport& report() const;
+
+	// Hits, misses and refinements of the marginal_dist caches
+	CacheCounters cache_counters() const;
 
 	// generators
 	std::map<NodeType, ValueType> sample();
+	std::vector<std::map<NodeType, ValueType>> sample(unsigned int count);
 	ValueType sample_node(NodeType node_id);
 	ValueType sample_node(NodeType node_id, std::vector<ValueType> parent_values);
 
+	// Forward samples in column layout, drawn four particles at a time;
+	// the batch refers to compiled() and is valid until the network changes
+	SampleBatch<NodeType, ValueType> sample_batch(unsigned int count);
+
 	// stochastic sampling algorithms
 	std::vector<std::map<NodeType, ValueType>> gibbs_sample(unsigned int count, unsigned int burn_in);
 	std::vector<std::map<NodeType, ValueType>> metropolis_sample(unsigned int count, unsigned int burn_in);
 
+	// Gibbs sampling by systematic sweeps over the colors of the moral
+	// graph; each sample is one full sweep, with large colors redrawn in
+	// parallel on the shared pool
+	std::vector<std::map<NodeType, ValueType>> chromatic_sample(unsigned int count, unsigned int burn_in);
+
+	// The same chains recorded compactly, bit-packed and delta-encoded;
+	// the store refers to compiled() and is valid until the network changes
+	ChainStore<NodeType, ValueType> gibbs_chain(unsigned int count, unsigned int burn_in);
+	ChainStore<NodeType, ValueType> metropolis_chain(unsigned int count, unsigned int burn_in);
+
+	// Streaming forms that pass each retained state, as value indices over
+	// compiled(), to a visitor such as the accumulators of Accumulators.h
+	// instead of materializing the chain
+	template <typename Visitor>
+	void gibbs_sample(unsigned int count, unsigned int burn_in, Visitor& visitor);
+	template <typename Visitor>
+	void metropolis_sample(unsigned int count, unsigned int burn_in, Visitor& visitor);
+	template <typename Visitor>
+	void chromatic_sample(unsigned int count, unsigned int burn_in, Visitor& visitor);
+
+	// Likelihood weighting: independent forward samples with the evidence
+	// clamped, passed to the visitor with the log likelihood of the evidence,
+	// e.g. to the weighted accumulators of Accumulators.h
+	template <typename Visitor>
+	void weighted_sample(unsigned int count, Visitor& visitor);
+
 	// inference queries
 	ValueType expected_value(NodeType node_id, unsigned int count);
 	float average_value(NodeType node_id, unsigned int count);
 	DistType marginal_dist(NodeType node_id, unsigned int count);
 
+	// Most probable assignment of every node given the evidence: exact by
+	// max-product on the junction tree when its treewidth is within the
+	// limit, otherwise the most probable state a Gibbs chain visits in
+	// count steps. Empty when the evidence is impossible.
+	std::map<NodeType, ValueType> most_probable_explanation(unsigned int count);
+
 	// Resolve a marginal distribution for a query involving
-	// where specified nodes hold specified values in q
+	// where specified nodes hold specified values in q.
+	// Both forms of marginal_dist keep their results in a bounded LRU
+	// cache keyed by the query, the evidence and the strategy. A repeated
+	// query is answered from the cache when it stored at least the samples
+	// asked for, and otherwise extends the stored result with the missing
+	// samples. Adding a node drops only the results it can change.
 	std::map<std::map<NodeType, ValueType>, double> marginal_dist(
 		std::map<NodeType, ValueType> q, 
 		unsigned int count,
 		SampleStrategy strat);
+
+	// Adaptive form that takes a target precision in place of a count:
+	// chains run until the confidence interval or effective sample size
+	// the rule asks for is reached and they pass its convergence checks,
+	// with burn-in extended for chains still drifting. The report of the
+	// answer gives the samples, burn-in and precision it took. A cached
+	// answer is reused when its report already meets the rule.
+	std::map<std::map<NodeType, ValueType>, double> marginal_dist(
+		std::map<NodeType, ValueType> q,
+		const StoppingRule& rule,
+		SampleStrategy strat);
+
+	// Answer joint queries and single-node marginals under the current
+	// evidence from one run: a single set of chains, burnt in once, feeds
+	// every query's accumulator on each retained state. Each node's
+	// marginal is answered as one indicator per value. Answers go through
+	// the same cache as the single query form, so either form can reuse
+	// what the other computed.
+	BatchAnswer<DistType> marginal_batch(
+		const std::vector<std::map<NodeType, ValueType>>& queries,
+		const std::vector<NodeType>& nodes,
+		unsigned int count,
+		SampleStrategy strat);
 private:
 	DistType normalize_dist(
 		const std::map<ValueType, int>& hist, 
 		unsigned int count);
 
-	double sample_probability(std::map<NodeType, ValueType> sample);
+	// Run a chain of the given type, feeding retained states to a visitor
+	template <typename ChainType, typename Visitor>
+	void run_chain(unsigned int count, unsigned int burn_in, Visitor& visitor);
+
+	// Value index each compiled node is clamped to, or -1 if unobserved
+	std::vector<int> clamps();
+	std::vector<int> clamps(const CompiledNet<NodeType, ValueType>& net);
+
+	// Bayes-ball marks of the compiled nodes relevant to a query
+	std::vector<Relevance> relevance(const std::set<NodeType>& query);
+
+	// Compiled subnetwork of the nodes relevant to a query under the
+	// current evidence, cached per query nodes and evidence; null when
+	// nothing would be pruned
+	std::shared_ptr<const CompiledNet<NodeType, ValueType>> relevant(const std::map<NodeType, ValueType>& q);
+
+	// Probability of a query from the junction tree; zero when the query
+	// names an unknown node or value
+	double exact_probability(const std::map<NodeType, ValueType>& q, const std::vector<int>& clamp);
+
+	// Drop the cached results that adding a node can change
+	void invalidate(NodeType node_id);
+
+	// Rebuild the CPT tables of a network that started out compiled
+	void thaw();
+
+	// Answer of a query together with the per-chain accumulators behind it
+	typedef typename NetSnapshot<NodeType, ValueType, DistType, EngineType>::SampledAnswer CachedQuery;
+
+	// Value counts behind a single node marginal
+	struct CachedMarginal {
+		CachedMarginal() : samples(0) {}
+
+		std::map<ValueType, unsigned long> counts;
+		unsigned long samples;
+	};
+
+	// The snapshot's Gibbs chain for a fixed cardinality, used when every
+	// node matches it
+	typedef typename NetSnapshot<NodeType, ValueType, DistType, EngineType>::FixedGibbs FixedGibbs;
+
+	bool fixed_gibbs(const CompiledNet<NodeType, ValueType>& net) const {
+		return net.uniform_cardinality() == NetSnapshot<NodeType, ValueType, DistType, EngineType>::fixed_k;
+	}
+
+	typedef std::tuple<std::map<NodeType, ValueType>, std::map<NodeType, ValueType>, SampleStrategy> query_key;
+	typedef std::pair<NodeType, std::map<NodeType, ValueType>> marginal_key;
+	typedef std::pair<std::set<NodeType>, std::map<NodeType, ValueType>> relevance_key;
 
 	int numNodes_;
 	std::set<NodeType> nodes_;
-	std::map<ValueType, std::set<NodeType>> parents_;
-	std::map<ValueType, std::set<NodeType>> children_;
+	std::map<NodeType, std::set<NodeType>> parents_;
+	std::map<NodeType, std::set<NodeType>> children_;
 	std::set<NodeType> sinks_;
-	std::map<ValueType, CondProb<NodeType, ValueType, DistType>> probabilities_;
+	std::map<NodeType, CondProb<NodeType, ValueType, DistType>> probabilities_;
 	std::map<NodeType, ValueType> observations_;
+
+	std::shared_ptr<const CompiledNet<NodeType, ValueType>> net_;
+	bool compiled_;
+	bool frozen_;
+
+	JunctionTree<NodeType, ValueType> tree_;
+	bool tree_built_;
+	unsigned treewidth_limit_;
+
+	std::uint64_t seed_;
+	EngineType engine_;
+
+	unsigned chains_;
+	ChainReport report_;
+
+	QueryCache<query_key, CachedQuery> query_cache_;
+	QueryCache<marginal_key, CachedMarginal> marginal_cache_;
+	QueryCache<relevance_key, std::shared_ptr<const CompiledNet<NodeType, ValueType>>> relevance_cache_;
+	bool pruning_;
+
+	std::shared_ptr<const NetSnapshot<NodeType, ValueType, DistType, EngineType>> snapshot_;
 };
 
-template <typename NodeType, typename ValueType, typename DistType>
-BayesNet<NodeType, ValueType, DistType>::BayesNet() :
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+BayesNet<NodeType, ValueType, DistType, EngineType>::BayesNet() :
 	numNodes_(0),
 	parents_(),
-	probabilities_()
+	probabilities_(),
+	net_(std::make_shared<const CompiledNet<NodeType, ValueType>>()),
+	compiled_(false),
+	frozen_(false),
+	tree_built_(false),
+	treewidth_limit_(16),
+	seed_(random_seed()),
+	engine_(seed_),
+	chains_(std::max(1u, std::thread::hardware_concurrency())),
+	pruning_(true)
 {}
 
-template <typename NodeType, typename ValueType, typename DistType>
-void BayesNet<NodeType, ValueType, DistType>::add_node(NodeType node_id, 
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+BayesNet<NodeType, ValueType, DistType, EngineType>::BayesNet(const CompiledNet<NodeType, ValueType>& net) :
+	numNodes_(net.size()),
+	net_(std::make_shared<const CompiledNet<NodeType, ValueType>>(net)),
+	compiled_(true),
+	frozen_(true),
+	tree_built_(false),
+	treewidth_limit_(16),
+	seed_(random_seed()),
+	engine_(seed_),
+	chains_(std::max(1u, std::thread::hardware_concurrency())),
+	pruning_(true) {
+	for (unsigned node = 0; node < net.size(); node++) {
+		NodeType node_id = net.label(node);
+		nodes_.insert(node_id);
+		std::set<NodeType>& parents = parents_[node_id];
+		for (const unsigned* p = net.parents_begin(node); p != net.parents_end(node); ++p) {
+			parents.insert(net.label(*p));
+			children_[net.label(*p)].insert(node_id);
+		}
+		if (net.children_begin(node) == net.children_end(node))
+			sinks_.insert(node_id);
+	}
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+void BayesNet<NodeType, ValueType, DistType, EngineType>::add_node(NodeType node_id, 
 	const CondProb<NodeType, ValueType, DistType>& condProb) {
 	auto it = nodes_.find(node_id);
 	if (it != nodes_.end())
 		throw DuplicateNodeException();
+	if (frozen_)
+		thaw();
 	
 	nodes_.insert(node_id);
 
@@ -118,15 +360,19 @@ void BayesNet<NodeType, ValueType, DistType>::add_node(NodeType node_id,
 	sinks_.insert(node_id);
 
 	++numNodes_;
+	compiled_ = false;
+	invalidate(node_id);
 }
 
-template <typename NodeType, typename ValueType, typename DistType>
-void BayesNet<NodeType, ValueType, DistType>::add_node(NodeType node_id, 
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+void BayesNet<NodeType, ValueType, DistType, EngineType>::add_node(NodeType node_id, 
 	const std::set<NodeType>& parents, 
 	const CondProb<NodeType, ValueType, DistType>& condProb) {
 	auto it = nodes_.find(node_id);
 	if (it != nodes_.end())
 		throw DuplicateNodeException();
+	if (frozen_)
+		thaw();
 	
 	nodes_.insert(node_id);
 
@@ -147,157 +393,333 @@ void BayesNet<NodeType, ValueType, DistType>::add_node(NodeType node_id,
 	sinks_.insert(node_id);
 
 	++numNodes_;
+	compiled_ = false;
+	invalidate(node_id);
 }
 
-template <typename NodeType, typename ValueType, typename DistType>
-void BayesNet<NodeType, ValueType, DistType>::observe(NodeType node_id, ValueType value) {
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+void BayesNet<NodeType, ValueType, DistType, EngineType>::observe(NodeType node_id, ValueType value) {
 	observations_[node_id] = value;
 }
 
-template <typename NodeType, typename ValueType, typename DistType>
-void BayesNet<NodeType, ValueType, DistType>::observe(std::map<NodeType, ValueType> evidence) {
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+void BayesNet<NodeType, ValueType, DistType, EngineType>::observe(std::map<NodeType, ValueType> evidence) {
 	observations_.insert(evidence.begin(), evidence.end());
 }
 
-template <typename NodeType, typename ValueType, typename DistType>
-std::set<ValueType> BayesNet<NodeType, ValueType, DistType>::markov_blanket(NodeType node_id) {
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+void BayesNet<NodeType, ValueType, DistType, EngineType>::unobserve(NodeType node_id) {
+	observations_.erase(node_id);
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+void BayesNet<NodeType, ValueType, DistType, EngineType>::clear_evidence() {
+	observations_.clear();
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+void BayesNet<NodeType, ValueType, DistType, EngineType>::compile() {
+	BN_PHASE("compile");
+	net_ = std::make_shared<const CompiledNet<NodeType, ValueType>>(nodes_, parents_, probabilities_);
+	compiled_ = true;
+	tree_built_ = false;
+	snapshot_.reset();
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+const CompiledNet<NodeType, ValueType>& BayesNet<NodeType, ValueType, DistType, EngineType>::compiled() {
+	if (!compiled_)
+		compile();
+	return *net_;
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+std::set<NodeType> BayesNet<NodeType, ValueType, DistType, EngineType>::relevant_nodes(
+	const std::set<NodeType>& query) {
+	const CompiledNet<NodeType, ValueType>& net = compiled();
+	std::vector<Relevance> marks = relevance(query);
+	std::set<NodeType> nodes;
+	for (unsigned node = 0; node < net.size(); node++)
+		if (marks[node] != Relevance::IRRELEVANT)
+			nodes.insert(net.label(node));
+	return nodes;
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+JunctionTree<NodeType, ValueType>& BayesNet<NodeType, ValueType, DistType, EngineType>::junction_tree() {
+	const CompiledNet<NodeType, ValueType>& net = compiled();
+	if (!tree_built_) {
+		BN_PHASE("junction_tree");
+		tree_ = JunctionTree<NodeType, ValueType>(net, treewidth_limit_);
+		tree_built_ = true;
+	}
+	return tree_;
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+std::shared_ptr<const NetSnapshot<NodeType, ValueType, DistType, EngineType>>
+BayesNet<NodeType, ValueType, DistType, EngineType>::snapshot() {
+	// The snapshot triangulates on its own first exact query unless the
+	// network already holds a tree
+	compiled();
+	if (!snapshot_)
+		snapshot_ = std::make_shared<const NetSnapshot<NodeType, ValueType, DistType, EngineType>>(net_,
+			tree_built_ ? std::make_shared<const JunctionTree<NodeType, ValueType>>(tree_) : nullptr,
+			treewidth_limit_, chains_, pruning_);
+	return snapshot_;
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+void BayesNet<NodeType, ValueType, DistType, EngineType>::seed(std::uint64_t seed) {
+	seed_ = seed;
+	engine_ = EngineType(seed);
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+void BayesNet<NodeType, ValueType, DistType, EngineType>::set_chains(unsigned chains) {
+	chains_ = std::max(1u, chains);
+	snapshot_.reset();
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+void BayesNet<NodeType, ValueType, DistType, EngineType>::set_cache_capacity(std::size_t capacity) {
+	query_cache_.set_capacity(capacity);
+	marginal_cache_.set_capacity(capacity);
+	relevance_cache_.set_capacity(capacity);
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+void BayesNet<NodeType, ValueType, DistType, EngineType>::set_pruning(bool pruning) {
+	pruning_ = pruning;
+	snapshot_.reset();
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+void BayesNet<NodeType, ValueType, DistType, EngineType>::set_treewidth_limit(unsigned limit) {
+	if (limit != treewidth_limit_) {
+		tree_built_ = false;
+		snapshot_.reset();
+	}
+	treewidth_limit_ = limit;
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+EngineType& BayesNet<NodeType, ValueType, DistType, EngineType>::engine() { return engine_; }
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+EngineType BayesNet<NodeType, ValueType, DistType, EngineType>::stream(std::uint64_t stream_id) const {
+	return EngineType(seed_, stream_id);
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+const ChainReport& BayesNet<NodeType, ValueType, DistType, EngineType>::report() const { return report_; }
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+CacheCounters BayesNet<NodeType, ValueType, DistType, EngineType>::cache_counters() const {
+	CacheCounters counters = query_cache_.counters();
+	counters.hits += marginal_cache_.counters().hits;
+	counters.misses += marginal_cache_.counters().misses;
+	counters.refinements += marginal_cache_.counters().refinements;
+	return counters;
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+std::set<ValueType> BayesNet<NodeType, ValueType, DistType, EngineType>::markov_blanket(NodeType node_id) {
+	const CompiledNet<NodeType, ValueType>& net = compiled();
+	unsigned node = net.index_of(node_id);
 	std::set<ValueType> blanket;
 	blanket.insert(node_id);
-	blanket.insert(parents_[node_id].begin(), parents_[node_id].end());
-	for (NodeType child : children_[node_id]) {
-		blanket.insert(child);
-		blanket.insert(parents_[child].begin(), parents_[child].end());
-	}
+	for (const unsigned* b = net.blanket_begin(node); b != net.blanket_end(node); ++b)
+		blanket.insert(net.label(*b));
 	return blanket;
 }
 
-template <typename NodeType, typename ValueType, typename DistType>
-std::map<NodeType, ValueType> BayesNet<NodeType, ValueType, DistType>::sample() {
-	std::map<NodeType, ValueType> samples;
-	for (NodeType node : nodes_)
-		samples.insert(std::make_pair(node, sample_node(node)));
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+std::map<NodeType, ValueType> BayesNet<NodeType, ValueType, DistType, EngineType>::sample() {
+	const CompiledNet<NodeType, ValueType>& net = compiled();
+	std::vector<unsigned> state(net.size());
+	forward_sample(net, clamps(), state, engine_);
+	return net.assignment(state);
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+std::vector<std::map<NodeType, ValueType>> BayesNet<NodeType, ValueType, DistType, EngineType>::sample(
+	unsigned int count) {
+	const CompiledNet<NodeType, ValueType>& net = compiled();
+	std::vector<int> clamp = clamps();
+	std::vector<unsigned> state(net.size());
+	std::vector<std::map<NodeType, ValueType>> samples;
+	samples.reserve(count);
+	for (unsigned int i = 0; i < count; i++) {
+		forward_sample(net, clamp, state, engine_);
+		samples.push_back(net.assignment(state));
+	}
 	return samples;
 }
 
-template <typename NodeType, typename ValueType, typename DistType>
-ValueType BayesNet<NodeType, ValueType, DistType>::sample_node(NodeType node_id) {
-	// handle the observed case
-	auto it = observations_.find(node_id);
-	if (it != observations_.end())
-		return it->second;
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+SampleBatch<NodeType, ValueType> BayesNet<NodeType, ValueType, DistType, EngineType>::sample_batch(
+	unsigned int count) {
+	const CompiledNet<NodeType, ValueType>& net = compiled();
+	SampleBatch<NodeType, ValueType> batch(net, count);
+	Xoshiro256x4 lanes(engine_());
+	BatchSampler<NodeType, ValueType>(net, clamps()).sample(batch, lanes);
+	return batch;
+}
 
-	double value;
-	std::vector<ValueType> values;
-	for (NodeType parent : parents_[node_id])
-		values.push_back(sample_node(parent));
-	DistType cond_dist = probabilities_[node_id].get_distribution(values);
-	DistType probs;
-	double sum = 0;
-	for (std::pair<ValueType, double> cond_prob : cond_dist) {
-		sum += cond_prob.second;
-		probs.insert(std::make_pair(cond_prob.first, sum));
-	}
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+ValueType BayesNet<NodeType, ValueType, DistType, EngineType>::sample_node(NodeType node_id) {
+	const CompiledNet<NodeType, ValueType>& net = compiled();
+	unsigned node = net.index_of(node_id);
+	std::vector<int> clamp = clamps();
 
-	std::random_device rd;
-	std::mt19937 gen(rd());
-	std::uniform_real_distribution<> dist(0, 1);
-	double prob = dist(gen);
+	// Collect the unobserved ancestors and draw them once each in
+	// topological order
+	std::vector<unsigned> ancestors(1, node);
+	std::vector<char> seen(net.size(), 0);
+	seen[node] = 1;
+	for (unsigned i = 0; i < ancestors.size(); i++)
+		if (clamp[ancestors[i]] < 0)
+			for (const unsigned* p = net.parents_begin(ancestors[i]); p != net.parents_end(ancestors[i]); ++p)
+				if (!seen[*p]) {
+					seen[*p] = 1;
+					ancestors.push_back(*p);
+				}
+	std::sort(ancestors.begin(), ancestors.end(), [&net](unsigned a, unsigned b) {
+		return net.rank(a) < net.rank(b);
+	});
 
-	for (std::pair<ValueType, double> cond_prob : probs)
-		if (prob <= cond_prob.second)
-			return cond_prob.first;
-	throw SampleError();
+	std::vector<unsigned> state(net.size());
+	for (unsigned a : ancestors)
+		state[a] = clamp[a] >= 0 ? clamp[a] :
+			net.sample(a, state, uniform_real(engine_));
+	return net.value(node, state[node]);
 }
 
-template <typename NodeType, typename ValueType, typename DistType>
-ValueType BayesNet<NodeType, ValueType, DistType>::sample_node(NodeType node_id,
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+ValueType BayesNet<NodeType, ValueType, DistType, EngineType>::sample_node(NodeType node_id,
 	std::vector<ValueType> parent_values) {
 	// handle the observed case
 	auto it = observations_.find(node_id);
 	if (it != observations_.end())
 		return it->second;
 
-	DistType cond_dist = probabilities_[node_id].get_distribution(parent_values);
-	DistType probs;
-	double sum = 0;
-	for (std::pair<ValueType, double> cond_prob : cond_dist) {
-		sum += cond_prob.second;
-		probs.insert(std::make_pair(cond_prob.first, sum));
-	}
+	const CompiledNet<NodeType, ValueType>& net = compiled();
+	unsigned node = net.index_of(node_id);
+	const unsigned* parents = net.parents_begin(node);
+	if (parent_values.size() != (unsigned)(net.parents_end(node) - parents))
+		throw SampleError();
+	std::vector<unsigned> values;
+	for (unsigned i = 0; i < parent_values.size(); i++)
+		values.push_back(net.value_index(parents[i], parent_values[i]));
 
-	std::random_device rd;
-	std::mt19937 gen(rd());
-	std::uniform_real_distribution<> dist(0, 1);
-	double prob = dist(gen);
+	return net.value(node, net.sample_of(node, values.data(), uniform_real(engine_)));
+}
 
-	for (std::pair<ValueType, double> cond_prob : probs)
-		if (prob <= cond_prob.second)
-			return cond_prob.first;
-	throw SampleError();
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+std::vector<std::map<NodeType, ValueType>> BayesNet<NodeType, ValueType, DistType, EngineType>::gibbs_sample(
+	unsigned int count,
+	unsigned int burn_in) {
+	std::vector<std::map<NodeType, ValueType>> samples;
+	samples.reserve(count);
+	auto collect = [this, &samples](const std::vector<unsigned>& state) {
+		samples.push_back(net_->assignment(state));
+	};
+	gibbs_sample(count, burn_in, collect);
+	return samples;
 }
 
-template <typename NodeType, typename ValueType, typename DistType>
-std::vector<std::map<NodeType, ValueType>> BayesNet<NodeType, ValueType, DistType>::gibbs_sample(
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+std::vector<std::map<NodeType, ValueType>> BayesNet<NodeType, ValueType, DistType, EngineType>::metropolis_sample(
 	unsigned int count,
 	unsigned int burn_in) {
-	std::vector<std::map<NodeType, ValueType>> chain;
-	chain.push_back(sample());
+	std::vector<std::map<NodeType, ValueType>> samples;
+	samples.reserve(count);
+	auto collect = [this, &samples](const std::vector<unsigned>& state) {
+		samples.push_back(net_->assignment(state));
+	};
+	metropolis_sample(count, burn_in, collect);
+	return samples;
+}
 
-	std::random_device rd;
-	std::mt19937 gen(rd());
-	std::uniform_int_distribution<> int_dist(0, nodes_.size() - 1);
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+ChainStore<NodeType, ValueType> BayesNet<NodeType, ValueType, DistType, EngineType>::gibbs_chain(
+	unsigned int count,
+	unsigned int burn_in) {
+	ChainStore<NodeType, ValueType> store(compiled());
+	gibbs_sample(count, burn_in, store);
+	return store;
+}
 
-	for (int i = 1; i < count + burn_in; i++) {
-		auto it = nodes_.begin();
-		std::advance(it, int_dist(gen));
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+ChainStore<NodeType, ValueType> BayesNet<NodeType, ValueType, DistType, EngineType>::metropolis_chain(
+	unsigned int count,
+	unsigned int burn_in) {
+	ChainStore<NodeType, ValueType> store(compiled());
+	metropolis_sample(count, burn_in, store);
+	return store;
+}
 
-		std::map<NodeType, ValueType> candidate(chain.back().begin(), chain.back().end());
-		std::vector<ValueType> parent_values;
-		for (NodeType parent : parents_[*it])
-			parent_values.push_back(chain.back().find(parent)->second);
-		candidate[*it] = sample_node(*it, parent_values);
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+std::vector<std::map<NodeType, ValueType>> BayesNet<NodeType, ValueType, DistType, EngineType>::chromatic_sample(
+	unsigned int count,
+	unsigned int burn_in) {
+	std::vector<std::map<NodeType, ValueType>> samples;
+	samples.reserve(count);
+	auto collect = [this, &samples](const std::vector<unsigned>& state) {
+		samples.push_back(net_->assignment(state));
+	};
+	chromatic_sample(count, burn_in, collect);
+	return samples;
+}
 
-		chain.push_back(candidate);
-	}
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+template <typename Visitor>
+void BayesNet<NodeType, ValueType, DistType, EngineType>::gibbs_sample(
+	unsigned int count,
+	unsigned int burn_in,
+	Visitor& visitor) {
+	BN_REPORT("gibbs_sample");
+	if (fixed_gibbs(compiled()))
+		run_chain<FixedGibbs>(count, burn_in, visitor);
+	else
+		run_chain<GibbsChain<NodeType, ValueType, EngineType>>(count, burn_in, visitor);
+}
 
-	return std::vector<std::map<NodeType, ValueType>>(&chain[burn_in], &chain[count+burn_in]);
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+template <typename Visitor>
+void BayesNet<NodeType, ValueType, DistType, EngineType>::metropolis_sample(
+	unsigned int count,
+	unsigned int burn_in,
+	Visitor& visitor) {
+	BN_REPORT("metropolis_sample");
+	run_chain<MetropolisChain<NodeType, ValueType, EngineType>>(count, burn_in, visitor);
 }
 
-template <typename NodeType, typename ValueType, typename DistType>
-std::vector<std::map<NodeType, ValueType>> BayesNet<NodeType, ValueType, DistType>::metropolis_sample(
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+template <typename Visitor>
+void BayesNet<NodeType, ValueType, DistType, EngineType>::chromatic_sample(
 	unsigned int count,
-	unsigned int burn_in) {
-	std::vector<std::map<NodeType, ValueType>> chain;
-	chain.push_back(sample());
-
-	std::random_device rd;
-	std::mt19937 gen(rd());
-	std::uniform_real_distribution<> real_dist(0, 1);
-	std::normal_distribution<> norm_dist(5, 2);
-	std::uniform_int_distribution<> int_dist(0, nodes_.size() - 1);
-
-	for (int i = 1; i < count + burn_in; i++) {
-		auto it = nodes_.begin();
-		std::advance(it, int_dist(gen));
-		std::map<NodeType, ValueType> candidate(chain.back());
-		std::vector<ValueType> parent_values;
-		for (NodeType parent : parents_[*it])
-			parent_values.push_back(chain.back().find(parent)->second);
-		candidate[*it] = sample_node(*it, parent_values);
-		double aprob = std::min<double>(1, sample_probability(
-			candidate) / sample_probability(chain.back()));
-
-		if (int_dist(gen) < aprob)
-			chain.push_back(candidate);
-		else
-			chain.push_back(chain.back());
-	}
+	unsigned int burn_in,
+	Visitor& visitor) {
+	BN_REPORT("chromatic_sample");
+	run_chain<ChromaticGibbsChain<NodeType, ValueType, EngineType>>(count, burn_in, visitor);
+}
 
-	return std::vector<std::map<NodeType, ValueType>>(&chain[burn_in], &chain[count+burn_in]);
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+template <typename Visitor>
+void BayesNet<NodeType, ValueType, DistType, EngineType>::weighted_sample(
+	unsigned int count,
+	Visitor& visitor) {
+	WeightingChain<NodeType, ValueType> chain(compiled(), clamps(), Xoshiro256x4(engine_()));
+	for (unsigned int i = 0; i < count; i++) {
+		chain.step();
+		visitor(chain.state(), chain.log_weight());
+	}
 }
 
-template <typename NodeType, typename ValueType, typename DistType>
-ValueType BayesNet<NodeType, ValueType, DistType>::expected_value(NodeType node_id, 
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+ValueType BayesNet<NodeType, ValueType, DistType, EngineType>::expected_value(NodeType node_id, 
 	unsigned int count) {
 	std::map<ValueType, int> hist;
 	std::pair<ValueType, int> max_pair;
@@ -314,46 +736,237 @@ ValueType BayesNet<NodeType, ValueType, DistType>::expected_value(NodeType node_
 	return max_pair->first;
 }
 
-template <typename NodeType, typename ValueType, typename DistType>
-DistType BayesNet<NodeType, ValueType, DistType>::marginal_dist(
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+DistType BayesNet<NodeType, ValueType, DistType, EngineType>::marginal_dist(
 	NodeType node_id,
 	unsigned int count) {
-	std::map<ValueType, int> hist;
-	for (int i = 0; i < count; i++) {
-		auto s = sample_node(node_id);
-		auto it = hist.find(s);
-		if (it == hist.end())
-			hist[s] = 0;
-		else
-			hist[s] = it->second + 1;
+	BN_REPORT("marginal_dist");
+	marginal_key key(node_id, observations_);
+	CachedMarginal* cached = marginal_cache_.find(key);
+	CachedMarginal entry;
+	if (cached && cached->samples >= count) {
+		++marginal_cache_.counters().hits;
+		entry = *cached;
+	} else {
+		if (cached) {
+			++marginal_cache_.counters().refinements;
+			entry = *cached;
+		} else {
+			++marginal_cache_.counters().misses;
+		}
+
+		// Forward samples with the evidence clamped, as sample_node draws them
+		const CompiledNet<NodeType, ValueType>& net = compiled();
+		std::vector<int> clamp = clamps();
+		std::vector<unsigned> state(net.size());
+		Histogram<NodeType, ValueType> histogram(net, node_id);
+		BN_PHASE("sampling");
+		for (unsigned long i = entry.samples; i < count; i++) {
+			forward_sample(net, clamp, state, engine_);
+			histogram(state);
+		}
+		unsigned node = net.index_of(node_id);
+		for (unsigned v = 0; v < net.cardinality(node); v++)
+			entry.counts[net.value(node, v)] += histogram.count(v);
+		entry.samples = count;
+		marginal_cache_.insert(key, entry);
 	}
 
-	return normalize_dist(hist, count);
+	DistType dist;
+	for (std::pair<ValueType, unsigned long> c : entry.counts)
+		if (c.second > 0)
+			dist[c.first] = c.second / (double)entry.samples;
+	return dist;
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+std::map<NodeType, ValueType> BayesNet<NodeType, ValueType, DistType, EngineType>::most_probable_explanation(
+	unsigned int count) {
+	return snapshot()->most_probable_explanation(observations_, count, engine_());
 }
 
-template <typename NodeType, typename ValueType, typename DistType>
-std::map<std::map<NodeType, ValueType>, double> BayesNet<NodeType, ValueType, DistType>::marginal_dist(
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+std::map<std::map<NodeType, ValueType>, double> BayesNet<NodeType, ValueType, DistType, EngineType>::marginal_dist(
 	std::map<NodeType, ValueType> q,
 	unsigned int count,
 	SampleStrategy strat) {
-	std::vector<std::map<NodeType, ValueType>> samples;
-	if (strat == SampleStrategy::GIBBS)
-		samples = gibbs_sample(count, 32);
-	else
-		samples = metropolis_sample(count, 32);
+	BN_REPORT("marginal_dist");
+	std::map<std::map<NodeType, ValueType>, double> hist;
+	query_key key(q, observations_, strat);
+	CachedQuery* cached = query_cache_.find(key);
+	if (cached && (cached->exact || cached->samples >= count)) {
+		++query_cache_.counters().hits;
+		report_ = cached->report;
+		hist[q] = report_.estimate();
+		return hist;
+	}
 
-	unsigned int hits = 0;
-	for (std::map<NodeType, ValueType> sample : samples)
-		if (std::includes(sample.begin(), sample.end(), q.begin(), q.end()))
-			++hits;
+	std::vector<CachedQuery> entries(1);
+	CachedQuery& entry = entries.front();
+	if (cached) {
+		++query_cache_.counters().refinements;
+		entry = *cached;
+		strat = entry.strategy;
+	} else {
+		++query_cache_.counters().misses;
+	}
+
+	std::vector<int> clamp = clamps();
+
+	if (strat == SampleStrategy::EXACT) {
+		JunctionTree<NodeType, ValueType>& tree = junction_tree();
+		if (tree.treewidth() <= treewidth_limit_) {
+			entry.report.mean = exact_probability(q, clamp);
+			entry.report.std_error = 0;
+			entry.exact = true;
+			query_cache_.insert(key, entry);
+			report_ = entry.report;
+			hist[q] = report_.estimate();
+			return hist;
+		}
+	}
+
+	// Only the samples beyond those already stored are drawn, on fresh
+	// chains whose accumulators join the stored ones. Each run draws a
+	// fresh seed so that the chains stay independent. The chains run on
+	// the part of the network the query depends on.
+	std::shared_ptr<const CompiledNet<NodeType, ValueType>> pruned = relevant(q);
+	const CompiledNet<NodeType, ValueType>& sampled = pruned ? *pruned : compiled();
+	snapshot()->sample(sampled, pruned ? clamps(sampled) : clamp,
+		std::vector<std::map<NodeType, ValueType>>(1, q), entries, count, strat, engine_());
+	query_cache_.insert(key, entry);
+
+	report_ = entry.report;
+	hist[q] = report_.estimate();
+	return hist;
+}
 
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+std::map<std::map<NodeType, ValueType>, double> BayesNet<NodeType, ValueType, DistType, EngineType>::marginal_dist(
+	std::map<NodeType, ValueType> q,
+	const StoppingRule& rule,
+	SampleStrategy strat) {
+	BN_REPORT("marginal_dist");
 	std::map<std::map<NodeType, ValueType>, double> hist;
-	hist[q] = hits / (double) count;
+	query_key key(q, observations_, strat);
+	CachedQuery* cached = query_cache_.find(key);
+	if (cached && (cached->exact || rule.met(cached->report))) {
+		++query_cache_.counters().hits;
+		report_ = cached->report;
+		hist[q] = report_.estimate();
+		return hist;
+	}
+	if (cached)
+		++query_cache_.counters().refinements;
+	else
+		++query_cache_.counters().misses;
+
+	std::vector<int> clamp = clamps();
+	CachedQuery entry;
+	if (strat == SampleStrategy::EXACT) {
+		if (junction_tree().treewidth() <= treewidth_limit_) {
+			entry.report.mean = exact_probability(q, clamp);
+			entry.report.std_error = 0;
+			entry.exact = true;
+			query_cache_.insert(key, entry);
+			report_ = entry.report;
+			hist[q] = report_.estimate();
+			return hist;
+		}
+	}
+
+	// A stored answer short of the target is replaced, not extended: its
+	// chains stopped on a budget rather than on their convergence
+	std::shared_ptr<const CompiledNet<NodeType, ValueType>> pruned = relevant(q);
+	const CompiledNet<NodeType, ValueType>& sampled = pruned ? *pruned : compiled();
+	snapshot()->sample(sampled, pruned ? clamps(sampled) : clamp, q, entry, rule, strat, engine_());
+	query_cache_.insert(key, entry);
+
+	report_ = entry.report;
+	hist[q] = report_.estimate();
 	return hist;
 }
 
-template <typename NodeType, typename ValueType, typename DistType>
-float BayesNet<NodeType, ValueType, DistType>::average_value(NodeType node_id, 
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+BatchAnswer<DistType> BayesNet<NodeType, ValueType, DistType, EngineType>::marginal_batch(
+	const std::vector<std::map<NodeType, ValueType>>& queries,
+	const std::vector<NodeType>& nodes,
+	unsigned int count,
+	SampleStrategy strat) {
+	BN_REPORT("marginal_batch");
+	std::shared_ptr<const NetSnapshot<NodeType, ValueType, DistType, EngineType>> shared = snapshot();
+	const CompiledNet<NodeType, ValueType>& net = compiled();
+	std::vector<int> clamp = clamps();
+
+	// Single nodes follow the joint queries as one indicator per value
+	std::vector<std::map<NodeType, ValueType>> indicators = shared->indicators(net, queries, nodes);
+
+	// Only the queries the cache cannot answer join the run
+	std::vector<ChainReport> reports(indicators.size());
+	std::vector<unsigned> pending;
+	for (unsigned i = 0; i < indicators.size(); i++) {
+		CachedQuery* cached = query_cache_.find(query_key(indicators[i], observations_, strat));
+		if (cached && (cached->exact || cached->samples >= count)) {
+			++query_cache_.counters().hits;
+			reports[i] = cached->report;
+		} else {
+			++query_cache_.counters().misses;
+			pending.push_back(i);
+		}
+	}
+
+	if (strat == SampleStrategy::EXACT && !pending.empty() && junction_tree().treewidth() <= treewidth_limit_) {
+		for (unsigned i : pending) {
+			CachedQuery entry;
+			entry.strategy = strat;
+			entry.report.mean = exact_probability(indicators[i], clamp);
+			entry.report.std_error = 0;
+			entry.exact = true;
+			query_cache_.insert(query_key(indicators[i], observations_, strat), entry);
+			reports[i] = entry.report;
+		}
+		pending.clear();
+	}
+
+	if (!pending.empty()) {
+		// The chains run on the part of the network any pending query
+		// depends on
+		std::map<NodeType, ValueType> touched;
+		std::vector<std::map<NodeType, ValueType>> sampled_queries;
+		for (unsigned i : pending) {
+			touched.insert(indicators[i].begin(), indicators[i].end());
+			sampled_queries.push_back(indicators[i]);
+		}
+		std::shared_ptr<const CompiledNet<NodeType, ValueType>> pruned = relevant(touched);
+		const CompiledNet<NodeType, ValueType>& sampled = pruned ? *pruned : net;
+		std::vector<CachedQuery> entries(pending.size());
+		shared->sample(sampled, pruned ? clamps(sampled) : clamp, sampled_queries, entries, count, strat, engine_());
+		for (unsigned j = 0; j < pending.size(); j++) {
+			query_cache_.insert(query_key(indicators[pending[j]], observations_, strat), entries[j]);
+			reports[pending[j]] = entries[j].report;
+		}
+	}
+	return shared->assemble(net, queries.size(), nodes, reports);
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+double BayesNet<NodeType, ValueType, DistType, EngineType>::exact_probability(
+	const std::map<NodeType, ValueType>& q,
+	const std::vector<int>& clamp) {
+	BN_PHASE("exact");
+	const CompiledNet<NodeType, ValueType>& net = compiled();
+	std::vector<std::pair<unsigned, unsigned>> query;
+	for (std::pair<NodeType, ValueType> p : q) {
+		if (!net.contains(p.first) || !net.in_domain(net.index_of(p.first), p.second))
+			return 0;
+		unsigned node = net.index_of(p.first);
+		query.push_back(std::make_pair(node, net.value_index(node, p.second)));
+	}
+	return junction_tree().probability(query, clamp);
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+float BayesNet<NodeType, ValueType, DistType, EngineType>::average_value(NodeType node_id, 
 	unsigned int count) {
 	assert(std::is_integral<ValueType>::value);
 	std::vector<ValueType> samples;
@@ -362,8 +975,8 @@ float BayesNet<NodeType, ValueType, DistType>::average_value(NodeType node_id,
 	return std::accumulate(samples.begin(), samples.end(), 0) / (float)count;
 }
 
-template <typename NodeType, typename ValueType, typename DistType>
-DistType BayesNet<NodeType, ValueType, DistType>::normalize_dist(
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+DistType BayesNet<NodeType, ValueType, DistType, EngineType>::normalize_dist(
 	const std::map<ValueType, int>& hist, 
 	unsigned int count) {
 	DistType normalized_dist;
@@ -372,19 +985,120 @@ DistType BayesNet<NodeType, ValueType, DistType>::normalize_dist(
 	return normalized_dist;
 }
 
-template <typename NodeType, typename ValueType, typename DistType>
-double BayesNet<NodeType, ValueType, DistType>::sample_probability(
-	std::map<NodeType, ValueType> sample) {
-	std::vector<ValueType> parent_values;
-	double accumulator = 1;
-	for (std::pair<NodeType, ValueType> p : sample) {
-		for (NodeType parent : parents_[p.first])
-			parent_values.push_back(sample[parent]);
-		double prob = probabilities_[p.first].
-			get_distribution(parent_values).at(p.second);
-		accumulator *= prob;
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+template <typename ChainType, typename Visitor>
+void BayesNet<NodeType, ValueType, DistType, EngineType>::run_chain(
+	unsigned int count,
+	unsigned int burn_in,
+	Visitor& visitor) {
+	ChainType chain(compiled(), clamps(), engine_);
+	{
+		BN_PHASE("burn_in");
+		for (unsigned int i = 0; i < burn_in; i++)
+			chain.step();
+		BN_COUNT_N(BURN_IN_STEPS, burn_in);
+	}
+	{
+		BN_PHASE("sampling");
+		for (unsigned int i = 0; i < count; i++) {
+			chain.step();
+			visitor(chain.state());
+		}
+		BN_COUNT_N(STEPS, count);
+	}
+	engine_ = chain.engine();
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+void BayesNet<NodeType, ValueType, DistType, EngineType>::invalidate(NodeType node_id) {
+	// The new node and any nodes already declared below it are barren for
+	// every query that neither asks about them nor observes them
+	std::set<NodeType> affected;
+	std::vector<NodeType> stack(1, node_id);
+	while (!stack.empty()) {
+		NodeType node = stack.back();
+		stack.pop_back();
+		if (!affected.insert(node).second)
+			continue;
+		auto it = children_.find(node);
+		if (it != children_.end())
+			stack.insert(stack.end(), it->second.begin(), it->second.end());
 	}
-	return accumulator;
+
+	auto touches = [&affected](const std::map<NodeType, ValueType>& nodes) {
+		for (std::pair<NodeType, ValueType> p : nodes)
+			if (affected.count(p.first))
+				return true;
+		return false;
+	};
+	relevance_cache_.erase_if([&touches, &affected](const relevance_key& key) {
+		for (NodeType node : key.first)
+			if (affected.count(node))
+				return true;
+		return touches(key.second);
+	});
+	query_cache_.erase_if([&touches](const query_key& key) {
+		return touches(std::get<0>(key)) || touches(std::get<1>(key));
+	});
+	marginal_cache_.erase_if([&touches, &affected](const marginal_key& key) {
+		return affected.count(key.first) || touches(key.second);
+	});
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+std::vector<int> BayesNet<NodeType, ValueType, DistType, EngineType>::clamps() {
+	return clamps(compiled());
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+std::vector<int> BayesNet<NodeType, ValueType, DistType, EngineType>::clamps(
+	const CompiledNet<NodeType, ValueType>& net) {
+	std::vector<int> clamp(net.size(), -1);
+	for (std::pair<NodeType, ValueType> obs : observations_)
+		if (net.contains(obs.first)) {
+			unsigned node = net.index_of(obs.first);
+			clamp[node] = net.value_index(node, obs.second);
+		}
+	return clamp;
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+std::vector<Relevance> BayesNet<NodeType, ValueType, DistType, EngineType>::relevance(
+	const std::set<NodeType>& query) {
+	const CompiledNet<NodeType, ValueType>& net = compiled();
+	std::vector<unsigned> indices;
+	for (NodeType node : query)
+		if (net.contains(node))
+			indices.push_back(net.index_of(node));
+	return ::relevance(net, indices, clamps(net));
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+std::shared_ptr<const CompiledNet<NodeType, ValueType>> BayesNet<NodeType, ValueType, DistType, EngineType>::relevant(
+	const std::map<NodeType, ValueType>& q) {
+	if (!pruning_)
+		return nullptr;
+	std::set<NodeType> query;
+	for (std::pair<NodeType, ValueType> p : q)
+		query.insert(p.first);
+	relevance_key key(query, observations_);
+	std::shared_ptr<const CompiledNet<NodeType, ValueType>>* cached = relevance_cache_.find(key);
+	if (cached)
+		return *cached;
+
+	const CompiledNet<NodeType, ValueType>& net = compiled();
+	std::shared_ptr<const CompiledNet<NodeType, ValueType>> pruned =
+		relevant_subnet<DistType>(net, relevance(query), clamps(net));
+	relevance_cache_.insert(key, pruned);
+	return pruned;
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+void BayesNet<NodeType, ValueType, DistType, EngineType>::thaw() {
+	const CompiledNet<NodeType, ValueType>& net = *net_;
+	for (unsigned node = 0; node < net.size(); node++)
+		probabilities_[net.label(node)] = net.template cpd<DistType>(node);
+	frozen_ = false;
 }
 
 #endif
@@ -1,5 +1,8 @@
 #include "BayesNet.h"
+#include "BifReader.h"
+#include "NetworkGenerator.h"
 #include "Benchmark.h"
+#include "QueryServer.h"
 #include "Assertion.h"
 
 #include <iostream>
@@ -7,6 +10,17 @@
 #include <map>
 #include <set>
 #include <tuple>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <thread>
+#include <future>
+#include <chrono>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 using namespace std;
 using namespace UnitTest;
@@ -132,6 +146,1462 @@ void canMarkovBlanket() {
 	assertEquals(blanket, set<int> {2, 0, 1, 3});
 }
 
+void canCompileNetwork() {
+	BayesNet<> bn;
+
+	map<vector<int>, map<int, double>> cpt;
+	map<int, double> dist;
+	dist.insert(make_pair(0, 0.5));
+	dist.insert(make_pair(1, 0.5));
+	cpt.insert(CondProb<>::CondCase(vector<int>(), dist));
+	bn.add_node(0, CondProb<>(cpt));
+	bn.add_node(1, CondProb<>(cpt));
+
+	cpt.clear();
+	dist.clear();
+	dist.insert(make_pair(0, 0.9));
+	dist.insert(make_pair(1, 0.1));
+	cpt.insert(CondProb<>::CondCase(vector<int> {0, 1}, dist));
+	dist.clear();
+	dist.insert(make_pair(0, 0.2));
+	dist.insert(make_pair(1, 0.8));
+	cpt.insert(CondProb<>::CondCase(vector<int> {1, 0}, dist));
+	bn.add_node(2, {0, 1}, CondProb<>(cpt));
+
+	const CompiledNet<>& net = bn.compiled();
+	assertEquals(net.size(), 3u);
+	assertEquals(net.cardinality(2), 2u);
+	assertEquals((int)(net.parents_end(2) - net.parents_begin(2)), 2);
+	assertEquals((int)(net.children_end(0) - net.children_begin(0)), 1);
+	assertEquals(*net.children_begin(1), 2u);
+
+	vector<unsigned> state {0, 1, 0};
+	size_t row = net.row_index(2, state);
+	assertTrue(net.probability(2, row, 0) > 0.89 && net.probability(2, row, 0) < 0.91);
+	state = vector<unsigned> {1, 0, 0};
+	row = net.row_index(2, state);
+	assertTrue(net.probability(2, row, 1) > 0.79 && net.probability(2, row, 1) < 0.81);
+	assertEquals(net.draw(2, row, 0.1), 0u);
+	assertEquals(net.draw(2, row, 0.5), 1u);
+
+	// A row keyed by the wrong number of parent values is an error
+	bn.add_node(3, {2}, CondProb<>(cpt));
+	bool threw = false;
+	try {
+		bn.compiled();
+	} catch (const CardinalityException&) {
+		threw = true;
+	}
+	assertTrue(threw);
+}
+
+void canSeedSampler() {
+	BayesNet<> bn;
+
+	map<vector<int>, map<int, double>> cpt;
+	map<int, double> dist;
+	dist.insert(make_pair(0, 0.5));
+	dist.insert(make_pair(1, 0.5));
+	cpt.insert(CondProb<>::CondCase(vector<int>(), dist));
+	for (int i = 0; i < 8; i++)
+		bn.add_node(i, CondProb<>(cpt));
+
+	bn.seed(42);
+	auto first = bn.gibbs_sample(64, 8);
+	bn.seed(42);
+	auto second = bn.gibbs_sample(64, 8);
+	assertEquals(first, second);
+
+	Xoshiro256 a = bn.stream(1), b = bn.stream(2);
+	assertTrue(a() != b());
+	Philox4x32 c(42, 1), d(42, 1), e(42, 2);
+	assertEquals(c(), d());
+	assertTrue(d() != e());
+}
+
+void canDrawFromAliasTable() {
+	BayesNet<> bn;
+
+	map<vector<int>, map<int, double>> cpt;
+	map<int, double> dist;
+	dist.insert(make_pair(3, 0.2));
+	dist.insert(make_pair(5, 0.5));
+	dist.insert(make_pair(7, 0.3));
+	cpt.insert(CondProb<>::CondCase(vector<int>(), dist));
+	bn.add_node(0, CondProb<>(cpt));
+
+	const CompiledNet<>& net = bn.compiled();
+	vector<int> hist(3, 0);
+	for (int i = 0; i < 10000; i++)
+		++hist[net.draw(0, 0, (i + 0.5) / 10000)];
+	assertTrue(hist[0] > 1990 && hist[0] < 2010);
+	assertTrue(hist[1] > 4990 && hist[1] < 5010);
+	assertTrue(hist[2] > 2990 && hist[2] < 3010);
+	assertEquals(net.value(0, 2), 7);
+}
+
+void canSampleDeepNetwork() {
+	BayesNet<> bn;
+
+	map<vector<int>, map<int, double>> cpt;
+	map<int, double> dist;
+	dist.insert(make_pair(0, 0.5));
+	dist.insert(make_pair(1, 0.5));
+	cpt.insert(CondProb<>::CondCase(vector<int>(), dist));
+	bn.add_node(0, CondProb<>(cpt));
+
+	// Each node copies its nearest parent, so every sample is constant
+	cpt.clear();
+	for (int a = 0; a < 2; a++)
+		for (int b = 0; b < 2; b++) {
+			dist.clear();
+			dist.insert(make_pair(a, 1.0));
+			dist.insert(make_pair(1 - a, 0.0));
+			cpt.insert(CondProb<>::CondCase(vector<int> {b, a}, dist));
+		}
+	bn.add_node(1, {0}, CondProb<>(map<vector<int>, map<int, double>> {
+		{ vector<int> {0}, map<int, double> {{0, 1.0}, {1, 0.0}} },
+		{ vector<int> {1}, map<int, double> {{0, 0.0}, {1, 1.0}} } }));
+	for (int i = 2; i < 64; i++)
+		bn.add_node(i, {i - 2, i - 1}, CondProb<>(cpt));
+
+	vector<map<int, int>> samples = bn.sample(64);
+	assertEquals(samples.size(), (size_t)64);
+	int ones = 0;
+	for (map<int, int> s : samples) {
+		for (pair<int, int> p : s)
+			assertEquals(p.second, s[0]);
+		ones += s[0];
+	}
+	assertTrue(ones > 0 && ones < 64);
+}
+
+void canRunParallelChains() {
+	BayesNet<> bn;
+
+	map<vector<int>, map<int, double>> cpt;
+	map<int, double> dist;
+	dist.insert(make_pair(0, 0.7));
+	dist.insert(make_pair(1, 0.3));
+	cpt.insert(CondProb<>::CondCase(vector<int>(), dist));
+	bn.add_node(0, CondProb<>(cpt));
+	bn.add_node(1, CondProb<>(cpt));
+
+	bn.set_chains(4);
+	bn.seed(7);
+	map<int, int> values;
+	values.insert(make_pair(0, 0));
+	map<std::map<int, int>, double> first = bn.marginal_dist(values, 4096, SampleStrategy::GIBBS);
+	assertTrue(first[values] > 0.65 && first[values] < 0.75);
+	assertEquals(bn.report().chains, 4u);
+	assertEquals(bn.report().samples, 4096ul);
+	assertTrue(bn.report().rhat < 1.1);
+
+	bn.seed(7);
+	map<std::map<int, int>, double> second = bn.marginal_dist(values, 4096, SampleStrategy::GIBBS);
+	assertEquals(first, second);
+
+	// A waiter with nothing to steal sleeps until the task finishes, and a
+	// task waiting on its own subtask runs it on a single worker
+	ThreadPool pool(1);
+	future<int> slow = pool.submit([]() {
+		this_thread::sleep_for(chrono::milliseconds(20));
+		return 1;
+	});
+	pool.wait(slow);
+	assertEquals(slow.get(), 1);
+	future<int> outer = pool.submit([&pool]() {
+		future<int> inner = pool.submit([]() { return 2; });
+		pool.wait(inner);
+		return inner.get() + 1;
+	});
+	pool.wait(outer);
+	assertEquals(outer.get(), 3);
+}
+
+void canSampleChromatic() {
+	NetworkShape shape(40, 2, 5, 2);
+	Xoshiro256 engine(11);
+	CompiledNet<> net = generate_network(shape, engine);
+	vector<int> clamp(net.size(), -1);
+	clamp[39] = 0;
+
+	// No two nodes of a color share a blanket, and every free node has one
+	vector<vector<unsigned>> classes = color_moral_graph(net, clamp);
+	vector<int> color(net.size(), -1);
+	for (unsigned c = 0; c < classes.size(); c++)
+		for (unsigned node : classes[c])
+			color[node] = c;
+	for (unsigned node = 0; node < net.size(); node++) {
+		assertTrue((color[node] < 0) == (clamp[node] >= 0));
+		for (const unsigned* b = net.blanket_begin(node); b != net.blanket_end(node); ++b)
+			assertTrue(color[node] < 0 || color[node] != color[*b]);
+	}
+
+	// Slices of every color run on four workers and still sample the
+	// posterior the junction tree computes
+	BayesNet<> bn(net);
+	bn.observe(39, 0);
+	map<int, int> q {{20, 0}};
+	double exact = bn.marginal_dist(q, 0, SampleStrategy::EXACT)[q];
+	ThreadPool pool(4);
+	ChromaticGibbsChain<int, int, Xoshiro256> chain(net, clamp, Xoshiro256(5), pool, 1);
+	IndicatorCounter<> counter(net, q);
+	for (unsigned i = 0; i < 100; i++)
+		chain.step();
+	for (unsigned i = 0; i < 20000; i++) {
+		chain.step();
+		counter(chain.state());
+		assertEquals(chain.state()[39], 0u);
+	}
+	assertTrue(fabs(counter.estimate() - exact) < 0.03);
+
+	bn.seed(2);
+	assertTrue(fabs(bn.marginal_dist(q, 10000, SampleStrategy::CHROMATIC_GIBBS)[q] - exact) < 0.03);
+	assertEquals(bn.chromatic_sample(10, 5).size(), (size_t)10);
+}
+
+void canUseFixedCardinality() {
+	NetworkShape shape(60, 3, 6, 2);
+	Xoshiro256 engine(23);
+	CompiledNet<> net = generate_network(shape, engine);
+	vector<int> clamp(net.size(), -1);
+	clamp[59] = 1;
+	assertEquals(net.uniform_cardinality(), 2u);
+
+	// The binary chain makes exactly the draws of the general one
+	GibbsChain<int, int, Xoshiro256> general(net, clamp, Xoshiro256(8));
+	FixedGibbsChain<int, int, Xoshiro256, 2> fixed(net, clamp, Xoshiro256(8));
+	for (unsigned i = 0; i < 5000; i++) {
+		general.step();
+		fixed.step();
+		assertTrue(general.state() == fixed.state());
+	}
+
+	// The constant-radix row agrees with the stored strides
+	for (unsigned node = 0; node < net.size(); node++)
+		if (net.dense(node))
+			assertEquals(net.dense_row<2>(node, general.state()), net.row_index(node, general.state()));
+
+	bool threw = false;
+	try {
+		FixedGibbsChain<int, int, Xoshiro256, 3> wrong(net, clamp, Xoshiro256(8));
+	} catch (const CardinalityException&) {
+		threw = true;
+	}
+	assertTrue(threw);
+
+	// An array-backed DistType fixes three values per node
+	typedef ArrayDist<3> Dist;
+	BayesNet<int, int, Dist> bn;
+	bn.add_node(0, CondProb<int, int, Dist>(map<vector<int>, Dist> {
+		{ vector<int>(), Dist {{0, 0.5}, {1, 0.3}, {2, 0.2}} } }));
+	bn.add_node(1, {0}, CondProb<int, int, Dist>(map<vector<int>, Dist> {
+		{ vector<int> {0}, Dist {{0, 0.8}, {1, 0.1}, {2, 0.1}} },
+		{ vector<int> {1}, Dist {{0, 0.2}, {1, 0.6}, {2, 0.2}} },
+		{ vector<int> {2}, Dist {{0, 0.1}, {1, 0.1}, {2, 0.8}} } }));
+	assertEquals(bn.compiled().uniform_cardinality(), 3u);
+	assertEquals(bn.sample_node(0, {}) < 3, true);
+
+	bn.observe(1, 2);
+	map<int, int> q {{0, 2}};
+	double exact = bn.marginal_dist(q, 0, SampleStrategy::EXACT)[q];
+	assertTrue(fabs(exact - 0.16 / 0.27) < 1e-12);
+	bn.seed(4);
+	BatchAnswer<Dist> batch = bn.marginal_batch({}, {0}, 20000, SampleStrategy::GIBBS);
+	assertTrue(fabs(batch.marginals[0].at(2) - exact) < 0.03);
+	assertTrue(fabs(batch.marginals[0].at(0) + batch.marginals[0].at(1) + batch.marginals[0].at(2) - 1) < 1e-9);
+	assertTrue(fabs(bn.marginal_dist(q, 20000, SampleStrategy::GIBBS)[q] - exact) < 0.03);
+
+	// Single node marginals forward sample, so a root keeps its prior
+	Dist prior = bn.marginal_dist(0, 20000);
+	assertTrue(fabs(prior.at(0) - 0.5) < 0.03 && fabs(prior.at(2) - 0.2) < 0.03);
+}
+
+void canStreamChain() {
+	BayesNet<> bn;
+
+	map<vector<int>, map<int, double>> cpt;
+	map<int, double> dist;
+	dist.insert(make_pair(0, 0.7));
+	dist.insert(make_pair(2, 0.3));
+	cpt.insert(CondProb<>::CondCase(vector<int>(), dist));
+	bn.add_node(0, CondProb<>(cpt));
+	bn.add_node(1, CondProb<>(cpt));
+
+	Histogram<> hist(bn.compiled(), 0);
+	bn.gibbs_sample(8192, 32, hist);
+	assertEquals(hist.count(), 8192ul);
+	map<int, double> marginal = hist.distribution();
+	assertTrue(marginal[0] > 0.65 && marginal[0] < 0.75);
+
+	RunningMean<> mean(bn.compiled(), 1);
+	bn.gibbs_sample(8192, 32, mean);
+	assertTrue(mean.stats().mean() > 0.5 && mean.stats().mean() < 0.7);
+
+	IndicatorCounter<> counter(bn.compiled(), map<int, int> {{0, 2}, {1, 2}});
+	bn.gibbs_sample(8192, 32, counter);
+	assertTrue(counter.estimate() > 0.05 && counter.estimate() < 0.13);
+}
+
+void canConditionOnEvidence() {
+	BayesNet<> bn;
+
+	map<vector<int>, map<int, double>> cpt;
+	map<int, double> dist;
+	dist.insert(make_pair(0, 0.7));
+	dist.insert(make_pair(1, 0.3));
+	cpt.insert(CondProb<>::CondCase(vector<int>(), dist));
+	bn.add_node(0, CondProb<>(cpt));
+
+	cpt.clear();
+	dist.clear();
+	dist.insert(make_pair(0, 0.8));
+	dist.insert(make_pair(1, 0.2));
+	cpt.insert(CondProb<>::CondCase(vector<int> {0}, dist));
+	dist.clear();
+	dist.insert(make_pair(0, 0.1));
+	dist.insert(make_pair(1, 0.9));
+	cpt.insert(CondProb<>::CondCase(vector<int> {1}, dist));
+	bn.add_node(1, {0}, CondProb<>(cpt));
+
+	// P(0 = 1 | 1 = 1) = 0.27 / (0.27 + 0.14)
+	bn.observe(1, 1);
+	map<int, int> values;
+	values.insert(make_pair(0, 1));
+	map<std::map<int, int>, double> marginal_dist = bn.marginal_dist(values, 8192, SampleStrategy::GIBBS);
+	assertTrue(marginal_dist[values] > 0.62 && marginal_dist[values] < 0.70);
+}
+
+void canMetropolisSample() {
+	BayesNet<> bn;
+
+	map<vector<int>, map<int, double>> cpt;
+	map<int, double> dist;
+	dist.insert(make_pair(0, 0.7));
+	dist.insert(make_pair(2, 0.3));
+	cpt.insert(CondProb<>::CondCase(vector<int>(), dist));
+	bn.add_node(0, CondProb<>(cpt));
+
+	cpt.clear();
+	dist.clear();
+	dist.insert(make_pair(0, 0.8));
+	dist.insert(make_pair(1, 0.2));
+	cpt.insert(CondProb<>::CondCase(vector<int> {0}, dist));
+	dist.clear();
+	dist.insert(make_pair(0, 0.1));
+	dist.insert(make_pair(1, 0.9));
+	cpt.insert(CondProb<>::CondCase(vector<int> {2}, dist));
+	bn.add_node(1, {0}, CondProb<>(cpt));
+
+	RunningMean<> mean(bn.compiled(), 0);
+	bn.metropolis_sample(16384, 64, mean);
+	assertTrue(mean.stats().mean() > 0.5 && mean.stats().mean() < 0.7);
+
+	// P(0 = 2 | 1 = 1) = 0.27 / (0.27 + 0.14)
+	bn.observe(1, 1);
+	map<int, int> values;
+	values.insert(make_pair(0, 2));
+	map<std::map<int, int>, double> marginal_dist = bn.marginal_dist(values, 8192, SampleStrategy::MH);
+	assertTrue(marginal_dist[values] > 0.62 && marginal_dist[values] < 0.70);
+}
+
+void canSampleBatch() {
+	BayesNet<> bn;
+
+	map<vector<int>, map<int, double>> cpt;
+	map<int, double> dist;
+	dist.insert(make_pair(0, 0.7));
+	dist.insert(make_pair(2, 0.3));
+	cpt.insert(CondProb<>::CondCase(vector<int>(), dist));
+	bn.add_node(0, CondProb<>(cpt));
+
+	// 1 copies 0, 2 is observed
+	bn.add_node(1, {0}, CondProb<>(map<vector<int>, map<int, double>> {
+		{ vector<int> {0}, map<int, double> {{0, 1.0}, {1, 0.0}} },
+		{ vector<int> {2}, map<int, double> {{0, 0.0}, {1, 1.0}} } }));
+	bn.add_node(2, CondProb<>(cpt));
+	bn.observe(2, 2);
+
+	SampleBatch<> batch = bn.sample_batch(10001);
+	assertEquals(batch.size(), 10001u);
+	const CompiledNet<>& net = bn.compiled();
+	const SampleBatch<>::lane_type* root = batch.column(net.index_of(0));
+	const SampleBatch<>::lane_type* child = batch.column(net.index_of(1));
+	unsigned zeros = 0;
+	for (unsigned i = 0; i < batch.size(); i++) {
+		assertEquals(root[i], child[i]);
+		zeros += root[i] == 0;
+	}
+	assertTrue(zeros > 6700 && zeros < 7300);
+
+	map<int, int> s = batch.assignment(10000);
+	assertEquals(s[2], 2);
+	assertEquals(s[1], s[0] == 2 ? 1 : 0);
+}
+
+void canWeightEvidence() {
+	// Weights far below the range of a double keep their ratios
+	WeightedStats stats;
+	stats.push(1, -2000);
+	stats.push(0, -2000 - log(3.0));
+	assertTrue(fabs(stats.mean() - 0.75) < 1e-9);
+	assertTrue(fabs(stats.effective_size() - 1.6) < 1e-9);
+
+	BayesNet<> bn;
+
+	map<vector<int>, map<int, double>> cpt;
+	map<int, double> dist;
+	dist.insert(make_pair(0, 0.99));
+	dist.insert(make_pair(1, 0.01));
+	cpt.insert(CondProb<>::CondCase(vector<int>(), dist));
+	bn.add_node(0, CondProb<>(cpt));
+	bn.add_node(1, {0}, CondProb<>(map<vector<int>, map<int, double>> {
+		{ vector<int> {0}, map<int, double> {{0, 0.99}, {1, 0.01}} },
+		{ vector<int> {1}, map<int, double> {{0, 0.1}, {1, 0.9}} } }));
+
+	// P(0 = 1 | 1 = 1) = 0.009 / (0.009 + 0.0099)
+	bn.observe(1, 1);
+	bn.set_chains(4);
+	map<int, int> values;
+	values.insert(make_pair(0, 1));
+	map<std::map<int, int>, double> marginal_dist =
+		bn.marginal_dist(values, 65536, SampleStrategy::LIKELIHOOD_WEIGHTING);
+	assertTrue(marginal_dist[values] > 0.42 && marginal_dist[values] < 0.53);
+	assertEquals(bn.report().samples, 65536ul);
+	assertTrue(bn.report().ess > 100 && bn.report().ess < 65536);
+
+	WeightedMean<> mean(bn.compiled(), 0);
+	bn.weighted_sample(65536, mean);
+	assertTrue(mean.stats().mean() > 0.42 && mean.stats().mean() < 0.53);
+}
+
+void canInferExactly() {
+	// Diamond 0 -> {1, 2} -> 3, whose moral graph has a cycle
+	BayesNet<> bn;
+	bn.add_node(0, CondProb<>(map<vector<int>, map<int, double>> {
+		{ vector<int>(), map<int, double> {{0, 0.6}, {1, 0.4}} } }));
+	bn.add_node(1, {0}, CondProb<>(map<vector<int>, map<int, double>> {
+		{ vector<int> {0}, map<int, double> {{0, 0.7}, {1, 0.3}} },
+		{ vector<int> {1}, map<int, double> {{0, 0.2}, {1, 0.8}} } }));
+	bn.add_node(2, {0}, CondProb<>(map<vector<int>, map<int, double>> {
+		{ vector<int> {0}, map<int, double> {{0, 0.9}, {1, 0.1}} },
+		{ vector<int> {1}, map<int, double> {{0, 0.4}, {1, 0.6}} } }));
+	bn.add_node(3, {1, 2}, CondProb<>(map<vector<int>, map<int, double>> {
+		{ vector<int> {0, 0}, map<int, double> {{0, 0.99}, {1, 0.01}} },
+		{ vector<int> {0, 1}, map<int, double> {{0, 0.5}, {1, 0.5}} },
+		{ vector<int> {1, 0}, map<int, double> {{0, 0.6}, {1, 0.4}} },
+		{ vector<int> {1, 1}, map<int, double> {{0, 0.05}, {1, 0.95}} } }));
+
+	// Reference answers by enumerating the joint
+	const CompiledNet<>& net = bn.compiled();
+	auto brute = [&net](map<int, int> q, map<int, int> e) {
+		double hit = 0, total = 0;
+		vector<unsigned> state(4);
+		for (unsigned i = 0; i < 16; i++) {
+			for (unsigned n = 0; n < 4; n++)
+				state[n] = (i >> n) & 1;
+			map<int, int> a = net.assignment(state);
+			double p = 1;
+			for (unsigned n = 0; n < 4; n++)
+				p *= net.probability(n, net.row_index(n, state), state[n]);
+			bool evident = true, holds = true;
+			for (pair<int, int> x : e)
+				evident = evident && a[x.first] == x.second;
+			for (pair<int, int> x : q)
+				holds = holds && a[x.first] == x.second;
+			total += evident ? p : 0;
+			hit += evident && holds ? p : 0;
+		}
+		return hit / total;
+	};
+
+	map<int, int> single {{0, 1}};
+	map<int, int> spread {{0, 1}, {3, 1}};
+	map<std::map<int, int>, double> result = bn.marginal_dist(single, 0, SampleStrategy::EXACT);
+	assertTrue(fabs(result[single] - 0.4) < 1e-12);
+	assertEquals(bn.report().samples, 0ul);
+
+	bn.observe(3, 1);
+	result = bn.marginal_dist(single, 0, SampleStrategy::EXACT);
+	assertTrue(fabs(result[single] - brute(single, {{3, 1}})) < 1e-12);
+
+	bn.observe(2, 0);
+	result = bn.marginal_dist(spread, 0, SampleStrategy::EXACT);
+	assertTrue(fabs(result[spread] - brute(spread, {{3, 1}, {2, 0}})) < 1e-12);
+	map<int, int> pair12 {{1, 1}, {2, 1}};
+	result = bn.marginal_dist(pair12, 0, SampleStrategy::EXACT);
+	assertTrue(fabs(result[pair12]) < 1e-12);
+	assertTrue(bn.junction_tree().treewidth() == 2);
+
+	// Beyond the limit the query is sampled instead
+	bn.set_treewidth_limit(1);
+	bn.seed(11);
+	result = bn.marginal_dist(single, 8192, SampleStrategy::EXACT);
+	assertEquals(bn.report().samples, 8192ul);
+	assertTrue(fabs(result[single] - brute(single, {{3, 1}, {2, 0}})) < 0.05);
+}
+
+void canStoreChains() {
+	NetworkShape shape(900, 3, 10, 2);
+	Xoshiro256 engine(17);
+	BayesNet<> bn(generate_network(shape, engine));
+	bn.observe(899, 1);
+	bn.seed(6);
+
+	// The store keeps exactly the states a plain visitor sees
+	vector<vector<unsigned>> states;
+	auto collect = [&states](const vector<unsigned>& state) { states.push_back(state); };
+	bn.gibbs_sample(3000, 10, collect);
+	bn.seed(6);
+	ChainStore<> store = bn.gibbs_chain(3000, 10);
+	assertEquals(store.size(), states.size());
+	for (size_t i = 0; i < states.size(); i += 97)
+		assertEquals(store.state(i), states[i]);
+	size_t i = 0;
+	for (ChainStore<>::const_iterator it = store.begin(); it != store.end(); ++it, ++i)
+		assertTrue(*it == states[i]);
+	assertEquals(i, states.size());
+
+	// Jumps in either direction rebuild from a keyframe
+	ChainStore<>::const_iterator it = store.end() - 1;
+	assertEquals(store.end() - store.begin(), (ptrdiff_t)3000);
+	assertTrue(*it == states.back());
+	it -= 1000;
+	assertTrue(*it == states[1999]);
+	assertTrue(it[-1500] == states[499]);
+	assertTrue(store.begin() < it && it <= store.end());
+	assertEquals(store.assignment(42), bn.compiled().assignment(states[42]));
+
+	// One bit per binary node in keyframes, a node index per change in
+	// between: far below a map per state
+	size_t map_bytes = states.size() * 900 * 48;
+	assertTrue(store.bytes() * 300 < map_bytes);
+
+	// Sweeping chains change many nodes per state and short intervals
+	// leave little between keyframes; both still round trip
+	ChainStore<> dense(bn.compiled(), 3);
+	vector<vector<unsigned>> sweeps;
+	auto both = [&dense, &sweeps](const vector<unsigned>& state) {
+		dense(state);
+		sweeps.push_back(state);
+	};
+	bn.chromatic_sample(50, 2, both);
+	for (size_t j = 0; j < sweeps.size(); j++)
+		assertTrue(dense.begin()[j] == sweeps[j]);
+}
+
+void canBatchQueries() {
+	NetworkShape shape(30, 2, 5, 3);
+	Xoshiro256 engine(13);
+	BayesNet<> bn(generate_network(shape, engine));
+	bn.observe(29, 1);
+	bn.set_chains(2);
+	bn.seed(4);
+
+	vector<map<int, int>> queries {{{10, 0}}, {{11, 2}, {12, 1}}, {{0, 1}, {5, 0}, {20, 2}}};
+	vector<int> nodes {3, 17};
+	BatchAnswer<map<int, double>> exact = bn.marginal_batch(queries, nodes, 0, SampleStrategy::EXACT);
+	for (unsigned i = 0; i < queries.size(); i++)
+		assertTrue(fabs(exact.joint[i] - bn.marginal_dist(queries[i], 0, SampleStrategy::EXACT)[queries[i]]) < 1e-12);
+
+	// One run answers every query, each from the same particles
+	BatchAnswer<map<int, double>> weighted = bn.marginal_batch(queries, nodes, 20000,
+		SampleStrategy::LIKELIHOOD_WEIGHTING);
+	assertEquals(weighted.joint.size(), queries.size());
+	assertEquals(weighted.marginals.size(), nodes.size());
+	for (unsigned i = 0; i < queries.size(); i++) {
+		assertTrue(fabs(weighted.joint[i] - exact.joint[i]) < 0.03);
+		assertEquals(weighted.reports[i].samples, 20000ul);
+	}
+	for (unsigned j = 0; j < nodes.size(); j++)
+		for (const pair<const int, double>& p : weighted.marginals[j])
+			assertTrue(fabs(p.second - exact.marginals[j][p.first]) < 0.03);
+
+	// Chains likewise feed every query from each retained state, so a
+	// node's indicators always sum to one
+	BatchAnswer<map<int, double>> sampled = bn.marginal_batch(queries, nodes, 4000, SampleStrategy::GIBBS);
+	for (unsigned i = 0; i < queries.size(); i++) {
+		assertEquals(sampled.reports[i].chains, 2u);
+		assertEquals(sampled.reports[i].samples, 4000ul);
+	}
+	for (unsigned j = 0; j < nodes.size(); j++) {
+		double total = 0;
+		for (const pair<const int, double>& p : sampled.marginals[j])
+			total += p.second;
+		assertTrue(fabs(total - 1) < 1e-9);
+	}
+
+	// The answers are cached like single queries
+	unsigned long hits = bn.cache_counters().hits;
+	map<std::map<int, int>, double> again = bn.marginal_dist(queries[1], 2000, SampleStrategy::GIBBS);
+	assertEquals(again[queries[1]], sampled.joint[1]);
+	assertEquals(bn.cache_counters().hits, hits + 1);
+}
+
+void canCacheQueries() {
+	BayesNet<> bn;
+
+	map<vector<int>, map<int, double>> cpt;
+	map<int, double> dist;
+	dist.insert(make_pair(0, 0.7));
+	dist.insert(make_pair(1, 0.3));
+	cpt.insert(CondProb<>::CondCase(vector<int>(), dist));
+	bn.add_node(0, CondProb<>(cpt));
+	bn.add_node(1, CondProb<>(cpt));
+
+	map<int, int> values;
+	values.insert(make_pair(0, 0));
+	map<std::map<int, int>, double> first = bn.marginal_dist(values, 2048, SampleStrategy::GIBBS);
+	map<std::map<int, int>, double> second = bn.marginal_dist(values, 1024, SampleStrategy::GIBBS);
+	assertEquals(first, second);
+	assertEquals(bn.cache_counters().misses, 1ul);
+	assertEquals(bn.cache_counters().hits, 1ul);
+
+	// A larger budget extends the stored chains
+	bn.marginal_dist(values, 4096, SampleStrategy::GIBBS);
+	assertEquals(bn.cache_counters().refinements, 1ul);
+	assertEquals(bn.report().samples, 4096ul);
+
+	// New evidence is a new key; the old result stays valid for the old evidence
+	bn.observe(1, 1);
+	bn.marginal_dist(values, 1024, SampleStrategy::GIBBS);
+	assertEquals(bn.cache_counters().misses, 2ul);
+
+	// A node below the query leaves it untouched unless it is observed
+	bn.add_node(2, {0}, CondProb<>(map<vector<int>, map<int, double>> {
+		{ vector<int> {0}, map<int, double> {{0, 0.5}, {1, 0.5}} },
+		{ vector<int> {1}, map<int, double> {{0, 0.5}, {1, 0.5}} } }));
+	bn.marginal_dist(values, 1024, SampleStrategy::GIBBS);
+	assertEquals(bn.cache_counters().hits, 2ul);
+	bn.marginal_dist(0, 512);
+	bn.marginal_dist(0, 512);
+	assertEquals(bn.cache_counters().hits, 3ul);
+	bn.add_node(3, {1}, CondProb<>(map<vector<int>, map<int, double>> {
+		{ vector<int> {0}, map<int, double> {{0, 0.5}, {1, 0.5}} },
+		{ vector<int> {1}, map<int, double> {{0, 0.5}, {1, 0.5}} } }));
+	bn.marginal_dist(0, 512);
+	assertEquals(bn.cache_counters().hits, 4ul);
+
+	map<int, int> below {{2, 1}};
+	bn.marginal_dist(below, 1024, SampleStrategy::GIBBS);
+	bn.add_node(4, {2}, CondProb<>(map<vector<int>, map<int, double>> {
+		{ vector<int> {0}, map<int, double> {{0, 0.5}, {1, 0.5}} },
+		{ vector<int> {1}, map<int, double> {{0, 0.5}, {1, 0.5}} } }));
+	bn.marginal_dist(below, 1024, SampleStrategy::GIBBS);
+	assertEquals(bn.cache_counters().hits, 5ul);
+
+	bn.set_cache_capacity(0);
+	unsigned long misses = bn.cache_counters().misses;
+	bn.marginal_dist(below, 1024, SampleStrategy::GIBBS);
+	bn.marginal_dist(below, 1024, SampleStrategy::GIBBS);
+	assertEquals(bn.cache_counters().misses, misses + 2);
+}
+
+void canStopAdaptively() {
+	// Batch means see through autocorrelation: an AR(1) series with
+	// coefficient 0.9 carries about a nineteenth of its length
+	Xoshiro256 engine(13);
+	BatchMeans iid, ar, drift;
+	double x = 0;
+	for (unsigned i = 0; i < 100000; i++) {
+		double noise = uniform_real(engine) - 0.5;
+		iid.push(noise);
+		x = 0.9 * x + noise;
+		ar.push(x);
+		drift.push(noise + (i < 20000 ? 1 : 0));
+	}
+	assertTrue(iid.effective_size() > 60000);
+	assertTrue(ar.effective_size() > 100000 / 40.0 && ar.effective_size() < 100000 / 10.0);
+	assertTrue(iid.batch_count() >= 32 && iid.batch_count() < 64);
+	assertTrue(iid.geweke() < 3 && drift.geweke() > 10);
+	assertTrue(fabs(normal_quantile(0.95) - 1.959964) < 1e-5);
+
+	// A merged series ending mid-batch is cut at the batch boundary, so it
+	// batches as the one series would; the constant tail splits exactly
+	BatchMeans head(4), tail(4), whole(4);
+	for (unsigned i = 0; i < 37; i++) {
+		head.push(i % 3);
+		whole.push(i % 3);
+	}
+	for (unsigned i = 0; i < 50; i++) {
+		tail.push(2);
+		whole.push(2);
+	}
+	head.merge(tail);
+	assertEquals(head.count(), whole.count());
+	assertEquals(head.batch_length(), whole.batch_length());
+	assertEquals(head.batch_count(), whole.batch_count());
+	assertTrue(fabs(head.variance_of_mean() - whole.variance_of_mean()) < 1e-12);
+
+	NetworkShape shape(30, 2, 5, 2);
+	Xoshiro256 generator(31);
+	BayesNet<> bn(generate_network(shape, generator));
+	bn.observe(29, 1);
+	bn.seed(3);
+	map<int, int> q {{15, 1}};
+	double exact = bn.marginal_dist(q, 0, SampleStrategy::EXACT)[q];
+
+	// Tighter targets take more samples, and each stops once it is met
+	StoppingRule loose, tight;
+	loose.half_width = 0.02;
+	tight.half_width = 0.005;
+	double estimate = bn.marginal_dist(q, loose, SampleStrategy::LIKELIHOOD_WEIGHTING)[q];
+	ChainReport coarse = bn.report();
+	assertTrue(coarse.half_width() <= 0.02 && fabs(estimate - exact) < 0.04);
+	estimate = bn.marginal_dist(q, tight, SampleStrategy::LIKELIHOOD_WEIGHTING)[q];
+	ChainReport fine = bn.report();
+	assertTrue(fine.half_width() <= 0.005 && fabs(estimate - exact) < 0.01);
+	assertTrue(fine.samples > 8 * coarse.samples && fine.samples < 64 * coarse.samples);
+
+	// The tight answer already meets the loose target
+	bn.marginal_dist(q, loose, SampleStrategy::LIKELIHOOD_WEIGHTING);
+	assertEquals(bn.cache_counters().hits, 1ul);
+	assertEquals(bn.report().samples, fine.samples);
+
+	StoppingRule effective;
+	effective.ess = 3000;
+	bn.marginal_dist(q, effective, SampleStrategy::LIKELIHOOD_WEIGHTING);
+	assertTrue(bn.report().ess >= 3000);
+
+	// Gibbs runs several chains whatever the chain count, burns each in
+	// and stops within the budget
+	BayesNet<> diamond;
+	diamond.add_node(0, CondProb<>(map<vector<int>, map<int, double>> {
+		{ vector<int>(), map<int, double> {{0, 0.6}, {1, 0.4}} } }));
+	diamond.add_node(1, {0}, CondProb<>(map<vector<int>, map<int, double>> {
+		{ vector<int> {0}, map<int, double> {{0, 0.7}, {1, 0.3}} },
+		{ vector<int> {1}, map<int, double> {{0, 0.2}, {1, 0.8}} } }));
+	diamond.add_node(2, {1}, CondProb<>(map<vector<int>, map<int, double>> {
+		{ vector<int> {0}, map<int, double> {{0, 0.9}, {1, 0.1}} },
+		{ vector<int> {1}, map<int, double> {{0, 0.4}, {1, 0.6}} } }));
+	diamond.observe(2, 1);
+	diamond.set_chains(1);
+	diamond.seed(5);
+	map<int, int> root {{0, 1}};
+	exact = diamond.marginal_dist(root, 0, SampleStrategy::EXACT)[root];
+	StoppingRule rule;
+	rule.half_width = 0.01;
+	rule.max_samples = 1 << 20;
+	estimate = diamond.marginal_dist(root, rule, SampleStrategy::GIBBS)[root];
+	const ChainReport& report = diamond.report();
+	assertTrue(report.chains >= 4 && report.burn_in >= 32);
+	assertTrue(report.half_width() <= 0.01 && report.rhat <= 1.05 && report.geweke <= 3);
+	assertTrue(report.samples < rule.max_samples);
+	assertTrue(fabs(estimate - exact) < 0.02);
+}
+
+void canPruneIrrelevantNodes() {
+	// 0 -> 1 -> 2 -> 5, 0 -> 3 <- 4, and 6 on its own
+	BayesNet<> bn;
+	CondProb<> root(map<vector<int>, map<int, double>> {
+		{ vector<int>(), map<int, double> {{0, 0.6}, {1, 0.4}} } });
+	CondProb<> child(map<vector<int>, map<int, double>> {
+		{ vector<int> {0}, map<int, double> {{0, 0.8}, {1, 0.2}} },
+		{ vector<int> {1}, map<int, double> {{0, 0.3}, {1, 0.7}} } });
+	CondProb<> collider(map<vector<int>, map<int, double>> {
+		{ vector<int> {0, 0}, map<int, double> {{0, 0.9}, {1, 0.1}} },
+		{ vector<int> {0, 1}, map<int, double> {{0, 0.4}, {1, 0.6}} },
+		{ vector<int> {1, 0}, map<int, double> {{0, 0.3}, {1, 0.7}} },
+		{ vector<int> {1, 1}, map<int, double> {{0, 0.1}, {1, 0.9}} } });
+	bn.add_node(0, root);
+	bn.add_node(4, root);
+	bn.add_node(6, root);
+	bn.add_node(1, {0}, child);
+	bn.add_node(2, {1}, child);
+	bn.add_node(5, {2}, child);
+	bn.add_node(3, {0, 4}, collider);
+
+	// Without evidence only the ancestors matter; an observed collider
+	// opens the path to its other parent; an observed parent blocks
+	// everything above it
+	assertEquals(bn.relevant_nodes({1}), (set<int> {0, 1}));
+	bn.observe(3, 1);
+	assertEquals(bn.relevant_nodes({1}), (set<int> {0, 1, 3, 4}));
+	assertEquals(bn.relevant_nodes({6}), (set<int> {6}));
+	bn.observe(0, 1);
+	assertEquals(bn.relevant_nodes({1}), (set<int> {0, 1}));
+	assertEquals(bn.relevant_nodes({4}), (set<int> {0, 3, 4}));
+	bn.observe(5, 0);
+	assertEquals(bn.relevant_nodes({1}), (set<int> {0, 1, 2, 5}));
+
+	// Sampling the pruned network gives the posterior of the whole one
+	bn.seed(9);
+	for (int node : {1, 2, 4}) {
+		map<int, int> q {{node, 1}};
+		double exact = bn.marginal_dist(q, 0, SampleStrategy::EXACT)[q];
+		assertTrue(fabs(bn.marginal_dist(q, 40000, SampleStrategy::LIKELIHOOD_WEIGHTING)[q] - exact) < 0.02);
+		assertTrue(fabs(bn.marginal_dist(q, 40000, SampleStrategy::GIBBS)[q] - exact) < 0.02);
+	}
+
+	// A node added below a query makes it relevant once observed
+	bn.add_node(7, {4}, child);
+	bn.observe(7, 0);
+	assertEquals(bn.relevant_nodes({4}), (set<int> {0, 3, 4, 7}));
+
+	// On a wide network a query reaches a small part of it
+	NetworkShape shape(400, 2, 8, 2);
+	Xoshiro256 engine(41);
+	BayesNet<> wide(generate_network(shape, engine));
+	wide.observe(399, 1);
+	wide.seed(2);
+	map<int, int> q {{56, 1}};
+	set<int> reached = wide.relevant_nodes({56});
+	assertTrue(reached.count(399) && reached.size() < 100);
+	double pruned = wide.marginal_dist(q, 40000, SampleStrategy::LIKELIHOOD_WEIGHTING)[q];
+	wide.set_pruning(false);
+	wide.set_cache_capacity(0);
+	double whole = wide.marginal_dist(q, 40000, SampleStrategy::LIKELIHOOD_WEIGHTING)[q];
+	assertTrue(fabs(pruned - whole) < 0.02);
+}
+
+void canServeConcurrentQueries() {
+	// Diamond 0 -> {1, 2} -> 3
+	BayesNet<> bn;
+	bn.add_node(0, CondProb<>(map<vector<int>, map<int, double>> {
+		{ vector<int>(), map<int, double> {{0, 0.6}, {1, 0.4}} } }));
+	bn.add_node(1, {0}, CondProb<>(map<vector<int>, map<int, double>> {
+		{ vector<int> {0}, map<int, double> {{0, 0.7}, {1, 0.3}} },
+		{ vector<int> {1}, map<int, double> {{0, 0.2}, {1, 0.8}} } }));
+	bn.add_node(2, {0}, CondProb<>(map<vector<int>, map<int, double>> {
+		{ vector<int> {0}, map<int, double> {{0, 0.9}, {1, 0.1}} },
+		{ vector<int> {1}, map<int, double> {{0, 0.4}, {1, 0.6}} } }));
+	bn.add_node(3, {1, 2}, CondProb<>(map<vector<int>, map<int, double>> {
+		{ vector<int> {0, 0}, map<int, double> {{0, 0.99}, {1, 0.01}} },
+		{ vector<int> {0, 1}, map<int, double> {{0, 0.5}, {1, 0.5}} },
+		{ vector<int> {1, 0}, map<int, double> {{0, 0.6}, {1, 0.4}} },
+		{ vector<int> {1, 1}, map<int, double> {{0, 0.05}, {1, 0.95}} } }));
+
+	// Most probable explanation by enumerating the joint
+	const CompiledNet<>& net = bn.compiled();
+	auto brute = [&net](int node, int value) {
+		double best = -1;
+		map<int, int> argmax;
+		vector<unsigned> state(4);
+		for (unsigned i = 0; i < 16; i++) {
+			for (unsigned n = 0; n < 4; n++)
+				state[n] = (i >> n) & 1;
+			double p = 1;
+			for (unsigned n = 0; n < 4; n++)
+				p *= net.probability(n, net.row_index(n, state), state[n]);
+			map<int, int> a = net.assignment(state);
+			if (a[node] == value && p > best) {
+				best = p;
+				argmax = a;
+			}
+		}
+		return argmax;
+	};
+	bn.observe(3, 1);
+	assertEquals(bn.most_probable_explanation(0), brute(3, 1));
+	bn.set_treewidth_limit(1);
+	bn.seed(4);
+	assertEquals(bn.most_probable_explanation(2000), brute(3, 1));
+	bn.set_treewidth_limit(16);
+	map<int, int> q {{0, 1}};
+	double exact = bn.marginal_dist(q, 0, SampleStrategy::EXACT)[q];
+	map<int, double> exact3;
+	bn.clear_evidence();
+	bn.observe(0, 1);
+	for (int v : {0, 1}) {
+		map<int, int> value {{3, v}};
+		exact3[v] = bn.marginal_dist(value, 0, SampleStrategy::EXACT)[value];
+	}
+
+	// The service answers from a snapshot; the evidence the network holds
+	// and anything done to it later stay out
+	ServiceOptions options;
+	options.workers = 2;
+	options.window = chrono::milliseconds(20);
+	options.count = 20000;
+	options.seed = 12;
+	QueryService<> service(bn, options);
+	bn.observe(1, 0);
+
+	// Queries from several threads under shared evidence share chains
+	vector<future<double>> posteriors;
+	vector<future<map<int, double>>> marginals;
+	mutex submitted;
+	vector<thread> clients;
+	for (unsigned t = 0; t < 4; t++)
+		clients.push_back(thread([&]() {
+			future<double> posterior = service.probability(q, {{3, 1}});
+			future<map<int, double>> marginal = service.marginal(3, {{0, 1}});
+			lock_guard<mutex> lock(submitted);
+			posteriors.push_back(move(posterior));
+			marginals.push_back(move(marginal));
+		}));
+	for (thread& client : clients)
+		client.join();
+	for (future<double>& posterior : posteriors)
+		assertTrue(fabs(posterior.get() - exact) < 0.02);
+	for (future<map<int, double>>& marginal : marginals) {
+		map<int, double> dist = marginal.get();
+		assertTrue(fabs(dist[0] - exact3[0]) < 0.02 && fabs(dist[1] - exact3[1]) < 0.02);
+	}
+	assertEquals(service.most_probable({{3, 1}}).get(), brute(3, 1));
+	assertTrue(fabs(service.probability(q, {}).get() - 0.4) < 0.02);
+	ServiceStats stats = service.stats();
+	assertEquals(stats.accepted, 10ul);
+	assertEquals(stats.answered, 10ul);
+	assertTrue(stats.batches < 8);
+
+	// Queries past their deadline fail, and a full service refuses more
+	bool late = false;
+	try {
+		service.probability(q, {}, chrono::steady_clock::now() - chrono::milliseconds(1)).get();
+	} catch (const DeadlineException&) {
+		late = true;
+	}
+	assertTrue(late);
+
+	// A query naming an unknown node or value fails alone; the queries
+	// batched with it are still answered, and only they count as answered
+	ServiceOptions wide = options;
+	wide.window = chrono::milliseconds(200);
+	QueryService<> mixed(bn, wide);
+	future<map<int, double>> unknown = mixed.marginal(7, {{0, 1}});
+	future<double> bad_value = mixed.probability({{0, 5}}, {{0, 1}});
+	future<map<int, double>> known = mixed.marginal(3, {{0, 1}});
+	bool missing = false, unknown_value = false;
+	try {
+		unknown.get();
+	} catch (const MissingNodeException&) {
+		missing = true;
+	}
+	try {
+		bad_value.get();
+	} catch (const UnknownValueException&) {
+		unknown_value = true;
+	}
+	assertTrue(missing && unknown_value);
+	map<int, double> dist = known.get();
+	assertTrue(fabs(dist[0] - exact3[0]) < 0.02 && fabs(dist[1] - exact3[1]) < 0.02);
+	stats = mixed.stats();
+	assertEquals(stats.batches, 1ul);
+	assertEquals(stats.answered, 1ul);
+	assertEquals(stats.failed, 2ul);
+
+	// Explanations batched under one evidence share a single search
+	QueryService<> explained(bn, wide);
+	future<map<int, int>> first_mpe = explained.most_probable({{3, 1}});
+	future<map<int, int>> second_mpe = explained.most_probable({{3, 1}});
+	assertEquals(first_mpe.get(), brute(3, 1));
+	assertEquals(second_mpe.get(), brute(3, 1));
+	assertEquals(explained.stats().batches, 1ul);
+
+	ServiceOptions narrow = options;
+	narrow.max_pending = 2;
+	narrow.window = chrono::milliseconds(200);
+	QueryService<> busy(bn, narrow);
+	future<double> first = busy.probability(q, {});
+	future<double> second = busy.probability(q, {});
+	bool refused = false;
+	try {
+		busy.probability(q, {}).get();
+	} catch (const OverloadedException&) {
+		refused = true;
+	}
+	assertTrue(refused);
+	assertTrue(fabs(first.get() - second.get()) < 1e-12);
+
+	// The socket front end speaks one line per request
+	QueryServer<QueryService<>> server(service, "/tmp/bayes_net_test.sock");
+	int client = socket(AF_UNIX, SOCK_STREAM, 0);
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, server.path().c_str());
+	assertEquals(connect(client, reinterpret_cast<sockaddr*>(&address), sizeof(address)), 0);
+	string requests = "probability 0=1 | 3=1\nmarginal 3 | 0=1 @10000\nmpe | 3=1\nbogus\n";
+	assertEquals(send(client, requests.data(), requests.size(), 0), (ssize_t)requests.size());
+	string replies;
+	char chunk[1024];
+	while (count(replies.begin(), replies.end(), '\n') < 4) {
+		ssize_t got = recv(client, chunk, sizeof(chunk), 0);
+		assertTrue(got > 0);
+		replies.append(chunk, got);
+	}
+	close(client);
+	istringstream lines(replies);
+	string line;
+	getline(lines, line);
+	assertTrue(line.compare(0, 3, "ok ") == 0 && fabs(stod(line.substr(3)) - exact) < 0.02);
+	getline(lines, line);
+	assertTrue(line.compare(0, 7, "ok 0:0.") == 0);
+	getline(lines, line);
+	assertEquals(line, string("ok 0=1 1=1 2=1 3=1"));
+	getline(lines, line);
+	assertEquals(line, string("error request"));
+}
+
+void canShareSnapshots() {
+	// Copies of evidence share one map until one of them changes
+	Evidence<> evidence {{1, 0}};
+	Evidence<> copy = evidence;
+	assertTrue(copy.shares(evidence));
+	copy.observe(2, 1);
+	assertTrue(!copy.shares(evidence) && evidence.size() == 1 && copy.size() == 2);
+	copy.forget(2);
+	assertTrue(copy == evidence);
+
+	// 0 -> 1 -> 2, 0 -> 3
+	BayesNet<> bn;
+	bn.add_node(0, CondProb<>(map<vector<int>, map<int, double>> {
+		{ vector<int>(), map<int, double> {{0, 0.3}, {1, 0.7}} } }));
+	bn.add_node(1, {0}, CondProb<>(map<vector<int>, map<int, double>> {
+		{ vector<int> {0}, map<int, double> {{0, 0.8}, {1, 0.2}} },
+		{ vector<int> {1}, map<int, double> {{0, 0.1}, {1, 0.9}} } }));
+	bn.add_node(2, {1}, CondProb<>(map<vector<int>, map<int, double>> {
+		{ vector<int> {0}, map<int, double> {{0, 0.6}, {1, 0.4}} },
+		{ vector<int> {1}, map<int, double> {{0, 0.25}, {1, 0.75}} } }));
+	bn.add_node(3, {0}, CondProb<>(map<vector<int>, map<int, double>> {
+		{ vector<int> {0}, map<int, double> {{0, 0.5}, {1, 0.5}} },
+		{ vector<int> {1}, map<int, double> {{0, 0.05}, {1, 0.95}} } }));
+
+	// The snapshot shares the compiled network and is handed out again
+	// until the network changes; evidence comes with each query
+	shared_ptr<const NetSnapshot<>> snapshot = bn.snapshot();
+	assertTrue(snapshot == bn.snapshot());
+	assertTrue(&snapshot->compiled() == &bn.compiled());
+	bn.observe(2, 1);
+	bn.unobserve(2);
+	map<int, int> q {{0, 1}};
+	assertTrue(fabs(snapshot->probability(q, {}, 0, SampleStrategy::EXACT, 0) - 0.7) < 1e-9);
+	assertEquals(snapshot->relevant_nodes({3}, {{2, 1}}), (set<int> {0, 1, 2, 3}));
+	assertEquals(snapshot->relevant_nodes({1}, {{0, 1}}), (set<int> {0, 1}));
+
+	// Threads query one snapshot under different evidence at once
+	vector<map<int, int>> evidence_sets {{{2, 0}}, {{2, 1}}, {{3, 0}}, {{2, 1}, {3, 1}}};
+	vector<double> expected;
+	for (const map<int, int>& e : evidence_sets) {
+		bn.clear_evidence();
+		bn.observe(e);
+		expected.push_back(bn.marginal_dist(q, 0, SampleStrategy::EXACT)[q]);
+	}
+	bn.clear_evidence();
+	vector<double> exact(evidence_sets.size()), weighted(evidence_sets.size());
+	vector<thread> readers;
+	for (unsigned i = 0; i < evidence_sets.size(); i++)
+		readers.push_back(thread([&, i]() {
+			Evidence<> e(evidence_sets[i]);
+			exact[i] = snapshot->probability(q, e, 0, SampleStrategy::EXACT, 0);
+			weighted[i] = snapshot->marginal_batch({q}, {3}, e, 40000,
+				SampleStrategy::LIKELIHOOD_WEIGHTING, 100 + i).joint[0];
+		}));
+	for (thread& reader : readers)
+		reader.join();
+	for (unsigned i = 0; i < evidence_sets.size(); i++) {
+		assertTrue(fabs(exact[i] - expected[i]) < 1e-9);
+		assertTrue(fabs(weighted[i] - expected[i]) < 0.02);
+	}
+
+	// Changing the network leaves the old snapshot as it was
+	bn.add_node(4, {2}, CondProb<>(map<vector<int>, map<int, double>> {
+		{ vector<int> {0}, map<int, double> {{0, 0.5}, {1, 0.5}} },
+		{ vector<int> {1}, map<int, double> {{0, 0.5}, {1, 0.5}} } }));
+	assertTrue(bn.snapshot() != snapshot);
+	assertEquals(snapshot->compiled().size(), 4u);
+	assertEquals(bn.snapshot()->compiled().size(), 5u);
+}
+
+void canTemperChains() {
+	// 2 = 0 xor 1 and 3 = 1, all deterministic. Given 2 = 1 the posterior
+	// has two modes that no single-site move connects.
+	BayesNet<> bn;
+	bn.add_node(0, CondProb<>(map<vector<int>, map<int, double>> {
+		{ vector<int>(), map<int, double> {{0, 0.7}, {1, 0.3}} } }));
+	bn.add_node(1, CondProb<>(map<vector<int>, map<int, double>> {
+		{ vector<int>(), map<int, double> {{0, 0.5}, {1, 0.5}} } }));
+	bn.add_node(2, {0, 1}, CondProb<>(map<vector<int>, map<int, double>> {
+		{ vector<int> {0, 0}, map<int, double> {{0, 1.0}, {1, 0.0}} },
+		{ vector<int> {0, 1}, map<int, double> {{0, 0.0}, {1, 1.0}} },
+		{ vector<int> {1, 0}, map<int, double> {{0, 0.0}, {1, 1.0}} },
+		{ vector<int> {1, 1}, map<int, double> {{0, 1.0}, {1, 0.0}} } }));
+	bn.add_node(3, {1}, CondProb<>(map<vector<int>, map<int, double>> {
+		{ vector<int> {0}, map<int, double> {{0, 1.0}, {1, 0.0}} },
+		{ vector<int> {1}, map<int, double> {{0, 0.0}, {1, 1.0}} } }));
+	bn.observe(2, 1);
+	bn.seed(9);
+	bn.set_chains(1);
+	map<int, int> q {{0, 1}};
+
+	// A single Gibbs chain stays in the mode it finds first
+	assertTrue(fabs(bn.marginal_dist(q, 4000, SampleStrategy::GIBBS)[q] - 0.3) > 0.2);
+
+	// Swaps with the hot replicas carry the cold chain between the modes
+	assertTrue(fabs(bn.marginal_dist(q, 4000, SampleStrategy::TEMPERED)[q] - 0.3) < 0.03);
+	const ChainReport& report = bn.report();
+	assertEquals(report.swap_rates.size(), (size_t)3);
+	for (double rate : report.swap_rates)
+		assertTrue(rate > 0.05 && rate <= 1);
+
+	// Batches feed one cold chain to every query
+	BatchAnswer<map<int, double>> batch = bn.marginal_batch({{{0, 0}, {3, 1}}}, {1}, 4000, SampleStrategy::TEMPERED);
+	assertTrue(fabs(batch.joint[0] - 0.7) < 0.03);
+	assertTrue(fabs(batch.marginals[0][1] - 0.7) < 0.03);
+	assertEquals(batch.reports[0].swap_rates.size(), (size_t)3);
+
+	// The chain can be driven directly with a ladder of its own
+	TemperingSchedule schedule;
+	schedule.replicas = 6;
+	schedule.swap_interval = 2;
+	const CompiledNet<>& net = bn.compiled();
+	vector<int> clamp(net.size(), -1);
+	clamp[net.index_of(2)] = net.value_index(net.index_of(2), 1);
+	TemperedChain<int, int, Xoshiro256> chain(net, clamp, Xoshiro256(3), schedule);
+	assertEquals(chain.betas().size(), (size_t)6);
+	assertTrue(chain.betas().front() == 1.0 && fabs(chain.betas().back() - 0.1) < 1e-12);
+	unsigned hits = 0;
+	for (unsigned i = 0; i < 4000; i++) {
+		chain.step();
+		hits += chain.state()[net.index_of(0)] == net.value_index(net.index_of(0), 1);
+	}
+	assertTrue(fabs(hits / 4000.0 - 0.3) < 0.04);
+	assertEquals(chain.swaps().attempts.size(), (size_t)5);
+	assertTrue(chain.swaps().attempts[0] == 1000 && chain.swaps().attempts[1] == 1000);
+}
+
+// Whether mapping a copy of a network file with one entry of a section
+// overwritten fails as a corrupt file. Sections are numbered as in NetFile,
+// their extents listed after the 64-byte header.
+template <typename T>
+bool rejectsCorruptFile(const std::string& path, unsigned section, std::size_t index, T value) {
+	std::ifstream in(path.c_str(), std::ios::binary);
+	std::string bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	std::uint64_t offset;
+	memcpy(&offset, bytes.data() + 64 + section * 16, sizeof(offset));
+	memcpy(&bytes[offset + index * sizeof(T)], &value, sizeof(value));
+	std::string copy = path + ".corrupt";
+	std::ofstream(copy.c_str(), std::ios::binary).write(bytes.data(), bytes.size());
+	bool rejected = false;
+	try {
+		NetFile::map<int, int>(copy);
+	} catch (const FormatException&) {
+		rejected = true;
+	}
+	std::remove(copy.c_str());
+	return rejected;
+}
+
+void canReadNetworkFiles() {
+	// The same network in both interchange formats; the BIF table lists
+	// the child slowest, the XMLBIF table the child fastest
+	std::istringstream bif(
+		"network dog { property \"source\"; }\n"
+		"// families go out with their dog\n"
+		"variable family { type discrete [ 2 ] { out, home }; }\n"
+		"variable bowel { type discrete [ 2 ] { sick, fine }; }\n"
+		"variable dog { type discrete [ 2 ] { out, in }; property \"x\"; }\n"
+		"probability ( family ) { table 0.15, 0.85; }\n"
+		"probability ( bowel ) { table 0.01, 0.99; }\n"
+		"probability ( dog | bowel, family ) {\n"
+		"  (sick, out) 0.99, 0.01;\n"
+		"  (fine, home) 0.3, 0.7;\n"
+		"  default 0.9, 0.1;\n"
+		"  (sick, home) 0.97, 0.03;\n"
+		"}\n");
+	std::istringstream xml(
+		"<?xml version=\"1.0\"?>\n<!-- dog problem -->\n<BIF VERSION=\"0.3\"><NETWORK><NAME>dog</NAME>\n"
+		"<VARIABLE TYPE=\"nature\"><NAME>family</NAME><OUTCOME>out</OUTCOME><OUTCOME>home</OUTCOME></VARIABLE>\n"
+		"<VARIABLE TYPE=\"nature\"><NAME>bowel</NAME><OUTCOME>sick</OUTCOME><OUTCOME>fine</OUTCOME></VARIABLE>\n"
+		"<VARIABLE TYPE=\"nature\"><NAME>dog</NAME><OUTCOME>out</OUTCOME><OUTCOME>in</OUTCOME>"
+		"<PROPERTY>position = (1, 2)</PROPERTY></VARIABLE>\n"
+		"<DEFINITION><FOR>family</FOR><TABLE>0.15 0.85</TABLE></DEFINITION>\n"
+		"<DEFINITION><FOR>bowel</FOR><TABLE>0.01 0.99</TABLE></DEFINITION>\n"
+		"<DEFINITION><FOR>dog</FOR><GIVEN>bowel</GIVEN><GIVEN>family</GIVEN>"
+		"<TABLE>0.99 0.01 0.97 0.03 0.9 0.1 0.3 0.7</TABLE></DEFINITION>\n"
+		"</NETWORK></BIF>\n");
+	BifNetwork from_bif = BifReader::read(bif);
+	BifNetwork from_xml = BifReader::read(xml);
+
+	assertEquals(from_bif.names.nodes, vector<string> {"family", "bowel", "dog"});
+	assertEquals(from_xml.names.values[2], vector<string> {"out", "in"});
+	const CompiledNet<>& net = from_bif.net;
+	unsigned values[2] = {1, 0};
+	assertTrue(fabs(net.probability(2, net.row_index_of(2, values), 0) - 0.9) < 1e-12);
+	for (unsigned node = 0; node < 3; node++)
+		for (unsigned r = 0; r < 4; r++) {
+			unsigned parents[2] = {r >> 1, r & 1};
+			std::size_t row = net.row_index_of(node, parents);
+			std::size_t other = from_xml.net.row_index_of(node, parents);
+			assertTrue(fabs(net.probability(node, row, 0) - from_xml.net.probability(node, other, 0)) < 1e-12);
+		}
+
+	std::istringstream broken("variable a { type discrete [ 2 ] { x, y }; }\nprobability ( b ) { table 1; }\n");
+	bool thrown = false;
+	try {
+		BifReader::read(broken);
+	} catch (MissingNodeException&) {
+		thrown = true;
+	}
+	assertTrue(thrown);
+
+	// Round trip through the binary format, read back in place
+	std::string path = "/tmp/bayes_net_test.bnet";
+	NetFile::write(path, net, from_bif.names);
+	NetNames names;
+	CompiledNet<> mapped = NetFile::map<int, int>(path, &names);
+	assertEquals(names.values, from_bif.names.values);
+	assertEquals(mapped.size(), 3u);
+	for (unsigned node = 0; node < 3; node++)
+		for (unsigned r = 0; r < 4; r++) {
+			unsigned parents[2] = {r >> 1, r & 1};
+			std::size_t row = net.row_index_of(node, parents);
+			for (unsigned v = 0; v < 2; v++)
+				assertTrue(net.probability(node, row, v) == mapped.probability(node, mapped.row_index_of(node, parents), v));
+		}
+
+	BayesNet<> bn(mapped);
+	map<int, int> out {{2, 0}};
+	map<std::map<int, int>, double> result = bn.marginal_dist(out, 0, SampleStrategy::EXACT);
+	double expected = 0.01 * (0.15 * 0.99 + 0.85 * 0.97) + 0.99 * (0.15 * 0.9 + 0.85 * 0.3);
+	assertTrue(fabs(result[out] - expected) < 1e-12);
+
+	// Growing a loaded network rebuilds its tables first
+	bn.add_node(3, {2}, CondProb<>(map<vector<int>, map<int, double>> {
+		{ vector<int> {0}, map<int, double> {{0, 0.8}, {1, 0.2}} },
+		{ vector<int> {1}, map<int, double> {{0, 0.1}, {1, 0.9}} } }));
+	result = bn.marginal_dist(out, 0, SampleStrategy::EXACT);
+	assertTrue(fabs(result[out] - expected) < 1e-12);
+	map<int, int> bark {{3, 0}};
+	result = bn.marginal_dist(bark, 0, SampleStrategy::EXACT);
+	assertTrue(fabs(result[bark] - (0.8 * expected + 0.1 * (1 - expected))) < 1e-12);
+
+	// Bad headers and indices out of range are refused when mapping:
+	// the magic, a parent past the last node, a repeated node in the
+	// topological order and a CPT offset past the probabilities
+	std::string header = path + ".header";
+	{
+		std::ifstream in(path.c_str(), std::ios::binary);
+		std::string bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		bytes[0] = 'X';
+		std::ofstream(header.c_str(), std::ios::binary).write(bytes.data(), bytes.size());
+	}
+	bool bad_header = false;
+	try {
+		NetFile::map<int, int>(header);
+	} catch (const FormatException&) {
+		bad_header = true;
+	}
+	std::remove(header.c_str());
+	assertTrue(bad_header);
+	assertTrue(rejectsCorruptFile(path, 4, 0, 7u));
+	assertTrue(rejectsCorruptFile(path, 10, 1, mapped.topological_order()[0]));
+	assertTrue(rejectsCorruptFile(path, 13, 1, std::size_t(1000)));
+	unsigned first = 0;
+	while (mapped.parents_begin(first) == mapped.parents_end(first))
+		first++;
+	assertTrue(!rejectsCorruptFile(path, 4, 0, mapped.parents_begin(first)[0]));
+	std::remove(path.c_str());
+}
+
+void canUseCompactCpds() {
+	typedef map<int, double> Dist;
+	BayesNet<> bn;
+	bn.add_node(0, CondProb<>(map<vector<int>, Dist> { { vector<int>(), Dist {{0, 0.3}, {1, 0.7}} } }));
+	bn.add_node(1, CondProb<>(map<vector<int>, Dist> { { vector<int>(), Dist {{0, 0.6}, {1, 0.4}} } }));
+	bn.add_node(2, CondProb<>(map<vector<int>, Dist> { { vector<int>(), Dist {{0, 0.5}, {1, 0.5}} } }));
+
+	// Context-specific CPD: only 0 matters while it is 0
+	CpdTree<> tree;
+	unsigned a = tree.leaf(Dist {{0, 0.9}, {1, 0.1}});
+	unsigned b = tree.leaf(Dist {{0, 0.2}, {1, 0.8}});
+	unsigned c = tree.leaf(Dist {{0, 0.5}, {1, 0.5}});
+	tree.split(0, map<int, unsigned> {{0, a}}, tree.split(1, map<int, unsigned> {{1, b}}, c));
+	bn.add_node(3, {0, 1, 2}, CondProb<>::tree(tree));
+
+	// Noisy-OR of 0 and 2 with a leak
+	bn.add_node(4, {0, 2}, CondProb<>::noisy_or(map<int, double> {{0, 0.8}, {2, 0.6}}, 0.05));
+
+	// Table listing one row, every other configuration takes the default
+	bn.add_node(5, {1, 3}, CondProb<>(map<vector<int>, Dist> { { vector<int> {1, 1}, Dist {{0, 0.1}, {1, 0.9}} } },
+		Dist {{0, 0.7}, {1, 0.3}}));
+
+	const CompiledNet<>& net = bn.compiled();
+	assertTrue(net.computed(4) && !net.dense(3) && net.dense(5));
+	assertEquals(net.cpt_offset(4) - net.cpt_offset(3), (size_t)6);
+	for (unsigned r = 0; r < 8; r++) {
+		unsigned values[3] = {r >> 2, (r >> 1) & 1, r & 1};
+		double expected = values[0] == 0 ? 0.1 : values[1] == 1 ? 0.8 : 0.5;
+		assertTrue(fabs(net.conditional_of(3, values, 1) - expected) < 1e-12);
+	}
+	unsigned causes[2] = {1, 1};
+	assertTrue(fabs(net.conditional_of(4, causes, 0) - 0.95 * 0.2 * 0.4) < 1e-12);
+	double dist[2];
+	net.distribution_of(4, causes, dist);
+	assertTrue(fabs(dist[0] + dist[1] - 1) < 1e-12);
+	assertTrue(fabs(CondProb<>::noisy_or(map<int, double> {{0, 0.8}, {2, 0.6}}, 0.05)
+		.get_distribution(vector<int> {1, 0}).at(0) - 0.95 * 0.2) < 1e-12);
+
+	// The tree splits on 0 and 1 of its node's three parents and reads
+	// the values of those two alone
+	CondProb<> context = CondProb<>::tree(tree);
+	assertEquals(context.scope(), set<int> {0, 1});
+	assertTrue(fabs(context.get_distribution(vector<int> {1, 1}).at(1) - 0.8) < 1e-12);
+	assertTrue(fabs(context.get_distribution(vector<int> {1, 0}).at(1) - 0.5) < 1e-12);
+	assertTrue(fabs(context.get_distribution(vector<int> {0, 1}).at(1) - 0.1) < 1e-12);
+	bool refused = false;
+	try {
+		context.get_distribution(vector<int> {1, 0, 1});
+	} catch (const SampleError&) {
+		refused = true;
+	}
+	assertTrue(refused);
+
+	unsigned listed[2] = {1, 1}, other[2] = {0, 1};
+	assertTrue(fabs(net.conditional_of(5, listed, 1) - 0.9) < 1e-12);
+	assertTrue(fabs(net.conditional_of(5, other, 1) - 0.3) < 1e-12);
+
+	// Exact and sampled answers agree with the hand computation
+	double p3 = 0.3 * 0.1 + 0.7 * (0.4 * 0.8 + 0.6 * 0.5);
+	double p4 = 1 - 0.95 * (1 - 0.7 * 0.8) * (1 - 0.5 * 0.6);
+	map<int, int> q3 {{3, 1}}, q4 {{4, 1}};
+	assertTrue(fabs(bn.marginal_dist(q3, 0, SampleStrategy::EXACT)[q3] - p3) < 1e-12);
+	assertTrue(fabs(bn.marginal_dist(q4, 0, SampleStrategy::EXACT)[q4] - p4) < 1e-12);
+	bn.seed(3);
+	assertTrue(fabs(bn.marginal_dist(q4, 20000, SampleStrategy::GIBBS)[q4] - p4) < 0.03);
+	assertTrue(fabs(bn.marginal_dist(q4, 20000, SampleStrategy::MH)[q4] - p4) < 0.03);
+
+	// The compact forms survive a file round trip and turn back into
+	// CPDs when a mapped network grows
+	std::string path = "/tmp/bayes_net_compact.bnet";
+	NetFile::write(path, net);
+	CompiledNet<> mapped = NetFile::map<int, int>(path);
+	for (unsigned node = 3; node < 6; node++)
+		for (unsigned r = 0; r < 8; r++) {
+			unsigned values[3] = {r >> 2, (r >> 1) & 1, r & 1};
+			assertTrue(net.conditional_of(node, values, 1) == mapped.conditional_of(node, values, 1));
+		}
+	BayesNet<> grown(mapped);
+	grown.add_node(6, {4}, CondProb<>(map<vector<int>, Dist> {
+		{ vector<int> {0}, Dist {{0, 1}} }, { vector<int> {1}, Dist {{1, 1}} } }));
+	assertTrue(grown.compiled().computed(4) && !grown.compiled().dense(3));
+	map<int, int> q6 {{6, 1}};
+	assertTrue(fabs(grown.marginal_dist(q6, 0, SampleStrategy::EXACT)[q6] - p4) < 1e-12);
+	assertTrue(fabs(grown.marginal_dist(q3, 0, SampleStrategy::EXACT)[q3] - p3) < 1e-12);
+
+	// A tree whose root lies outside its block is refused
+	assertTrue(rejectsCorruptFile(path, 23, 0, 1000u));
+	std::remove(path.c_str());
+
+	// A noisy-OR over hundreds of parents stores no table at all
+	BayesNet<> wide;
+	set<int> parents;
+	map<int, double> links;
+	for (int i = 0; i < 300; i++) {
+		wide.add_node(i, CondProb<>(map<vector<int>, Dist> { { vector<int>(), Dist {{0, 0.98}, {1, 0.02}} } }));
+		parents.insert(i);
+		links[i] = 0.1;
+	}
+	wide.add_node(300, parents, CondProb<>::noisy_or(links, 0.01));
+	wide.seed(7);
+	map<int, int> off {{300, 0}};
+	double expected = 0.99 * pow(1 - 0.1 * 0.02, 300);
+	assertTrue(fabs(wide.marginal_dist(off, 20000, SampleStrategy::LIKELIHOOD_WEIGHTING)[off] - expected) < 0.02);
+}
+
+void canBenchmarkGeneratedNetwork() {
+	NetworkShape shape(60, 3, 6, 3);
+	Xoshiro256 engine(5);
+	CompiledNet<> net = generate_network(shape, engine);
+	assertEquals(net.size(), 60u);
+
+	// Every node past the first layer has a parent in the layer above,
+	// so the longest path crosses all six layers
+	vector<unsigned> longest(net.size(), 0);
+	unsigned deepest = 0;
+	for (unsigned node : net.topological_order()) {
+		assertEquals(net.cardinality(node), 3u);
+		unsigned fan_in = net.parents_end(node) - net.parents_begin(node);
+		assertTrue(fan_in <= 3 && (node % 6 == 0) == (fan_in == 0));
+		for (const unsigned* p = net.parents_begin(node); p != net.parents_end(node); ++p)
+			longest[node] = max(longest[node], longest[*p] + 1);
+		deepest = max(deepest, longest[node]);
+	}
+	assertEquals(deepest, 5u);
+
+	Benchmark bm("forward");
+	BayesNet<> bn(net);
+	unsigned calls = 0;
+	bm.run([&bn, &calls]() { bn.sample_batch(64); ++calls; }, 2, 5);
+	bm.add_work("samples", 64 * 5);
+	assertEquals(calls, 7u);
+	assertEquals(bm.trials(), 5u);
+	assertTrue(bm.percentile(0) <= bm.median() && bm.median() <= bm.percentile(1));
+	assertTrue(bm.rate("samples") > 0);
+
+	ostringstream csv;
+	BenchmarkReport report;
+	report.add(bm);
+	report.write_csv(csv);
+	assertEquals(csv.str().substr(0, csv.str().find('\n')),
+		string("name,trials,mean_ns,min_ns,p10_ns,median_ns,p90_ns,p99_ns,max_ns,samples_per_s"));
+
+	// Names with control characters still make valid JSON
+	Benchmark odd(string("tab\there\r\x01\"q\"\\"));
+	odd.set_param("net", "a\nb\x1f");
+	odd.record(10);
+	BenchmarkReport escaped;
+	escaped.add(odd);
+	ostringstream json;
+	escaped.write_json(json);
+	string text = json.str();
+	assertTrue(text.find("\"tab\\there\\r\\u0001\\\"q\\\"\\\\\"") != string::npos);
+	assertTrue(text.find("\"a\\nb\\u001f\"") != string::npos);
+	for (char c : text)
+		assertTrue(c == '\n' || static_cast<unsigned char>(c) >= 0x20);
+}
+
+void canInstrumentSamplers() {
+	BayesNet<> bn;
+	bn.add_node(0, CondProb<>(map<vector<int>, map<int, double>> {
+		{ vector<int>(), map<int, double> {{0, 0.5}, {1, 0.5}} } }));
+	bn.add_node(1, {0}, CondProb<>(map<vector<int>, map<int, double>> {
+		{ vector<int> {0}, map<int, double> {{0, 0.9}, {1, 0.1}} },
+		{ vector<int> {1}, map<int, double> {{0, 0.2}, {1, 0.8}} } }));
+	bn.observe(1, 1);
+
+	Instrumentation& instrumentation = Instrumentation::instance();
+	ostringstream sink;
+	instrumentation.set_sink(&sink);
+	instrumentation.reset();
+	unsigned long visited = 0;
+	auto visit = [&visited](const vector<unsigned>&) { ++visited; };
+	bn.metropolis_sample(500, 100, visit);
+	assertEquals(visited, 500ul);
+
+	// Each call dumps only what it did and leaves the totals alone
+	InstrumentReport report = instrumentation.report();
+	assertEquals(report.counters[Instrumentation::STEPS], (std::uint64_t)(Instrumentation::enabled() ? 500 : 0));
+	if (Instrumentation::enabled()) {
+		assertTrue(sink.str().find("metropolis_sample\n") == 0);
+		assertTrue(sink.str().find("  steps 500\n") != string::npos);
+		assertTrue(sink.str().find("  burn_in_steps 100\n") != string::npos);
+		assertTrue(sink.str().find("  sampling ") != string::npos);
+		sink.str("");
+		bn.metropolis_sample(200, 0, visit);
+		assertTrue(sink.str().find("  steps 200\n") != string::npos);
+		assertTrue(sink.str().find("  sampling ") != string::npos && sink.str().find(" over 2 ") == string::npos);
+		assertEquals(instrumentation.report().counters[Instrumentation::STEPS], (std::uint64_t)700);
+
+		instrumentation.set_sink(nullptr);
+		instrumentation.reset();
+		bn.observe(0, 0);
+		bn.metropolis_sample(0, 0, visit);
+		BN_COUNT_N(ACCEPTED, 3);
+		BN_COUNT(REJECTED);
+		report = instrumentation.report();
+		assertEquals(report.counters[Instrumentation::ACCEPTED], (std::uint64_t)3);
+		assertEquals(report.counters[Instrumentation::REJECTED], (std::uint64_t)1);
+	} else {
+		assertTrue(sink.str().empty());
+		for (std::uint64_t c : report.counters)
+			assertEquals(c, (std::uint64_t)0);
+	}
+	instrumentation.set_sink(nullptr);
+}
+
 void canSampleNetwork() {
 	BayesNet<> bn;
 
@@ -237,8 +1707,33 @@ void runTests() {
 	runner.runTest("Can obtain Markov Blanket of Node", canMarkovBlanket);
 	
 	// Bayesian Network Tests
+	runner.runTest("Can Compile Network", canCompileNetwork);
+	runner.runTest("Can Seed Sampler", canSeedSampler);
+	runner.runTest("Can Draw From Alias Table", canDrawFromAliasTable);
 	runner.runTest("Can Sample Network", canSampleNetwork);
+	runner.runTest("Can Sample Deep Network", canSampleDeepNetwork);
 	runner.runTest("Can Marginalize Network", canMarginalizeNetwork);
+	runner.runTest("Can Run Parallel Chains", canRunParallelChains);
+	runner.runTest("Can Stream Chain", canStreamChain);
+	runner.runTest("Can Sample Chromatic", canSampleChromatic);
+	runner.runTest("Can Use Fixed Cardinality", canUseFixedCardinality);
+	runner.runTest("Can Condition On Evidence", canConditionOnEvidence);
+	runner.runTest("Can Metropolis Sample", canMetropolisSample);
+	runner.runTest("Can Sample Batch", canSampleBatch);
+	runner.runTest("Can Weight Evidence", canWeightEvidence);
+	runner.runTest("Can Infer Exactly", canInferExactly);
+	runner.runTest("Can Cache Queries", canCacheQueries);
+	runner.runTest("Can Batch Queries", canBatchQueries);
+	runner.runTest("Can Store Chains", canStoreChains);
+	runner.runTest("Can Stop Adaptively", canStopAdaptively);
+	runner.runTest("Can Prune Irrelevant Nodes", canPruneIrrelevantNodes);
+	runner.runTest("Can Serve Concurrent Queries", canServeConcurrentQueries);
+	runner.runTest("Can Share Snapshots", canShareSnapshots);
+	runner.runTest("Can Temper Chains", canTemperChains);
+	runner.runTest("Can Read Network Files", canReadNetworkFiles);
+	runner.runTest("Can Use Compact Cpds", canUseCompactCpds);
+	runner.runTest("Can Benchmark Generated Network", canBenchmarkGeneratedNetwork);
+	runner.runTest("Can Instrument Samplers", canInstrumentSamplers);
 
 	ostringstream oss;
 	for (int i = 100; i < 1000; i += 100) {
@@ -252,22 +1747,22 @@ void runTests() {
 }
 
 void benchmark() {
-	vector<Benchmark> benchmarks;
+	BenchmarkReport report;
 	ostringstream oss;
 	for (int i = 100; i < 1000; i += 100) {
 		oss << "Marginalization of Bayesian Network of Size (" << i << ")";
 		cout << "COMPUTING " << oss.str() << endl;
 		Benchmark b(oss.str());
-		b.start();
-		for (int j = 8; j <= 64; j *= 2)
-			run(i, j);
-		b.stop();
-		benchmarks.push_back(b);
+		b.set_param("nodes", to_string(i + 1));
+		b.run([i]() {
+			for (int j = 8; j <= 64; j *= 2)
+				run(i, j);
+		}, 0, 1);
+		report.add(b);
 		oss.str("");
 	}
 
-	for (Benchmark mark : benchmarks)
-		cout << mark.toString(",") << "ms" << endl;
+	report.write_csv(cout);
 }
 
 int main(int argc, char* argv[])
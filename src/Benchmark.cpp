@@ -1,7 +1,9 @@
 #include "Benchmark.h"
 #include <sstream>
+#include <algorithm>
+#include <set>
 
-Benchmark::Benchmark(std::string name) : name_(name), duration_(0)
+Benchmark::Benchmark(std::string name) : name_(name)
 	{}
 
 void Benchmark::start() {
@@ -9,19 +11,89 @@ void Benchmark::start() {
 }
 
 void Benchmark::stop() {
-	duration_ = std::chrono::duration_cast<std::chrono::milliseconds>(
-		std::chrono::steady_clock::now() - start_).count();
+	durations_.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now() - start_).count());
+}
+
+void Benchmark::record(long long nanoseconds) {
+	durations_.push_back(nanoseconds);
+}
+
+void Benchmark::set_param(const std::string& key, const std::string& value) {
+	for (std::pair<std::string, std::string>& param : params_)
+		if (param.first == key) {
+			param.second = value;
+			return;
+		}
+	params_.push_back(std::make_pair(key, value));
+}
+
+void Benchmark::add_work(const std::string& unit, double amount) {
+	work_[unit] += amount;
+}
+
+const std::string& Benchmark::name() const { return name_; }
+
+const std::vector<std::pair<std::string, std::string>>& Benchmark::params() const { return params_; }
+
+unsigned Benchmark::trials() const { return durations_.size(); }
+
+const std::vector<long long>& Benchmark::durations() const { return durations_; }
+
+long long Benchmark::elapsed() const {
+	return durations_.empty() ? 0 : durations_.back();
+}
+
+double Benchmark::mean() const {
+	if (durations_.empty())
+		return 0;
+	double sum = 0;
+	for (long long d : durations_)
+		sum += d;
+	return sum / durations_.size();
+}
+
+double Benchmark::median() const { return percentile(0.5); }
+
+double Benchmark::percentile(double p) const {
+	if (durations_.empty())
+		return 0;
+	std::vector<long long> sorted(durations_);
+	std::sort(sorted.begin(), sorted.end());
+	double rank = std::min(1.0, std::max(0.0, p)) * (sorted.size() - 1);
+	std::size_t below = static_cast<std::size_t>(rank);
+	if (below + 1 >= sorted.size())
+		return sorted.back();
+	return sorted[below] + (rank - below) * (sorted[below + 1] - sorted[below]);
+}
+
+const std::map<std::string, double>& Benchmark::work() const { return work_; }
+
+double Benchmark::rate(const std::string& unit) const {
+	std::map<std::string, double>::const_iterator it = work_.find(unit);
+	double total = mean() * durations_.size();
+	if (it == work_.end() || total <= 0)
+		return 0;
+	return it->second / (total * 1e-9);
 }
 
 std::string Benchmark::toString() const {
 	std::ostringstream oss;
-	oss << name_ << ": " << duration_;
+	oss << name_ << ": " << static_cast<long long>(median()) << "ns";
+	if (durations_.size() > 1)
+		oss << " (p10 " << static_cast<long long>(percentile(0.1))
+			<< ", p90 " << static_cast<long long>(percentile(0.9))
+			<< ", " << durations_.size() << " trials)";
+	for (const std::pair<const std::string, double>& w : work_)
+		oss << ", " << rate(w.first) << " " << w.first << "/s";
 	return oss.str();
 }
 
 std::string Benchmark::toString(std::string delim) const {
 	std::ostringstream oss;
-	oss << name_ << delim << duration_;
+	oss << name_ << delim << static_cast<long long>(median());
+	for (const std::pair<const std::string, double>& w : work_)
+		oss << delim << rate(w.first);
 	return oss.str();
 }
 
@@ -29,3 +101,142 @@ std::ostream& operator<<(std::ostream& os, const Benchmark& bm) {
 	os << bm.toString();
 	return os;
 }
+
+void BenchmarkReport::add(const Benchmark& bm) {
+	results_.push_back(bm);
+}
+
+const std::vector<Benchmark>& BenchmarkReport::results() const { return results_; }
+
+std::vector<std::string> BenchmarkReport::param_keys() const {
+	std::vector<std::string> keys;
+	for (const Benchmark& bm : results_)
+		for (const std::pair<std::string, std::string>& param : bm.params())
+			if (std::find(keys.begin(), keys.end(), param.first) == keys.end())
+				keys.push_back(param.first);
+	return keys;
+}
+
+std::vector<std::string> BenchmarkReport::units() const {
+	std::set<std::string> units;
+	for (const Benchmark& bm : results_)
+		for (const std::pair<const std::string, double>& w : bm.work())
+			units.insert(w.first);
+	return std::vector<std::string>(units.begin(), units.end());
+}
+
+namespace {
+
+std::string param_of(const Benchmark& bm, const std::string& key) {
+	for (const std::pair<std::string, std::string>& param : bm.params())
+		if (param.first == key)
+			return param.second;
+	return std::string();
+}
+
+std::string csv_field(const std::string& text) {
+	if (text.find_first_of(",\"\n") == std::string::npos)
+		return text;
+	std::string quoted = "\"";
+	for (char c : text)
+		quoted += c == '"' ? std::string("\"\"") : std::string(1, c);
+	return quoted + "\"";
+}
+
+// Quoted JSON string; control characters without a short escape are
+// written as \u00XX
+std::string json_string(const std::string& text) {
+	static const char hex[] = "0123456789abcdef";
+	std::string quoted = "\"";
+	for (char c : text) {
+		unsigned char u = static_cast<unsigned char>(c);
+		switch (c) {
+		case '"':
+			quoted += "\\\"";
+			break;
+		case '\\':
+			quoted += "\\\\";
+			break;
+		case '\b':
+			quoted += "\\b";
+			break;
+		case '\f':
+			quoted += "\\f";
+			break;
+		case '\n':
+			quoted += "\\n";
+			break;
+		case '\r':
+			quoted += "\\r";
+			break;
+		case '\t':
+			quoted += "\\t";
+			break;
+		default:
+			if (u < 0x20) {
+				quoted += "\\u00";
+				quoted += hex[u >> 4];
+				quoted += hex[u & 0xf];
+			} else {
+				quoted += c;
+			}
+		}
+	}
+	return quoted + "\"";
+}
+
+}
+
+void BenchmarkReport::write_csv(std::ostream& os) const {
+	std::vector<std::string> keys = param_keys();
+	std::vector<std::string> rates = units();
+	std::streamsize precision = os.precision(12);
+	os << "name";
+	for (const std::string& key : keys)
+		os << "," << csv_field(key);
+	os << ",trials,mean_ns,min_ns,p10_ns,median_ns,p90_ns,p99_ns,max_ns";
+	for (const std::string& unit : rates)
+		os << "," << csv_field(unit + "_per_s");
+	os << "\n";
+
+	for (const Benchmark& bm : results_) {
+		os << csv_field(bm.name());
+		for (const std::string& key : keys)
+			os << "," << csv_field(param_of(bm, key));
+		os << "," << bm.trials() << "," << bm.mean() << "," << bm.percentile(0)
+			<< "," << bm.percentile(0.1) << "," << bm.median() << "," << bm.percentile(0.9)
+			<< "," << bm.percentile(0.99) << "," << bm.percentile(1);
+		for (const std::string& unit : rates) {
+			os << ",";
+			if (bm.work().count(unit))
+				os << bm.rate(unit);
+		}
+		os << "\n";
+	}
+	os.precision(precision);
+}
+
+void BenchmarkReport::write_json(std::ostream& os) const {
+	std::streamsize precision = os.precision(12);
+	os << "[";
+	for (std::size_t i = 0; i < results_.size(); i++) {
+		const Benchmark& bm = results_[i];
+		os << (i ? ",\n " : "\n ") << "{\"name\": " << json_string(bm.name()) << ", \"params\": {";
+		for (std::size_t p = 0; p < bm.params().size(); p++)
+			os << (p ? ", " : "") << json_string(bm.params()[p].first) << ": "
+				<< json_string(bm.params()[p].second);
+		os << "}, \"trials\": " << bm.trials() << ", \"mean_ns\": " << bm.mean()
+			<< ", \"min_ns\": " << bm.percentile(0) << ", \"p10_ns\": " << bm.percentile(0.1)
+			<< ", \"median_ns\": " << bm.median() << ", \"p90_ns\": " << bm.percentile(0.9)
+			<< ", \"p99_ns\": " << bm.percentile(0.99) << ", \"max_ns\": " << bm.percentile(1)
+			<< ", \"rates\": {";
+		bool first = true;
+		for (const std::pair<const std::string, double>& w : bm.work()) {
+			os << (first ? "" : ", ") << json_string(w.first + "_per_s") << ": " << bm.rate(w.first);
+			first = false;
+		}
+		os << "}}";
+	}
+	os << "\n]\n";
+	os.precision(precision);
+}
@@ -3,22 +3,92 @@
 
 #include <chrono>
 #include <ostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <utility>
 
+// Repeated timing of one piece of work. Each start()/stop() pair records a
+// trial in nanoseconds; run() precedes the timed trials with untimed warmup
+// rounds. Work done during the trials is tallied per unit so that rates
+// such as samples or node updates per second come out of the same run.
 class Benchmark {
 public:
 	Benchmark(std::string name);
 
 	void start();
 	void stop();
+
+	// Add a trial timed elsewhere
+	void record(long long nanoseconds);
+
+	// Call work() warmup times untimed, then time it for each trial
+	template <typename Work>
+	void run(Work work, unsigned warmup, unsigned trials);
+
+	// Describe the configuration being measured, e.g. ("nodes", "500")
+	void set_param(const std::string& key, const std::string& value);
+
+	// Count units of work done over the timed trials
+	void add_work(const std::string& unit, double amount);
+
+	const std::string& name() const;
+	const std::vector<std::pair<std::string, std::string>>& params() const;
+	unsigned trials() const;
+
+	// Trial durations in nanoseconds
+	const std::vector<long long>& durations() const;
+	long long elapsed() const;
+	double mean() const;
+	double median() const;
+
+	// Duration below which a fraction p of the trials fall, interpolated
+	// between the nearest ranks
+	double percentile(double p) const;
+
+	// Units of work per second over the total timed duration
+	const std::map<std::string, double>& work() const;
+	double rate(const std::string& unit) const;
+
 	std::string toString() const;
 	std::string toString(std::string delim) const;
 private:
 	std::string name_;
+	std::vector<std::pair<std::string, std::string>> params_;
 
 	std::chrono::steady_clock::time_point start_;
-	long long duration_;
+	std::vector<long long> durations_;
+	std::map<std::string, double> work_;
 };
 
 std::ostream& operator<<(std::ostream& os, const Benchmark& bm);
 
+// Results of several benchmarks, written as CSV or JSON with one record
+// per benchmark. Parameter and rate columns are the union over every
+// record, left empty where a benchmark has none.
+class BenchmarkReport {
+public:
+	void add(const Benchmark& bm);
+	const std::vector<Benchmark>& results() const;
+
+	void write_csv(std::ostream& os) const;
+	void write_json(std::ostream& os) const;
+private:
+	std::vector<std::string> param_keys() const;
+	std::vector<std::string> units() const;
+
+	std::vector<Benchmark> results_;
+};
+
+template <typename Work>
+void Benchmark::run(Work work, unsigned warmup, unsigned trials) {
+	for (unsigned i = 0; i < warmup; i++)
+		work();
+	for (unsigned i = 0; i < trials; i++) {
+		start();
+		work();
+		stop();
+	}
+}
+
 #endif
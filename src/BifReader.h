@@ -0,0 +1,443 @@
+#ifndef BIF_READER_H
+#define BIF_READER_H
+
+#include "CompiledNet.h"
+#include "NetFile.h"
+#include "Errors.h"
+
+#include <vector>
+#include <map>
+#include <string>
+#include <istream>
+#include <fstream>
+#include <cstdlib>
+#include <cctype>
+
+// Network read from a BIF or XMLBIF file. Nodes are labelled 0..n-1 in
+// declaration order and values 0..k-1 in the order the file lists them;
+// the names keep the original spelling.
+struct BifNetwork
+{
+	CompiledNet<int, int> net;
+	NetNames names;
+};
+
+// Streaming readers for the BIF and XMLBIF interchange formats. Both read
+// their input a token at a time and fill flat CPT tables directly, so no
+// per-row map is ever built; the tables then go through CompiledNet's flat
+// constructor, ready to be written by NetFile.
+class BifReader
+{
+public:
+	// Read either format, told apart by a leading '<'
+	static BifNetwork read(std::istream& in);
+
+	static BifNetwork read_bif(std::istream& in);
+	static BifNetwork read_xmlbif(std::istream& in);
+
+	// Convert a BIF or XMLBIF file into the binary format
+	static void convert(const std::string& source, const std::string& target);
+private:
+	// Declarations gathered while reading. Tables are dense over the
+	// parents, last parent fastest, with the child's values fastest.
+	struct Model {
+		std::vector<std::string> variables;
+		std::vector<std::vector<std::string>> states;
+		std::map<std::string, unsigned> index;
+		std::vector<std::vector<unsigned>> parents;
+		std::vector<std::vector<double>> tables;
+
+		unsigned add(const std::string& name, const std::vector<std::string>& outcomes);
+		unsigned find(const std::string& name) const;
+		unsigned state(unsigned variable, const std::string& name) const;
+		std::size_t rows(unsigned variable) const;
+		BifNetwork build() const;
+	};
+
+	// BIF tokens: words, numbers and quoted strings, and single punctuation
+	// characters; comments are skipped
+	class Lexer {
+	public:
+		explicit Lexer(std::istream& in) : in_(in) {}
+
+		// Next token, or an empty string at the end of the input
+		std::string next();
+		std::string expect(const std::string& token);
+		double number();
+	private:
+		std::istream& in_;
+	};
+
+	// Skip a brace-delimited block whose opening brace has been read
+	static void skip_block(Lexer& lexer);
+
+	static void read_variable(Lexer& lexer, Model& model);
+	static void read_probability(Lexer& lexer, Model& model);
+	static std::string decode(const std::string& text);
+};
+
+inline unsigned BifReader::Model::add(const std::string& name, const std::vector<std::string>& outcomes) {
+	if (index.count(name))
+		throw DuplicateNodeException();
+	index[name] = variables.size();
+	variables.push_back(name);
+	states.push_back(outcomes);
+	parents.push_back(std::vector<unsigned>());
+	tables.push_back(std::vector<double>());
+	return variables.size() - 1;
+}
+
+inline unsigned BifReader::Model::find(const std::string& name) const {
+	std::map<std::string, unsigned>::const_iterator it = index.find(name);
+	if (it == index.end())
+		throw MissingNodeException();
+	return it->second;
+}
+
+inline unsigned BifReader::Model::state(unsigned variable, const std::string& name) const {
+	for (unsigned v = 0; v < states[variable].size(); v++)
+		if (states[variable][v] == name)
+			return v;
+	throw UnknownValueException();
+}
+
+inline std::size_t BifReader::Model::rows(unsigned variable) const {
+	std::size_t rows = 1;
+	for (unsigned parent : parents[variable])
+		rows *= states[parent].size();
+	return rows;
+}
+
+inline BifNetwork BifReader::Model::build() const {
+	unsigned n = variables.size();
+	std::vector<int> labels(n);
+	std::vector<std::vector<int>> domains(n);
+	for (unsigned i = 0; i < n; i++) {
+		labels[i] = i;
+		for (unsigned v = 0; v < states[i].size(); v++)
+			domains[i].push_back(v);
+	}
+	BifNetwork network;
+	network.net = CompiledNet<int, int>(labels, domains, parents, tables);
+	network.names.nodes = variables;
+	network.names.values = states;
+	return network;
+}
+
+inline std::string BifReader::Lexer::next() {
+	int c;
+	while ((c = in_.get()) != EOF) {
+		if (std::isspace(c))
+			continue;
+		if (c == '/' && in_.peek() == '/') {
+			while ((c = in_.get()) != EOF && c != '\n')
+				;
+			continue;
+		}
+		if (c == '/' && in_.peek() == '*') {
+			in_.get();
+			int last = 0;
+			while ((c = in_.get()) != EOF && !(last == '*' && c == '/'))
+				last = c;
+			continue;
+		}
+		break;
+	}
+	if (c == EOF)
+		return std::string();
+	if (c == '"') {
+		std::string token;
+		while ((c = in_.get()) != EOF && c != '"')
+			token += static_cast<char>(c);
+		return token;
+	}
+
+	std::string token(1, static_cast<char>(c));
+	static const std::string punctuation = "{}()[],;|=";
+	if (punctuation.find(static_cast<char>(c)) != std::string::npos)
+		return token;
+	while ((c = in_.peek()) != EOF && !std::isspace(c) &&
+		punctuation.find(static_cast<char>(c)) == std::string::npos)
+		token += static_cast<char>(in_.get());
+	return token;
+}
+
+inline std::string BifReader::Lexer::expect(const std::string& token) {
+	std::string read = next();
+	if (read != token)
+		throw FormatException();
+	return read;
+}
+
+inline double BifReader::Lexer::number() {
+	std::string token = next();
+	char* end;
+	double value = std::strtod(token.c_str(), &end);
+	if (token.empty() || *end != '\0')
+		throw FormatException();
+	return value;
+}
+
+inline void BifReader::skip_block(Lexer& lexer) {
+	for (unsigned depth = 1; depth > 0; ) {
+		std::string token = lexer.next();
+		if (token.empty())
+			throw FormatException();
+		if (token == "{")
+			++depth;
+		else if (token == "}")
+			--depth;
+	}
+}
+
+inline void BifReader::read_variable(Lexer& lexer, Model& model) {
+	std::string name = lexer.next();
+	lexer.expect("{");
+	std::vector<std::string> outcomes;
+	for (std::string token = lexer.next(); token != "}"; token = lexer.next()) {
+		if (token.empty())
+			throw FormatException();
+		if (token == "type") {
+			// type discrete [ k ] { s1, s2, ... };
+			lexer.expect("discrete");
+			lexer.expect("[");
+			lexer.next();
+			lexer.expect("]");
+			lexer.expect("{");
+			for (std::string state = lexer.next(); state != "}"; state = lexer.next()) {
+				if (state.empty())
+					throw FormatException();
+				if (state != ",")
+					outcomes.push_back(state);
+			}
+		} else {
+			while (token != ";" && !token.empty())
+				token = lexer.next();
+		}
+	}
+	model.add(name, outcomes);
+}
+
+inline void BifReader::read_probability(Lexer& lexer, Model& model) {
+	// probability ( child | p1, p2 ), or the older ( child p1 p2 )
+	lexer.expect("(");
+	unsigned child = model.find(lexer.next());
+	std::vector<unsigned>& parents = model.parents[child];
+	parents.clear();
+	for (std::string token = lexer.next(); token != ")"; token = lexer.next()) {
+		if (token.empty())
+			throw FormatException();
+		if (token != "|" && token != ",")
+			parents.push_back(model.find(token));
+	}
+
+	unsigned k = model.states[child].size();
+	std::size_t rows = model.rows(child);
+	std::vector<double>& table = model.tables[child];
+	table.assign(rows * k, 0.0);
+	std::vector<char> given(rows, 0);
+	std::vector<double> fallback;
+
+	lexer.expect("{");
+	for (std::string token = lexer.next(); token != "}"; token = lexer.next()) {
+		if (token.empty())
+			throw FormatException();
+		if (token == "table") {
+			// Entries run with the child slowest and the last parent fastest
+			for (unsigned v = 0; v < k; v++)
+				for (std::size_t r = 0; r < rows; r++) {
+					table[r * k + v] = lexer.number();
+					if (r + 1 < rows || v + 1 < k)
+						if (lexer.next() != ",")
+							throw FormatException();
+				}
+			std::fill(given.begin(), given.end(), 1);
+			lexer.expect(";");
+		} else if (token == "default") {
+			for (unsigned v = 0; v < k; v++) {
+				fallback.push_back(lexer.number());
+				if (v + 1 < k)
+					lexer.expect(",");
+			}
+			lexer.expect(";");
+		} else if (token == "(") {
+			std::size_t r = 0;
+			for (unsigned j = 0; j < parents.size(); j++) {
+				r = r * model.states[parents[j]].size() + model.state(parents[j], lexer.next());
+				lexer.expect(j + 1 < parents.size() ? "," : ")");
+			}
+			for (unsigned v = 0; v < k; v++) {
+				table[r * k + v] = lexer.number();
+				if (v + 1 < k)
+					lexer.expect(",");
+			}
+			given[r] = 1;
+			lexer.expect(";");
+		} else {
+			while (token != ";" && !token.empty())
+				token = lexer.next();
+		}
+	}
+
+	if (!fallback.empty())
+		for (std::size_t r = 0; r < rows; r++)
+			if (!given[r])
+				std::copy(fallback.begin(), fallback.end(), table.begin() + r * k);
+}
+
+inline BifNetwork BifReader::read_bif(std::istream& in) {
+	Lexer lexer(in);
+	Model model;
+	for (std::string token = lexer.next(); !token.empty(); token = lexer.next()) {
+		if (token == "network") {
+			while (token != "{" && !token.empty())
+				token = lexer.next();
+			skip_block(lexer);
+		} else if (token == "variable") {
+			read_variable(lexer, model);
+		} else if (token == "probability") {
+			read_probability(lexer, model);
+		} else {
+			throw FormatException();
+		}
+	}
+	return model.build();
+}
+
+inline std::string BifReader::decode(const std::string& text) {
+	static const char* entities[][2] = {
+		{ "&lt;", "<" }, { "&gt;", ">" }, { "&quot;", "\"" }, { "&apos;", "'" }, { "&amp;", "&" }
+	};
+	std::size_t begin = text.find_first_not_of(" \t\r\n");
+	std::size_t end = text.find_last_not_of(" \t\r\n");
+	std::string trimmed = begin == std::string::npos ? std::string() : text.substr(begin, end - begin + 1);
+	std::string decoded;
+	for (std::size_t i = 0; i < trimmed.size(); ) {
+		bool replaced = false;
+		if (trimmed[i] == '&')
+			for (const auto& entity : entities)
+				if (trimmed.compare(i, std::string(entity[0]).size(), entity[0]) == 0) {
+					decoded += entity[1];
+					i += std::string(entity[0]).size();
+					replaced = true;
+					break;
+				}
+		if (!replaced)
+			decoded += trimmed[i++];
+	}
+	return decoded;
+}
+
+inline BifNetwork BifReader::read_xmlbif(std::istream& in) {
+	Model model;
+	std::vector<std::string> open;
+	std::string text;
+
+	// Current VARIABLE or DEFINITION being read
+	std::string name;
+	std::vector<std::string> outcomes;
+	std::string child;
+	std::vector<std::string> given;
+	std::vector<double> table;
+
+	int c;
+	while ((c = in.get()) != EOF) {
+		if (c != '<') {
+			text += static_cast<char>(c);
+			continue;
+		}
+
+		std::string tag;
+		while ((c = in.get()) != EOF && c != '>') {
+			tag += static_cast<char>(c);
+			if (tag == "!--") {
+				// Comments end at the first -->
+				std::string tail;
+				while ((c = in.get()) != EOF) {
+					tail += static_cast<char>(c);
+					if (tail.size() >= 3 && tail.compare(tail.size() - 3, 3, "-->") == 0)
+						break;
+				}
+				tag.clear();
+				break;
+			}
+		}
+		if (c == EOF)
+			throw FormatException();
+		if (tag.empty() || tag[0] == '?' || tag[0] == '!') {
+			text.clear();
+			continue;
+		}
+
+		bool closing = tag[0] == '/';
+		bool empty = tag[tag.size() - 1] == '/';
+		std::size_t start = closing ? 1 : 0;
+		std::string element = tag.substr(start, tag.find_first_of(" \t\r\n/", start) - start);
+		for (char& ch : element)
+			ch = std::toupper(static_cast<unsigned char>(ch));
+
+		if (!closing) {
+			text.clear();
+			if (!empty)
+				open.push_back(element);
+			continue;
+		}
+		if (open.empty() || open.back() != element)
+			throw FormatException();
+		open.pop_back();
+		std::string parent = open.empty() ? std::string() : open.back();
+		std::string value = decode(text);
+		text.clear();
+
+		if (element == "NAME" && parent == "VARIABLE")
+			name = value;
+		else if (element == "OUTCOME" && parent == "VARIABLE")
+			outcomes.push_back(value);
+		else if (element == "VARIABLE") {
+			model.add(name, outcomes);
+			name.clear();
+			outcomes.clear();
+		} else if (element == "FOR")
+			child = value;
+		else if (element == "GIVEN")
+			given.push_back(value);
+		else if (element == "TABLE") {
+			const char* p = value.c_str();
+			char* end;
+			for (double x = std::strtod(p, &end); end != p; x = std::strtod(p, &end)) {
+				table.push_back(x);
+				p = end;
+			}
+		} else if (element == "DEFINITION" || element == "PROBABILITY") {
+			unsigned node = model.find(child);
+			model.parents[node].clear();
+			for (const std::string& g : given)
+				model.parents[node].push_back(model.find(g));
+			if (table.size() != model.rows(node) * model.states[node].size())
+				throw FormatException();
+			model.tables[node].swap(table);
+			child.clear();
+			given.clear();
+			table.clear();
+		}
+	}
+	if (!open.empty())
+		throw FormatException();
+	return model.build();
+}
+
+inline BifNetwork BifReader::read(std::istream& in) {
+	while (std::isspace(in.peek()))
+		in.get();
+	return in.peek() == '<' ? read_xmlbif(in) : read_bif(in);
+}
+
+inline void BifReader::convert(const std::string& source, const std::string& target) {
+	std::ifstream in(source.c_str());
+	if (!in)
+		throw FileException();
+	BifNetwork network = read(in);
+	NetFile::write(target, network.net, network.names);
+}
+
+#endif
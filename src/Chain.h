@@ -0,0 +1,797 @@
+#ifndef CHAIN_H
+#define CHAIN_H
+
+#include "CompiledNet.h"
+#include "Random.h"
+#include "Instrument.h"
+#include "ThreadPool.h"
+
+#include <vector>
+#include <array>
+#include <future>
+#include <mutex>
+#include <memory>
+#include <exception>
+#include <cstdint>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+// Fill a state with one ancestral sample in topological order
+template <typename NodeType, typename ValueType, typename EngineType>
+void forward_sample(const CompiledNet<NodeType, ValueType>& net,
+	const std::vector<int>& clamp,
+	std::vector<unsigned>& state,
+	EngineType& engine) {
+	for (unsigned node : net.topological_order())
+		state[node] = clamp[node] >= 0 ? clamp[node] :
+			net.sample(node, state, uniform_real(engine));
+}
+
+// Value index drawn from k non-negative weights summing to sum > 0, by
+// inverse CDF with one uniform draw
+template <typename Weights>
+unsigned draw_weighted(const Weights& weights, unsigned k, double sum, double u) {
+	BN_COUNT(DRAWS);
+	u *= sum;
+	unsigned drawn = 0;
+	for (unsigned v = 0; v < k; v++)
+		if (weights[v] > 0) {
+			drawn = v;
+			u -= weights[v];
+			if (u < 0)
+				break;
+		}
+	return drawn;
+}
+
+// Redraw one node of a state from its full conditional: the node's own
+// CPT row times the matching entries of its children's CPTs, with child
+// rows read through the node's stride in each child's CPT. With K = 0 the
+// cardinalities are read from the network and the weights are a
+// std::vector sized to the node's. With K > 0 every node must take K
+// values: the weights are a std::array, every trip count is K, and dense
+// rows and offsets into the probability table are computed with K as a
+// constant radix, so a binary network indexes by shifts. Only the node's
+// own entry of the state is written.
+template <unsigned K, typename NodeType, typename ValueType, typename Weights, typename EngineType>
+void gibbs_redraw(const CompiledNet<NodeType, ValueType>& net,
+	std::vector<unsigned>& state,
+	unsigned node,
+	Weights& weights,
+	EngineType& engine) {
+	const unsigned k = K ? K : net.cardinality(node);
+	unsigned current = state[node];
+	if (K && net.dense(node)) {
+		const double* row = net.probabilities() + net.cpt_offset(node) + net.template dense_row<K>(node, state) * K;
+		for (unsigned v = 0; v < k; v++)
+			weights[v] = row[v];
+	} else {
+		net.distribution(node, state, &weights[0]);
+	}
+
+	const std::size_t* stride = net.child_strides_begin(node);
+	for (const unsigned* c = net.children_begin(node); c != net.children_end(node); ++c, ++stride) {
+		unsigned child = *c;
+		double max = 0;
+		if (K && net.dense(child)) {
+			// Entry v sits K * stride further on for each step of v
+			const double* entry = net.probabilities() + net.cpt_offset(child) +
+				(net.template dense_row<K>(child, state) - current * *stride) * K + state[child];
+			std::size_t step = *stride * K;
+			for (unsigned v = 0; v < k; v++)
+				if (weights[v] > 0)
+					max = std::max(max, weights[v] *= entry[v * step]);
+		} else if (net.dense(child)) {
+			std::size_t base = net.row_index(child, state) - current * *stride;
+			for (unsigned v = 0; v < k; v++)
+				if (weights[v] > 0)
+					max = std::max(max, weights[v] *= net.probability(child, base + v * *stride, state[child]));
+		} else {
+			for (unsigned v = 0; v < k; v++)
+				if (weights[v] > 0) {
+					state[node] = v;
+					max = std::max(max, weights[v] *= net.conditional(child, state, state[child]));
+				}
+			state[node] = current;
+		}
+
+		// Rescale so that long products over many children cannot underflow
+		if (max > 0 && max < 1e-100)
+			for (unsigned v = 0; v < k; v++)
+				weights[v] /= max;
+	}
+
+	double sum = 0;
+	for (unsigned v = 0; v < k; v++)
+		sum += weights[v];
+
+	// A state outside the support of the evidence has no mass anywhere in
+	// the blanket; move by the node's own CPT until the chain finds it
+	if (sum <= 0) {
+		state[node] = net.sample(node, state, uniform_real(engine));
+		return;
+	}
+	state[node] = draw_weighted(weights, k, sum, uniform_real(engine));
+}
+
+// Greedy coloring of the moral graph restricted to the free nodes. The
+// neighbours of a node in the moral graph are exactly its Markov blanket,
+// so nodes sharing a color are conditionally independent given the rest
+// and can be redrawn at the same time. Nodes are colored in order of
+// decreasing blanket size, each taking the lowest color none of its
+// neighbours holds; the result lists the nodes of each color.
+template <typename NodeType, typename ValueType>
+std::vector<std::vector<unsigned>> color_moral_graph(const CompiledNet<NodeType, ValueType>& net,
+	const std::vector<int>& clamp) {
+	std::vector<unsigned> order;
+	for (unsigned node = 0; node < net.size(); node++)
+		if (clamp[node] < 0)
+			order.push_back(node);
+	std::stable_sort(order.begin(), order.end(), [&net](unsigned a, unsigned b) {
+		return net.blanket_end(a) - net.blanket_begin(a) > net.blanket_end(b) - net.blanket_begin(b);
+	});
+
+	const unsigned none = static_cast<unsigned>(-1);
+	std::vector<unsigned> color(net.size(), none);
+	std::vector<unsigned> taken;
+	std::vector<std::vector<unsigned>> classes;
+	for (unsigned node : order) {
+		for (const unsigned* b = net.blanket_begin(node); b != net.blanket_end(node); ++b)
+			if (color[*b] != none) {
+				if (taken.size() <= color[*b])
+					taken.resize(color[*b] + 1, none);
+				taken[color[*b]] = node;
+			}
+		unsigned c = 0;
+		while (c < taken.size() && taken[c] == node)
+			++c;
+		color[node] = c;
+		if (c == classes.size())
+			classes.push_back(std::vector<unsigned>());
+		classes[c].push_back(node);
+	}
+	for (std::vector<unsigned>& nodes : classes)
+		std::sort(nodes.begin(), nodes.end());
+	return classes;
+}
+
+// State shared by the single-site chains. A chain owns its state and its
+// engine, so independent chains can run on separate threads over one
+// compiled network. The chain starts from an ancestral sample and only
+// ever updates the unobserved nodes.
+template <typename NodeType, typename ValueType, typename EngineType>
+class Chain
+{
+public:
+	typedef CompiledNet<NodeType, ValueType> net_type;
+	typedef EngineType engine_type;
+
+	Chain(const CompiledNet<NodeType, ValueType>& net,
+		const std::vector<int>& clamp,
+		const EngineType& engine);
+
+	const std::vector<unsigned>& state() const;
+	EngineType& engine();
+protected:
+	// Probability of a child's value in the current state with the node
+	// set to the given value, reading the child's row through the stride
+	// of the node in the child's CPT
+	double child_probability(unsigned node, unsigned value,
+		unsigned child, std::size_t stride);
+
+	const CompiledNet<NodeType, ValueType>* net_;
+	std::vector<int> clamp_;
+	std::vector<unsigned> state_;
+	std::vector<unsigned> free_;
+	EngineType engine_;
+};
+
+// Gibbs chain redrawing one uniformly chosen node per step from its full
+// conditional, by gibbs_redraw, so a step only touches the node's blanket.
+template <typename NodeType, typename ValueType, typename EngineType>
+class GibbsChain : public Chain<NodeType, ValueType, EngineType>
+{
+public:
+	GibbsChain(const CompiledNet<NodeType, ValueType>& net,
+		const std::vector<int>& clamp,
+		const EngineType& engine);
+
+	void step();
+
+	// Redraw one node from its full conditional
+	void update(unsigned node);
+protected:
+	// Redraw a node with the given engine and weight buffer. Only the
+	// node's own entry of the state is written, so nodes outside each
+	// other's blankets can be redrawn concurrently.
+	void redraw(unsigned node, EngineType& engine, std::vector<double>& weights);
+private:
+	std::vector<double> weights_;
+};
+
+// Gibbs chain for networks whose nodes all take K values. The full
+// conditional lives in a std::array, every loop over the values has a
+// constant trip count, and dense CPT rows are located with K as a
+// constant radix rather than through stored strides and cardinalities.
+// It makes exactly the draws GibbsChain makes.
+template <typename NodeType, typename ValueType, typename EngineType, unsigned K>
+class FixedGibbsChain : public Chain<NodeType, ValueType, EngineType>
+{
+public:
+	// Throws CardinalityException unless every node takes K values
+	FixedGibbsChain(const CompiledNet<NodeType, ValueType>& net,
+		const std::vector<int>& clamp,
+		const EngineType& engine);
+
+	void step();
+	void update(unsigned node);
+};
+
+// Gibbs chain sweeping the free nodes systematically, one color of the
+// moral graph at a time. A step redraws every free node once, so no node
+// is ever selected at random. Large color classes are cut into one slice
+// per pool worker and the slices redrawn in parallel, each with an engine
+// of its own seeded from the chain's engine; the draws depend on the
+// number of slices but not on how they are scheduled.
+template <typename NodeType, typename ValueType, typename EngineType>
+class ChromaticGibbsChain : public GibbsChain<NodeType, ValueType, EngineType>
+{
+public:
+	ChromaticGibbsChain(const CompiledNet<NodeType, ValueType>& net,
+		const std::vector<int>& clamp,
+		const EngineType& engine,
+		ThreadPool& pool = ThreadPool::instance(),
+		unsigned grain = 256);
+
+	// One sweep over every color
+	void step();
+
+	// Free nodes of each color
+	const std::vector<std::vector<unsigned>>& color_classes() const;
+private:
+	// Redraw one slice of a color class
+	void sweep(const std::vector<unsigned>& nodes, unsigned slice, unsigned slices);
+
+	std::vector<std::vector<unsigned>> classes_;
+	std::vector<EngineType> engines_;
+	std::vector<std::vector<double>> weights_;
+	ThreadPool& pool_;
+	unsigned grain_;
+};
+
+// Metropolis-Hastings chain proposing one node from its CPT per step.
+// The chain keeps the log joint of its state and scores a proposal by the
+// change in the log factors of the node's blanket alone. Factors that are
+// exactly zero are counted rather than logged, so states outside the
+// support never produce 0/0.
+template <typename NodeType, typename ValueType, typename EngineType>
+class MetropolisChain : public Chain<NodeType, ValueType, EngineType>
+{
+public:
+	MetropolisChain(const CompiledNet<NodeType, ValueType>& net,
+		const std::vector<int>& clamp,
+		const EngineType& engine);
+
+	void step();
+
+	// Log joint probability of the current state
+	double log_joint() const;
+private:
+	unsigned zeros_;
+	double log_sum_;
+};
+
+// Temperature ladder of a tempered run. Replica r targets the network's
+// distribution with every CPT entry p of a node with K values replaced by
+// ((1 - e) p + e / K)^b, where b is the replica's inverse temperature and
+// e = 1 - b. The cold replica, b = 1, samples the network itself; hotter
+// ones flatten it, and because e > 0 they also cross the zeros of
+// deterministic CPTs, which raising to a power alone would keep.
+struct TemperingSchedule
+{
+	TemperingSchedule() : replicas(4), hottest(0.1), swap_interval(1), grain(64) {}
+
+	// Inverse temperatures, from 1 down to the hottest geometrically
+	std::vector<double> betas() const {
+		std::vector<double> b(std::max(1u, replicas), 1.0);
+		for (unsigned r = 1; r < b.size(); r++)
+			b[r] = std::pow(hottest, r / double(b.size() - 1));
+		return b;
+	}
+
+	unsigned replicas;
+	double hottest;
+
+	// Sweeps between rounds of swaps
+	unsigned swap_interval;
+
+	// Free nodes below which the replicas are swept on the calling thread
+	unsigned grain;
+};
+
+// Swap attempts and acceptances between each pair of adjacent replicas
+struct SwapStats
+{
+	std::vector<unsigned long> attempts;
+	std::vector<unsigned long> accepted;
+
+	void merge(const SwapStats& other) {
+		attempts.resize(std::max(attempts.size(), other.attempts.size()), 0);
+		accepted.resize(attempts.size(), 0);
+		for (std::size_t i = 0; i < other.attempts.size(); i++) {
+			attempts[i] += other.attempts[i];
+			accepted[i] += other.accepted[i];
+		}
+	}
+
+	std::vector<double> rates() const {
+		std::vector<double> r;
+		for (std::size_t i = 0; i < attempts.size(); i++)
+			r.push_back(attempts[i] ? accepted[i] / (double)attempts[i] : 0);
+		return r;
+	}
+};
+
+// Replica-exchange chain: one Gibbs replica per temperature of a
+// schedule. A step sweeps every replica once, on the pool when the
+// network is large enough, each replica with an engine of its own; every
+// swap_interval steps, adjacent replicas propose to exchange states,
+// alternating between the even and the odd pairs. Only the cold replica's
+// state is visible, so the estimators see samples of the network alone,
+// while modes found by the hot replicas reach it through the swaps.
+template <typename NodeType, typename ValueType, typename EngineType>
+class TemperedChain
+{
+public:
+	typedef CompiledNet<NodeType, ValueType> net_type;
+	typedef EngineType engine_type;
+
+	TemperedChain(const CompiledNet<NodeType, ValueType>& net,
+		const std::vector<int>& clamp,
+		const EngineType& engine,
+		const TemperingSchedule& schedule = TemperingSchedule(),
+		ThreadPool& pool = ThreadPool::instance());
+
+	void step();
+
+	// State of the cold replica
+	const std::vector<unsigned>& state() const;
+	EngineType& engine();
+
+	const std::vector<double>& betas() const;
+	const SwapStats& swaps() const;
+private:
+	struct Replica {
+		double beta;
+		double mix;
+		std::vector<unsigned> state;
+		EngineType engine;
+		std::vector<double> weights;
+	};
+
+	// Tempered log factor of a node's CPT entry in a replica; -infinity
+	// only for zeros of the cold replica
+	double log_factor(const Replica& replica, unsigned node, double prob) const;
+
+	// Tempered log density of a state under a replica, with the cold
+	// replica's zero factors counted apart
+	double log_density(const Replica& replica, const std::vector<unsigned>& state, unsigned& zeros) const;
+
+	void sweep(Replica& replica);
+	void redraw(Replica& replica, unsigned node);
+	void exchange(unsigned pair);
+
+	const CompiledNet<NodeType, ValueType>* net_;
+	std::vector<int> clamp_;
+	std::vector<unsigned> free_;
+	std::vector<Replica> replicas_;
+	std::vector<double> betas_;
+	EngineType engine_;
+	SwapStats swaps_;
+	TemperingSchedule schedule_;
+	ThreadPool& pool_;
+	unsigned long steps_;
+};
+
+// Swap counts a chain kept; only tempered chains swap
+template <typename ChainType>
+void collect_swaps(SwapStats&, const ChainType&) {}
+
+template <typename NodeType, typename ValueType, typename EngineType>
+void collect_swaps(SwapStats& stats, const TemperedChain<NodeType, ValueType, EngineType>& chain) {
+	stats.merge(chain.swaps());
+}
+
+// Finish argument of an executor run that adds up the swaps of its
+// chains, which finish on different threads
+class SwapTally
+{
+public:
+	explicit SwapTally(SwapStats& stats) : stats_(&stats), mutex_(std::make_shared<std::mutex>()) {}
+
+	template <typename ChainType>
+	void operator()(const ChainType& chain) const {
+		std::lock_guard<std::mutex> lock(*mutex_);
+		collect_swaps(*stats_, chain);
+	}
+private:
+	SwapStats* stats_;
+	std::shared_ptr<std::mutex> mutex_;
+};
+
+template <typename NodeType, typename ValueType, typename EngineType>
+Chain<NodeType, ValueType, EngineType>::Chain(const CompiledNet<NodeType, ValueType>& net,
+	const std::vector<int>& clamp,
+	const EngineType& engine) :
+	net_(&net), clamp_(clamp), state_(net.size()), engine_(engine) {
+	BN_COUNT(ALLOCATIONS);
+	for (unsigned node = 0; node < net.size(); node++)
+		if (clamp_[node] < 0)
+			free_.push_back(node);
+	forward_sample(net, clamp_, state_, engine_);
+}
+
+template <typename NodeType, typename ValueType, typename EngineType>
+const std::vector<unsigned>& Chain<NodeType, ValueType, EngineType>::state() const { return state_; }
+
+template <typename NodeType, typename ValueType, typename EngineType>
+double Chain<NodeType, ValueType, EngineType>::child_probability(unsigned node,
+	unsigned value,
+	unsigned child,
+	std::size_t stride) {
+	const CompiledNet<NodeType, ValueType>& net = *net_;
+	unsigned current = state_[node];
+	if (net.dense(child))
+		return net.probability(child,
+			net.row_index(child, state_) - current * stride + value * stride, state_[child]);
+
+	state_[node] = value;
+	double prob = net.conditional(child, state_, state_[child]);
+	state_[node] = current;
+	return prob;
+}
+
+template <typename NodeType, typename ValueType, typename EngineType>
+EngineType& Chain<NodeType, ValueType, EngineType>::engine() { return engine_; }
+
+template <typename NodeType, typename ValueType, typename EngineType>
+GibbsChain<NodeType, ValueType, EngineType>::GibbsChain(const CompiledNet<NodeType, ValueType>& net,
+	const std::vector<int>& clamp,
+	const EngineType& engine) :
+	Chain<NodeType, ValueType, EngineType>(net, clamp, engine)
+{}
+
+template <typename NodeType, typename ValueType, typename EngineType>
+void GibbsChain<NodeType, ValueType, EngineType>::step() {
+	if (!this->free_.empty())
+		update(this->free_[uniform_index(this->engine_, this->free_.size())]);
+}
+
+template <typename NodeType, typename ValueType, typename EngineType>
+void GibbsChain<NodeType, ValueType, EngineType>::update(unsigned node) {
+	redraw(node, this->engine_, weights_);
+}
+
+template <typename NodeType, typename ValueType, typename EngineType>
+void GibbsChain<NodeType, ValueType, EngineType>::redraw(unsigned node,
+	EngineType& engine,
+	std::vector<double>& weights) {
+	weights.resize(this->net_->cardinality(node));
+	gibbs_redraw<0>(*this->net_, this->state_, node, weights, engine);
+}
+
+template <typename NodeType, typename ValueType, typename EngineType, unsigned K>
+FixedGibbsChain<NodeType, ValueType, EngineType, K>::FixedGibbsChain(const CompiledNet<NodeType, ValueType>& net,
+	const std::vector<int>& clamp,
+	const EngineType& engine) :
+	Chain<NodeType, ValueType, EngineType>(net, clamp, engine) {
+	if (net.uniform_cardinality() != K)
+		throw CardinalityException();
+}
+
+template <typename NodeType, typename ValueType, typename EngineType, unsigned K>
+void FixedGibbsChain<NodeType, ValueType, EngineType, K>::step() {
+	if (!this->free_.empty())
+		update(this->free_[uniform_index(this->engine_, this->free_.size())]);
+}
+
+template <typename NodeType, typename ValueType, typename EngineType, unsigned K>
+void FixedGibbsChain<NodeType, ValueType, EngineType, K>::update(unsigned node) {
+	std::array<double, K> weights;
+	gibbs_redraw<K>(*this->net_, this->state_, node, weights, this->engine_);
+}
+
+template <typename NodeType, typename ValueType, typename EngineType>
+ChromaticGibbsChain<NodeType, ValueType, EngineType>::ChromaticGibbsChain(
+	const CompiledNet<NodeType, ValueType>& net,
+	const std::vector<int>& clamp,
+	const EngineType& engine,
+	ThreadPool& pool,
+	unsigned grain) :
+	GibbsChain<NodeType, ValueType, EngineType>(net, clamp, engine),
+	classes_(color_moral_graph(net, clamp)),
+	weights_(pool.size()),
+	pool_(pool),
+	grain_(std::max(1u, grain)) {
+	std::uint64_t seed = this->engine_();
+	for (unsigned slice = 0; slice < pool.size(); slice++)
+		engines_.push_back(EngineType(seed, slice));
+}
+
+template <typename NodeType, typename ValueType, typename EngineType>
+void ChromaticGibbsChain<NodeType, ValueType, EngineType>::step() {
+	for (const std::vector<unsigned>& nodes : classes_) {
+		unsigned slices = std::min<std::size_t>(engines_.size(), nodes.size() / grain_);
+		if (slices <= 1) {
+			sweep(nodes, 0, 1);
+			continue;
+		}
+
+		// Every slice must finish before the next color reads its values
+		std::vector<std::future<void>> done;
+		for (unsigned slice = 1; slice < slices; slice++)
+			done.push_back(pool_.submit([this, &nodes, slice, slices]() {
+				sweep(nodes, slice, slices);
+			}));
+		std::exception_ptr failure;
+		try {
+			sweep(nodes, 0, slices);
+		} catch (...) {
+			failure = std::current_exception();
+		}
+		for (std::future<void>& d : done)
+			pool_.wait(d);
+		if (failure)
+			std::rethrow_exception(failure);
+		for (std::future<void>& d : done)
+			d.get();
+	}
+}
+
+template <typename NodeType, typename ValueType, typename EngineType>
+void ChromaticGibbsChain<NodeType, ValueType, EngineType>::sweep(const std::vector<unsigned>& nodes,
+	unsigned slice,
+	unsigned slices) {
+	std::size_t begin = nodes.size() * slice / slices;
+	std::size_t end = nodes.size() * (slice + 1) / slices;
+	for (std::size_t i = begin; i < end; i++)
+		this->redraw(nodes[i], engines_[slice], weights_[slice]);
+}
+
+template <typename NodeType, typename ValueType, typename EngineType>
+const std::vector<std::vector<unsigned>>&
+ChromaticGibbsChain<NodeType, ValueType, EngineType>::color_classes() const { return classes_; }
+
+template <typename NodeType, typename ValueType, typename EngineType>
+MetropolisChain<NodeType, ValueType, EngineType>::MetropolisChain(const CompiledNet<NodeType, ValueType>& net,
+	const std::vector<int>& clamp,
+	const EngineType& engine) :
+	Chain<NodeType, ValueType, EngineType>(net, clamp, engine),
+	zeros_(0),
+	log_sum_(0) {
+	for (unsigned node = 0; node < net.size(); node++) {
+		double prob = net.conditional(node, this->state_, this->state_[node]);
+		if (prob > 0)
+			log_sum_ += std::log(prob);
+		else
+			++zeros_;
+	}
+}
+
+template <typename NodeType, typename ValueType, typename EngineType>
+void MetropolisChain<NodeType, ValueType, EngineType>::step() {
+	const CompiledNet<NodeType, ValueType>& net = *this->net_;
+	std::vector<unsigned>& state = this->state_;
+	if (this->free_.empty())
+		return;
+	unsigned node = this->free_[uniform_index(this->engine_, this->free_.size())];
+
+	unsigned current = state[node];
+	unsigned proposal = net.sample(node, state, uniform_real(this->engine_));
+	if (proposal == current) {
+		BN_COUNT(ACCEPTED);
+		return;
+	}
+
+	// The node's own factor cancels against the proposal ratio, leaving
+	// the children's factors to decide acceptance
+	double delta = 0;
+	unsigned zeros_before = 0, zeros_after = 0;
+	const std::size_t* stride = net.child_strides_begin(node);
+	for (const unsigned* c = net.children_begin(node); c != net.children_end(node); ++c, ++stride) {
+		double before = this->child_probability(node, current, *c, *stride);
+		double after = this->child_probability(node, proposal, *c, *stride);
+		if (before > 0)
+			delta -= std::log(before);
+		else
+			++zeros_before;
+		if (after > 0)
+			delta += std::log(after);
+		else
+			++zeros_after;
+	}
+	double own_before = net.conditional(node, state, current);
+	double own_after = net.conditional(node, state, proposal);
+	zeros_before += own_before <= 0;
+
+	// Outside the support any move that does not add zero factors is taken
+	bool accept;
+	if (zeros_ > 0)
+		accept = zeros_after <= zeros_before;
+	else
+		accept = zeros_after == 0 && std::log(uniform_real(this->engine_)) < delta;
+	if (!accept) {
+		BN_COUNT(REJECTED);
+		return;
+	}
+
+	BN_COUNT(ACCEPTED);
+	state[node] = proposal;
+	zeros_ = zeros_ + zeros_after - zeros_before;
+	log_sum_ += delta + std::log(own_after) - (own_before > 0 ? std::log(own_before) : 0);
+}
+
+template <typename NodeType, typename ValueType, typename EngineType>
+double MetropolisChain<NodeType, ValueType, EngineType>::log_joint() const {
+	return zeros_ > 0 ? -std::numeric_limits<double>::infinity() : log_sum_;
+}
+
+template <typename NodeType, typename ValueType, typename EngineType>
+TemperedChain<NodeType, ValueType, EngineType>::TemperedChain(const CompiledNet<NodeType, ValueType>& net,
+	const std::vector<int>& clamp,
+	const EngineType& engine,
+	const TemperingSchedule& schedule,
+	ThreadPool& pool) :
+	net_(&net),
+	clamp_(clamp),
+	betas_(schedule.betas()),
+	engine_(engine),
+	schedule_(schedule),
+	pool_(pool),
+	steps_(0) {
+	BN_COUNT(ALLOCATIONS);
+	for (unsigned node = 0; node < net.size(); node++)
+		if (clamp_[node] < 0)
+			free_.push_back(node);
+	std::uint64_t seed = engine_();
+	for (unsigned r = 0; r < betas_.size(); r++) {
+		Replica replica = { betas_[r], 1 - betas_[r], std::vector<unsigned>(net.size()),
+			EngineType(seed, r), std::vector<double>() };
+		forward_sample(net, clamp_, replica.state, replica.engine);
+		replicas_.push_back(replica);
+	}
+	swaps_.attempts.assign(betas_.size() - 1, 0);
+	swaps_.accepted.assign(betas_.size() - 1, 0);
+}
+
+template <typename NodeType, typename ValueType, typename EngineType>
+void TemperedChain<NodeType, ValueType, EngineType>::step() {
+	unsigned n = replicas_.size();
+	if (n > 1 && free_.size() >= schedule_.grain) {
+		std::vector<std::future<void>> done;
+		for (unsigned r = 1; r < n; r++)
+			done.push_back(pool_.submit([this, r]() { sweep(replicas_[r]); }));
+		std::exception_ptr failure;
+		try {
+			sweep(replicas_[0]);
+		} catch (...) {
+			failure = std::current_exception();
+		}
+		for (std::future<void>& d : done)
+			pool_.wait(d);
+		if (failure)
+			std::rethrow_exception(failure);
+		for (std::future<void>& d : done)
+			d.get();
+	} else {
+		for (Replica& replica : replicas_)
+			sweep(replica);
+	}
+
+	if (++steps_ % std::max(1u, schedule_.swap_interval) == 0) {
+		unsigned round = steps_ / std::max(1u, schedule_.swap_interval);
+		for (unsigned pair = round % 2; pair + 1 < n; pair += 2)
+			exchange(pair);
+	}
+}
+
+template <typename NodeType, typename ValueType, typename EngineType>
+const std::vector<unsigned>& TemperedChain<NodeType, ValueType, EngineType>::state() const {
+	return replicas_.front().state;
+}
+
+template <typename NodeType, typename ValueType, typename EngineType>
+EngineType& TemperedChain<NodeType, ValueType, EngineType>::engine() { return engine_; }
+
+template <typename NodeType, typename ValueType, typename EngineType>
+const std::vector<double>& TemperedChain<NodeType, ValueType, EngineType>::betas() const { return betas_; }
+
+template <typename NodeType, typename ValueType, typename EngineType>
+const SwapStats& TemperedChain<NodeType, ValueType, EngineType>::swaps() const { return swaps_; }
+
+template <typename NodeType, typename ValueType, typename EngineType>
+double TemperedChain<NodeType, ValueType, EngineType>::log_factor(const Replica& replica,
+	unsigned node,
+	double prob) const {
+	double mixed = (1 - replica.mix) * prob + replica.mix / net_->cardinality(node);
+	return mixed > 0 ? replica.beta * std::log(mixed) : -std::numeric_limits<double>::infinity();
+}
+
+template <typename NodeType, typename ValueType, typename EngineType>
+double TemperedChain<NodeType, ValueType, EngineType>::log_density(const Replica& replica,
+	const std::vector<unsigned>& state,
+	unsigned& zeros) const {
+	double sum = 0;
+	zeros = 0;
+	for (unsigned node = 0; node < net_->size(); node++) {
+		double f = log_factor(replica, node, net_->conditional(node, state, state[node]));
+		if (f == -std::numeric_limits<double>::infinity())
+			++zeros;
+		else
+			sum += f;
+	}
+	return sum;
+}
+
+template <typename NodeType, typename ValueType, typename EngineType>
+void TemperedChain<NodeType, ValueType, EngineType>::sweep(Replica& replica) {
+	for (unsigned node : free_)
+		redraw(replica, node);
+}
+
+template <typename NodeType, typename ValueType, typename EngineType>
+void TemperedChain<NodeType, ValueType, EngineType>::redraw(Replica& replica, unsigned node) {
+	// The tempered full conditional in logs, from the node's own row and
+	// the entries of its children's rows
+	const CompiledNet<NodeType, ValueType>& net = *net_;
+	std::vector<unsigned>& state = replica.state;
+	std::vector<double>& weights = replica.weights;
+	unsigned k = net.cardinality(node);
+	unsigned current = state[node];
+	weights.resize(k);
+	net.distribution(node, state, weights.data());
+	for (unsigned v = 0; v < k; v++)
+		weights[v] = log_factor(replica, node, weights[v]);
+	for (const unsigned* c = net.children_begin(node); c != net.children_end(node); ++c)
+		for (unsigned v = 0; v < k; v++)
+			if (weights[v] > -std::numeric_limits<double>::infinity()) {
+				state[node] = v;
+				weights[v] += log_factor(replica, *c, net.conditional(*c, state, state[*c]));
+			}
+	state[node] = current;
+
+	double max = *std::max_element(weights.begin(), weights.end());
+	if (max == -std::numeric_limits<double>::infinity()) {
+		state[node] = net.sample(node, state, uniform_real(replica.engine));
+		return;
+	}
+	double sum = 0;
+	for (unsigned v = 0; v < k; v++)
+		sum += weights[v] = std::exp(weights[v] - max);
+	state[node] = draw_weighted(weights, k, sum, uniform_real(replica.engine));
+}
+
+template <typename NodeType, typename ValueType, typename EngineType>
+void TemperedChain<NodeType, ValueType, EngineType>::exchange(unsigned pair) {
+	// Accept with the ratio of the two densities at the swapped states to
+	// those at the current ones. Only the colder replica can see zeros; a
+	// swap that brings it fewer is taken, one that brings it more is not.
+	Replica& cold = replicas_[pair];
+	Replica& hot = replicas_[pair + 1];
+	unsigned cold_zeros, swapped_zeros, unused;
+	double delta = log_density(cold, hot.state, swapped_zeros) - log_density(cold, cold.state, cold_zeros) +
+		log_density(hot, cold.state, unused) - log_density(hot, hot.state, unused);
+	bool accept;
+	if (swapped_zeros != cold_zeros)
+		accept = swapped_zeros < cold_zeros;
+	else
+		accept = std::log(uniform_real(engine_)) < delta;
+	++swaps_.attempts[pair];
+	if (accept) {
+		++swaps_.accepted[pair];
+		std::swap(cold.state, hot.state);
+	}
+}
+
+#endif
@@ -0,0 +1,380 @@
+#ifndef CHAIN_EXECUTOR_H
+#define CHAIN_EXECUTOR_H
+
+#include "Chain.h"
+#include "Accumulators.h"
+#include "Diagnostics.h"
+#include "ThreadPool.h"
+#include "Instrument.h"
+
+#include <vector>
+#include <future>
+#include <memory>
+#include <cmath>
+#include <limits>
+#include <cstdint>
+#include <algorithm>
+
+// Outcome of an indicator query answered by several chains
+struct ChainReport
+{
+	ChainReport() :
+		chains(0), samples(0), hits(0), mean(0), ess(0), rhat(1),
+		std_error(std::numeric_limits<double>::infinity()), geweke(0), burn_in(0) {}
+
+	// Estimated probability of the query
+	double estimate() const { return mean; }
+
+	// Half-width of the normal confidence interval about the estimate
+	double half_width(double confidence = 0.95) const {
+		return normal_quantile(confidence) * std_error;
+	}
+
+	unsigned chains;
+	unsigned long samples;
+	unsigned long hits;
+
+	// Fraction of retained states satisfying the query, or its
+	// self-normalized weighted form for weighted samples
+	double mean;
+
+	// Effective sample size: Kish's for weighted samples, from the batch
+	// means of each chain for unweighted ones
+	double ess;
+
+	// Potential scale reduction of the query indicator across chains
+	double rhat;
+
+	// Standard error of the estimate; infinite until it can be estimated
+	double std_error;
+
+	// Largest Geweke score of a chain; 0 for independent particles
+	double geweke;
+
+	// Most steps any chain discarded before its retained samples
+	unsigned long burn_in;
+
+	// Fraction of proposed swaps taken between each pair of adjacent
+	// temperatures; empty unless the chains were tempered
+	std::vector<double> swap_rates;
+};
+
+// Target precision of an adaptive query. Sampling stops as soon as every
+// target that is set holds and the chains look converged, or once
+// max_samples are retained.
+struct StoppingRule
+{
+	StoppingRule() :
+		half_width(0), ess(0), confidence(0.95), rhat(1.05), geweke(3), min_chains(4),
+		min_samples(1024), max_samples(1ul << 22), burn_in(32), max_burn_in(1ul << 16) {}
+
+	// Largest confidence interval half-width at the given confidence; 0
+	// for no target
+	double half_width;
+
+	// Smallest effective sample size; 0 for no target
+	double ess;
+	double confidence;
+
+	// Convergence required before stopping: R-hat across chains and the
+	// Geweke score of every chain must not exceed these
+	double rhat;
+	double geweke;
+
+	// Chains run even when fewer are asked for; a single chain stuck in
+	// one mode looks converged, several disagree
+	unsigned min_chains;
+
+	// Retained samples over all chains
+	unsigned long min_samples;
+	unsigned long max_samples;
+
+	// Steps each chain discards up front. A chain whose Geweke score
+	// still exceeds the limit discards its samples so far as well, while
+	// its burn-in stays within max_burn_in.
+	unsigned burn_in;
+	unsigned long max_burn_in;
+
+	bool met(const ChainReport& report) const {
+		return (half_width <= 0 || report.half_width(confidence) <= half_width) &&
+			(ess <= 0 || report.ess >= ess) &&
+			report.rhat <= rhat && report.geweke <= geweke;
+	}
+};
+
+// Default for the finish argument of ChainExecutor's runs
+struct IgnoreChain
+{
+	template <typename ChainType>
+	void operator()(const ChainType&) const {}
+};
+
+// Runs independent chains of one chain type on a work-stealing pool.
+// Chain c draws from stream c of the run seed, performs its own burn-in
+// and feeds its share of the retained steps to its own copy of an
+// accumulator, so uneven chains simply leave their share of the pool to
+// the others. The per-chain accumulators are returned once every chain
+// has finished, ready to be merged. Each finished chain is passed to the
+// finish argument on the thread that ran it, e.g. to read statistics the
+// chain keeps of itself.
+template <typename ChainType>
+class ChainExecutor
+{
+public:
+	typedef typename ChainType::net_type net_type;
+	typedef typename ChainType::engine_type engine_type;
+
+	ChainExecutor(const net_type& net,
+		const std::vector<int>& clamp,
+		ThreadPool& pool = ThreadPool::instance());
+
+	template <typename Accumulator, typename Finish = IgnoreChain>
+	std::vector<Accumulator> run(const Accumulator& prototype,
+		unsigned long count,
+		unsigned burn_in,
+		unsigned chains,
+		std::uint64_t seed,
+		Finish finish = Finish());
+
+	// Run the chains in rounds until the summary of their accumulators
+	// meets the rule. Each round extends every chain towards a common
+	// budget, projected from the precision reached so far.
+	template <typename Accumulator, typename Finish = IgnoreChain>
+	std::vector<Accumulator> run_until(const Accumulator& prototype,
+		const StoppingRule& rule,
+		unsigned chains,
+		std::uint64_t seed,
+		Finish finish = Finish());
+
+	// Most steps a chain of the last run_until discarded
+	unsigned long burn_in() const;
+private:
+	const net_type& net_;
+	const std::vector<int>& clamp_;
+	ThreadPool& pool_;
+	unsigned long burn_in_;
+};
+
+// Pass a chain's current state to an accumulator
+template <typename Accumulator, typename ChainType>
+void visit_state(Accumulator& accumulator, const ChainType& chain) {
+	accumulator(chain.state());
+}
+
+// Merge the accumulators of several chains
+template <typename Accumulator>
+Accumulator merge_chains(const std::vector<Accumulator>& chains) {
+	Accumulator merged = chains.front();
+	for (unsigned c = 1; c < chains.size(); c++)
+		merged.merge(chains[c]);
+	return merged;
+}
+
+// Merge the indicator counters of several chains into a report
+template <typename NodeType, typename ValueType>
+ChainReport summarize_chains(const std::vector<IndicatorCounter<NodeType, ValueType>>& chains) {
+	ChainReport report;
+	std::vector<RunningStats> stats;
+	for (const IndicatorCounter<NodeType, ValueType>& chain : chains) {
+		report.hits += chain.hits();
+		report.samples += chain.count();
+		stats.push_back(chain.stats());
+	}
+	report.chains = chains.size();
+	report.mean = report.samples ? report.hits / (double)report.samples : 0;
+	report.rhat = potential_scale_reduction(stats);
+
+	// Chains are independent, so their variances of the mean combine
+	// weighted by their share of the samples
+	double variance = 0;
+	for (const IndicatorCounter<NodeType, ValueType>& chain : chains) {
+		const BatchMeans& batches = chain.batches();
+		report.ess += batches.effective_size();
+		report.geweke = std::max(report.geweke, batches.geweke());
+		if (batches.count() > 0) {
+			double share = batches.count() / (double)report.samples;
+			variance += share * share * batches.variance_of_mean();
+		}
+	}
+	// Never below the error of as many independent samples, with the
+	// proportion smoothed so that chains that never moved claim no certainty
+	if (report.samples) {
+		double p = (report.hits + 1) / (report.samples + 2.0);
+		report.std_error = std::sqrt(std::max(variance, p * (1 - p) / report.samples));
+	}
+	return report;
+}
+
+// Geweke score of one chain's accumulator; independent particles have no
+// transient to detect
+template <typename NodeType, typename ValueType>
+double chain_geweke(const IndicatorCounter<NodeType, ValueType>& chain) {
+	return chain.batches().geweke();
+}
+
+template <typename NodeType, typename ValueType>
+double chain_geweke(const WeightedIndicator<NodeType, ValueType>&) {
+	return 0;
+}
+
+// Merge the weighted indicators of independent particle streams into a
+// report; independent particles need no convergence check
+template <typename NodeType, typename ValueType>
+ChainReport summarize_chains(const std::vector<WeightedIndicator<NodeType, ValueType>>& chains) {
+	WeightedIndicator<NodeType, ValueType> merged = merge_chains(chains);
+	ChainReport report;
+	report.chains = chains.size();
+	report.samples = merged.count();
+	report.hits = merged.hits();
+	report.mean = merged.estimate();
+	report.ess = merged.stats().effective_size();
+	if (report.ess > 0)
+		report.std_error = std::sqrt(merged.stats().variance() / report.ess);
+	return report;
+}
+
+template <typename ChainType>
+ChainExecutor<ChainType>::ChainExecutor(const net_type& net,
+	const std::vector<int>& clamp,
+	ThreadPool& pool) :
+	net_(net), clamp_(clamp), pool_(pool), burn_in_(0)
+{}
+
+template <typename ChainType>
+unsigned long ChainExecutor<ChainType>::burn_in() const { return burn_in_; }
+
+template <typename ChainType>
+template <typename Accumulator, typename Finish>
+std::vector<Accumulator> ChainExecutor<ChainType>::run(const Accumulator& prototype,
+	unsigned long count,
+	unsigned burn_in,
+	unsigned chains,
+	std::uint64_t seed,
+	Finish finish) {
+	if (chains > count)
+		chains = count;
+	if (chains == 0)
+		chains = 1;
+
+	std::vector<std::future<Accumulator>> results;
+	for (unsigned c = 0; c < chains; c++) {
+		unsigned long share = count / chains + (c < count % chains);
+		results.push_back(pool_.submit([this, &prototype, &finish, share, burn_in, seed, c]() {
+			ChainType chain(net_, clamp_, engine_type(seed, c));
+			{
+				BN_PHASE("burn_in");
+				for (unsigned i = 0; i < burn_in; i++)
+					chain.step();
+				BN_COUNT_N(BURN_IN_STEPS, burn_in);
+			}
+
+			BN_COUNT(ALLOCATIONS);
+			Accumulator accumulator(prototype);
+			{
+				BN_PHASE("sampling");
+				for (unsigned long i = 0; i < share; i++) {
+					chain.step();
+					visit_state(accumulator, chain);
+				}
+				BN_COUNT_N(STEPS, share);
+			}
+			finish(chain);
+			return accumulator;
+		}));
+	}
+
+	// Every chain must finish before any failure is rethrown
+	for (std::future<Accumulator>& result : results)
+		pool_.wait(result);
+
+	std::vector<Accumulator> accumulators;
+	for (std::future<Accumulator>& result : results)
+		accumulators.push_back(result.get());
+	return accumulators;
+}
+
+template <typename ChainType>
+template <typename Accumulator, typename Finish>
+std::vector<Accumulator> ChainExecutor<ChainType>::run_until(const Accumulator& prototype,
+	const StoppingRule& rule,
+	unsigned chains,
+	std::uint64_t seed,
+	Finish finish) {
+	chains = std::max(std::max(chains, rule.min_chains), 1u);
+
+	// Chains persist across rounds so that each continues where it stopped
+	std::vector<std::unique_ptr<ChainType>> runners;
+	for (unsigned c = 0; c < chains; c++)
+		runners.emplace_back(new ChainType(net_, clamp_, engine_type(seed, c)));
+	std::vector<Accumulator> accumulators(chains, prototype);
+	std::vector<unsigned long> burnt(chains, rule.burn_in);
+
+	unsigned long budget = std::min(rule.max_samples, std::max<unsigned long>(rule.min_samples, chains));
+	bool first = true;
+	for (;;) {
+		std::vector<std::future<void>> results;
+		for (unsigned c = 0; c < chains; c++) {
+			unsigned long goal = budget / chains + (c < budget % chains);
+			unsigned long share = goal > accumulators[c].count() ? goal - accumulators[c].count() : 0;
+			unsigned burn_in = first ? rule.burn_in : 0;
+			results.push_back(pool_.submit([this, &runners, &accumulators, share, burn_in, c]() {
+				ChainType& chain = *runners[c];
+				{
+					BN_PHASE("burn_in");
+					for (unsigned i = 0; i < burn_in; i++)
+						chain.step();
+					BN_COUNT_N(BURN_IN_STEPS, burn_in);
+				}
+				BN_PHASE("sampling");
+				for (unsigned long i = 0; i < share; i++) {
+					chain.step();
+					visit_state(accumulators[c], chain);
+				}
+				BN_COUNT_N(STEPS, share);
+			}));
+		}
+		for (std::future<void>& result : results)
+			pool_.wait(result);
+		for (std::future<void>& result : results)
+			result.get();
+		first = false;
+
+		// A chain still drifting treats what it kept so far as burn-in
+		bool discarded = false;
+		for (unsigned c = 0; c < chains; c++) {
+			unsigned long kept = accumulators[c].count();
+			if (chain_geweke(accumulators[c]) > rule.geweke && burnt[c] + kept <= rule.max_burn_in) {
+				burnt[c] += kept;
+				accumulators[c] = prototype;
+				discarded = true;
+			}
+		}
+		if (discarded)
+			continue;
+
+		ChainReport report = summarize_chains(accumulators);
+		if (rule.met(report) || report.samples >= rule.max_samples)
+			break;
+
+		// Grow the budget by the factor the unmet targets call for, at least
+		// a quarter and at most double so the projection cannot run away;
+		// chains that only lack convergence grow by half
+		double factor = 0;
+		if (rule.half_width > 0 && report.half_width(rule.confidence) > rule.half_width) {
+			double ratio = report.half_width(rule.confidence) / rule.half_width;
+			factor = std::max(factor, ratio * ratio);
+		}
+		if (rule.ess > 0 && report.ess < rule.ess)
+			factor = std::max(factor, report.ess > 0 ? rule.ess / report.ess : 2.0);
+		if (factor == 0)
+			factor = 1.5;
+		factor = std::min(std::max(factor, 1.25), 2.0);
+		budget = std::min<unsigned long>(rule.max_samples, std::ceil(report.samples * factor));
+	}
+	burn_in_ = *std::max_element(burnt.begin(), burnt.end());
+	for (std::unique_ptr<ChainType>& runner : runners)
+		finish(*runner);
+	return accumulators;
+}
+
+#endif
@@ -0,0 +1,408 @@
+#ifndef CHAIN_STORE_H
+#define CHAIN_STORE_H
+
+#include "CompiledNet.h"
+
+#include <vector>
+#include <map>
+#include <iterator>
+#include <cstdint>
+#include <cstddef>
+
+// Compact record of a chain over a compiled network. Every value is
+// packed into just enough bits for its node's cardinality, one bit for a
+// binary node. Every keyframe_interval-th state is stored whole as a
+// keyframe; each state between keyframes is stored as the list of
+// (node, value) pairs that changed since the state before it, which for a
+// single-site chain is at most one pair. A state is rebuilt from the
+// keyframe before it and the deltas since, so random access costs at most
+// one keyframe and keyframe_interval deltas, and iterating forward costs
+// one delta per state. The store can be passed as the visitor of the
+// streaming samplers; it only refers to the network to label assignments.
+template <
+	typename NodeType = int,
+	typename ValueType = int
+>
+class ChainStore
+{
+public:
+	class const_iterator;
+
+	explicit ChainStore(const CompiledNet<NodeType, ValueType>& net,
+		unsigned keyframe_interval = 256);
+
+	// Append a state of value indices over the network
+	void push_back(const std::vector<unsigned>& state);
+	void operator()(const std::vector<unsigned>& state);
+
+	std::size_t size() const;
+	bool empty() const;
+	void clear();
+
+	// Rebuild the state at a position
+	std::vector<unsigned> state(std::size_t step) const;
+	void state(std::size_t step, std::vector<unsigned>& out) const;
+
+	// Labelled assignment of the state at a position
+	std::map<NodeType, ValueType> assignment(std::size_t step) const;
+
+	// Bytes held by the encoded chain
+	std::size_t bytes() const;
+
+	const_iterator begin() const;
+	const_iterator end() const;
+private:
+	typedef std::uint64_t word;
+
+	static unsigned bits_for(std::size_t values);
+
+	void write(word value, unsigned bits);
+	word read(std::uint64_t& position, unsigned bits) const;
+
+	// Decode the keyframe of a block, leaving position after it
+	void read_keyframe(std::size_t block, std::vector<unsigned>& out, std::uint64_t& position) const;
+
+	// Apply the delta of one state, leaving position after it
+	void read_delta(std::vector<unsigned>& out, std::uint64_t& position) const;
+
+	const CompiledNet<NodeType, ValueType>* net_;
+	unsigned interval_;
+	std::vector<unsigned> value_bits_;
+	unsigned node_bits_;
+	unsigned count_bits_;
+
+	std::vector<word> words_;
+	std::uint64_t size_bits_;
+	std::size_t steps_;
+
+	// Bit position of each keyframe
+	std::vector<std::uint64_t> keyframes_;
+
+	// Last state appended, to take deltas against
+	std::vector<unsigned> last_;
+};
+
+// Random-access iterator over the states of a store. Dereferencing yields
+// the rebuilt state, held by the iterator and valid until it moves; moving
+// forward a little replays the deltas in between, any other move restarts
+// from the nearest keyframe.
+template <typename NodeType, typename ValueType>
+class ChainStore<NodeType, ValueType>::const_iterator
+{
+public:
+	typedef std::random_access_iterator_tag iterator_category;
+	typedef std::vector<unsigned> value_type;
+	typedef std::ptrdiff_t difference_type;
+	typedef const std::vector<unsigned>* pointer;
+	typedef const std::vector<unsigned>& reference;
+
+	const_iterator();
+
+	reference operator*() const;
+	pointer operator->() const;
+	value_type operator[](difference_type n) const;
+
+	const_iterator& operator++();
+	const_iterator operator++(int);
+	const_iterator& operator--();
+	const_iterator operator--(int);
+	const_iterator& operator+=(difference_type n);
+	const_iterator& operator-=(difference_type n);
+	const_iterator operator+(difference_type n) const;
+	const_iterator operator-(difference_type n) const;
+	difference_type operator-(const const_iterator& other) const;
+
+	bool operator==(const const_iterator& other) const;
+	bool operator!=(const const_iterator& other) const;
+	bool operator<(const const_iterator& other) const;
+	bool operator>(const const_iterator& other) const;
+	bool operator<=(const const_iterator& other) const;
+	bool operator>=(const const_iterator& other) const;
+private:
+	friend class ChainStore;
+
+	const_iterator(const ChainStore* store, std::size_t step);
+
+	const ChainStore* store_;
+	std::size_t step_;
+
+	// State decoded so far, the step it belongs to, and the bit position
+	// of the record after it
+	mutable std::vector<unsigned> state_;
+	mutable std::size_t decoded_;
+	mutable std::uint64_t position_;
+};
+
+template <typename NodeType, typename ValueType>
+ChainStore<NodeType, ValueType>::ChainStore(const CompiledNet<NodeType, ValueType>& net,
+	unsigned keyframe_interval) :
+	net_(&net),
+	interval_(keyframe_interval ? keyframe_interval : 1),
+	node_bits_(bits_for(net.size())),
+	count_bits_(bits_for(net.size() + 1)),
+	size_bits_(0),
+	steps_(0) {
+	for (unsigned node = 0; node < net.size(); node++)
+		value_bits_.push_back(bits_for(net.cardinality(node)));
+}
+
+template <typename NodeType, typename ValueType>
+unsigned ChainStore<NodeType, ValueType>::bits_for(std::size_t values) {
+	unsigned bits = 0;
+	while (bits < 64 && (std::size_t(1) << bits) < values)
+		++bits;
+	return bits;
+}
+
+template <typename NodeType, typename ValueType>
+void ChainStore<NodeType, ValueType>::write(word value, unsigned bits) {
+	if (bits == 0)
+		return;
+	unsigned offset = size_bits_ % 64;
+	if (offset == 0)
+		words_.push_back(0);
+	words_.back() |= value << offset;
+	if (offset + bits > 64)
+		words_.push_back(value >> (64 - offset));
+	size_bits_ += bits;
+}
+
+template <typename NodeType, typename ValueType>
+typename ChainStore<NodeType, ValueType>::word ChainStore<NodeType, ValueType>::read(
+	std::uint64_t& position, unsigned bits) const {
+	if (bits == 0)
+		return 0;
+	std::size_t index = position / 64;
+	unsigned offset = position % 64;
+	word value = words_[index] >> offset;
+	if (offset + bits > 64)
+		value |= words_[index + 1] << (64 - offset);
+	position += bits;
+	return bits == 64 ? value : value & ((word(1) << bits) - 1);
+}
+
+template <typename NodeType, typename ValueType>
+void ChainStore<NodeType, ValueType>::push_back(const std::vector<unsigned>& state) {
+	if (steps_ % interval_ == 0) {
+		keyframes_.push_back(size_bits_);
+		for (unsigned node = 0; node < state.size(); node++)
+			write(state[node], value_bits_[node]);
+	} else {
+		unsigned changed = 0;
+		for (unsigned node = 0; node < state.size(); node++)
+			changed += state[node] != last_[node];
+		write(changed, count_bits_);
+		for (unsigned node = 0; node < state.size(); node++)
+			if (state[node] != last_[node]) {
+				write(node, node_bits_);
+				write(state[node], value_bits_[node]);
+			}
+	}
+	last_ = state;
+	++steps_;
+}
+
+template <typename NodeType, typename ValueType>
+void ChainStore<NodeType, ValueType>::operator()(const std::vector<unsigned>& state) { push_back(state); }
+
+template <typename NodeType, typename ValueType>
+std::size_t ChainStore<NodeType, ValueType>::size() const { return steps_; }
+
+template <typename NodeType, typename ValueType>
+bool ChainStore<NodeType, ValueType>::empty() const { return steps_ == 0; }
+
+template <typename NodeType, typename ValueType>
+void ChainStore<NodeType, ValueType>::clear() {
+	words_.clear();
+	keyframes_.clear();
+	last_.clear();
+	size_bits_ = 0;
+	steps_ = 0;
+}
+
+template <typename NodeType, typename ValueType>
+void ChainStore<NodeType, ValueType>::read_keyframe(std::size_t block,
+	std::vector<unsigned>& out, std::uint64_t& position) const {
+	position = keyframes_[block];
+	out.resize(value_bits_.size());
+	for (unsigned node = 0; node < out.size(); node++)
+		out[node] = read(position, value_bits_[node]);
+}
+
+template <typename NodeType, typename ValueType>
+void ChainStore<NodeType, ValueType>::read_delta(std::vector<unsigned>& out,
+	std::uint64_t& position) const {
+	for (word changed = read(position, count_bits_); changed > 0; changed--) {
+		unsigned node = read(position, node_bits_);
+		out[node] = read(position, value_bits_[node]);
+	}
+}
+
+template <typename NodeType, typename ValueType>
+void ChainStore<NodeType, ValueType>::state(std::size_t step, std::vector<unsigned>& out) const {
+	std::uint64_t position;
+	read_keyframe(step / interval_, out, position);
+	for (std::size_t i = step / interval_ * interval_; i < step; i++)
+		read_delta(out, position);
+}
+
+template <typename NodeType, typename ValueType>
+std::vector<unsigned> ChainStore<NodeType, ValueType>::state(std::size_t step) const {
+	std::vector<unsigned> out;
+	state(step, out);
+	return out;
+}
+
+template <typename NodeType, typename ValueType>
+std::map<NodeType, ValueType> ChainStore<NodeType, ValueType>::assignment(std::size_t step) const {
+	return net_->assignment(state(step));
+}
+
+template <typename NodeType, typename ValueType>
+std::size_t ChainStore<NodeType, ValueType>::bytes() const {
+	return words_.size() * sizeof(word) + keyframes_.size() * sizeof(std::uint64_t);
+}
+
+template <typename NodeType, typename ValueType>
+typename ChainStore<NodeType, ValueType>::const_iterator ChainStore<NodeType, ValueType>::begin() const {
+	return const_iterator(this, 0);
+}
+
+template <typename NodeType, typename ValueType>
+typename ChainStore<NodeType, ValueType>::const_iterator ChainStore<NodeType, ValueType>::end() const {
+	return const_iterator(this, steps_);
+}
+
+template <typename NodeType, typename ValueType>
+ChainStore<NodeType, ValueType>::const_iterator::const_iterator() :
+	store_(nullptr), step_(0), decoded_(static_cast<std::size_t>(-1)), position_(0)
+{}
+
+template <typename NodeType, typename ValueType>
+ChainStore<NodeType, ValueType>::const_iterator::const_iterator(const ChainStore* store, std::size_t step) :
+	store_(store), step_(step), decoded_(static_cast<std::size_t>(-1)), position_(0)
+{}
+
+template <typename NodeType, typename ValueType>
+typename ChainStore<NodeType, ValueType>::const_iterator::reference
+ChainStore<NodeType, ValueType>::const_iterator::operator*() const {
+	if (decoded_ == step_)
+		return state_;
+
+	// Replay forward within the block, else start at the step's keyframe
+	std::size_t interval = store_->interval_;
+	if (decoded_ == static_cast<std::size_t>(-1) || decoded_ > step_ ||
+		decoded_ / interval != step_ / interval) {
+		decoded_ = step_ / interval * interval;
+		store_->read_keyframe(step_ / interval, state_, position_);
+	}
+	for (; decoded_ < step_; decoded_++)
+		store_->read_delta(state_, position_);
+	return state_;
+}
+
+template <typename NodeType, typename ValueType>
+typename ChainStore<NodeType, ValueType>::const_iterator::pointer
+ChainStore<NodeType, ValueType>::const_iterator::operator->() const { return &**this; }
+
+template <typename NodeType, typename ValueType>
+typename ChainStore<NodeType, ValueType>::const_iterator::value_type
+ChainStore<NodeType, ValueType>::const_iterator::operator[](difference_type n) const {
+	return store_->state(step_ + n);
+}
+
+template <typename NodeType, typename ValueType>
+typename ChainStore<NodeType, ValueType>::const_iterator&
+ChainStore<NodeType, ValueType>::const_iterator::operator++() {
+	++step_;
+	return *this;
+}
+
+template <typename NodeType, typename ValueType>
+typename ChainStore<NodeType, ValueType>::const_iterator
+ChainStore<NodeType, ValueType>::const_iterator::operator++(int) {
+	const_iterator before(*this);
+	++step_;
+	return before;
+}
+
+template <typename NodeType, typename ValueType>
+typename ChainStore<NodeType, ValueType>::const_iterator&
+ChainStore<NodeType, ValueType>::const_iterator::operator--() {
+	--step_;
+	return *this;
+}
+
+template <typename NodeType, typename ValueType>
+typename ChainStore<NodeType, ValueType>::const_iterator
+ChainStore<NodeType, ValueType>::const_iterator::operator--(int) {
+	const_iterator before(*this);
+	--step_;
+	return before;
+}
+
+template <typename NodeType, typename ValueType>
+typename ChainStore<NodeType, ValueType>::const_iterator&
+ChainStore<NodeType, ValueType>::const_iterator::operator+=(difference_type n) {
+	step_ += n;
+	return *this;
+}
+
+template <typename NodeType, typename ValueType>
+typename ChainStore<NodeType, ValueType>::const_iterator&
+ChainStore<NodeType, ValueType>::const_iterator::operator-=(difference_type n) {
+	step_ -= n;
+	return *this;
+}
+
+template <typename NodeType, typename ValueType>
+typename ChainStore<NodeType, ValueType>::const_iterator
+ChainStore<NodeType, ValueType>::const_iterator::operator+(difference_type n) const {
+	const_iterator moved(*this);
+	return moved += n;
+}
+
+template <typename NodeType, typename ValueType>
+typename ChainStore<NodeType, ValueType>::const_iterator
+ChainStore<NodeType, ValueType>::const_iterator::operator-(difference_type n) const {
+	const_iterator moved(*this);
+	return moved -= n;
+}
+
+template <typename NodeType, typename ValueType>
+typename ChainStore<NodeType, ValueType>::const_iterator::difference_type
+ChainStore<NodeType, ValueType>::const_iterator::operator-(const const_iterator& other) const {
+	return static_cast<difference_type>(step_) - static_cast<difference_type>(other.step_);
+}
+
+template <typename NodeType, typename ValueType>
+bool ChainStore<NodeType, ValueType>::const_iterator::operator==(const const_iterator& other) const {
+	return store_ == other.store_ && step_ == other.step_;
+}
+
+template <typename NodeType, typename ValueType>
+bool ChainStore<NodeType, ValueType>::const_iterator::operator!=(const const_iterator& other) const {
+	return !(*this == other);
+}
+
+template <typename NodeType, typename ValueType>
+bool ChainStore<NodeType, ValueType>::const_iterator::operator<(const const_iterator& other) const {
+	return step_ < other.step_;
+}
+
+template <typename NodeType, typename ValueType>
+bool ChainStore<NodeType, ValueType>::const_iterator::operator>(const const_iterator& other) const {
+	return other < *this;
+}
+
+template <typename NodeType, typename ValueType>
+bool ChainStore<NodeType, ValueType>::const_iterator::operator<=(const const_iterator& other) const {
+	return !(other < *this);
+}
+
+template <typename NodeType, typename ValueType>
+bool ChainStore<NodeType, ValueType>::const_iterator::operator>=(const const_iterator& other) const {
+	return !(*this < other);
+}
+
+#endif
@@ -0,0 +1,1099 @@
+#ifndef COMPILED_NET_H
+#define COMPILED_NET_H
+
+#include "CondProb.h"
+#include "Errors.h"
+#include "FlatArray.h"
+#include "Instrument.h"
+
+#include <vector>
+#include <map>
+#include <set>
+#include <cstddef>
+#include <algorithm>
+
+// Flat, index-dense form of a Bayesian network used by the samplers.
+// Nodes are renumbered 0..N-1 in label order and values 0..k-1 per node
+// in value order. The graph is stored as CSR parent/child arrays and each
+// CPT is one contiguous block of rows addressed by mixed-radix strides
+// over the parent cardinalities. CPTs too wide to store densely fall back
+// to a sparse row index holding only the rows of the original table, plus
+// one shared row for a table's default. Decision-tree CPDs store their
+// leaves as rows and walk the tree to find one, so only the distinct
+// leaves are stored. Noisy-MAX CPDs store no rows at all, only one CDF per
+// parent value, and are evaluated in O(parents * k) on demand.
+// Every row also carries a Walker alias table so that a draw costs one
+// uniform variate and a single comparison whatever the cardinality.
+// All tables are flat arrays, so a compiled network can also be mapped
+// straight from a file written by NetFile.
+class NetFile;
+
+template <
+	typename NodeType = int,
+	typename ValueType = int
+>
+class CompiledNet
+{
+public:
+	// Row index of a parent configuration missing from a sparse CPT
+	static const std::size_t npos = static_cast<std::size_t>(-1);
+
+	// constructors; a CPT row whose key does not name one value per
+	// parent throws CardinalityException
+	CompiledNet();
+	template <typename DistType>
+	CompiledNet(const std::set<NodeType>& nodes,
+		const std::map<NodeType, std::set<NodeType>>& parents,
+		const std::map<NodeType, CondProb<NodeType, ValueType, DistType>>& probabilities);
+
+	// Build from flat tables without going through CondProb: labels in
+	// ascending order, the ascending values of each node, each node's
+	// parents as label indices and its CPT as dense rows over the parents,
+	// last parent fastest, with the node's values fastest within a row
+	CompiledNet(const std::vector<NodeType>& labels,
+		const std::vector<std::vector<ValueType>>& domains,
+		const std::vector<std::vector<unsigned>>& parents,
+		const std::vector<std::vector<double>>& tables);
+
+	// observers
+	unsigned size() const;
+	bool contains(NodeType node_id) const;
+	unsigned index_of(NodeType node_id) const;
+	NodeType label(unsigned node) const;
+	unsigned cardinality(unsigned node) const;
+	ValueType value(unsigned node, unsigned value_index) const;
+	unsigned value_index(unsigned node, ValueType value) const;
+	bool in_domain(unsigned node, ValueType value) const;
+
+	// Cardinality shared by every node, or 0 when they differ
+	unsigned uniform_cardinality() const;
+
+	// adjacency
+	const unsigned* parents_begin(unsigned node) const;
+	const unsigned* parents_end(unsigned node) const;
+	const unsigned* children_begin(unsigned node) const;
+	const unsigned* children_end(unsigned node) const;
+
+	// Stride of the node in each child's CPT, parallel to its children.
+	// Only meaningful for children with a dense CPT.
+	const std::size_t* child_strides_begin(unsigned node) const;
+
+	// Markov blanket: parents, children and the children's other parents
+	const unsigned* blanket_begin(unsigned node) const;
+	const unsigned* blanket_end(unsigned node) const;
+
+	// Nodes ordered so that every parent precedes its children, and the
+	// position of each node in that order
+	const FlatArray<unsigned>& topological_order() const;
+	unsigned rank(unsigned node) const;
+
+	// Whether the node's CPT is stored densely, so that rows follow the
+	// mixed-radix strides
+	bool dense(unsigned node) const;
+
+	// Whether the node's distribution is computed from its parameters
+	// rather than stored as rows, as for noisy-MAX nodes
+	bool computed(unsigned node) const;
+
+	// CPT row selected by the parent values held in a full state; npos
+	// when the table has no such row or the node has no rows at all
+	std::size_t row_index(unsigned node, const std::vector<unsigned>& state) const;
+
+	// CPT row selected by parent values listed in parent order
+	std::size_t row_index_of(unsigned node, const unsigned* parent_values) const;
+
+	// Row of a dense CPT whose parents all take K values, by Horner's
+	// rule with K as a constant radix instead of the stored strides
+	template <unsigned K>
+	std::size_t dense_row(unsigned node, const std::vector<unsigned>& state) const;
+
+	// Probability of a value within a CPT row
+	double probability(unsigned node, std::size_t row, unsigned value_index) const;
+
+	// Draw a value from a CPT row given a uniform variate in [0, 1)
+	unsigned draw(unsigned node, std::size_t row, double u) const;
+
+	// Conditional distribution of a node whatever its storage, given the
+	// parent values held in a full state or listed in parent order. The
+	// distribution is written to k consecutive entries of out.
+	void distribution(unsigned node, const std::vector<unsigned>& state, double* out) const;
+	void distribution_of(unsigned node, const unsigned* parent_values, double* out) const;
+
+	// Probability of one value of a node whatever its storage
+	double conditional(unsigned node, const std::vector<unsigned>& state, unsigned value_index) const;
+	double conditional_of(unsigned node, const unsigned* parent_values, unsigned value_index) const;
+
+	// Draw a value of a node whatever its storage
+	unsigned sample(unsigned node, const std::vector<unsigned>& state, double u) const;
+	unsigned sample_of(unsigned node, const unsigned* parent_values, double u) const;
+
+	// Conditional distribution of a node in model form, keyed by parent
+	// values in ascending label order
+	template <typename DistType>
+	CondProb<NodeType, ValueType, DistType> cpd(unsigned node) const;
+
+	// Raw tables for vectorized samplers. Row r of a node starts at
+	// cpt_offset(node) + r * cardinality(node) in the alias arrays, and
+	// the strides run parallel to the node's parents.
+	std::size_t cpt_offset(unsigned node) const;
+	const std::size_t* strides_begin(unsigned node) const;
+	const double* cutoffs() const;
+	const unsigned* aliases() const;
+
+	// Raw probabilities, laid out as the alias arrays for dense CPTs
+	const double* probabilities() const;
+
+	// Labelled assignment of an index state
+	std::map<NodeType, ValueType> assignment(const std::vector<unsigned>& state) const;
+private:
+	friend class NetFile;
+
+	// Derive the children, topological order and blankets from the parents
+	void link();
+
+	// Derive the child strides and alias tables once probs_ is filled
+	void finish();
+
+	// Largest number of probabilities stored densely for a single CPT
+	static const std::size_t dense_limit = 1 << 22;
+
+	// How a node's distribution is stored
+	enum Storage { SPARSE, DENSE, TREE, NOISY };
+
+	// Tag of a leaf in an encoded decision tree
+	static const unsigned leaf_tag = static_cast<unsigned>(-1);
+
+	// Flatten the parametric forms of a CPD
+	template <typename DistType>
+	void compile_tree(unsigned node, const CondProb<NodeType, ValueType, DistType>& cpd);
+	template <typename DistType>
+	void compile_noisy(unsigned node, const CondProb<NodeType, ValueType, DistType>& cpd);
+
+	// Normalize a distribution into a row of probs_, all zero when it has
+	// no mass
+	template <typename DistType>
+	void write_row(unsigned node, std::size_t row, const DistType& dist);
+
+	// Position of a parent label among the node's parents
+	unsigned parent_position(unsigned node, NodeType parent) const;
+
+	// Cumulative distribution of a normalized distribution over the
+	// node's values, all one when it has no mass
+	template <typename DistType>
+	void write_cdf(unsigned node, const DistType& dist);
+
+	// Value index of a value, or the cardinality when it is not in the domain
+	unsigned find_value(unsigned node, ValueType value) const;
+
+	template <typename ParentValue>
+	std::size_t lookup_row(unsigned node, ParentValue parent_value) const;
+
+	template <typename ParentValue>
+	void distribution_at(unsigned node, ParentValue parent_value, double* out) const;
+	template <typename ParentValue>
+	double conditional_at(unsigned node, ParentValue parent_value, unsigned value_index) const;
+	template <typename ParentValue>
+	unsigned sample_at(unsigned node, ParentValue parent_value, double u) const;
+
+	// P(node <= y) of a noisy-MAX node
+	template <typename ParentValue>
+	double noisy_cdf(unsigned node, ParentValue parent_value, unsigned y) const;
+
+	// Build the alias table of a normalized row of k probabilities. Rows
+	// without mass alias every column to k, which draw() reports.
+	static void build_alias(const double* p, unsigned k, double* cutoff, unsigned* alias);
+
+	// labels in ascending order, so that a node's index is its rank
+	FlatArray<NodeType> labels_;
+
+	// value domains
+	FlatArray<unsigned> value_offset_;
+	FlatArray<ValueType> values_;
+
+	// CSR adjacency
+	FlatArray<unsigned> parent_offset_;
+	FlatArray<unsigned> parents_;
+	FlatArray<unsigned> child_offset_;
+	FlatArray<unsigned> children_;
+	FlatArray<std::size_t> child_strides_;
+	FlatArray<unsigned> blanket_offset_;
+	FlatArray<unsigned> blanket_;
+	FlatArray<unsigned> order_;
+	FlatArray<unsigned> rank_;
+
+	// CPT storage, strides are parallel to parents_
+	FlatArray<std::size_t> strides_;
+	FlatArray<std::size_t> cpt_offset_;
+	FlatArray<char> storage_;
+	std::vector<std::map<std::vector<unsigned>, std::size_t>> sparse_rows_;
+	FlatArray<double> probs_;
+
+	// Row taken by sparse configurations the table does not list, or npos
+	FlatArray<std::size_t> fallback_;
+
+	// Decision trees, one block per node: the position of the root, then
+	// the nodes. A split is the position of its parent among the node's
+	// parents followed by the position of the subtree for each parent
+	// value; a leaf is leaf_tag followed by its row.
+	FlatArray<unsigned> tree_offset_;
+	FlatArray<unsigned> tree_;
+
+	// Noisy-MAX CDFs, one block per node: the leak's CDF, then for each
+	// parent in parent order one CDF per parent value
+	FlatArray<std::size_t> noisy_offset_;
+	FlatArray<double> noisy_cdf_;
+
+	// alias tables, parallel to probs_
+	FlatArray<double> cutoff_;
+	FlatArray<unsigned> alias_;
+};
+
+template <typename NodeType, typename ValueType>
+const std::size_t CompiledNet<NodeType, ValueType>::npos;
+
+template <typename NodeType, typename ValueType>
+const std::size_t CompiledNet<NodeType, ValueType>::dense_limit;
+
+template <typename NodeType, typename ValueType>
+const unsigned CompiledNet<NodeType, ValueType>::leaf_tag;
+
+template <typename NodeType, typename ValueType>
+CompiledNet<NodeType, ValueType>::CompiledNet() :
+	value_offset_(1, 0),
+	parent_offset_(1, 0),
+	child_offset_(1, 0),
+	blanket_offset_(1, 0),
+	tree_offset_(1, 0),
+	noisy_offset_(1, 0)
+{}
+
+template <typename NodeType, typename ValueType>
+template <typename DistType>
+CompiledNet<NodeType, ValueType>::CompiledNet(const std::set<NodeType>& nodes,
+	const std::map<NodeType, std::set<NodeType>>& parents,
+	const std::map<NodeType, CondProb<NodeType, ValueType, DistType>>& probabilities) :
+	value_offset_(1, 0),
+	parent_offset_(1, 0),
+	tree_offset_(1, 0),
+	noisy_offset_(1, 0) {
+	labels_.append(nodes.begin(), nodes.end());
+	unsigned n = labels_.size();
+
+	// Value domains are the union of the values the CPD can give
+	for (NodeType node : labels_) {
+		std::set<ValueType> domain;
+		auto it = probabilities.find(node);
+		if (it != probabilities.end())
+			domain = it->second.domain();
+		values_.append(domain.begin(), domain.end());
+		value_offset_.push_back(values_.size());
+	}
+
+	// Parents in CSR form, ordered as the CPT keys
+	for (NodeType node : labels_) {
+		auto it = parents.find(node);
+		if (it != parents.end())
+			for (NodeType parent : it->second)
+				parents_.push_back(index_of(parent));
+		parent_offset_.push_back(parents_.size());
+	}
+	link();
+
+	// Flatten each CPT into rows of normalized probabilities
+	strides_.resize(parents_.size());
+	storage_.resize(n);
+	fallback_.assign(n, npos);
+	sparse_rows_.resize(n);
+	for (unsigned i = 0; i < n; i++) {
+		unsigned k = cardinality(i);
+		auto it = probabilities.find(labels_[i]);
+		CpdKind kind = it == probabilities.end() ? CpdKind::TABLE : it->second.kind();
+		cpt_offset_.push_back(probs_.size());
+		if (kind == CpdKind::TREE)
+			compile_tree(i, it->second);
+		else if (kind == CpdKind::NOISY_MAX)
+			compile_noisy(i, it->second);
+		tree_offset_.push_back(tree_.size());
+		noisy_offset_.push_back(noisy_cdf_.size());
+		if (kind != CpdKind::TABLE)
+			continue;
+
+		std::size_t rows = 1;
+		bool dense = true;
+		for (unsigned e = parent_offset_[i + 1]; e-- > parent_offset_[i]; ) {
+			std::size_t c = cardinality(parents_[e]);
+			strides_[e] = rows;
+			if (c > 1 && rows > dense_limit / c) {
+				dense = false;
+				break;
+			}
+			rows *= c;
+		}
+		dense = dense && rows * k <= dense_limit;
+		storage_[i] = dense ? DENSE : SPARSE;
+		if (dense)
+			probs_.resize(probs_.size() + rows * k, 0.0);
+
+		if (it == probabilities.end())
+			continue;
+
+		// A dense table spells the default out in every row the table
+		// does not overwrite below
+		if (dense && it->second.has_default())
+			for (std::size_t r = 0; r < rows; r++)
+				write_row(i, r, it->second.default_row());
+		std::size_t next_row = 0;
+		for (const auto& row : it->second.table()) {
+			if (row.first.size() != parent_offset_[i + 1] - parent_offset_[i])
+				throw CardinalityException();
+
+			// Rows naming values outside a parent's domain are unreachable
+			std::vector<unsigned> key;
+			for (unsigned j = 0; j < row.first.size(); j++) {
+				unsigned parent = parents_[parent_offset_[i] + j];
+				unsigned v = find_value(parent, row.first[j]);
+				if (v == cardinality(parent))
+					break;
+				key.push_back(v);
+			}
+			if (key.size() != row.first.size())
+				continue;
+
+			std::size_t r;
+			if (dense) {
+				r = 0;
+				for (unsigned j = 0; j < key.size(); j++)
+					r += key[j] * strides_[parent_offset_[i] + j];
+			} else {
+				r = next_row++;
+				sparse_rows_[i][key] = r;
+				probs_.resize(probs_.size() + k, 0.0);
+			}
+			write_row(i, r, row.second);
+		}
+
+		// A sparse table keeps the default as one row after the others
+		if (!dense && it->second.has_default()) {
+			fallback_[i] = next_row;
+			probs_.resize(probs_.size() + k, 0.0);
+			write_row(i, next_row, it->second.default_row());
+		}
+	}
+	finish();
+}
+
+template <typename NodeType, typename ValueType>
+template <typename DistType>
+void CompiledNet<NodeType, ValueType>::write_row(unsigned node, std::size_t row,
+	const DistType& dist) {
+	unsigned k = cardinality(node);
+	double* p = &probs_[cpt_offset_[node] + row * k];
+	std::fill(p, p + k, 0.0);
+	double sum = 0;
+	for (const auto& entry : dist)
+		sum += entry.second;
+	if (sum <= 0)
+		return;
+	for (const auto& entry : dist)
+		p[find_value(node, entry.first)] = entry.second / sum;
+}
+
+template <typename NodeType, typename ValueType>
+unsigned CompiledNet<NodeType, ValueType>::parent_position(unsigned node, NodeType parent) const {
+	for (unsigned e = parent_offset_[node]; e < parent_offset_[node + 1]; e++)
+		if (!(labels_[parents_[e]] < parent) && !(parent < labels_[parents_[e]]))
+			return e - parent_offset_[node];
+	throw MissingNodeException();
+}
+
+template <typename NodeType, typename ValueType>
+template <typename DistType>
+void CompiledNet<NodeType, ValueType>::compile_tree(unsigned node,
+	const CondProb<NodeType, ValueType, DistType>& cpd) {
+	storage_[node] = TREE;
+	unsigned k = cardinality(node);
+	const auto& nodes = cpd.decision_tree().nodes();
+
+	// Subtrees are added before the splits that use them, so every
+	// branch target is already placed when its split is encoded
+	std::vector<unsigned> position(nodes.size());
+	std::size_t begin = tree_.size();
+	tree_.push_back(0);
+	std::size_t rows = 0;
+	for (unsigned t = 0; t < nodes.size(); t++) {
+		position[t] = tree_.size() - begin;
+		if (nodes[t].leaf) {
+			tree_.push_back(leaf_tag);
+			tree_.push_back(rows);
+			probs_.resize(probs_.size() + k, 0.0);
+			write_row(node, rows++, nodes[t].dist);
+			continue;
+		}
+		unsigned j = parent_position(node, nodes[t].parent);
+		unsigned parent = parents_[parent_offset_[node] + j];
+		tree_.push_back(j);
+		for (unsigned v = 0; v < cardinality(parent); v++) {
+			auto branch = nodes[t].branches.find(value(parent, v));
+			tree_.push_back(position[branch == nodes[t].branches.end() ? nodes[t].otherwise : branch->second]);
+		}
+	}
+	tree_[begin] = position[cpd.decision_tree().root()];
+}
+
+template <typename NodeType, typename ValueType>
+template <typename DistType>
+void CompiledNet<NodeType, ValueType>::write_cdf(unsigned node, const DistType& dist) {
+	unsigned k = cardinality(node);
+	std::vector<double> p(k, 0.0);
+	double sum = 0;
+	for (const auto& entry : dist) {
+		p[find_value(node, entry.first)] += entry.second;
+		sum += entry.second;
+	}
+	double below = 0;
+	for (unsigned y = 0; y < k; y++) {
+		below += p[y];
+		noisy_cdf_.push_back(sum > 0 && y + 1 < k ? below / sum : 1.0);
+	}
+}
+
+template <typename NodeType, typename ValueType>
+template <typename DistType>
+void CompiledNet<NodeType, ValueType>::compile_noisy(unsigned node,
+	const CondProb<NodeType, ValueType, DistType>& cpd) {
+	storage_[node] = NOISY;
+	for (const auto& effect : cpd.effects())
+		parent_position(node, effect.first);
+
+	// Parent values that cause nothing leave the lowest value certain,
+	// a CDF of all ones
+	write_cdf(node, cpd.leak());
+	for (unsigned e = parent_offset_[node]; e < parent_offset_[node + 1]; e++) {
+		unsigned parent = parents_[e];
+		auto effect = cpd.effects().find(labels_[parent]);
+		for (unsigned x = 0; x < cardinality(parent); x++) {
+			if (effect == cpd.effects().end() || !effect->second.count(value(parent, x)))
+				write_cdf(node, DistType());
+			else
+				write_cdf(node, effect->second.find(value(parent, x))->second);
+		}
+	}
+}
+
+template <typename NodeType, typename ValueType>
+CompiledNet<NodeType, ValueType>::CompiledNet(const std::vector<NodeType>& labels,
+	const std::vector<std::vector<ValueType>>& domains,
+	const std::vector<std::vector<unsigned>>& parents,
+	const std::vector<std::vector<double>>& tables) :
+	value_offset_(1, 0),
+	parent_offset_(1, 0) {
+	labels_.append(labels.begin(), labels.end());
+	unsigned n = labels_.size();
+	for (unsigned i = 0; i < n; i++) {
+		values_.append(domains[i].begin(), domains[i].end());
+		value_offset_.push_back(values_.size());
+		for (unsigned parent : parents[i]) {
+			if (parent >= n)
+				throw MissingNodeException();
+			parents_.push_back(parent);
+		}
+		parent_offset_.push_back(parents_.size());
+	}
+	link();
+
+	strides_.resize(parents_.size());
+	storage_.assign(n, DENSE);
+	fallback_.assign(n, npos);
+	tree_offset_.assign(n + 1, 0);
+	noisy_offset_.assign(n + 1, 0);
+	sparse_rows_.resize(n);
+	for (unsigned i = 0; i < n; i++) {
+		unsigned k = cardinality(i);
+		std::size_t rows = 1;
+		for (unsigned e = parent_offset_[i + 1]; e-- > parent_offset_[i]; ) {
+			strides_[e] = rows;
+			rows *= cardinality(parents_[e]);
+		}
+		cpt_offset_.push_back(probs_.size());
+		probs_.resize(probs_.size() + rows * k, 0.0);
+		double* p = &probs_[cpt_offset_[i]];
+		for (std::size_t r = 0; r < rows && (r + 1) * k <= tables[i].size(); r++) {
+			double sum = 0;
+			for (unsigned v = 0; v < k; v++)
+				sum += tables[i][r * k + v];
+			if (sum > 0)
+				for (unsigned v = 0; v < k; v++)
+					p[r * k + v] = tables[i][r * k + v] / sum;
+		}
+	}
+	finish();
+}
+
+template <typename NodeType, typename ValueType>
+void CompiledNet<NodeType, ValueType>::link() {
+	unsigned n = labels_.size();
+
+	// Children in CSR form
+	child_offset_.assign(n + 1, 0);
+	for (unsigned parent : parents_)
+		++child_offset_[parent + 1];
+	for (unsigned i = 0; i < n; i++)
+		child_offset_[i + 1] += child_offset_[i];
+	children_.resize(parents_.size());
+	std::vector<unsigned> fill(child_offset_.begin(), child_offset_.end() - 1);
+	for (unsigned i = 0; i < n; i++)
+		for (unsigned e = parent_offset_[i]; e < parent_offset_[i + 1]; e++)
+			children_[fill[parents_[e]]++] = i;
+
+	// Topological order by Kahn's algorithm
+	std::vector<unsigned> pending(n);
+	for (unsigned i = 0; i < n; i++) {
+		pending[i] = parent_offset_[i + 1] - parent_offset_[i];
+		if (pending[i] == 0)
+			order_.push_back(i);
+	}
+	for (unsigned j = 0; j < order_.size(); j++)
+		for (unsigned e = child_offset_[order_[j]]; e < child_offset_[order_[j] + 1]; e++)
+			if (--pending[children_[e]] == 0)
+				order_.push_back(children_[e]);
+	if (order_.size() != n)
+		throw CycleException();
+	rank_.resize(n);
+	for (unsigned j = 0; j < n; j++)
+		rank_[order_[j]] = j;
+
+	// Markov blankets in CSR form
+	std::vector<char> mark(n, 0);
+	blanket_offset_.push_back(0);
+	for (unsigned i = 0; i < n; i++) {
+		unsigned begin = blanket_.size();
+		mark[i] = 1;
+		auto add = [&](unsigned other) {
+			if (!mark[other]) {
+				mark[other] = 1;
+				blanket_.push_back(other);
+			}
+		};
+		for (unsigned e = parent_offset_[i]; e < parent_offset_[i + 1]; e++)
+			add(parents_[e]);
+		for (unsigned e = child_offset_[i]; e < child_offset_[i + 1]; e++) {
+			add(children_[e]);
+			unsigned child = children_[e];
+			for (unsigned f = parent_offset_[child]; f < parent_offset_[child + 1]; f++)
+				add(parents_[f]);
+		}
+		mark[i] = 0;
+		for (unsigned j = begin; j < blanket_.size(); j++)
+			mark[blanket_[j]] = 0;
+		std::sort(blanket_.begin() + begin, blanket_.end());
+		blanket_offset_.push_back(blanket_.size());
+	}
+}
+
+template <typename NodeType, typename ValueType>
+void CompiledNet<NodeType, ValueType>::finish() {
+	unsigned n = labels_.size();
+
+	// Strides of each node in its children's CPTs
+	child_strides_.resize(children_.size());
+	std::vector<unsigned> fill(child_offset_.begin(), child_offset_.end() - 1);
+	for (unsigned i = 0; i < n; i++)
+		for (unsigned e = parent_offset_[i]; e < parent_offset_[i + 1]; e++)
+			child_strides_[fill[parents_[e]]++] = strides_[e];
+
+	cutoff_.resize(probs_.size());
+	alias_.resize(probs_.size());
+	for (unsigned i = 0; i < n; i++) {
+		unsigned k = cardinality(i);
+		std::size_t end = i + 1 < n ? cpt_offset_[i + 1] : probs_.size();
+		for (std::size_t r = cpt_offset_[i]; k > 0 && r < end; r += k)
+			build_alias(&probs_[r], k, &cutoff_[r], &alias_[r]);
+	}
+}
+
+template <typename NodeType, typename ValueType>
+unsigned CompiledNet<NodeType, ValueType>::size() const { return labels_.size(); }
+
+template <typename NodeType, typename ValueType>
+bool CompiledNet<NodeType, ValueType>::contains(NodeType node_id) const {
+	const NodeType* it = std::lower_bound(labels_.begin(), labels_.end(), node_id);
+	return it != labels_.end() && !(node_id < *it);
+}
+
+template <typename NodeType, typename ValueType>
+unsigned CompiledNet<NodeType, ValueType>::index_of(NodeType node_id) const {
+	const NodeType* it = std::lower_bound(labels_.begin(), labels_.end(), node_id);
+	if (it == labels_.end() || node_id < *it)
+		throw MissingNodeException();
+	return it - labels_.begin();
+}
+
+template <typename NodeType, typename ValueType>
+NodeType CompiledNet<NodeType, ValueType>::label(unsigned node) const { return labels_[node]; }
+
+template <typename NodeType, typename ValueType>
+unsigned CompiledNet<NodeType, ValueType>::cardinality(unsigned node) const {
+	return value_offset_[node + 1] - value_offset_[node];
+}
+
+template <typename NodeType, typename ValueType>
+ValueType CompiledNet<NodeType, ValueType>::value(unsigned node, unsigned value_index) const {
+	return values_[value_offset_[node] + value_index];
+}
+
+template <typename NodeType, typename ValueType>
+unsigned CompiledNet<NodeType, ValueType>::value_index(unsigned node, ValueType value) const {
+	unsigned v = find_value(node, value);
+	if (v == cardinality(node))
+		throw UnknownValueException();
+	return v;
+}
+
+template <typename NodeType, typename ValueType>
+bool CompiledNet<NodeType, ValueType>::in_domain(unsigned node, ValueType value) const {
+	return find_value(node, value) < cardinality(node);
+}
+
+template <typename NodeType, typename ValueType>
+unsigned CompiledNet<NodeType, ValueType>::uniform_cardinality() const {
+	unsigned n = size();
+	for (unsigned i = 1; i < n; i++)
+		if (cardinality(i) != cardinality(0))
+			return 0;
+	return n ? cardinality(0) : 0;
+}
+
+template <typename NodeType, typename ValueType>
+unsigned CompiledNet<NodeType, ValueType>::find_value(unsigned node, ValueType value) const {
+	auto begin = values_.begin() + value_offset_[node];
+	auto end = values_.begin() + value_offset_[node + 1];
+	auto it = std::lower_bound(begin, end, value);
+	if (it == end || value < *it)
+		return cardinality(node);
+	return it - begin;
+}
+
+template <typename NodeType, typename ValueType>
+const unsigned* CompiledNet<NodeType, ValueType>::parents_begin(unsigned node) const {
+	return parents_.data() + parent_offset_[node];
+}
+
+template <typename NodeType, typename ValueType>
+const unsigned* CompiledNet<NodeType, ValueType>::parents_end(unsigned node) const {
+	return parents_.data() + parent_offset_[node + 1];
+}
+
+template <typename NodeType, typename ValueType>
+const unsigned* CompiledNet<NodeType, ValueType>::children_begin(unsigned node) const {
+	return children_.data() + child_offset_[node];
+}
+
+template <typename NodeType, typename ValueType>
+const unsigned* CompiledNet<NodeType, ValueType>::children_end(unsigned node) const {
+	return children_.data() + child_offset_[node + 1];
+}
+
+template <typename NodeType, typename ValueType>
+const std::size_t* CompiledNet<NodeType, ValueType>::child_strides_begin(unsigned node) const {
+	return child_strides_.data() + child_offset_[node];
+}
+
+template <typename NodeType, typename ValueType>
+const unsigned* CompiledNet<NodeType, ValueType>::blanket_begin(unsigned node) const {
+	return blanket_.data() + blanket_offset_[node];
+}
+
+template <typename NodeType, typename ValueType>
+const unsigned* CompiledNet<NodeType, ValueType>::blanket_end(unsigned node) const {
+	return blanket_.data() + blanket_offset_[node + 1];
+}
+
+template <typename NodeType, typename ValueType>
+bool CompiledNet<NodeType, ValueType>::dense(unsigned node) const { return storage_[node] == DENSE; }
+
+template <typename NodeType, typename ValueType>
+bool CompiledNet<NodeType, ValueType>::computed(unsigned node) const { return storage_[node] == NOISY; }
+
+template <typename NodeType, typename ValueType>
+const FlatArray<unsigned>& CompiledNet<NodeType, ValueType>::topological_order() const {
+	return order_;
+}
+
+template <typename NodeType, typename ValueType>
+unsigned CompiledNet<NodeType, ValueType>::rank(unsigned node) const { return rank_[node]; }
+
+template <typename NodeType, typename ValueType>
+template <typename ParentValue>
+std::size_t CompiledNet<NodeType, ValueType>::lookup_row(unsigned node,
+	ParentValue parent_value) const {
+	BN_COUNT(ROW_LOOKUPS);
+	unsigned begin = parent_offset_[node];
+	unsigned end = parent_offset_[node + 1];
+	switch (storage_[node]) {
+	case DENSE: {
+		std::size_t r = 0;
+		for (unsigned e = begin; e < end; e++)
+			r += parent_value(e) * strides_[e];
+		return r;
+	}
+	case TREE: {
+		const unsigned* block = tree_.data() + tree_offset_[node];
+		unsigned at = block[0];
+		while (block[at] != leaf_tag)
+			at = block[at + 1 + parent_value(begin + block[at])];
+		return block[at + 1];
+	}
+	case NOISY:
+		return npos;
+	}
+
+	// The key is built in a buffer each thread keeps, so a lookup does
+	// not allocate once the buffer has grown to the widest sparse table
+	static thread_local std::vector<unsigned> key;
+	key.clear();
+	for (unsigned e = begin; e < end; e++)
+		key.push_back(parent_value(e));
+	auto it = sparse_rows_[node].find(key);
+	return it == sparse_rows_[node].end() ? fallback_[node] : it->second;
+}
+
+template <typename NodeType, typename ValueType>
+template <typename ParentValue>
+double CompiledNet<NodeType, ValueType>::noisy_cdf(unsigned node,
+	ParentValue parent_value, unsigned y) const {
+	unsigned k = cardinality(node);
+	const double* cdf = noisy_cdf_.data() + noisy_offset_[node];
+	double below = cdf[y];
+	cdf += k;
+	for (unsigned e = parent_offset_[node]; e < parent_offset_[node + 1] && below > 0; e++) {
+		below *= cdf[parent_value(e) * k + y];
+		cdf += cardinality(parents_[e]) * k;
+	}
+	return below;
+}
+
+template <typename NodeType, typename ValueType>
+template <typename ParentValue>
+void CompiledNet<NodeType, ValueType>::distribution_at(unsigned node,
+	ParentValue parent_value, double* out) const {
+	unsigned k = cardinality(node);
+	if (storage_[node] != NOISY) {
+		std::size_t row = lookup_row(node, parent_value);
+		for (unsigned v = 0; v < k; v++)
+			out[v] = probability(node, row, v);
+		return;
+	}
+
+	// The child's CDF is the product of the active causes' CDFs
+	const double* cdf = noisy_cdf_.data() + noisy_offset_[node];
+	std::copy(cdf, cdf + k, out);
+	cdf += k;
+	for (unsigned e = parent_offset_[node]; e < parent_offset_[node + 1]; e++) {
+		const double* active = cdf + parent_value(e) * k;
+		for (unsigned y = 0; y < k; y++)
+			out[y] *= active[y];
+		cdf += cardinality(parents_[e]) * k;
+	}
+	for (unsigned y = k; y-- > 1; )
+		out[y] -= out[y - 1];
+}
+
+template <typename NodeType, typename ValueType>
+template <typename ParentValue>
+double CompiledNet<NodeType, ValueType>::conditional_at(unsigned node,
+	ParentValue parent_value, unsigned value_index) const {
+	if (storage_[node] != NOISY)
+		return probability(node, lookup_row(node, parent_value), value_index);
+	double cdf = noisy_cdf(node, parent_value, value_index);
+	return value_index > 0 ? cdf - noisy_cdf(node, parent_value, value_index - 1) : cdf;
+}
+
+template <typename NodeType, typename ValueType>
+template <typename ParentValue>
+unsigned CompiledNet<NodeType, ValueType>::sample_at(unsigned node,
+	ParentValue parent_value, double u) const {
+	if (storage_[node] != NOISY)
+		return draw(node, lookup_row(node, parent_value), u);
+
+	// Invert the CDF from the bottom, which for noisy-OR is a single
+	// product over the parents
+	BN_COUNT(DRAWS);
+	unsigned k = cardinality(node);
+	for (unsigned y = 0; y + 1 < k; y++)
+		if (u < noisy_cdf(node, parent_value, y))
+			return y;
+	if (k == 0)
+		throw SampleError();
+	return k - 1;
+}
+
+template <typename NodeType, typename ValueType>
+std::size_t CompiledNet<NodeType, ValueType>::row_index(unsigned node,
+	const std::vector<unsigned>& state) const {
+	const unsigned* parents = parents_.data();
+	return lookup_row(node, [&state, parents](unsigned e) { return state[parents[e]]; });
+}
+
+template <typename NodeType, typename ValueType>
+std::size_t CompiledNet<NodeType, ValueType>::row_index_of(unsigned node,
+	const unsigned* parent_values) const {
+	unsigned begin = parent_offset_[node];
+	return lookup_row(node, [parent_values, begin](unsigned e) { return parent_values[e - begin]; });
+}
+
+template <typename NodeType, typename ValueType>
+template <unsigned K>
+std::size_t CompiledNet<NodeType, ValueType>::dense_row(unsigned node,
+	const std::vector<unsigned>& state) const {
+	BN_COUNT(ROW_LOOKUPS);
+	std::size_t r = 0;
+	for (const unsigned* p = parents_begin(node); p != parents_end(node); ++p)
+		r = r * K + state[*p];
+	return r;
+}
+
+template <typename NodeType, typename ValueType>
+void CompiledNet<NodeType, ValueType>::distribution(unsigned node,
+	const std::vector<unsigned>& state, double* out) const {
+	const unsigned* parents = parents_.data();
+	distribution_at(node, [&state, parents](unsigned e) { return state[parents[e]]; }, out);
+}
+
+template <typename NodeType, typename ValueType>
+void CompiledNet<NodeType, ValueType>::distribution_of(unsigned node,
+	const unsigned* parent_values, double* out) const {
+	unsigned begin = parent_offset_[node];
+	distribution_at(node, [parent_values, begin](unsigned e) { return parent_values[e - begin]; }, out);
+}
+
+template <typename NodeType, typename ValueType>
+double CompiledNet<NodeType, ValueType>::conditional(unsigned node,
+	const std::vector<unsigned>& state, unsigned value_index) const {
+	const unsigned* parents = parents_.data();
+	return conditional_at(node, [&state, parents](unsigned e) { return state[parents[e]]; }, value_index);
+}
+
+template <typename NodeType, typename ValueType>
+double CompiledNet<NodeType, ValueType>::conditional_of(unsigned node,
+	const unsigned* parent_values, unsigned value_index) const {
+	unsigned begin = parent_offset_[node];
+	return conditional_at(node, [parent_values, begin](unsigned e) { return parent_values[e - begin]; },
+		value_index);
+}
+
+template <typename NodeType, typename ValueType>
+unsigned CompiledNet<NodeType, ValueType>::sample(unsigned node,
+	const std::vector<unsigned>& state, double u) const {
+	const unsigned* parents = parents_.data();
+	return sample_at(node, [&state, parents](unsigned e) { return state[parents[e]]; }, u);
+}
+
+template <typename NodeType, typename ValueType>
+unsigned CompiledNet<NodeType, ValueType>::sample_of(unsigned node,
+	const unsigned* parent_values, double u) const {
+	unsigned begin = parent_offset_[node];
+	return sample_at(node, [parent_values, begin](unsigned e) { return parent_values[e - begin]; }, u);
+}
+
+template <typename NodeType, typename ValueType>
+double CompiledNet<NodeType, ValueType>::probability(unsigned node,
+	std::size_t row, unsigned value_index) const {
+	if (row == npos)
+		return 0;
+	return probs_[cpt_offset_[node] + row * cardinality(node) + value_index];
+}
+
+template <typename NodeType, typename ValueType>
+unsigned CompiledNet<NodeType, ValueType>::draw(unsigned node,
+	std::size_t row, double u) const {
+	if (row == npos)
+		throw SampleError();
+	BN_COUNT(DRAWS);
+	unsigned k = cardinality(node);
+	std::size_t offset = cpt_offset_[node] + row * k;
+
+	// The integer part of u * k picks a column, the fraction decides
+	// between the column and its alias
+	double x = u * k;
+	unsigned column = static_cast<unsigned>(x);
+	if (column >= k)
+		column = k - 1;
+	unsigned value = x - column < cutoff_[offset + column] ? column : alias_[offset + column];
+	if (value >= k)
+		throw SampleError();
+	return value;
+}
+
+template <typename NodeType, typename ValueType>
+std::size_t CompiledNet<NodeType, ValueType>::cpt_offset(unsigned node) const { return cpt_offset_[node]; }
+
+template <typename NodeType, typename ValueType>
+const std::size_t* CompiledNet<NodeType, ValueType>::strides_begin(unsigned node) const {
+	return strides_.data() + parent_offset_[node];
+}
+
+template <typename NodeType, typename ValueType>
+const double* CompiledNet<NodeType, ValueType>::cutoffs() const { return cutoff_.data(); }
+
+template <typename NodeType, typename ValueType>
+const unsigned* CompiledNet<NodeType, ValueType>::aliases() const { return alias_.data(); }
+
+template <typename NodeType, typename ValueType>
+const double* CompiledNet<NodeType, ValueType>::probabilities() const { return probs_.data(); }
+
+template <typename NodeType, typename ValueType>
+template <typename DistType>
+CondProb<NodeType, ValueType, DistType> CompiledNet<NodeType, ValueType>::cpd(unsigned node) const {
+	typedef CondProb<NodeType, ValueType, DistType> cpd_type;
+	unsigned k = cardinality(node);
+	unsigned begin = parent_offset_[node];
+	unsigned width = parent_offset_[node + 1] - begin;
+	auto row_dist = [this, node, k](std::size_t row) {
+		DistType dist;
+		for (unsigned v = 0; v < k; v++)
+			dist[value(node, v)] = probability(node, row, v);
+		return dist;
+	};
+
+	if (storage_[node] == TREE) {
+		// Blocks list subtrees before the splits over them, as CpdTree does
+		CpdTree<NodeType, ValueType, DistType> tree;
+		const unsigned* block = tree_.data() + tree_offset_[node];
+		std::map<unsigned, unsigned> index;
+		for (unsigned at = 1; at < tree_offset_[node + 1] - tree_offset_[node]; ) {
+			if (block[at] == leaf_tag) {
+				index[at] = tree.leaf(row_dist(block[at + 1]));
+				at += 2;
+				continue;
+			}
+			unsigned parent = parents_[begin + block[at]];
+			std::map<ValueType, unsigned> branches;
+			for (unsigned v = 0; v < cardinality(parent); v++)
+				branches[value(parent, v)] = index[block[at + 1 + v]];
+			index[at] = tree.split(labels_[parent], branches, branches.begin()->second);
+			at += 1 + cardinality(parent);
+		}
+		return cpd_type::tree(tree);
+	}
+
+	if (storage_[node] == NOISY) {
+		// Effects are the differences of their CDFs; a CDF of all ones
+		// causes nothing and is left out
+		const double* cdf = noisy_cdf_.data() + noisy_offset_[node];
+		auto cdf_dist = [this, node, k](const double* c) {
+			DistType dist;
+			for (unsigned y = 0; y < k; y++)
+				dist[value(node, y)] = c[y] - (y > 0 ? c[y - 1] : 0);
+			return dist;
+		};
+		DistType leak = cdf_dist(cdf);
+		cdf += k;
+		std::map<NodeType, std::map<ValueType, DistType>> effects;
+		for (unsigned e = begin; e < parent_offset_[node + 1]; e++) {
+			unsigned parent = parents_[e];
+			for (unsigned x = 0; x < cardinality(parent); x++, cdf += k)
+				if (std::find_if(cdf, cdf + k, [](double c) { return c < 1; }) != cdf + k)
+					effects[labels_[parent]][value(parent, x)] = cdf_dist(cdf);
+		}
+		return cpd_type::noisy_max(effects, leak);
+	}
+
+	// Table keys list parent values by ascending label, which need not be
+	// the compiled parent order
+	std::vector<unsigned> by_label(width);
+	for (unsigned j = 0; j < width; j++)
+		by_label[j] = j;
+	std::sort(by_label.begin(), by_label.end(), [this, begin](unsigned a, unsigned b) {
+		return parents_[begin + a] < parents_[begin + b];
+	});
+	auto key_of = [this, begin, &by_label](const std::vector<unsigned>& values) {
+		std::vector<ValueType> key;
+		for (unsigned j : by_label)
+			key.push_back(value(parents_[begin + j], values[j]));
+		return key;
+	};
+
+	// Rows without mass were never given and are left out
+	std::map<std::vector<ValueType>, DistType> table;
+	auto add = [&](const std::vector<unsigned>& values, std::size_t row) {
+		double mass = 0;
+		for (unsigned v = 0; v < k; v++)
+			mass += probability(node, row, v);
+		if (mass > 0)
+			table[key_of(values)] = row_dist(row);
+	};
+	if (storage_[node] == SPARSE) {
+		for (const auto& row : sparse_rows_[node])
+			add(row.first, row.second);
+		if (fallback_[node] != npos)
+			return cpd_type(table, row_dist(fallback_[node]));
+		return cpd_type(table);
+	}
+
+	std::vector<unsigned> values(width, 0);
+	for (bool more = true; more; ) {
+		add(values, row_index_of(node, values.data()));
+		more = false;
+		for (unsigned j = width; j-- > 0; ) {
+			if (++values[j] < cardinality(parents_[begin + j])) {
+				more = true;
+				break;
+			}
+			values[j] = 0;
+		}
+	}
+	return cpd_type(table);
+}
+
+template <typename NodeType, typename ValueType>
+void CompiledNet<NodeType, ValueType>::build_alias(const double* p, unsigned k,
+	double* cutoff, unsigned* alias) {
+	std::vector<double> scaled(p, p + k);
+	std::vector<unsigned> small, large;
+	double sum = 0;
+	for (unsigned j = 0; j < k; j++) {
+		sum += p[j];
+		scaled[j] *= k;
+		(scaled[j] < 1 ? small : large).push_back(j);
+	}
+	if (sum <= 0) {
+		std::fill(cutoff, cutoff + k, 0.0);
+		std::fill(alias, alias + k, k);
+		return;
+	}
+
+	while (!small.empty() && !large.empty()) {
+		unsigned s = small.back(), l = large.back();
+		small.pop_back();
+		cutoff[s] = scaled[s];
+		alias[s] = l;
+		scaled[l] -= 1 - scaled[s];
+		if (scaled[l] < 1) {
+			large.pop_back();
+			small.push_back(l);
+		}
+	}
+
+	// Whatever remains holds a full column up to rounding
+	for (unsigned j : large) {
+		cutoff[j] = 1;
+		alias[j] = j;
+	}
+	for (unsigned j : small) {
+		cutoff[j] = 1;
+		alias[j] = j;
+	}
+}
+
+template <typename NodeType, typename ValueType>
+std::map<NodeType, ValueType> CompiledNet<NodeType, ValueType>::assignment(
+	const std::vector<unsigned>& state) const {
+	// One map node per entry, the cost of handing a state out by label
+	BN_COUNT_N(ALLOCATIONS, state.size());
+	std::map<NodeType, ValueType> values;
+	for (unsigned i = 0; i < state.size(); i++)
+		values.insert(values.end(), std::make_pair(labels_[i], value(i, state[i])));
+	return values;
+}
+
+#endif
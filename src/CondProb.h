@@ -1,9 +1,54 @@
 #ifndef COND_PROB_H
 #define COND_PROB_H
 
+#include "Errors.h"
+
 #include <vector>
 #include <set>
 #include <map>
+#include <algorithm>
+
+// Forms a conditional distribution can take. TABLE lists rows by parent
+// values, optionally with a default row for every configuration it does
+// not list; the other forms are parametric and never list rows at all.
+enum class CpdKind { TABLE, NOISY_MAX, TREE };
+
+// Context-specific CPD as a decision tree. Internal nodes test one parent
+// and branch on its value, with a branch for any value not listed; leaves
+// hold distributions. Nodes are added bottom-up and refer to each other
+// by the indices returned when they were added, so subtrees can be
+// shared. The node added last is the root.
+template <
+	typename NodeType = int,
+	typename ValueType = int,
+	typename DistType = std::map<ValueType, double>
+>
+class CpdTree
+{
+public:
+	struct Node {
+		bool leaf;
+		NodeType parent;
+		std::map<ValueType, unsigned> branches;
+		unsigned otherwise;
+		DistType dist;
+	};
+
+	unsigned leaf(const DistType& dist);
+	unsigned split(NodeType parent,
+		const std::map<ValueType, unsigned>& branches,
+		unsigned otherwise);
+
+	bool empty() const;
+	unsigned root() const;
+	const std::vector<Node>& nodes() const;
+
+	// Distribution at the leaf reached by a lookup of parent values
+	template <typename Lookup>
+	const DistType& find(Lookup parent_value) const;
+private:
+	std::vector<Node> nodes_;
+};
 
 template <
 	typename NodeType = int,
@@ -16,46 +61,301 @@ public:
 	// constructors
 	CondProb();
 	CondProb(const std::map<std::vector<ValueType>, DistType>& table);
-	CondProb(const std::set<NodeType>& scope, 
+	CondProb(const std::set<NodeType>& scope,
 		const std::map<std::vector<ValueType>, DistType>& table);
 
+	// Table whose unlisted parent configurations take a default row
+	CondProb(const std::map<std::vector<ValueType>, DistType>& table,
+		const DistType& default_row);
+
+	// Noisy-MAX over the child's values in ascending order. Each parent
+	// holding one of its listed values causes an effect drawn from the
+	// given distribution; any other value causes the lowest child value.
+	// The leak is the effect of every cause left out, and the child takes
+	// the largest effect.
+	static CondProb noisy_max(const std::map<NodeType, std::map<ValueType, DistType>>& effects,
+		const DistType& leak);
+
+	// Noisy-OR over a child taking the values off and on: a parent holding
+	// on turns the child on with its link probability, and the leak turns
+	// it on regardless
+	static CondProb noisy_or(const std::map<NodeType, double>& links,
+		double leak,
+		ValueType off = ValueType(0),
+		ValueType on = ValueType(1));
+
+	static CondProb tree(const CpdTree<NodeType, ValueType, DistType>& tree);
+
 	// observers
+
+	// Distribution for the values of the parents in scope(), in its
+	// ascending label order. A table without a scope is keyed by the
+	// values of every parent in that order, as its rows are. The
+	// parametric forms name their own parents, so a tree splitting on some
+	// of a node's parents takes those values alone, and any other number
+	// of values throws SampleError. A table row that is not listed gives
+	// the default row, or an empty distribution.
 	const DistType get_distribution(
-		const std::vector<ValueType>& parentvalues);
+		const std::vector<ValueType>& parentvalues) const;
+
+	CpdKind kind() const;
+
+	// Parents the distribution is declared over, if any
+	const std::set<NodeType>& scope() const;
+
+	// Every value the child can take under this distribution
+	std::set<ValueType> domain() const;
 
 	// size of the conditional probability table
 	unsigned int size() const;
 
+	// rows of the conditional probability table
+	const std::map<std::vector<ValueType>, DistType>& table() const;
+
+	bool has_default() const;
+	const DistType& default_row() const;
+
+	const std::map<NodeType, std::map<ValueType, DistType>>& effects() const;
+	const DistType& leak() const;
+	const CpdTree<NodeType, ValueType, DistType>& decision_tree() const;
+
 	using CondCase = std::pair<std::vector<ValueType>, DistType>;
 private:
+	CpdKind kind_;
+
 	// parents in table
 	std::set<NodeType> scope_;
 
 	// conditional probability table
 	std::map<std::vector<ValueType>, DistType> table_;
+	bool has_default_;
+	DistType default_row_;
+
+	// noisy-MAX parameters
+	std::map<NodeType, std::map<ValueType, DistType>> effects_;
+	DistType leak_;
+
+	CpdTree<NodeType, ValueType, DistType> tree_;
 };
 
 template <typename NodeType, typename ValueType, typename DistType>
-CondProb<NodeType, ValueType, DistType>::CondProb() {}
+unsigned CpdTree<NodeType, ValueType, DistType>::leaf(const DistType& dist) {
+	Node node;
+	node.leaf = true;
+	node.parent = NodeType();
+	node.otherwise = 0;
+	node.dist = dist;
+	nodes_.push_back(node);
+	return nodes_.size() - 1;
+}
+
+template <typename NodeType, typename ValueType, typename DistType>
+unsigned CpdTree<NodeType, ValueType, DistType>::split(NodeType parent,
+	const std::map<ValueType, unsigned>& branches,
+	unsigned otherwise) {
+	if (otherwise >= nodes_.size())
+		throw MissingNodeException();
+	for (const std::pair<const ValueType, unsigned>& branch : branches)
+		if (branch.second >= nodes_.size())
+			throw MissingNodeException();
+	Node node;
+	node.leaf = false;
+	node.parent = parent;
+	node.branches = branches;
+	node.otherwise = otherwise;
+	nodes_.push_back(node);
+	return nodes_.size() - 1;
+}
+
+template <typename NodeType, typename ValueType, typename DistType>
+bool CpdTree<NodeType, ValueType, DistType>::empty() const { return nodes_.empty(); }
+
+template <typename NodeType, typename ValueType, typename DistType>
+unsigned CpdTree<NodeType, ValueType, DistType>::root() const { return nodes_.size() - 1; }
+
+template <typename NodeType, typename ValueType, typename DistType>
+const std::vector<typename CpdTree<NodeType, ValueType, DistType>::Node>&
+CpdTree<NodeType, ValueType, DistType>::nodes() const { return nodes_; }
+
+template <typename NodeType, typename ValueType, typename DistType>
+template <typename Lookup>
+const DistType& CpdTree<NodeType, ValueType, DistType>::find(Lookup parent_value) const {
+	const Node* node = &nodes_[root()];
+	while (!node->leaf) {
+		auto it = node->branches.find(parent_value(node->parent));
+		node = &nodes_[it == node->branches.end() ? node->otherwise : it->second];
+	}
+	return node->dist;
+}
+
+template <typename NodeType, typename ValueType, typename DistType>
+CondProb<NodeType, ValueType, DistType>::CondProb() :
+	kind_(CpdKind::TABLE), has_default_(false)
+{}
 
 template <typename NodeType, typename ValueType, typename DistType>
 CondProb<NodeType, ValueType, DistType>::CondProb(const std::map<std::vector<ValueType>, DistType>& table) :
-	scope_(), table_(table)
+	kind_(CpdKind::TABLE), scope_(), table_(table), has_default_(false)
 {}
 
 template <typename NodeType, typename ValueType, typename DistType>
-CondProb<NodeType, ValueType, DistType>::CondProb(const std::set<NodeType>& scope, 
+CondProb<NodeType, ValueType, DistType>::CondProb(const std::set<NodeType>& scope,
 	const std::map<std::vector<ValueType>, DistType>& table) :
-	scope_(scope), table_(table)
+	kind_(CpdKind::TABLE), scope_(scope), table_(table), has_default_(false)
+{}
+
+template <typename NodeType, typename ValueType, typename DistType>
+CondProb<NodeType, ValueType, DistType>::CondProb(const std::map<std::vector<ValueType>, DistType>& table,
+	const DistType& default_row) :
+	kind_(CpdKind::TABLE), scope_(), table_(table), has_default_(true), default_row_(default_row)
 {}
 
+template <typename NodeType, typename ValueType, typename DistType>
+CondProb<NodeType, ValueType, DistType> CondProb<NodeType, ValueType, DistType>::noisy_max(
+	const std::map<NodeType, std::map<ValueType, DistType>>& effects,
+	const DistType& leak) {
+	CondProb cpd;
+	cpd.kind_ = CpdKind::NOISY_MAX;
+	cpd.effects_ = effects;
+	cpd.leak_ = leak;
+	for (const auto& effect : effects)
+		cpd.scope_.insert(effect.first);
+	return cpd;
+}
+
+template <typename NodeType, typename ValueType, typename DistType>
+CondProb<NodeType, ValueType, DistType> CondProb<NodeType, ValueType, DistType>::noisy_or(
+	const std::map<NodeType, double>& links,
+	double leak,
+	ValueType off,
+	ValueType on) {
+	std::map<NodeType, std::map<ValueType, DistType>> effects;
+	for (const std::pair<const NodeType, double>& link : links) {
+		DistType effect;
+		effect[off] = 1 - link.second;
+		effect[on] = link.second;
+		effects[link.first][on] = effect;
+	}
+	DistType leaked;
+	leaked[off] = 1 - leak;
+	leaked[on] = leak;
+	return noisy_max(effects, leaked);
+}
+
+template <typename NodeType, typename ValueType, typename DistType>
+CondProb<NodeType, ValueType, DistType> CondProb<NodeType, ValueType, DistType>::tree(
+	const CpdTree<NodeType, ValueType, DistType>& tree) {
+	if (tree.empty())
+		throw MissingNodeException();
+	CondProb cpd;
+	cpd.kind_ = CpdKind::TREE;
+	cpd.tree_ = tree;
+	for (const auto& node : tree.nodes())
+		if (!node.leaf)
+			cpd.scope_.insert(node.parent);
+	return cpd;
+}
+
 template <typename NodeType, typename ValueType, typename DistType>
 const DistType CondProb<NodeType, ValueType, DistType>::get_distribution(
-	const std::vector<ValueType>& parentValues) {
-	return table_[parentValues];
+	const std::vector<ValueType>& parentValues) const {
+	if (kind_ == CpdKind::TABLE) {
+		auto it = table_.find(parentValues);
+		if (it != table_.end())
+			return it->second;
+		return has_default_ ? default_row_ : DistType();
+	}
+
+	// The parametric forms name their parents, read through the scope
+	if (parentValues.size() != scope_.size())
+		throw SampleError();
+	std::map<NodeType, ValueType> values;
+	unsigned j = 0;
+	for (NodeType parent : scope_)
+		values[parent] = parentValues[j++];
+	if (kind_ == CpdKind::TREE)
+		return tree_.find([&values](NodeType parent) { return values[parent]; });
+
+	// P(child <= y) is the product of every active cause's P(effect <= y);
+	// a cause without mass, like an inactive one, leaves the lowest value
+	std::set<ValueType> values_of_child = domain();
+	auto cdf = [](const DistType& effect, ValueType y) {
+		double below = 0, sum = 0;
+		for (const auto& p : effect) {
+			sum += p.second;
+			if (!(y < p.first))
+				below += p.second;
+		}
+		return sum > 0 ? below / sum : 1.0;
+	};
+	DistType dist;
+	double below = 0;
+	for (ValueType y : values_of_child) {
+		double c = cdf(leak_, y);
+		for (const auto& effect : effects_) {
+			auto active = effect.second.find(values[effect.first]);
+			if (active != effect.second.end())
+				c *= cdf(active->second, y);
+		}
+		dist[y] = c - below;
+		below = c;
+	}
+	return dist;
+}
+
+template <typename NodeType, typename ValueType, typename DistType>
+CpdKind CondProb<NodeType, ValueType, DistType>::kind() const { return kind_; }
+
+template <typename NodeType, typename ValueType, typename DistType>
+const std::set<NodeType>& CondProb<NodeType, ValueType, DistType>::scope() const { return scope_; }
+
+template <typename NodeType, typename ValueType, typename DistType>
+std::set<ValueType> CondProb<NodeType, ValueType, DistType>::domain() const {
+	std::set<ValueType> domain;
+	auto add = [&domain](const DistType& dist) {
+		for (const auto& entry : dist)
+			domain.insert(entry.first);
+	};
+	for (const auto& row : table_)
+		add(row.second);
+	if (has_default_)
+		add(default_row_);
+	add(leak_);
+	for (const auto& effect : effects_)
+		for (const auto& active : effect.second)
+			add(active.second);
+	if (!tree_.empty())
+		for (const auto& node : tree_.nodes())
+			if (node.leaf)
+				add(node.dist);
+	return domain;
 }
 
 template <typename NodeType, typename ValueType, typename DistType>
 unsigned int CondProb<NodeType, ValueType, DistType>::size() const { return table_.size(); }
 
+template <typename NodeType, typename ValueType, typename DistType>
+const std::map<std::vector<ValueType>, DistType>& CondProb<NodeType, ValueType, DistType>::table() const {
+	return table_;
+}
+
+template <typename NodeType, typename ValueType, typename DistType>
+bool CondProb<NodeType, ValueType, DistType>::has_default() const { return has_default_; }
+
+template <typename NodeType, typename ValueType, typename DistType>
+const DistType& CondProb<NodeType, ValueType, DistType>::default_row() const { return default_row_; }
+
+template <typename NodeType, typename ValueType, typename DistType>
+const std::map<NodeType, std::map<ValueType, DistType>>& CondProb<NodeType, ValueType, DistType>::effects() const {
+	return effects_;
+}
+
+template <typename NodeType, typename ValueType, typename DistType>
+const DistType& CondProb<NodeType, ValueType, DistType>::leak() const { return leak_; }
+
+template <typename NodeType, typename ValueType, typename DistType>
+const CpdTree<NodeType, ValueType, DistType>& CondProb<NodeType, ValueType, DistType>::decision_tree() const {
+	return tree_;
+}
+
 #endif
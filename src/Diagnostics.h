@@ -0,0 +1,328 @@
+#ifndef DIAGNOSTICS_H
+#define DIAGNOSTICS_H
+
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+// Running mean and variance of a scalar series (Welford)
+class RunningStats
+{
+public:
+	RunningStats() : count_(0), mean_(0), m2_(0) {}
+
+	void push(double x) {
+		++count_;
+		double delta = x - mean_;
+		mean_ += delta / count_;
+		m2_ += delta * (x - mean_);
+	}
+
+	// Combine with the statistics of another series (Chan et al.)
+	void merge(const RunningStats& other) {
+		if (other.count_ == 0)
+			return;
+		double n = count_ + other.count_;
+		double delta = other.mean_ - mean_;
+		mean_ += delta * other.count_ / n;
+		m2_ += other.m2_ + delta * delta * count_ * (other.count_ / n);
+		count_ += other.count_;
+	}
+
+	unsigned long count() const { return count_; }
+	double mean() const { return mean_; }
+
+	// Unbiased sample variance
+	double variance() const { return count_ > 1 ? m2_ / (count_ - 1) : 0; }
+private:
+	unsigned long count_;
+	double mean_;
+	double m2_;
+};
+
+// Self-normalized weighted mean of a series whose weights are given as
+// logs. The sums are held relative to the largest log weight seen so far,
+// so weights far below the range of a double still compare correctly.
+class WeightedStats
+{
+public:
+	WeightedStats() :
+		count_(0), shift_(-std::numeric_limits<double>::infinity()),
+		weight_(0), weight_sq_(0), sum_(0), sum_sq_(0) {}
+
+	void push(double x, double log_weight) {
+		++count_;
+		if (log_weight == -std::numeric_limits<double>::infinity())
+			return;
+		if (log_weight > shift_)
+			rescale(log_weight);
+		double w = std::exp(log_weight - shift_);
+		weight_ += w;
+		weight_sq_ += w * w;
+		sum_ += w * x;
+		sum_sq_ += w * x * x;
+	}
+
+	void merge(const WeightedStats& other) {
+		count_ += other.count_;
+		if (other.weight_ <= 0)
+			return;
+		if (other.shift_ > shift_)
+			rescale(other.shift_);
+		double f = std::exp(other.shift_ - shift_);
+		weight_ += f * other.weight_;
+		weight_sq_ += f * f * other.weight_sq_;
+		sum_ += f * other.sum_;
+		sum_sq_ += f * other.sum_sq_;
+	}
+
+	unsigned long count() const { return count_; }
+	double mean() const { return weight_ > 0 ? sum_ / weight_ : 0; }
+
+	// Weighted variance of the series about its mean
+	double variance() const {
+		return weight_ > 0 ? std::max(0.0, sum_sq_ / weight_ - mean() * mean()) : 0;
+	}
+
+	// Kish effective sample size, (sum w)^2 / sum w^2
+	double effective_size() const {
+		return weight_sq_ > 0 ? weight_ * weight_ / weight_sq_ : 0;
+	}
+private:
+	void rescale(double shift) {
+		double f = std::exp(shift_ - shift);
+		weight_ *= f;
+		weight_sq_ *= f * f;
+		sum_ *= f;
+		sum_sq_ *= f;
+		shift_ = shift;
+	}
+
+	unsigned long count_;
+	double shift_;
+	double weight_;
+	double weight_sq_;
+	double sum_;
+	double sum_sq_;
+};
+
+// Batch means of a scalar series in memory bounded by the batch count.
+// Batches start one value long; whenever twice the requested number are
+// full, neighbours merge and the batch length doubles. The spread of the
+// batch means gives the variance of the series mean under autocorrelation
+// and their drift over the series gives Geweke's stationarity score.
+class BatchMeans
+{
+public:
+	explicit BatchMeans(unsigned batches = 32) :
+		batches_(batches), length_(1), count_(0), sum_(0), sum_sq_(0), partial_(0), filled_(0) {}
+
+	void push(double x) {
+		++count_;
+		sum_ += x;
+		sum_sq_ += x * x;
+		partial_ += x;
+		if (++filled_ == length_)
+			close();
+	}
+
+	// Append the series of another chain, as if it continued this one.
+	// Its batches are fed through this one's partial batch, so that every
+	// closed batch keeps the common length; a batch cut at the boundary
+	// lends its mean to both parts.
+	void merge(const BatchMeans& other) {
+		BatchMeans tail(other);
+		while (tail.length_ < length_)
+			tail.collapse();
+		while (length_ < tail.length_)
+			collapse();
+		count_ += tail.count_;
+		sum_ += tail.sum_;
+		sum_sq_ += tail.sum_sq_;
+		for (double m : tail.means_)
+			absorb(m * tail.length_, tail.length_);
+		absorb(tail.partial_, tail.filled_);
+	}
+
+	unsigned long count() const { return count_; }
+	double mean() const { return count_ ? sum_ / count_ : 0; }
+
+	// Unbiased variance of the series itself
+	double variance() const {
+		return count_ > 1 ? std::max(0.0, (sum_sq_ - sum_ * mean()) / (count_ - 1)) : 0;
+	}
+
+	std::size_t batch_count() const { return means_.size(); }
+	unsigned long batch_length() const { return length_; }
+
+	// Variance of the series mean estimated from the batch means; infinite
+	// until two batches are full
+	double variance_of_mean() const {
+		std::size_t m = means_.size();
+		if (m < 2)
+			return std::numeric_limits<double>::infinity();
+		return window_variance(0, m) / m;
+	}
+
+	// Effective sample size, the count scaled by the ratio of the
+	// independent to the batch-means variance of the mean
+	double effective_size() const {
+		double v = variance_of_mean();
+		if (v == std::numeric_limits<double>::infinity())
+			return 0;
+		if (v <= 0)
+			return count_;
+		return std::min<double>(count_, variance() / v);
+	}
+
+	// Geweke's z-score comparing the mean of the first and the last
+	// fractions of the series; 0 until each holds two batches
+	double geweke(double first = 0.1, double last = 0.5) const {
+		std::size_t m = means_.size();
+		std::size_t a = std::max<std::size_t>(2, m * first);
+		std::size_t b = std::max<std::size_t>(2, m * last);
+		if (a + b > m)
+			return 0;
+		double diff = window_mean(0, a) - window_mean(m - b, m);
+		double se = window_variance(0, a) / a + window_variance(m - b, m) / b;
+		if (se <= 0)
+			return diff == 0 ? 0 : std::numeric_limits<double>::infinity();
+		return std::fabs(diff) / std::sqrt(se);
+	}
+private:
+	void close() {
+		means_.push_back(partial_ / filled_);
+		partial_ = 0;
+		filled_ = 0;
+		if (means_.size() == 2 * batches_)
+			collapse();
+	}
+
+	// Add n consecutive values summing to sum, closing each batch as it
+	// fills
+	void absorb(double sum, unsigned long n) {
+		while (n > 0) {
+			unsigned long take = std::min(n, length_ - filled_);
+			double part = sum * take / n;
+			partial_ += part;
+			filled_ += take;
+			sum -= part;
+			n -= take;
+			if (filled_ == length_)
+				close();
+		}
+	}
+
+	// Halve the batches; an odd last batch goes back into the partial one
+	void collapse() {
+		std::size_t half = means_.size() / 2;
+		if (means_.size() % 2) {
+			partial_ += means_.back() * length_;
+			filled_ += length_;
+		}
+		for (std::size_t i = 0; i < half; i++)
+			means_[i] = (means_[2 * i] + means_[2 * i + 1]) / 2;
+		means_.resize(half);
+		length_ *= 2;
+	}
+
+	double window_mean(std::size_t from, std::size_t to) const {
+		double sum = 0;
+		for (std::size_t i = from; i < to; i++)
+			sum += means_[i];
+		return sum / (to - from);
+	}
+
+	double window_variance(std::size_t from, std::size_t to) const {
+		double mean = window_mean(from, to), sum = 0;
+		for (std::size_t i = from; i < to; i++)
+			sum += (means_[i] - mean) * (means_[i] - mean);
+		return sum / (to - from - 1);
+	}
+
+	unsigned batches_;
+	unsigned long length_;
+	unsigned long count_;
+	double sum_;
+	double sum_sq_;
+	std::vector<double> means_;
+	double partial_;
+	unsigned long filled_;
+};
+
+// Two-sided standard normal quantile: the z for which a confidence
+// interval of +- z standard errors has the given coverage
+inline double normal_quantile(double confidence) {
+	double lo = 0, hi = 40;
+	for (int i = 0; i < 100; i++) {
+		double z = (lo + hi) / 2;
+		if (std::erfc(z / std::sqrt(2.0)) > 1 - confidence)
+			lo = z;
+		else
+			hi = z;
+	}
+	return (lo + hi) / 2;
+}
+
+// Gelman-Rubin potential scale reduction over the series of several
+// chains. Values near 1 indicate that the chains agree; a single chain or
+// chains without variation report 1.
+inline double potential_scale_reduction(const std::vector<RunningStats>& chains) {
+	unsigned m = chains.size();
+	if (m < 2)
+		return 1;
+
+	double n = 0, within = 0, grand = 0;
+	for (const RunningStats& chain : chains) {
+		n += chain.count();
+		within += chain.variance();
+		grand += chain.mean();
+	}
+	n /= m;
+	within /= m;
+	grand /= m;
+	double between = 0;
+	for (const RunningStats& chain : chains)
+		between += (chain.mean() - grand) * (chain.mean() - grand);
+	between *= n / (m - 1);
+
+	if (within <= 0)
+		return between <= 0 ? 1 : std::numeric_limits<double>::infinity();
+	double pooled = (n - 1) / n * within + between / n;
+	return std::sqrt(pooled / within);
+}
+
+// Effective sample size of one autocorrelated series, using Geyer's
+// initial positive sequence: autocorrelations are summed in adjacent
+// pairs until a pair turns negative. A constant series reports its length.
+inline double effective_sample_size(const std::vector<double>& series) {
+	std::size_t n = series.size();
+	if (n < 4)
+		return n;
+
+	double mean = 0;
+	for (double x : series)
+		mean += x;
+	mean /= n;
+	auto autocovariance = [&series, mean, n](std::size_t lag) {
+		double sum = 0;
+		for (std::size_t i = 0; i + lag < n; i++)
+			sum += (series[i] - mean) * (series[i + lag] - mean);
+		return sum / n;
+	};
+
+	double variance = autocovariance(0);
+	if (variance <= 0)
+		return n;
+	double tau = -1;
+	for (std::size_t lag = 0; lag + 1 < n; lag += 2) {
+		double pair = (autocovariance(lag) + autocovariance(lag + 1)) / variance;
+		if (pair <= 0)
+			break;
+		tau += 2 * pair;
+	}
+	return n / std::max(tau, 1.0 / n);
+}
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef ERRORS_H
+#define ERRORS_H
+
+// Potential errors
+class SampleError {};
+class DuplicateNodeException {};
+class MissingNodeException {};
+class UnknownValueException {};
+class CycleException {};
+class CardinalityException {};
+class FileException {};
+class FormatException {};
+class OverloadedException {};
+class DeadlineException {};
+
+#endif
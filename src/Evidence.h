@@ -0,0 +1,73 @@
+#ifndef EVIDENCE_H
+#define EVIDENCE_H
+
+#include <map>
+#include <memory>
+#include <utility>
+#include <cstddef>
+#include <initializer_list>
+
+// Observed values of a set of nodes as a copy-on-write overlay: copies
+// share one map until one of them changes, and only a changed copy that
+// still shares its map pays for duplicating it. Queries against a shared
+// snapshot carry their own evidence this way, so passing evidence around
+// costs a reference count rather than a map.
+template <
+	typename NodeType = int,
+	typename ValueType = int
+>
+class Evidence
+{
+public:
+	typedef std::map<NodeType, ValueType> map_type;
+	typedef typename map_type::const_iterator const_iterator;
+
+	Evidence() : values_(std::make_shared<map_type>()) {}
+	Evidence(const map_type& values) : values_(std::make_shared<map_type>(values)) {}
+	Evidence(std::initializer_list<std::pair<const NodeType, ValueType>> values) :
+		values_(std::make_shared<map_type>(values)) {}
+
+	// Clamp a node to a value
+	void observe(NodeType node_id, ValueType value) {
+		detach();
+		(*values_)[node_id] = value;
+	}
+
+	// Release a clamped node
+	void forget(NodeType node_id) {
+		if (!values_->count(node_id))
+			return;
+		detach();
+		values_->erase(node_id);
+	}
+
+	void clear() {
+		if (!values_->empty())
+			values_ = std::make_shared<map_type>();
+	}
+
+	bool observed(NodeType node_id) const { return values_->count(node_id) > 0; }
+	const ValueType& at(NodeType node_id) const { return values_->at(node_id); }
+	std::size_t size() const { return values_->size(); }
+	bool empty() const { return values_->empty(); }
+	const_iterator begin() const { return values_->begin(); }
+	const_iterator end() const { return values_->end(); }
+
+	const map_type& values() const { return *values_; }
+
+	// Whether two sets of evidence are held in the same map
+	bool shares(const Evidence& other) const { return values_ == other.values_; }
+
+	bool operator==(const Evidence& other) const { return shares(other) || *values_ == *other.values_; }
+	bool operator!=(const Evidence& other) const { return !(*this == other); }
+	bool operator<(const Evidence& other) const { return !shares(other) && *values_ < *other.values_; }
+private:
+	void detach() {
+		if (values_.use_count() > 1)
+			values_ = std::make_shared<map_type>(*values_);
+	}
+
+	std::shared_ptr<map_type> values_;
+};
+
+#endif
@@ -0,0 +1,136 @@
+#ifndef FACTOR_H
+#define FACTOR_H
+
+#include <vector>
+#include <cstddef>
+#include <algorithm>
+
+// Non-negative table over a sorted set of compiled node indices, stored
+// densely with the last variable fastest. Factors combine with factors
+// over subsets of their variables, which is all the junction tree needs.
+class Factor
+{
+public:
+	Factor() : values_(1, 1) {}
+
+	Factor(const std::vector<unsigned>& variables,
+		const std::vector<unsigned>& cardinalities,
+		double fill = 1) :
+		variables_(variables),
+		cardinalities_(cardinalities),
+		strides_(variables.size()) {
+		std::size_t size = 1;
+		for (unsigned i = variables_.size(); i-- > 0; ) {
+			strides_[i] = size;
+			size *= cardinalities_[i];
+		}
+		values_.assign(size, fill);
+	}
+
+	const std::vector<unsigned>& variables() const { return variables_; }
+	const std::vector<unsigned>& cardinalities() const { return cardinalities_; }
+	std::size_t size() const { return values_.size(); }
+
+	double& operator[](std::size_t i) { return values_[i]; }
+	double operator[](std::size_t i) const { return values_[i]; }
+
+	bool contains(unsigned variable) const {
+		return std::binary_search(variables_.begin(), variables_.end(), variable);
+	}
+
+	// Value index of a variable in the entry at position i
+	unsigned value_of(std::size_t i, unsigned variable) const {
+		unsigned v = std::lower_bound(variables_.begin(), variables_.end(), variable) - variables_.begin();
+		return i / strides_[v] % cardinalities_[v];
+	}
+
+	double sum() const {
+		double total = 0;
+		for (double x : values_)
+			total += x;
+		return total;
+	}
+
+	void scale(double factor) {
+		for (double& x : values_)
+			x *= factor;
+	}
+
+	// Multiply in a factor over a subset of the variables
+	void multiply(const Factor& other) {
+		walk(other, [this, &other](std::size_t i, std::size_t j) { values_[i] *= other.values_[j]; });
+	}
+
+	// Divide by a factor over a subset of the variables, with 0 / 0 = 0
+	void divide(const Factor& other) {
+		walk(other, [this, &other](std::size_t i, std::size_t j) {
+			values_[i] = other.values_[j] > 0 ? values_[i] / other.values_[j] : 0;
+		});
+	}
+
+	// Sum out every variable not in a sorted subset of the variables
+	Factor marginal(const std::vector<unsigned>& variables) const {
+		Factor result(variables, cardinalities_of(variables), 0);
+		walk(result, [this, &result](std::size_t i, std::size_t j) { result.values_[j] += values_[i]; });
+		return result;
+	}
+
+	// Maximize out every variable not in a sorted subset of the variables
+	Factor max_marginal(const std::vector<unsigned>& variables) const {
+		Factor result(variables, cardinalities_of(variables), 0);
+		walk(result, [this, &result](std::size_t i, std::size_t j) {
+			result.values_[j] = std::max(result.values_[j], values_[i]);
+		});
+		return result;
+	}
+
+	double max() const { return *std::max_element(values_.begin(), values_.end()); }
+
+	// Zero every entry in which a variable does not hold a value
+	void reduce(unsigned variable, unsigned value) {
+		unsigned v = std::lower_bound(variables_.begin(), variables_.end(), variable) - variables_.begin();
+		for (std::size_t i = 0; i < values_.size(); i++)
+			if (i / strides_[v] % cardinalities_[v] != value)
+				values_[i] = 0;
+	}
+private:
+	std::vector<unsigned> cardinalities_of(const std::vector<unsigned>& variables) const {
+		std::vector<unsigned> cardinalities;
+		for (unsigned variable : variables)
+			cardinalities.push_back(cardinalities_[
+				std::lower_bound(variables_.begin(), variables_.end(), variable) - variables_.begin()]);
+		return cardinalities;
+	}
+
+	// Visit every entry i together with the entry j of a factor over a
+	// subset of the variables that agrees with it, by an odometer over the
+	// variables carrying the subset's strides along
+	template <typename F>
+	void walk(const Factor& subset, F f) const {
+		unsigned n = variables_.size();
+		std::vector<std::size_t> inner(n, 0);
+		for (unsigned v = 0, s = 0; v < n && s < subset.variables_.size(); v++)
+			if (variables_[v] == subset.variables_[s])
+				inner[v] = subset.strides_[s++];
+
+		std::vector<unsigned> digits(n, 0);
+		std::size_t j = 0;
+		for (std::size_t i = 0; i < values_.size(); i++) {
+			f(i, j);
+			for (unsigned v = n; v-- > 0; ) {
+				j += inner[v];
+				if (++digits[v] < cardinalities_[v])
+					break;
+				j -= inner[v] * digits[v];
+				digits[v] = 0;
+			}
+		}
+	}
+
+	std::vector<unsigned> variables_;
+	std::vector<unsigned> cardinalities_;
+	std::vector<std::size_t> strides_;
+	std::vector<double> values_;
+};
+
+#endif
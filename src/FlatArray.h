@@ -0,0 +1,116 @@
+#ifndef FLAT_ARRAY_H
+#define FLAT_ARRAY_H
+
+#include <vector>
+#include <memory>
+#include <cstddef>
+#include <utility>
+#include <algorithm>
+
+// Contiguous array that either owns its elements or views memory owned
+// elsewhere, such as a mapped file kept alive through a shared handle.
+// Views are read only; any growth turns the array back into an owned copy.
+template <typename T>
+class FlatArray
+{
+public:
+	FlatArray() : data_(nullptr), size_(0) {}
+
+	FlatArray(std::size_t size, const T& fill) : data_(nullptr), size_(0) {
+		resize(size, fill);
+	}
+
+	FlatArray(const FlatArray& other) :
+		owned_(other.owned_), keep_(other.keep_), size_(other.size_) {
+		data_ = keep_ ? other.data_ : owned_.data();
+	}
+
+	FlatArray(FlatArray&& other) :
+		owned_(std::move(other.owned_)), keep_(std::move(other.keep_)),
+		data_(other.data_), size_(other.size_) {
+		other.data_ = nullptr;
+		other.size_ = 0;
+	}
+
+	FlatArray& operator=(FlatArray other) {
+		swap(other);
+		return *this;
+	}
+
+	void swap(FlatArray& other) {
+		owned_.swap(other.owned_);
+		keep_.swap(other.keep_);
+		std::swap(data_, other.data_);
+		std::swap(size_, other.size_);
+	}
+
+	void resize(std::size_t size, const T& fill = T()) {
+		own();
+		owned_.resize(size, fill);
+		update();
+	}
+
+	void assign(std::size_t size, const T& fill) {
+		own();
+		owned_.assign(size, fill);
+		update();
+	}
+
+	void push_back(const T& value) {
+		own();
+		owned_.push_back(value);
+		update();
+	}
+
+	template <typename Iterator>
+	void append(Iterator first, Iterator last) {
+		own();
+		owned_.insert(owned_.end(), first, last);
+		update();
+	}
+
+	// View size elements at data, valid for as long as keep is held
+	void view(const T* data, std::size_t size, const std::shared_ptr<const void>& keep) {
+		std::vector<T>().swap(owned_);
+		keep_ = keep;
+		data_ = const_cast<T*>(data);
+		size_ = size;
+	}
+
+	// Whether the elements belong to someone else
+	bool borrowed() const { return static_cast<bool>(keep_); }
+
+	std::size_t size() const { return size_; }
+	bool empty() const { return size_ == 0; }
+
+	T* data() { return data_; }
+	const T* data() const { return data_; }
+
+	T& operator[](std::size_t i) { return data_[i]; }
+	const T& operator[](std::size_t i) const { return data_[i]; }
+
+	T* begin() { return data_; }
+	T* end() { return data_ + size_; }
+	const T* begin() const { return data_; }
+	const T* end() const { return data_ + size_; }
+private:
+	// Copy borrowed elements into owned storage before changing them
+	void own() {
+		if (!keep_)
+			return;
+		owned_.assign(data_, data_ + size_);
+		keep_.reset();
+	}
+
+	void update() {
+		data_ = owned_.data();
+		size_ = owned_.size();
+	}
+
+	std::vector<T> owned_;
+	std::shared_ptr<const void> keep_;
+	T* data_;
+	std::size_t size_;
+};
+
+#endif
@@ -0,0 +1,260 @@
+#ifndef INSTRUMENT_H
+#define INSTRUMENT_H
+
+#include "Benchmark.h"
+
+#include <vector>
+#include <map>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <sstream>
+
+// Counters and phase timers for the samplers. The hooks below are only
+// compiled in when BAYES_NET_INSTRUMENT is defined; otherwise they expand
+// to nothing and the samplers carry no trace of them. The collected data
+// is read back through Instrumentation::instance() in either build, and
+// simply stays empty when the hooks are compiled out.
+#ifdef BAYES_NET_INSTRUMENT
+#define BN_CONCAT_(a, b) a##b
+#define BN_CONCAT(a, b) BN_CONCAT_(a, b)
+#define BN_COUNT(counter) Instrumentation::count(Instrumentation::counter)
+#define BN_COUNT_N(counter, n) Instrumentation::count(Instrumentation::counter, n)
+#define BN_PHASE(name) ScopedPhase BN_CONCAT(bn_phase_, __LINE__)(name)
+#define BN_REPORT(label) ScopedReport BN_CONCAT(bn_report_, __LINE__)(label)
+#else
+#define BN_COUNT(counter) ((void)0)
+#define BN_COUNT_N(counter, n) ((void)0)
+#define BN_PHASE(name) ((void)0)
+#define BN_REPORT(label) ((void)0)
+#endif
+
+// Counter totals and phase timings collected since the last reset
+struct InstrumentReport
+{
+	std::vector<std::uint64_t> counters;
+
+	// One benchmark per phase name, a trial per timed scope
+	std::vector<Benchmark> phases;
+
+	// What was counted and timed since an earlier report of the same
+	// collector. A counter reset in between counts from zero.
+	InstrumentReport since(const InstrumentReport& earlier) const;
+
+	std::string toString() const;
+};
+
+// Process-wide collector. Each thread counts into a block of its own, so
+// the chains of a parallel run never contend on a counter; the blocks are
+// summed when a report is taken. Counts are atomic adds, so a reset from
+// another thread is never undone by a count in flight. Reports never reset
+// anything: a scoped report holds the totals it started from and writes
+// the difference, so concurrent scopes cannot erase each other's counts.
+// A scope's report covers everything counted while it was open, on any
+// thread, including the work of scopes overlapping it. Phase timings are
+// rarer and go through a lock.
+class Instrumentation
+{
+public:
+	enum Counter {
+		ROW_LOOKUPS,
+		DRAWS,
+		ACCEPTED,
+		REJECTED,
+		ALLOCATIONS,
+		BURN_IN_STEPS,
+		STEPS,
+		COUNTERS
+	};
+
+	static Instrumentation& instance();
+	static const char* counter_name(Counter counter);
+
+	// Whether the hooks were compiled in
+	static bool enabled();
+
+	static void count(Counter counter, std::uint64_t n = 1);
+	void record_phase(const std::string& phase, long long nanoseconds);
+
+	InstrumentReport report() const;
+	void reset();
+
+	// Stream that dump() writes to; null, the default, discards reports
+	void set_sink(std::ostream* sink);
+
+	// Write a report of everything since an earlier report to the sink;
+	// by default, of everything since the last reset
+	void dump(const std::string& label, const InstrumentReport& since = InstrumentReport());
+private:
+	Instrumentation();
+	Instrumentation(const Instrumentation&);
+	Instrumentation& operator=(const Instrumentation&);
+
+	struct Block {
+		Block() {
+			for (unsigned c = 0; c < COUNTERS; c++)
+				counts[c].store(0, std::memory_order_relaxed);
+		}
+
+		std::atomic<std::uint64_t> counts[COUNTERS];
+	};
+
+	// Counter block of the calling thread, created on first use
+	static Block& local();
+
+	mutable std::mutex mutex_;
+	std::vector<std::unique_ptr<Block>> blocks_;
+	std::map<std::string, Benchmark> phases_;
+	std::ostream* sink_;
+};
+
+// Dumps a report of what was counted while the enclosing scope was open
+// when it ends, however it ends
+class ScopedReport
+{
+public:
+	explicit ScopedReport(const char* label) : label_(label), start_(Instrumentation::instance().report()) {}
+	~ScopedReport() { Instrumentation::instance().dump(label_, start_); }
+private:
+	ScopedReport(const ScopedReport&);
+	ScopedReport& operator=(const ScopedReport&);
+
+	const char* label_;
+	InstrumentReport start_;
+};
+
+// Times the enclosing scope and files it under a phase name
+class ScopedPhase
+{
+public:
+	explicit ScopedPhase(const char* phase) : timer_(phase) { timer_.start(); }
+	~ScopedPhase() {
+		timer_.stop();
+		Instrumentation::instance().record_phase(timer_.name(), timer_.elapsed());
+	}
+private:
+	ScopedPhase(const ScopedPhase&);
+	ScopedPhase& operator=(const ScopedPhase&);
+
+	Benchmark timer_;
+};
+
+inline InstrumentReport InstrumentReport::since(const InstrumentReport& earlier) const {
+	InstrumentReport delta;
+	delta.counters = counters;
+	for (unsigned c = 0; c < counters.size() && c < earlier.counters.size(); c++)
+		if (counters[c] >= earlier.counters[c])
+			delta.counters[c] -= earlier.counters[c];
+
+	// Phases are in name order in both; trials only ever append
+	std::vector<Benchmark>::const_iterator old = earlier.phases.begin();
+	for (const Benchmark& phase : phases) {
+		while (old != earlier.phases.end() && old->name() < phase.name())
+			++old;
+		std::size_t seen = old != earlier.phases.end() && old->name() == phase.name() &&
+			old->trials() <= phase.trials() ? old->trials() : 0;
+		if (seen == phase.trials())
+			continue;
+		Benchmark recent(phase.name());
+		for (std::size_t t = seen; t < phase.durations().size(); t++)
+			recent.record(phase.durations()[t]);
+		delta.phases.push_back(recent);
+	}
+	return delta;
+}
+
+inline std::string InstrumentReport::toString() const {
+	std::ostringstream oss;
+	for (unsigned c = 0; c < counters.size(); c++)
+		oss << "  " << Instrumentation::counter_name(static_cast<Instrumentation::Counter>(c))
+			<< " " << counters[c] << "\n";
+	for (const Benchmark& phase : phases)
+		oss << "  " << phase.name() << " " << static_cast<long long>(phase.mean() * phase.trials())
+			<< "ns over " << phase.trials() << " (median " << static_cast<long long>(phase.median())
+			<< "ns, p90 " << static_cast<long long>(phase.percentile(0.9)) << "ns)\n";
+	return oss.str();
+}
+
+inline Instrumentation::Instrumentation() : sink_(nullptr) {}
+
+inline Instrumentation& Instrumentation::instance() {
+	static Instrumentation instrumentation;
+	return instrumentation;
+}
+
+inline const char* Instrumentation::counter_name(Counter counter) {
+	static const char* names[COUNTERS] = {
+		"row_lookups", "draws", "accepted", "rejected", "allocations", "burn_in_steps", "steps"
+	};
+	return counter < COUNTERS ? names[counter] : "";
+}
+
+inline bool Instrumentation::enabled() {
+#ifdef BAYES_NET_INSTRUMENT
+	return true;
+#else
+	return false;
+#endif
+}
+
+inline Instrumentation::Block& Instrumentation::local() {
+	static thread_local Block* block = nullptr;
+	if (!block) {
+		Instrumentation& self = instance();
+		std::lock_guard<std::mutex> lock(self.mutex_);
+		self.blocks_.push_back(std::unique_ptr<Block>(new Block()));
+		block = self.blocks_.back().get();
+	}
+	return *block;
+}
+
+inline void Instrumentation::count(Counter counter, std::uint64_t n) {
+	// An atomic add rather than a load and store, which a concurrent reset
+	// could land between
+	local().counts[counter].fetch_add(n, std::memory_order_relaxed);
+}
+
+inline void Instrumentation::record_phase(const std::string& phase, long long nanoseconds) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	std::map<std::string, Benchmark>::iterator it = phases_.find(phase);
+	if (it == phases_.end())
+		it = phases_.insert(std::make_pair(phase, Benchmark(phase))).first;
+	it->second.record(nanoseconds);
+}
+
+inline InstrumentReport Instrumentation::report() const {
+	InstrumentReport report;
+	report.counters.assign(COUNTERS, 0);
+	std::lock_guard<std::mutex> lock(mutex_);
+	for (const std::unique_ptr<Block>& block : blocks_)
+		for (unsigned c = 0; c < COUNTERS; c++)
+			report.counters[c] += block->counts[c].load(std::memory_order_relaxed);
+	for (const std::pair<const std::string, Benchmark>& phase : phases_)
+		report.phases.push_back(phase.second);
+	return report;
+}
+
+inline void Instrumentation::reset() {
+	std::lock_guard<std::mutex> lock(mutex_);
+	for (const std::unique_ptr<Block>& block : blocks_)
+		for (unsigned c = 0; c < COUNTERS; c++)
+			block->counts[c].store(0, std::memory_order_relaxed);
+	phases_.clear();
+}
+
+inline void Instrumentation::set_sink(std::ostream* sink) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	sink_ = sink;
+}
+
+inline void Instrumentation::dump(const std::string& label, const InstrumentReport& since) {
+	InstrumentReport delta = report().since(since);
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (sink_)
+		*sink_ << label << "\n" << delta.toString() << std::flush;
+}
+
+#endif
@@ -0,0 +1,390 @@
+#ifndef JUNCTION_TREE_H
+#define JUNCTION_TREE_H
+
+#include "CompiledNet.h"
+#include "Factor.h"
+
+#include <vector>
+#include <set>
+#include <utility>
+#include <tuple>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+// Exact inference over a compiled network. The moral graph is triangulated
+// by greedy min-fill elimination; each elimination step yields a clique,
+// linked to the clique of the first of its other variables to be
+// eliminated, which gives a junction tree directly. The product of the
+// CPTs assigned to each clique is computed once. Calibration under a set
+// of evidence runs Hugin collect and distribute passes over copies of
+// these potentials and is cached until the evidence changes, so repeated
+// queries under the same evidence only read the calibrated beliefs.
+template <
+	typename NodeType = int,
+	typename ValueType = int
+>
+class JunctionTree
+{
+public:
+	JunctionTree();
+
+	// Triangulation is abandoned as soon as it would need a clique wider
+	// than the limit; treewidth() then exceeds the limit and the tree
+	// cannot answer queries
+	JunctionTree(const CompiledNet<NodeType, ValueType>& net, unsigned width_limit);
+
+	// Width of the triangulation, its largest clique size minus one
+	unsigned treewidth() const;
+	unsigned cliques() const;
+
+	// Probability that every (node, value index) pair of a query holds
+	// given the clamped values, 0 when the evidence is impossible
+	double probability(const std::vector<std::pair<unsigned, unsigned>>& query,
+		const std::vector<int>& clamp);
+
+	// Posterior distribution of one node given the clamped values
+	std::vector<double> marginal(unsigned node, const std::vector<int>& clamp);
+
+	// Log probability of the clamped values from a collect pass alone.
+	// It leaves the cached calibration alone, so concurrent readers of one
+	// tree may call it.
+	double log_evidence(const std::vector<int>& clamp) const;
+
+	// Value index of every node in the most probable assignment given the
+	// clamped values, by max-product collect and traceback from the root;
+	// empty when the evidence is impossible
+	std::vector<unsigned> most_probable(const std::vector<int>& clamp) const;
+private:
+	// Enter the evidence into copies of the potentials and pass messages
+	// towards the root, returning the log probability of the evidence
+	double collect(const std::vector<int>& clamp,
+		std::vector<Factor>& beliefs,
+		std::vector<Factor>& messages) const;
+
+	// Calibrate the beliefs for a set of evidence unless already done
+	void calibrate(const std::vector<int>& clamp);
+
+	unsigned width_;
+	std::vector<Factor> potentials_;
+	std::vector<Factor> beliefs_;
+
+	// Cliques ordered root first, and each clique's parent and separator
+	std::vector<unsigned> order_;
+	std::vector<unsigned> parent_;
+	std::vector<std::vector<unsigned>> separators_;
+	std::vector<Factor> messages_;
+
+	// A clique holding each node together with its parents
+	std::vector<unsigned> home_;
+
+	bool calibrated_;
+	std::vector<int> evidence_;
+	double log_mass_;
+};
+
+template <typename NodeType, typename ValueType>
+JunctionTree<NodeType, ValueType>::JunctionTree() :
+	width_(0), calibrated_(false), log_mass_(0)
+{}
+
+template <typename NodeType, typename ValueType>
+JunctionTree<NodeType, ValueType>::JunctionTree(const CompiledNet<NodeType, ValueType>& net,
+	unsigned width_limit) :
+	width_(0), calibrated_(false), log_mass_(0) {
+	unsigned n = net.size();
+
+	// Moral graph
+	std::vector<std::set<unsigned>> adjacent(n);
+	for (unsigned node = 0; node < n; node++) {
+		std::vector<unsigned> family(net.parents_begin(node), net.parents_end(node));
+		family.push_back(node);
+		for (unsigned a : family)
+			for (unsigned b : family)
+				if (a != b)
+					adjacent[a].insert(b);
+	}
+
+	// Greedy min-fill elimination, ties broken by degree. The scores sit in
+	// an ordered queue and an elimination only rescores the nodes whose
+	// neighbourhood it changes: its neighbours, and the common neighbours
+	// of each fill edge it adds. The first clique wider than the limit ends
+	// the triangulation. A node's fill is its neighbour pairs less the
+	// edges among them, each counted once from either end.
+	std::vector<unsigned> marked(n, 0);
+	unsigned stamp = 0;
+	auto fill_of = [&adjacent, &marked, &stamp](unsigned v) {
+		++stamp;
+		for (unsigned a : adjacent[v])
+			marked[a] = stamp;
+		std::size_t linked = 0;
+		for (unsigned a : adjacent[v])
+			for (unsigned b : adjacent[a])
+				linked += marked[b] == stamp;
+		std::size_t degree = adjacent[v].size();
+		return degree * (degree - 1) / 2 - linked / 2;
+	};
+	typedef std::tuple<std::size_t, std::size_t, unsigned> score_type;
+	std::vector<score_type> score(n);
+	std::set<score_type> queue;
+	for (unsigned v = 0; v < n; v++) {
+		score[v] = std::make_tuple(fill_of(v), adjacent[v].size(), v);
+		queue.insert(score[v]);
+	}
+
+	std::vector<std::vector<unsigned>> cliques;
+	std::vector<unsigned> eliminated_at(n, n);
+	for (unsigned step = 0; step < n; step++) {
+		unsigned best = std::get<2>(*queue.begin());
+		queue.erase(queue.begin());
+		if (adjacent[best].size() > width_limit) {
+			width_ = width_limit + 1;
+			return;
+		}
+
+		std::vector<unsigned> clique(adjacent[best].begin(), adjacent[best].end());
+		clique.insert(std::lower_bound(clique.begin(), clique.end(), best), best);
+		width_ = std::max<unsigned>(width_, clique.size() - 1);
+		std::set<unsigned> dirty(adjacent[best].begin(), adjacent[best].end());
+		for (unsigned a : adjacent[best])
+			for (unsigned b : adjacent[best])
+				if (a < b && adjacent[a].insert(b).second) {
+					adjacent[b].insert(a);
+					for (unsigned w : adjacent[a])
+						if (w != b && w != best && adjacent[b].count(w))
+							dirty.insert(w);
+				}
+		for (unsigned a : adjacent[best])
+			adjacent[a].erase(best);
+		adjacent[best].clear();
+		eliminated_at[best] = step;
+		cliques.push_back(clique);
+
+		for (unsigned w : dirty) {
+			queue.erase(score[w]);
+			score[w] = std::make_tuple(fill_of(w), adjacent[w].size(), w);
+			queue.insert(score[w]);
+		}
+	}
+
+	// Clique i was created by eliminating the i-th node; its parent is the
+	// clique of the first of its other nodes to go. Cliques left without a
+	// parent are components of their own and hang off the last clique with
+	// an empty separator.
+	unsigned m = cliques.size();
+	std::vector<unsigned> eliminated(n);
+	for (unsigned v = 0; v < n; v++)
+		eliminated[eliminated_at[v]] = v;
+	parent_.assign(m, m);
+	separators_.resize(m);
+	for (unsigned c = 0; c + 1 < m; c++) {
+		unsigned first = m;
+		for (unsigned v : cliques[c])
+			if (v != eliminated[c])
+				first = std::min(first, eliminated_at[v]);
+		parent_[c] = first < m ? first : m - 1;
+		for (unsigned v : cliques[c])
+			if (v != eliminated[c])
+				separators_[c].push_back(v);
+	}
+
+	// Children always come before their parent, so the reverse is root first
+	for (unsigned c = m; c-- > 0; )
+		order_.push_back(c);
+
+	// A family is a clique of the moral graph, so the clique of its first
+	// node to be eliminated holds all of it
+	home_.resize(n);
+	for (unsigned node = 0; node < n; node++) {
+		unsigned first = eliminated_at[node];
+		for (const unsigned* p = net.parents_begin(node); p != net.parents_end(node); ++p)
+			first = std::min(first, eliminated_at[*p]);
+		home_[node] = first;
+	}
+
+	for (unsigned c = 0; c < m; c++) {
+		std::vector<unsigned> cardinalities;
+		for (unsigned v : cliques[c])
+			cardinalities.push_back(net.cardinality(v));
+		potentials_.push_back(Factor(cliques[c], cardinalities));
+	}
+
+	// Multiply each CPT, as a factor over its family, into its home clique
+	for (unsigned node = 0; node < n; node++) {
+		std::vector<unsigned> family(net.parents_begin(node), net.parents_end(node));
+		family.push_back(node);
+		std::sort(family.begin(), family.end());
+		std::vector<unsigned> cardinalities;
+		for (unsigned v : family)
+			cardinalities.push_back(net.cardinality(v));
+		Factor cpt(family, cardinalities);
+
+		std::vector<unsigned> parent_values(net.parents_end(node) - net.parents_begin(node));
+		for (std::size_t i = 0; i < cpt.size(); i++) {
+			for (unsigned p = 0; p < parent_values.size(); p++)
+				parent_values[p] = cpt.value_of(i, net.parents_begin(node)[p]);
+			cpt[i] = net.conditional_of(node, parent_values.data(), cpt.value_of(i, node));
+		}
+		potentials_[home_[node]].multiply(cpt);
+	}
+}
+
+template <typename NodeType, typename ValueType>
+unsigned JunctionTree<NodeType, ValueType>::treewidth() const { return width_; }
+
+template <typename NodeType, typename ValueType>
+unsigned JunctionTree<NodeType, ValueType>::cliques() const { return potentials_.size(); }
+
+template <typename NodeType, typename ValueType>
+double JunctionTree<NodeType, ValueType>::collect(const std::vector<int>& clamp,
+	std::vector<Factor>& beliefs,
+	std::vector<Factor>& messages) const {
+	if (potentials_.empty())
+		return 0;
+	beliefs = potentials_;
+	for (unsigned node = 0; node < clamp.size(); node++)
+		if (clamp[node] >= 0)
+			beliefs[home_[node]].reduce(node, clamp[node]);
+
+	// Messages are normalized with their scale kept aside, so that long
+	// chains of small probabilities cannot underflow
+	double log_scale = 0;
+	messages.assign(beliefs.size(), Factor());
+	for (unsigned i = order_.size(); i-- > 1; ) {
+		unsigned c = order_[i];
+		Factor message = beliefs[c].marginal(separators_[c]);
+		double mass = message.sum();
+		if (mass <= 0)
+			return -std::numeric_limits<double>::infinity();
+		message.scale(1 / mass);
+		log_scale += std::log(mass);
+		beliefs[parent_[c]].multiply(message);
+		messages[c] = message;
+	}
+	double mass = beliefs[order_.front()].sum();
+	return mass > 0 ? log_scale + std::log(mass) : -std::numeric_limits<double>::infinity();
+}
+
+template <typename NodeType, typename ValueType>
+void JunctionTree<NodeType, ValueType>::calibrate(const std::vector<int>& clamp) {
+	if (calibrated_ && clamp == evidence_)
+		return;
+	log_mass_ = collect(clamp, beliefs_, messages_);
+
+	// Distribute back out, dividing out what each clique already sent
+	if (log_mass_ > -std::numeric_limits<double>::infinity())
+		for (unsigned i = 1; i < order_.size(); i++) {
+			unsigned c = order_[i];
+			Factor message = beliefs_[parent_[c]].marginal(separators_[c]);
+			message.divide(messages_[c]);
+			beliefs_[c].multiply(message);
+		}
+
+	evidence_ = clamp;
+	calibrated_ = true;
+}
+
+template <typename NodeType, typename ValueType>
+double JunctionTree<NodeType, ValueType>::probability(
+	const std::vector<std::pair<unsigned, unsigned>>& query,
+	const std::vector<int>& clamp) {
+	calibrate(clamp);
+	if (log_mass_ == -std::numeric_limits<double>::infinity())
+		return 0;
+
+	// A query inside one clique reads its calibrated belief
+	for (const Factor& belief : beliefs_) {
+		bool inside = true;
+		for (unsigned i = 0; inside && i < query.size(); i++)
+			inside = belief.contains(query[i].first);
+		if (!inside)
+			continue;
+		double hit = 0;
+		for (std::size_t i = 0; i < belief.size(); i++) {
+			bool holds = true;
+			for (unsigned q = 0; holds && q < query.size(); q++)
+				holds = belief.value_of(i, query[q].first) == query[q].second;
+			if (holds)
+				hit += belief[i];
+		}
+		return hit / belief.sum();
+	}
+
+	// Otherwise take the ratio of the evidence masses with and without the
+	// query; a collect pass alone gives the mass and the cached
+	// calibration stays in place
+	std::vector<int> joint = clamp;
+	for (const std::pair<unsigned, unsigned>& q : query) {
+		if (joint[q.first] >= 0 && joint[q.first] != (int)q.second)
+			return 0;
+		joint[q.first] = q.second;
+	}
+	std::vector<Factor> beliefs, messages;
+	return std::exp(collect(joint, beliefs, messages) - log_mass_);
+}
+
+template <typename NodeType, typename ValueType>
+double JunctionTree<NodeType, ValueType>::log_evidence(const std::vector<int>& clamp) const {
+	std::vector<Factor> beliefs, messages;
+	return collect(clamp, beliefs, messages);
+}
+
+template <typename NodeType, typename ValueType>
+std::vector<double> JunctionTree<NodeType, ValueType>::marginal(unsigned node,
+	const std::vector<int>& clamp) {
+	calibrate(clamp);
+	Factor belief = beliefs_[home_[node]].marginal(std::vector<unsigned>(1, node));
+	double mass = belief.sum();
+	std::vector<double> dist(belief.size(), 0);
+	for (std::size_t v = 0; v < belief.size(); v++)
+		dist[v] = mass > 0 ? belief[v] / mass : 0;
+	return dist;
+}
+
+template <typename NodeType, typename ValueType>
+std::vector<unsigned> JunctionTree<NodeType, ValueType>::most_probable(const std::vector<int>& clamp) const {
+	std::vector<Factor> beliefs = potentials_;
+	for (unsigned node = 0; node < clamp.size(); node++)
+		if (clamp[node] >= 0)
+			beliefs[home_[node]].reduce(node, clamp[node]);
+
+	// Max-messages are scaled to a largest entry of one; after the collect
+	// pass each belief holds the best completion of its subtree
+	for (unsigned i = order_.size(); i-- > 1; ) {
+		unsigned c = order_[i];
+		Factor message = beliefs[c].max_marginal(separators_[c]);
+		double best = message.max();
+		if (best <= 0)
+			return std::vector<unsigned>();
+		message.scale(1 / best);
+		beliefs[parent_[c]].multiply(message);
+	}
+	if (!order_.empty() && beliefs[order_.front()].max() <= 0)
+		return std::vector<unsigned>();
+
+	// Root first, each clique takes its best entry agreeing with the
+	// values its parent clique fixed
+	std::vector<int> assigned(clamp.size(), -1);
+	for (unsigned c : order_) {
+		const Factor& belief = beliefs[c];
+		const std::vector<unsigned>& variables = belief.variables();
+		std::size_t best = 0;
+		double best_value = -1;
+		for (std::size_t i = 0; i < belief.size(); i++) {
+			if (belief[i] <= best_value)
+				continue;
+			bool agrees = true;
+			for (unsigned v = 0; agrees && v < variables.size(); v++)
+				agrees = assigned[variables[v]] < 0 || belief.value_of(i, variables[v]) == (unsigned)assigned[variables[v]];
+			if (agrees) {
+				best = i;
+				best_value = belief[i];
+			}
+		}
+		for (unsigned variable : variables)
+			assigned[variable] = belief.value_of(best, variable);
+	}
+	return std::vector<unsigned>(assigned.begin(), assigned.end());
+}
+
+#endif
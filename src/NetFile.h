@@ -0,0 +1,476 @@
+#ifndef NET_FILE_H
+#define NET_FILE_H
+
+#include "CompiledNet.h"
+#include "FlatArray.h"
+#include "Errors.h"
+
+#include <vector>
+#include <map>
+#include <string>
+#include <memory>
+#include <fstream>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Display names of the nodes of a network and of each node's values, as
+// read from a BIF file. Either list may be empty.
+struct NetNames
+{
+	std::vector<std::string> nodes;
+	std::vector<std::vector<std::string>> values;
+};
+
+// Binary form of a compiled network. The file holds a fixed 64-byte
+// header, a table of sections, and every array of the compiled network as
+// its own section starting on a 64-byte boundary: the node table (labels
+// and value domains), the CSR parent, child and blanket arrays, the CPT
+// strides, offsets and storage kinds, the probability, cutoff and alias
+// arrays, and the decision trees and noisy-MAX CDFs of the compact CPDs.
+// Mapping a file makes every one of those arrays a view into the mapping,
+// so loading costs no copies; only the row index of sparse CPTs is
+// rebuilt. Files are in native byte order and word sizes, which the
+// header records and map() checks. Before handing out any view, map() also
+// checks that every index the arrays hold stays within what it indexes, so
+// a truncated or corrupt file fails with FormatException rather than
+// reading out of bounds later.
+class NetFile
+{
+public:
+	template <typename NodeType, typename ValueType>
+	static void write(const std::string& path,
+		const CompiledNet<NodeType, ValueType>& net,
+		const NetNames& names = NetNames());
+
+	// Map a file read only; the network keeps the mapping alive
+	template <typename NodeType, typename ValueType>
+	static CompiledNet<NodeType, ValueType> map(const std::string& path,
+		NetNames* names = nullptr);
+private:
+	enum Section {
+		LABELS, VALUE_OFFSET, VALUES,
+		PARENT_OFFSET, PARENTS, CHILD_OFFSET, CHILDREN, CHILD_STRIDES,
+		BLANKET_OFFSET, BLANKET, ORDER, RANK,
+		STRIDES, CPT_OFFSET, STORAGE, SPARSE_OFFSET, SPARSE_KEYS,
+		PROBS, CUTOFFS, ALIASES, NAMES,
+		FALLBACK, TREE_OFFSET, TREE, NOISY_OFFSET, NOISY_CDF,
+		SECTIONS
+	};
+
+	struct Header {
+		char magic[8];
+		std::uint32_t version;
+		std::uint32_t byte_order;
+		std::uint32_t node_size;
+		std::uint32_t value_size;
+		std::uint32_t index_size;
+		std::uint32_t nodes;
+		std::uint32_t sections;
+		char reserved[28];
+	};
+
+	struct Extent {
+		std::uint64_t offset;
+		std::uint64_t bytes;
+	};
+
+	static const std::uint32_t version = 2;
+	static const std::uint32_t byte_order = 0x01020304;
+	static const std::size_t alignment = 64;
+
+	static std::size_t align(std::size_t offset) {
+		return (offset + alignment - 1) / alignment * alignment;
+	}
+
+	// Unmaps a file once the last array viewing it is gone
+	struct Mapping {
+		Mapping(void* address, std::size_t bytes) : address(address), bytes(bytes) {}
+		~Mapping() { munmap(address, bytes); }
+
+		void* address;
+		std::size_t bytes;
+	};
+
+	template <typename T>
+	static void view(FlatArray<T>& array, const char* base, const Extent& extent,
+		const std::shared_ptr<const void>& keep);
+
+	// Whether CSR offsets over n nodes start at 0, never decrease and end
+	// at the size of the array they index
+	template <typename Offsets>
+	static bool offsets(const Offsets& offset, std::size_t n, std::size_t size);
+
+	// Throw FormatException unless the adjacency, order and CPT indices of
+	// a mapped network, and the sparse row counts, are consistent
+	template <typename NodeType, typename ValueType>
+	static void check(const CompiledNet<NodeType, ValueType>& net, const std::uint64_t* sparse_offset);
+};
+
+template <typename NodeType, typename ValueType>
+void NetFile::write(const std::string& path,
+	const CompiledNet<NodeType, ValueType>& net,
+	const NetNames& names) {
+	static_assert(std::is_trivially_copyable<NodeType>::value &&
+		std::is_trivially_copyable<ValueType>::value,
+		"only trivially copyable labels and values can be stored");
+	unsigned n = net.size();
+
+	// Sparse CPTs store the parent values of each row in row order
+	std::vector<std::uint64_t> sparse_offset(1, 0);
+	std::vector<unsigned> sparse_keys;
+	for (unsigned i = 0; i < n; i++) {
+		std::vector<const std::vector<unsigned>*> keys(net.sparse_rows_[i].size());
+		for (const auto& row : net.sparse_rows_[i])
+			keys[row.second] = &row.first;
+		for (const std::vector<unsigned>* key : keys)
+			sparse_keys.insert(sparse_keys.end(), key->begin(), key->end());
+		sparse_offset.push_back(sparse_offset.back() + keys.size());
+	}
+
+	// Names as consecutive NUL-terminated strings, each node before its values
+	std::string blob;
+	if (!names.nodes.empty())
+		for (unsigned i = 0; i < n; i++) {
+			blob += names.nodes[i];
+			blob += '\0';
+			for (unsigned v = 0; v < net.cardinality(i); v++) {
+				if (i < names.values.size() && v < names.values[i].size())
+					blob += names.values[i][v];
+				blob += '\0';
+			}
+		}
+
+	const void* data[SECTIONS] = {
+		net.labels_.data(), net.value_offset_.data(), net.values_.data(),
+		net.parent_offset_.data(), net.parents_.data(), net.child_offset_.data(),
+		net.children_.data(), net.child_strides_.data(),
+		net.blanket_offset_.data(), net.blanket_.data(), net.order_.data(), net.rank_.data(),
+		net.strides_.data(), net.cpt_offset_.data(), net.storage_.data(),
+		sparse_offset.data(), sparse_keys.data(),
+		net.probs_.data(), net.cutoff_.data(), net.alias_.data(), blob.data(),
+		net.fallback_.data(), net.tree_offset_.data(), net.tree_.data(),
+		net.noisy_offset_.data(), net.noisy_cdf_.data()
+	};
+	std::size_t bytes[SECTIONS] = {
+		net.labels_.size() * sizeof(NodeType),
+		net.value_offset_.size() * sizeof(unsigned),
+		net.values_.size() * sizeof(ValueType),
+		net.parent_offset_.size() * sizeof(unsigned),
+		net.parents_.size() * sizeof(unsigned),
+		net.child_offset_.size() * sizeof(unsigned),
+		net.children_.size() * sizeof(unsigned),
+		net.child_strides_.size() * sizeof(std::size_t),
+		net.blanket_offset_.size() * sizeof(unsigned),
+		net.blanket_.size() * sizeof(unsigned),
+		net.order_.size() * sizeof(unsigned),
+		net.rank_.size() * sizeof(unsigned),
+		net.strides_.size() * sizeof(std::size_t),
+		net.cpt_offset_.size() * sizeof(std::size_t),
+		net.storage_.size() * sizeof(char),
+		sparse_offset.size() * sizeof(std::uint64_t),
+		sparse_keys.size() * sizeof(unsigned),
+		net.probs_.size() * sizeof(double),
+		net.cutoff_.size() * sizeof(double),
+		net.alias_.size() * sizeof(unsigned),
+		blob.size(),
+		net.fallback_.size() * sizeof(std::size_t),
+		net.tree_offset_.size() * sizeof(unsigned),
+		net.tree_.size() * sizeof(unsigned),
+		net.noisy_offset_.size() * sizeof(std::size_t),
+		net.noisy_cdf_.size() * sizeof(double)
+	};
+
+	Header header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, "BNMCNET", 8);
+	header.version = version;
+	header.byte_order = byte_order;
+	header.node_size = sizeof(NodeType);
+	header.value_size = sizeof(ValueType);
+	header.index_size = sizeof(std::size_t);
+	header.nodes = n;
+	header.sections = SECTIONS;
+
+	Extent extents[SECTIONS];
+	std::size_t offset = align(sizeof(Header) + sizeof(extents));
+	for (unsigned s = 0; s < SECTIONS; s++) {
+		extents[s].offset = offset;
+		extents[s].bytes = bytes[s];
+		offset = align(offset + bytes[s]);
+	}
+
+	std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+	if (!out)
+		throw FileException();
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	out.write(reinterpret_cast<const char*>(extents), sizeof(extents));
+	std::size_t written = sizeof(header) + sizeof(extents);
+	const char padding[alignment] = {};
+	for (unsigned s = 0; s < SECTIONS; s++) {
+		out.write(padding, extents[s].offset - written);
+		out.write(static_cast<const char*>(data[s]), bytes[s]);
+		written = extents[s].offset + bytes[s];
+	}
+	out.write(padding, align(written) - written);
+	if (!out)
+		throw FileException();
+}
+
+template <typename T>
+void NetFile::view(FlatArray<T>& array, const char* base, const Extent& extent,
+	const std::shared_ptr<const void>& keep) {
+	if (extent.bytes % sizeof(T) != 0)
+		throw FormatException();
+	array.view(reinterpret_cast<const T*>(base + extent.offset), extent.bytes / sizeof(T), keep);
+}
+
+template <typename Offsets>
+bool NetFile::offsets(const Offsets& offset, std::size_t n, std::size_t size) {
+	if (offset.size() != n + 1 || offset[0] != 0 || offset[n] != size)
+		return false;
+	for (std::size_t i = 0; i < n; i++)
+		if (offset[i] > offset[i + 1])
+			return false;
+	return true;
+}
+
+template <typename NodeType, typename ValueType>
+void NetFile::check(const CompiledNet<NodeType, ValueType>& net, const std::uint64_t* sparse_offset) {
+	typedef CompiledNet<NodeType, ValueType> net_type;
+	std::size_t n = net.labels_.size();
+	auto nodes = [n](const FlatArray<unsigned>& indices) {
+		for (unsigned index : indices)
+			if (index >= n)
+				return false;
+		return true;
+	};
+	if (!offsets(net.value_offset_, n, net.values_.size()) ||
+		!offsets(net.parent_offset_, n, net.parents_.size()) ||
+		!offsets(net.child_offset_, n, net.children_.size()) ||
+		!offsets(net.blanket_offset_, n, net.blanket_.size()) ||
+		!offsets(net.tree_offset_, n, net.tree_.size()) ||
+		!offsets(net.noisy_offset_, n, net.noisy_cdf_.size()) ||
+		!nodes(net.parents_) || !nodes(net.children_) || !nodes(net.blanket_) ||
+		net.strides_.size() != net.parents_.size() || net.child_strides_.size() != net.children_.size() ||
+		net.order_.size() != n || net.rank_.size() != n || sparse_offset[0] != 0)
+		throw FormatException();
+
+	// Labels ascend, the order is a permutation with rank its inverse and
+	// puts parents first, and the children and their strides mirror the
+	// parents
+	std::vector<unsigned> fill(net.child_offset_.begin(), net.child_offset_.end() - 1);
+	for (unsigned j = 0; j < n; j++)
+		if (net.order_[j] >= n || net.rank_[net.order_[j]] != j)
+			throw FormatException();
+	for (unsigned i = 0; i < n; i++) {
+		if (i > 0 && !(net.labels_[i - 1] < net.labels_[i]))
+			throw FormatException();
+		for (unsigned e = net.parent_offset_[i]; e < net.parent_offset_[i + 1]; e++) {
+			unsigned parent = net.parents_[e];
+			unsigned at = fill[parent]++;
+			if (net.rank_[parent] >= net.rank_[i] || at >= net.child_offset_[parent + 1] ||
+				net.children_[at] != i || net.child_strides_[at] != net.strides_[e])
+				throw FormatException();
+		}
+	}
+
+	// Each node's rows run from its CPT offset to the next node's; every
+	// row its storage can reach must be among them
+	std::size_t probs = net.probs_.size();
+	for (unsigned i = 0; i < n; i++) {
+		std::size_t begin = net.cpt_offset_[i];
+		std::size_t end = i + 1 < n ? net.cpt_offset_[i + 1] : probs;
+		unsigned k = net.cardinality(i);
+		if (begin > end || end > probs || (k > 0 && (end - begin) % k != 0) ||
+			sparse_offset[i + 1] < sparse_offset[i])
+			throw FormatException();
+		std::size_t rows = k > 0 ? (end - begin) / k : 0;
+		for (std::size_t a = begin; a < end; a++)
+			if (net.alias_[a] > k)
+				throw FormatException();
+		std::uint64_t listed = sparse_offset[i + 1] - sparse_offset[i];
+		unsigned parents = net.parent_offset_[i + 1] - net.parent_offset_[i];
+		const unsigned* parent = net.parents_.data() + net.parent_offset_[i];
+		const std::size_t* stride = net.strides_.data() + net.parent_offset_[i];
+		if (net.storage_[i] != net_type::SPARSE && listed != 0)
+			throw FormatException();
+
+		switch (net.storage_[i]) {
+		case net_type::DENSE: {
+			// The last row is where every parent takes its last value;
+			// a node without values reads no row at all
+			if (k == 0)
+				break;
+			std::size_t last = 0;
+			for (unsigned j = 0; j < parents; j++) {
+				std::size_t c = net.cardinality(parent[j]);
+				if (c > 1 && (stride[j] > rows / (c - 1) || (last += (c - 1) * stride[j]) >= rows))
+					throw FormatException();
+			}
+			if (last >= rows)
+				throw FormatException();
+			break;
+		}
+		case net_type::SPARSE:
+			if (listed > rows || (net.fallback_[i] != net_type::npos && net.fallback_[i] >= rows))
+				throw FormatException();
+			break;
+		case net_type::TREE: {
+			// Subtrees come before the splits over them, so every branch
+			// points back to a node already seen and lookups terminate
+			const unsigned* block = net.tree_.data() + net.tree_offset_[i];
+			std::size_t size = net.tree_offset_[i + 1] - net.tree_offset_[i];
+			std::vector<char> seen(size, 0);
+			for (std::size_t at = 1; at < size; ) {
+				seen[at] = 1;
+				if (block[at] == net_type::leaf_tag) {
+					if (at + 2 > size || block[at + 1] >= rows)
+						throw FormatException();
+					at += 2;
+					continue;
+				}
+				if (block[at] >= parents)
+					throw FormatException();
+				std::size_t c = net.cardinality(parent[block[at]]);
+				if (c > size - at - 1)
+					throw FormatException();
+				for (std::size_t v = 0; v < c; v++)
+					if (block[at + 1 + v] >= at || !seen[block[at + 1 + v]])
+						throw FormatException();
+				at += 1 + c;
+			}
+			if (size < 2 || block[0] >= size || !seen[block[0]])
+				throw FormatException();
+			break;
+		}
+		case net_type::NOISY: {
+			std::size_t cdfs = 1;
+			for (unsigned j = 0; j < parents; j++)
+				cdfs += net.cardinality(parent[j]);
+			if (net.noisy_offset_[i + 1] - net.noisy_offset_[i] != cdfs * k)
+				throw FormatException();
+			break;
+		}
+		default:
+			throw FormatException();
+		}
+	}
+}
+
+template <typename NodeType, typename ValueType>
+CompiledNet<NodeType, ValueType> NetFile::map(const std::string& path, NetNames* names) {
+	static_assert(std::is_trivially_copyable<NodeType>::value &&
+		std::is_trivially_copyable<ValueType>::value,
+		"only trivially copyable labels and values can be stored");
+
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw FileException();
+	struct stat info;
+	if (fstat(fd, &info) != 0) {
+		close(fd);
+		throw FileException();
+	}
+	std::size_t size = info.st_size;
+	if (size < sizeof(Header) + SECTIONS * sizeof(Extent)) {
+		close(fd);
+		throw FormatException();
+	}
+	void* address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (address == MAP_FAILED)
+		throw FileException();
+	std::shared_ptr<const void> keep = std::make_shared<Mapping>(address, size);
+	const char* base = static_cast<const char*>(address);
+
+	Header header;
+	std::memcpy(&header, base, sizeof(header));
+	if (std::memcmp(header.magic, "BNMCNET", 8) != 0 || header.version != version ||
+		header.byte_order != byte_order || header.node_size != sizeof(NodeType) ||
+		header.value_size != sizeof(ValueType) || header.index_size != sizeof(std::size_t) ||
+		header.sections != SECTIONS)
+		throw FormatException();
+	Extent extents[SECTIONS];
+	std::memcpy(extents, base + sizeof(header), sizeof(extents));
+	for (const Extent& extent : extents)
+		if (extent.offset % alignment != 0 || extent.offset > size || extent.bytes > size - extent.offset)
+			throw FormatException();
+
+	CompiledNet<NodeType, ValueType> net;
+	view(net.labels_, base, extents[LABELS], keep);
+	view(net.value_offset_, base, extents[VALUE_OFFSET], keep);
+	view(net.values_, base, extents[VALUES], keep);
+	view(net.parent_offset_, base, extents[PARENT_OFFSET], keep);
+	view(net.parents_, base, extents[PARENTS], keep);
+	view(net.child_offset_, base, extents[CHILD_OFFSET], keep);
+	view(net.children_, base, extents[CHILDREN], keep);
+	view(net.child_strides_, base, extents[CHILD_STRIDES], keep);
+	view(net.blanket_offset_, base, extents[BLANKET_OFFSET], keep);
+	view(net.blanket_, base, extents[BLANKET], keep);
+	view(net.order_, base, extents[ORDER], keep);
+	view(net.rank_, base, extents[RANK], keep);
+	view(net.strides_, base, extents[STRIDES], keep);
+	view(net.cpt_offset_, base, extents[CPT_OFFSET], keep);
+	view(net.storage_, base, extents[STORAGE], keep);
+	view(net.probs_, base, extents[PROBS], keep);
+	view(net.cutoff_, base, extents[CUTOFFS], keep);
+	view(net.alias_, base, extents[ALIASES], keep);
+	view(net.fallback_, base, extents[FALLBACK], keep);
+	view(net.tree_offset_, base, extents[TREE_OFFSET], keep);
+	view(net.tree_, base, extents[TREE], keep);
+	view(net.noisy_offset_, base, extents[NOISY_OFFSET], keep);
+	view(net.noisy_cdf_, base, extents[NOISY_CDF], keep);
+
+	unsigned n = header.nodes;
+	if (net.labels_.size() != n || net.value_offset_.size() != n + 1 ||
+		net.parent_offset_.size() != n + 1 || net.cpt_offset_.size() != n ||
+		net.storage_.size() != n || net.cutoff_.size() != net.probs_.size() ||
+		net.alias_.size() != net.probs_.size() || net.fallback_.size() != n ||
+		net.tree_offset_.size() != n + 1 || net.tree_offset_[n] != net.tree_.size() ||
+		net.noisy_offset_.size() != n + 1 || net.noisy_offset_[n] != net.noisy_cdf_.size())
+		throw FormatException();
+
+	// Rebuild the row index of the sparse CPTs
+	const std::uint64_t* sparse_offset = reinterpret_cast<const std::uint64_t*>(base + extents[SPARSE_OFFSET].offset);
+	const unsigned* sparse_keys = reinterpret_cast<const unsigned*>(base + extents[SPARSE_KEYS].offset);
+	if (extents[SPARSE_OFFSET].bytes != (n + 1) * sizeof(std::uint64_t))
+		throw FormatException();
+	check(net, sparse_offset);
+	net.sparse_rows_.resize(n);
+	std::size_t key = 0;
+	for (unsigned i = 0; i < n; i++) {
+		unsigned width = net.parent_offset_[i + 1] - net.parent_offset_[i];
+		for (std::uint64_t r = 0; r < sparse_offset[i + 1] - sparse_offset[i]; r++, key += width) {
+			if ((key + width) * sizeof(unsigned) > extents[SPARSE_KEYS].bytes)
+				throw FormatException();
+			net.sparse_rows_[i][std::vector<unsigned>(sparse_keys + key, sparse_keys + key + width)] = r;
+		}
+	}
+
+	if (names) {
+		*names = NetNames();
+		const char* text = base + extents[NAMES].offset;
+		const char* end = text + extents[NAMES].bytes;
+		auto next = [&text, end]() {
+			std::string name(text, strnlen(text, end - text));
+			text += std::min<std::size_t>(name.size() + 1, end - text);
+			return name;
+		};
+		for (unsigned i = 0; i < n && text < end; i++) {
+			names->nodes.push_back(next());
+			names->values.push_back(std::vector<std::string>());
+			for (unsigned v = 0; v < net.cardinality(i) && text < end; v++)
+				names->values.back().push_back(next());
+		}
+	}
+	return net;
+}
+
+#endif
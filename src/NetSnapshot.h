@@ -0,0 +1,501 @@
+#ifndef NET_SNAPSHOT_H
+#define NET_SNAPSHOT_H
+
+#include "CompiledNet.h"
+#include "Chain.h"
+#include "ChainExecutor.h"
+#include "Accumulators.h"
+#include "Weighting.h"
+#include "JunctionTree.h"
+#include "Relevance.h"
+#include "Evidence.h"
+#include "QueryTypes.h"
+#include "ArrayDist.h"
+#include "Instrument.h"
+
+#include <vector>
+#include <map>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <limits>
+#include <cmath>
+#include <cstdint>
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+class BayesNet;
+
+// Immutable view of a network for concurrent readers: the compiled
+// structure and CPTs, the junction tree and the sampling settings, frozen
+// when the snapshot is taken. Every query is const and takes its evidence
+// and seed as arguments, so any number of threads may query one shared
+// snapshot under different evidence at once. Nothing is cached between
+// queries; BayesNet keeps the caches for single-threaded use and samples
+// through its snapshot, so both answer a query alike. The junction tree is
+// triangulated on the first query that can use it, unless the network had
+// already built one, so taking a snapshot is cheap.
+template <
+	typename NodeType = int,
+	typename ValueType = int,
+	typename DistType = std::map<ValueType, double>,
+	typename EngineType = Xoshiro256
+>
+class NetSnapshot
+{
+public:
+	typedef Evidence<NodeType, ValueType> evidence_type;
+
+	// The tree, if given, must have been built from the same network with
+	// the same limit; it is only used when its treewidth is within the limit
+	NetSnapshot(std::shared_ptr<const CompiledNet<NodeType, ValueType>> net,
+		std::shared_ptr<const JunctionTree<NodeType, ValueType>> tree,
+		unsigned treewidth_limit,
+		unsigned chains,
+		bool pruning);
+
+	const CompiledNet<NodeType, ValueType>& compiled() const;
+	unsigned chains() const;
+
+	// Whether SampleStrategy::EXACT is answered from the junction tree,
+	// building the tree if it is not built yet
+	bool exact() const;
+
+	// Nodes a query on the given nodes depends on under the evidence
+	std::set<NodeType> relevant_nodes(const std::set<NodeType>& query, const evidence_type& evidence) const;
+
+	// Probability that every node of q holds its value given the evidence
+	double probability(const std::map<NodeType, ValueType>& q,
+		const evidence_type& evidence,
+		unsigned int count,
+		SampleStrategy strat,
+		std::uint64_t seed) const;
+
+	// Joint queries and single-node marginals from one set of chains, as
+	// BayesNet::marginal_batch answers them
+	BatchAnswer<DistType> marginal_batch(
+		const std::vector<std::map<NodeType, ValueType>>& queries,
+		const std::vector<NodeType>& nodes,
+		const evidence_type& evidence,
+		unsigned int count,
+		SampleStrategy strat,
+		std::uint64_t seed) const;
+
+	// Most probable assignment of every node given the evidence, as
+	// BayesNet::most_probable_explanation finds it
+	std::map<NodeType, ValueType> most_probable_explanation(const evidence_type& evidence,
+		unsigned int count,
+		std::uint64_t seed) const;
+private:
+	friend class BayesNet<NodeType, ValueType, DistType, EngineType>;
+
+	NetSnapshot(const NetSnapshot&);
+	NetSnapshot& operator=(const NetSnapshot&);
+
+	// Answer of a sampled query together with the per-chain accumulators
+	// behind it, so that a cache can extend the chains later
+	struct SampledAnswer {
+		SampledAnswer() : strategy(SampleStrategy::GIBBS), samples(0), exact(false) {}
+
+		ChainReport report;
+		SampleStrategy strategy;
+		std::vector<IndicatorCounter<NodeType, ValueType>> counters;
+		std::vector<WeightedIndicator<NodeType, ValueType>> weighted;
+		SwapStats swaps;
+		unsigned long samples;
+		bool exact;
+	};
+
+	// The junction tree, built by the first caller
+	const JunctionTree<NodeType, ValueType>& tree() const;
+
+	// Value index each node of a network is clamped to, or -1
+	static std::vector<int> clamps(const CompiledNet<NodeType, ValueType>& net, const evidence_type& evidence);
+
+	// Probability of a query from the junction tree; zero when the query
+	// names an unknown node or value or contradicts the evidence
+	double exact_probability(const std::map<NodeType, ValueType>& q, const std::vector<int>& clamp) const;
+
+	// The joint queries of a batch followed by one indicator per value of
+	// each single node, and the answer assembled from their reports
+	static std::vector<std::map<NodeType, ValueType>> indicators(const CompiledNet<NodeType, ValueType>& net,
+		const std::vector<std::map<NodeType, ValueType>>& queries,
+		const std::vector<NodeType>& nodes);
+	static BatchAnswer<DistType> assemble(const CompiledNet<NodeType, ValueType>& net,
+		std::size_t queries,
+		const std::vector<NodeType>& nodes,
+		const std::vector<ChainReport>& reports);
+
+	// Extend every entry to count samples from one set of chains feeding
+	// all the queries, on the snapshot's network or a subnetwork of it. The
+	// entries must hold equally many samples, as those of one earlier call.
+	void sample(const CompiledNet<NodeType, ValueType>& net,
+		const std::vector<int>& clamp,
+		const std::vector<std::map<NodeType, ValueType>>& queries,
+		std::vector<SampledAnswer>& entries,
+		unsigned long count,
+		SampleStrategy strat,
+		std::uint64_t seed) const;
+
+	// Replace an entry with chains run until their summary meets the rule
+	void sample(const CompiledNet<NodeType, ValueType>& net,
+		const std::vector<int>& clamp,
+		const std::map<NodeType, ValueType>& q,
+		SampledAnswer& entry,
+		const StoppingRule& rule,
+		SampleStrategy strat,
+		std::uint64_t seed) const;
+
+	// Call run.apply<ChainType, Accumulator>(burn_in) with the chain a
+	// strategy samples a network with; EXACT falls back on Gibbs
+	template <typename Run>
+	static void with_chain(const CompiledNet<NodeType, ValueType>& net, SampleStrategy strat, Run& run);
+
+	// Accumulators an entry keeps for a kind of chain
+	static std::vector<IndicatorCounter<NodeType, ValueType>>& kept(SampledAnswer& entry,
+		const IndicatorCounter<NodeType, ValueType>*) { return entry.counters; }
+	static std::vector<WeightedIndicator<NodeType, ValueType>>& kept(SampledAnswer& entry,
+		const WeightedIndicator<NodeType, ValueType>*) { return entry.weighted; }
+
+	struct Extend;
+	struct Converge;
+
+	// Gibbs chain specialised to the cardinality DistType fixes, or to
+	// binary nodes when it fixes none; used when every node matches it
+	static const unsigned fixed_k = fixed_cardinality<DistType>::value ? fixed_cardinality<DistType>::value : 2;
+	typedef FixedGibbsChain<NodeType, ValueType, EngineType, fixed_k> FixedGibbs;
+	typedef TemperedChain<NodeType, ValueType, EngineType> Tempered;
+
+	const std::shared_ptr<const CompiledNet<NodeType, ValueType>> net_;
+	mutable std::shared_ptr<const JunctionTree<NodeType, ValueType>> tree_;
+	mutable std::once_flag tree_built_;
+	const unsigned treewidth_limit_;
+	const unsigned chains_;
+	const bool pruning_;
+};
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+NetSnapshot<NodeType, ValueType, DistType, EngineType>::NetSnapshot(
+	std::shared_ptr<const CompiledNet<NodeType, ValueType>> net,
+	std::shared_ptr<const JunctionTree<NodeType, ValueType>> tree,
+	unsigned treewidth_limit,
+	unsigned chains,
+	bool pruning) :
+	net_(net),
+	tree_(tree),
+	treewidth_limit_(treewidth_limit),
+	chains_(std::max(1u, chains)),
+	pruning_(pruning) {}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+const CompiledNet<NodeType, ValueType>& NetSnapshot<NodeType, ValueType, DistType, EngineType>::compiled() const {
+	return *net_;
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+unsigned NetSnapshot<NodeType, ValueType, DistType, EngineType>::chains() const { return chains_; }
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+bool NetSnapshot<NodeType, ValueType, DistType, EngineType>::exact() const {
+	const JunctionTree<NodeType, ValueType>& built = tree();
+	return built.cliques() > 0 && built.treewidth() <= treewidth_limit_;
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+const JunctionTree<NodeType, ValueType>& NetSnapshot<NodeType, ValueType, DistType, EngineType>::tree() const {
+	std::call_once(tree_built_, [this]() {
+		if (!tree_) {
+			BN_PHASE("junction_tree");
+			tree_ = std::make_shared<const JunctionTree<NodeType, ValueType>>(*net_, treewidth_limit_);
+		}
+	});
+	return *tree_;
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+std::set<NodeType> NetSnapshot<NodeType, ValueType, DistType, EngineType>::relevant_nodes(
+	const std::set<NodeType>& query,
+	const evidence_type& evidence) const {
+	std::vector<unsigned> indices;
+	for (NodeType node_id : query)
+		if (net_->contains(node_id))
+			indices.push_back(net_->index_of(node_id));
+	std::vector<Relevance> marks = relevance(*net_, indices, clamps(*net_, evidence));
+	std::set<NodeType> nodes;
+	for (unsigned node = 0; node < net_->size(); node++)
+		if (marks[node] != Relevance::IRRELEVANT)
+			nodes.insert(net_->label(node));
+	return nodes;
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+double NetSnapshot<NodeType, ValueType, DistType, EngineType>::probability(
+	const std::map<NodeType, ValueType>& q,
+	const evidence_type& evidence,
+	unsigned int count,
+	SampleStrategy strat,
+	std::uint64_t seed) const {
+	return marginal_batch(std::vector<std::map<NodeType, ValueType>>(1, q),
+		std::vector<NodeType>(), evidence, count, strat, seed).joint.front();
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+BatchAnswer<DistType> NetSnapshot<NodeType, ValueType, DistType, EngineType>::marginal_batch(
+	const std::vector<std::map<NodeType, ValueType>>& queries,
+	const std::vector<NodeType>& nodes,
+	const evidence_type& evidence,
+	unsigned int count,
+	SampleStrategy strat,
+	std::uint64_t seed) const {
+	BN_REPORT("snapshot_batch");
+	std::vector<int> clamp = clamps(*net_, evidence);
+	std::vector<std::map<NodeType, ValueType>> queried = indicators(*net_, queries, nodes);
+	std::vector<ChainReport> reports(queried.size());
+	if (strat == SampleStrategy::EXACT && exact()) {
+		for (unsigned i = 0; i < queried.size(); i++) {
+			reports[i].mean = exact_probability(queried[i], clamp);
+			reports[i].std_error = 0;
+		}
+	} else if (!queried.empty()) {
+		// The chains run on the part of the network the queries depend on
+		std::shared_ptr<const CompiledNet<NodeType, ValueType>> pruned;
+		if (pruning_) {
+			std::set<unsigned> touched;
+			for (const std::map<NodeType, ValueType>& q : queried)
+				for (std::pair<NodeType, ValueType> p : q)
+					if (net_->contains(p.first))
+						touched.insert(net_->index_of(p.first));
+			pruned = relevant_subnet<DistType>(*net_,
+				relevance(*net_, std::vector<unsigned>(touched.begin(), touched.end()), clamp), clamp);
+		}
+		const CompiledNet<NodeType, ValueType>& sampled = pruned ? *pruned : *net_;
+		std::vector<SampledAnswer> entries(queried.size());
+		sample(sampled, pruned ? clamps(sampled, evidence) : clamp, queried, entries, count, strat, seed);
+		for (unsigned i = 0; i < queried.size(); i++)
+			reports[i] = entries[i].report;
+	}
+	return assemble(*net_, queries.size(), nodes, reports);
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+std::map<NodeType, ValueType> NetSnapshot<NodeType, ValueType, DistType, EngineType>::most_probable_explanation(
+	const evidence_type& evidence,
+	unsigned int count,
+	std::uint64_t seed) const {
+	BN_REPORT("most_probable_explanation");
+	std::vector<int> clamp = clamps(*net_, evidence);
+	if (exact()) {
+		BN_PHASE("exact");
+		std::vector<unsigned> best = tree().most_probable(clamp);
+		return best.empty() ? std::map<NodeType, ValueType>() : net_->assignment(best);
+	}
+
+	// Score each state a Gibbs chain visits by its joint log probability
+	const CompiledNet<NodeType, ValueType>& net = *net_;
+	std::vector<unsigned> best;
+	double best_score = -std::numeric_limits<double>::infinity();
+	GibbsChain<NodeType, ValueType, EngineType> chain(net, clamp, EngineType(seed));
+	for (unsigned int i = 0; i < 32; i++)
+		chain.step();
+	for (unsigned int i = 0; i < count; i++) {
+		chain.step();
+		const std::vector<unsigned>& state = chain.state();
+		double log_p = 0;
+		for (unsigned node = 0; node < net.size(); node++)
+			log_p += std::log(net.conditional(node, state, state[node]));
+		if (log_p > best_score) {
+			best_score = log_p;
+			best = state;
+		}
+	}
+	return best.empty() || best_score == -std::numeric_limits<double>::infinity() ?
+		std::map<NodeType, ValueType>() : net.assignment(best);
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+std::vector<int> NetSnapshot<NodeType, ValueType, DistType, EngineType>::clamps(
+	const CompiledNet<NodeType, ValueType>& net,
+	const evidence_type& evidence) {
+	std::vector<int> clamp(net.size(), -1);
+	for (std::pair<NodeType, ValueType> obs : evidence)
+		if (net.contains(obs.first)) {
+			unsigned node = net.index_of(obs.first);
+			clamp[node] = net.value_index(node, obs.second);
+		}
+	return clamp;
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+double NetSnapshot<NodeType, ValueType, DistType, EngineType>::exact_probability(
+	const std::map<NodeType, ValueType>& q,
+	const std::vector<int>& clamp) const {
+	BN_PHASE("exact");
+	// The ratio of the evidence masses with and without the query, each
+	// from a collect pass that leaves the shared tree untouched
+	std::vector<int> joint = clamp;
+	for (std::pair<NodeType, ValueType> p : q) {
+		if (!net_->contains(p.first) || !net_->in_domain(net_->index_of(p.first), p.second))
+			return 0;
+		unsigned node = net_->index_of(p.first);
+		int value = net_->value_index(node, p.second);
+		if (joint[node] >= 0 && joint[node] != value)
+			return 0;
+		joint[node] = value;
+	}
+	double log_mass = tree().log_evidence(clamp);
+	if (log_mass == -std::numeric_limits<double>::infinity())
+		return 0;
+	return std::exp(tree().log_evidence(joint) - log_mass);
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+std::vector<std::map<NodeType, ValueType>> NetSnapshot<NodeType, ValueType, DistType, EngineType>::indicators(
+	const CompiledNet<NodeType, ValueType>& net,
+	const std::vector<std::map<NodeType, ValueType>>& queries,
+	const std::vector<NodeType>& nodes) {
+	std::vector<std::map<NodeType, ValueType>> queried(queries);
+	for (NodeType node_id : nodes) {
+		unsigned node = net.index_of(node_id);
+		for (unsigned v = 0; v < net.cardinality(node); v++)
+			queried.push_back(std::map<NodeType, ValueType> {{node_id, net.value(node, v)}});
+	}
+	return queried;
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+BatchAnswer<DistType> NetSnapshot<NodeType, ValueType, DistType, EngineType>::assemble(
+	const CompiledNet<NodeType, ValueType>& net,
+	std::size_t queries,
+	const std::vector<NodeType>& nodes,
+	const std::vector<ChainReport>& reports) {
+	BatchAnswer<DistType> answer;
+	answer.reports.assign(reports.begin(), reports.begin() + queries);
+	for (const ChainReport& report : answer.reports)
+		answer.joint.push_back(report.estimate());
+	std::size_t i = queries;
+	for (NodeType node_id : nodes) {
+		DistType dist;
+		for (unsigned node = net.index_of(node_id), v = 0; v < net.cardinality(node); v++, i++)
+			if (reports[i].estimate() > 0)
+				dist[net.value(node, v)] = reports[i].estimate();
+		answer.marginals.push_back(dist);
+	}
+	return answer;
+}
+
+// Extends a batch of entries by a fixed number of samples each
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+struct NetSnapshot<NodeType, ValueType, DistType, EngineType>::Extend
+{
+	const NetSnapshot& snapshot;
+	const CompiledNet<NodeType, ValueType>& net;
+	const std::vector<int>& clamp;
+	const std::vector<std::map<NodeType, ValueType>>& queries;
+	std::vector<SampledAnswer>& entries;
+	unsigned long count;
+	std::uint64_t seed;
+
+	template <typename ChainType, typename Accumulator>
+	void apply(unsigned burn_in) {
+		std::vector<Accumulator> members;
+		for (const std::map<NodeType, ValueType>& q : queries)
+			members.push_back(Accumulator(net, q));
+		SwapStats& swaps = entries.front().swaps;
+		std::vector<AccumulatorSet<Accumulator>> chains = ChainExecutor<ChainType>(net, clamp).run(
+			AccumulatorSet<Accumulator>(members), count - entries.front().samples, burn_in,
+			snapshot.chains_, seed, SwapTally(swaps));
+		for (std::size_t j = 0; j < entries.size(); j++) {
+			std::vector<Accumulator>& accumulators = kept(entries[j], (const Accumulator*)0);
+			for (const AccumulatorSet<Accumulator>& chain : chains)
+				accumulators.push_back(chain[j]);
+			if (j > 0)
+				entries[j].swaps = swaps;
+			entries[j].report = summarize_chains(accumulators);
+			entries[j].report.swap_rates = swaps.rates();
+			entries[j].samples = count;
+		}
+	}
+};
+
+// Replaces an entry with chains run until they meet a stopping rule
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+struct NetSnapshot<NodeType, ValueType, DistType, EngineType>::Converge
+{
+	const NetSnapshot& snapshot;
+	const CompiledNet<NodeType, ValueType>& net;
+	const std::vector<int>& clamp;
+	const std::map<NodeType, ValueType>& q;
+	SampledAnswer& entry;
+	const StoppingRule& rule;
+	std::uint64_t seed;
+
+	// The rule sets the burn-in
+	template <typename ChainType, typename Accumulator>
+	void apply(unsigned) {
+		ChainExecutor<ChainType> executor(net, clamp);
+		std::vector<Accumulator>& accumulators = kept(entry, (const Accumulator*)0);
+		accumulators = executor.run_until(Accumulator(net, q), rule, snapshot.chains_, seed, SwapTally(entry.swaps));
+		entry.report = summarize_chains(accumulators);
+		entry.report.burn_in = executor.burn_in();
+		entry.report.swap_rates = entry.swaps.rates();
+		entry.samples = entry.report.samples;
+	}
+};
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+void NetSnapshot<NodeType, ValueType, DistType, EngineType>::sample(
+	const CompiledNet<NodeType, ValueType>& net,
+	const std::vector<int>& clamp,
+	const std::vector<std::map<NodeType, ValueType>>& queries,
+	std::vector<SampledAnswer>& entries,
+	unsigned long count,
+	SampleStrategy strat,
+	std::uint64_t seed) const {
+	if (entries.empty() || entries.front().samples >= count)
+		return;
+	Extend run = {*this, net, clamp, queries, entries, count, seed};
+	with_chain(net, strat, run);
+	for (SampledAnswer& entry : entries)
+		entry.strategy = strat == SampleStrategy::EXACT ? SampleStrategy::GIBBS : strat;
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+void NetSnapshot<NodeType, ValueType, DistType, EngineType>::sample(
+	const CompiledNet<NodeType, ValueType>& net,
+	const std::vector<int>& clamp,
+	const std::map<NodeType, ValueType>& q,
+	SampledAnswer& entry,
+	const StoppingRule& rule,
+	SampleStrategy strat,
+	std::uint64_t seed) const {
+	entry = SampledAnswer();
+	Converge run = {*this, net, clamp, q, entry, rule, seed};
+	with_chain(net, strat, run);
+	entry.strategy = strat == SampleStrategy::EXACT ? SampleStrategy::GIBBS : strat;
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+template <typename Run>
+void NetSnapshot<NodeType, ValueType, DistType, EngineType>::with_chain(
+	const CompiledNet<NodeType, ValueType>& net,
+	SampleStrategy strat,
+	Run& run) {
+	// Weighted particles are drawn independently, with nothing to burn in
+	const unsigned burn_in = 32;
+	if (strat == SampleStrategy::LIKELIHOOD_WEIGHTING)
+		run.template apply<WeightingChain<NodeType, ValueType>, WeightedIndicator<NodeType, ValueType>>(0);
+	else if (strat == SampleStrategy::CHROMATIC_GIBBS)
+		run.template apply<ChromaticGibbsChain<NodeType, ValueType, EngineType>,
+			IndicatorCounter<NodeType, ValueType>>(burn_in);
+	else if (strat == SampleStrategy::TEMPERED)
+		run.template apply<Tempered, IndicatorCounter<NodeType, ValueType>>(burn_in);
+	else if (strat == SampleStrategy::MH)
+		run.template apply<MetropolisChain<NodeType, ValueType, EngineType>,
+			IndicatorCounter<NodeType, ValueType>>(burn_in);
+	else if (net.uniform_cardinality() == fixed_k)
+		run.template apply<FixedGibbs, IndicatorCounter<NodeType, ValueType>>(burn_in);
+	else
+		run.template apply<GibbsChain<NodeType, ValueType, EngineType>,
+			IndicatorCounter<NodeType, ValueType>>(burn_in);
+}
+
+#endif
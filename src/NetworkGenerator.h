@@ -0,0 +1,83 @@
+#ifndef NETWORK_GENERATOR_H
+#define NETWORK_GENERATOR_H
+
+#include "CompiledNet.h"
+#include "Random.h"
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+// Shape of a synthetic network: how many nodes, how many parents each
+// node may have, over how many layers, and how many values each node takes
+struct NetworkShape
+{
+	NetworkShape(unsigned nodes = 100, unsigned fan_in = 2, unsigned depth = 10,
+		unsigned cardinality = 2) :
+		nodes(nodes), fan_in(fan_in), depth(depth), cardinality(cardinality) {}
+
+	unsigned nodes;
+	unsigned fan_in;
+	unsigned depth;
+	unsigned cardinality;
+};
+
+// Random layered network of a given shape. Nodes are dealt round-robin
+// into depth layers; a node past the first layer takes one parent from
+// the layer just above, so the longest path spans every layer, and up to
+// fan_in - 1 more from any earlier layer. CPT rows are drawn uniformly
+// from the simplex. Tables are built flat, so wide networks cost no more
+// to generate than to store.
+template <typename EngineType>
+CompiledNet<int, int> generate_network(const NetworkShape& shape, EngineType& engine) {
+	unsigned n = shape.nodes;
+	unsigned depth = std::max(1u, std::min(shape.depth, n));
+	unsigned k = std::max(1u, shape.cardinality);
+
+	std::vector<int> labels(n);
+	std::vector<std::vector<int>> domains(n, std::vector<int>(k));
+	for (unsigned i = 0; i < n; i++) {
+		labels[i] = i;
+		for (unsigned v = 0; v < k; v++)
+			domains[i][v] = v;
+	}
+
+	// Node i sits in layer i % depth; layers fill in label order
+	std::vector<std::vector<unsigned>> layers(depth);
+	for (unsigned i = 0; i < n; i++)
+		layers[i % depth].push_back(i);
+
+	std::vector<std::vector<unsigned>> parents(n);
+	std::vector<unsigned> earlier;
+	for (unsigned l = 1; l < depth; l++) {
+		earlier.insert(earlier.end(), layers[l - 1].begin(), layers[l - 1].end());
+		for (unsigned node : layers[l]) {
+			if (shape.fan_in == 0)
+				continue;
+			std::vector<unsigned>& p = parents[node];
+			const std::vector<unsigned>& above = layers[l - 1];
+			p.push_back(above[uniform_index(engine, above.size())]);
+			unsigned want = std::min<unsigned>(shape.fan_in, earlier.size());
+			while (p.size() < want) {
+				unsigned candidate = earlier[uniform_index(engine, earlier.size())];
+				if (std::find(p.begin(), p.end(), candidate) == p.end())
+					p.push_back(candidate);
+			}
+		}
+	}
+
+	// Uniform points on the simplex from normalized exponential variates
+	std::vector<std::vector<double>> tables(n);
+	for (unsigned i = 0; i < n; i++) {
+		std::size_t rows = 1;
+		for (std::size_t j = 0; j < parents[i].size(); j++)
+			rows *= k;
+		tables[i].resize(rows * k);
+		for (double& p : tables[i])
+			p = -std::log(1 - uniform_real(engine));
+	}
+
+	return CompiledNet<int, int>(labels, domains, parents, tables);
+}
+
+#endif
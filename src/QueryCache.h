@@ -0,0 +1,161 @@
+#ifndef QUERY_CACHE_H
+#define QUERY_CACHE_H
+
+#include <list>
+#include <map>
+#include <utility>
+#include <cstddef>
+
+// Outcome counts of the lookups made against a query cache
+struct CacheCounters
+{
+	CacheCounters() : hits(0), misses(0), refinements(0) {}
+
+	// Queries answered from a stored result alone
+	unsigned long hits;
+
+	// Queries computed from scratch
+	unsigned long misses;
+
+	// Queries that extended a stored result with further samples
+	unsigned long refinements;
+};
+
+// Bounded map from query keys to results, evicting the least recently
+// used entry once full. A capacity of zero disables caching.
+template <typename Key, typename Value>
+class QueryCache
+{
+public:
+	explicit QueryCache(std::size_t capacity = 64);
+	QueryCache(const QueryCache& other);
+	QueryCache& operator=(const QueryCache& other);
+
+	// Stored result for a key, marked as most recently used, or null
+	Value* find(const Key& key);
+
+	// Store a result, replacing any result under the same key
+	void insert(const Key& key, const Value& value);
+
+	// Drop every entry whose key satisfies a predicate
+	template <typename Predicate>
+	void erase_if(Predicate stale);
+
+	void clear();
+	void set_capacity(std::size_t capacity);
+	std::size_t capacity() const;
+	std::size_t size() const;
+
+	CacheCounters& counters();
+	const CacheCounters& counters() const;
+private:
+	typedef std::list<std::pair<Key, Value>> entry_list;
+
+	void reindex();
+	void trim();
+
+	std::size_t capacity_;
+	entry_list entries_;
+	std::map<Key, typename entry_list::iterator> index_;
+	CacheCounters counters_;
+};
+
+template <typename Key, typename Value>
+QueryCache<Key, Value>::QueryCache(std::size_t capacity) :
+	capacity_(capacity)
+{}
+
+template <typename Key, typename Value>
+QueryCache<Key, Value>::QueryCache(const QueryCache& other) :
+	capacity_(other.capacity_),
+	entries_(other.entries_),
+	counters_(other.counters_) {
+	reindex();
+}
+
+template <typename Key, typename Value>
+QueryCache<Key, Value>& QueryCache<Key, Value>::operator=(const QueryCache& other) {
+	capacity_ = other.capacity_;
+	entries_ = other.entries_;
+	counters_ = other.counters_;
+	reindex();
+	return *this;
+}
+
+template <typename Key, typename Value>
+Value* QueryCache<Key, Value>::find(const Key& key) {
+	typename std::map<Key, typename entry_list::iterator>::iterator it = index_.find(key);
+	if (it == index_.end())
+		return nullptr;
+	entries_.splice(entries_.begin(), entries_, it->second);
+	return &it->second->second;
+}
+
+template <typename Key, typename Value>
+void QueryCache<Key, Value>::insert(const Key& key, const Value& value) {
+	if (capacity_ == 0)
+		return;
+	typename std::map<Key, typename entry_list::iterator>::iterator it = index_.find(key);
+	if (it != index_.end()) {
+		it->second->second = value;
+		entries_.splice(entries_.begin(), entries_, it->second);
+		return;
+	}
+	entries_.push_front(std::make_pair(key, value));
+	index_[key] = entries_.begin();
+	trim();
+}
+
+template <typename Key, typename Value>
+template <typename Predicate>
+void QueryCache<Key, Value>::erase_if(Predicate stale) {
+	for (typename entry_list::iterator it = entries_.begin(); it != entries_.end(); ) {
+		if (stale(it->first)) {
+			index_.erase(it->first);
+			it = entries_.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
+
+template <typename Key, typename Value>
+void QueryCache<Key, Value>::clear() {
+	entries_.clear();
+	index_.clear();
+}
+
+template <typename Key, typename Value>
+void QueryCache<Key, Value>::set_capacity(std::size_t capacity) {
+	capacity_ = capacity;
+	trim();
+}
+
+template <typename Key, typename Value>
+std::size_t QueryCache<Key, Value>::capacity() const { return capacity_; }
+
+template <typename Key, typename Value>
+std::size_t QueryCache<Key, Value>::size() const { return entries_.size(); }
+
+template <typename Key, typename Value>
+CacheCounters& QueryCache<Key, Value>::counters() { return counters_; }
+
+template <typename Key, typename Value>
+const CacheCounters& QueryCache<Key, Value>::counters() const { return counters_; }
+
+template <typename Key, typename Value>
+void QueryCache<Key, Value>::reindex() {
+	index_.clear();
+	for (typename entry_list::iterator it = entries_.begin(); it != entries_.end(); ++it)
+		index_[it->first] = it;
+}
+
+template <typename Key, typename Value>
+void QueryCache<Key, Value>::trim() {
+	while (entries_.size() > capacity_) {
+		index_.erase(entries_.back().first);
+		entries_.pop_back();
+	}
+}
+
+#endif
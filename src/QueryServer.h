@@ -0,0 +1,220 @@
+#ifndef QUERY_SERVER_H
+#define QUERY_SERVER_H
+
+#include "QueryService.h"
+#include "Errors.h"
+
+#include <string>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Line-oriented front end serving a QueryService on a Unix domain socket,
+// meant for local testing. Each request is one line: a command, then
+// node=value pairs for the query, then optionally "|" and the evidence
+// pairs, then optionally @<milliseconds> for a deadline:
+//
+//   probability 1=0,2=1 | 3=1 @50     ->  ok 0.4213
+//   marginal 4 | 3=1                  ->  ok 0:0.3 1:0.7
+//   mpe | 3=1                         ->  ok 0=1 1=0 2=1 3=1
+//
+// Pairs are separated by commas or spaces. Failures reply "error" and a
+// reason: overloaded, deadline or request. Every connection is served on
+// its own thread until the client closes it or the server stops.
+template <typename Service>
+class QueryServer
+{
+public:
+	typedef typename Service::node_type node_type;
+	typedef typename Service::value_type value_type;
+	typedef typename Service::assignment_type assignment_type;
+
+	// Listen on a socket at the path, replacing any file there; throws
+	// FileException if the socket cannot be set up
+	QueryServer(Service& service, const std::string& path);
+
+	// Closes every connection and removes the socket
+	~QueryServer();
+
+	const std::string& path() const;
+
+	// Reply to one request line, without the newline
+	std::string handle(const std::string& line);
+private:
+	QueryServer(const QueryServer&);
+	QueryServer& operator=(const QueryServer&);
+
+	void listen_loop();
+	void serve(int client);
+
+	Service& service_;
+	std::string path_;
+	int listener_;
+
+	std::mutex mutex_;
+	bool stop_;
+	std::vector<int> clients_;
+	std::vector<std::thread> connections_;
+	std::thread acceptor_;
+};
+
+template <typename Service>
+QueryServer<Service>::QueryServer(Service& service, const std::string& path) :
+	service_(service), path_(path), listener_(-1), stop_(false) {
+	sockaddr_un address;
+	std::memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(address.sun_path))
+		throw FileException();
+	std::strcpy(address.sun_path, path.c_str());
+
+	listener_ = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener_ < 0)
+		throw FileException();
+	unlink(path.c_str());
+	if (bind(listener_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 ||
+		listen(listener_, 16) < 0) {
+		close(listener_);
+		throw FileException();
+	}
+	acceptor_ = std::thread(&QueryServer::listen_loop, this);
+}
+
+template <typename Service>
+QueryServer<Service>::~QueryServer() {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stop_ = true;
+		for (int client : clients_)
+			shutdown(client, SHUT_RDWR);
+	}
+	// Shutting the listener down wakes the blocked accept
+	shutdown(listener_, SHUT_RDWR);
+	acceptor_.join();
+	close(listener_);
+	for (std::thread& connection : connections_)
+		connection.join();
+	unlink(path_.c_str());
+}
+
+template <typename Service>
+const std::string& QueryServer<Service>::path() const { return path_; }
+
+template <typename Service>
+void QueryServer<Service>::listen_loop() {
+	while (true) {
+		int client = accept(listener_, nullptr, nullptr);
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (stop_) {
+			if (client >= 0)
+				close(client);
+			return;
+		}
+		if (client < 0)
+			continue;
+		clients_.push_back(client);
+		connections_.push_back(std::thread(&QueryServer::serve, this, client));
+	}
+}
+
+template <typename Service>
+void QueryServer<Service>::serve(int client) {
+	std::string buffer;
+	char chunk[4096];
+	ssize_t got;
+	while ((got = recv(client, chunk, sizeof(chunk), 0)) > 0) {
+		buffer.append(chunk, got);
+		std::size_t end;
+		while ((end = buffer.find('\n')) != std::string::npos) {
+			std::string reply = handle(buffer.substr(0, end)) + "\n";
+			buffer.erase(0, end + 1);
+			if (send(client, reply.data(), reply.size(), MSG_NOSIGNAL) < 0)
+				break;
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	for (std::size_t i = 0; i < clients_.size(); i++)
+		if (clients_[i] == client) {
+			clients_.erase(clients_.begin() + i);
+			break;
+		}
+	close(client);
+}
+
+template <typename Service>
+std::string QueryServer<Service>::handle(const std::string& line) {
+	// Commas separate pairs as well as spaces do
+	std::string spaced(line);
+	for (char& c : spaced)
+		if (c == ',')
+			c = ' ';
+	std::istringstream tokens(spaced);
+	std::string command, token;
+	tokens >> command;
+
+	assignment_type query, evidence;
+	std::vector<std::string> words;
+	typename Service::clock::time_point deadline = Service::clock::time_point::max();
+	bool given = false;
+	while (tokens >> token) {
+		if (token == "|") {
+			given = true;
+		} else if (token[0] == '@') {
+			std::istringstream ms(token.substr(1));
+			long milliseconds;
+			if (!(ms >> milliseconds))
+				return "error request";
+			deadline = Service::clock::now() + std::chrono::milliseconds(milliseconds);
+		} else if (token.find('=') != std::string::npos) {
+			std::istringstream pair(token.substr(0, token.find('=')) + " " + token.substr(token.find('=') + 1));
+			node_type node;
+			value_type value;
+			if (!(pair >> node >> value))
+				return "error request";
+			(given ? evidence : query)[node] = value;
+		} else if (!given) {
+			words.push_back(token);
+		} else {
+			return "error request";
+		}
+	}
+
+	std::ostringstream reply;
+	try {
+		if (command == "probability" && words.empty() && !query.empty()) {
+			reply << "ok " << service_.probability(query, evidence, deadline).get();
+		} else if (command == "marginal" && words.size() == 1 && query.empty()) {
+			std::istringstream word(words[0]);
+			node_type node;
+			if (!(word >> node))
+				return "error request";
+			reply << "ok";
+			for (const auto& entry : service_.marginal(node, evidence, deadline).get())
+				reply << " " << entry.first << ":" << entry.second;
+		} else if (command == "mpe" && words.empty() && query.empty()) {
+			reply << "ok";
+			for (const auto& entry : service_.most_probable(evidence, deadline).get())
+				reply << " " << entry.first << "=" << entry.second;
+		} else {
+			return "error request";
+		}
+	} catch (const OverloadedException&) {
+		return "error overloaded";
+	} catch (const DeadlineException&) {
+		return "error deadline";
+	} catch (...) {
+		return "error request";
+	}
+	return reply.str();
+}
+
+#endif
@@ -0,0 +1,425 @@
+#ifndef QUERY_SERVICE_H
+#define QUERY_SERVICE_H
+
+#include "BayesNet.h"
+#include "Errors.h"
+#include "ThreadPool.h"
+
+#include <vector>
+#include <map>
+#include <memory>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <exception>
+#include <cstdint>
+#include <algorithm>
+
+// Settings of a query service
+struct ServiceOptions
+{
+	ServiceOptions() :
+		workers(std::max(1u, std::thread::hardware_concurrency())),
+		max_pending(1024),
+		window(std::chrono::microseconds(500)),
+		count(4096),
+		strategy(SampleStrategy::LIKELIHOOD_WEIGHTING),
+		seed(random_seed()) {}
+
+	// Threads answering queries from the shared snapshot
+	unsigned workers;
+
+	// Queries accepted but not yet answered before new ones are refused
+	std::size_t max_pending;
+
+	// How long the first query of a batch waits for others to join it
+	std::chrono::microseconds window;
+
+	// Samples per answer and the strategy drawing them; each batch seeds
+	// its chains from the seed and its own number
+	unsigned count;
+	SampleStrategy strategy;
+	std::uint64_t seed;
+};
+
+// Counts of what a service has done with its queries
+struct ServiceStats
+{
+	ServiceStats() : accepted(0), rejected(0), expired(0), failed(0), answered(0), batches(0) {}
+
+	unsigned long accepted;
+	unsigned long rejected;
+
+	// Accepted queries whose deadline passed before they were run
+	unsigned long expired;
+
+	// Accepted queries that named a node or value the network lacks, or
+	// whose computation threw
+	unsigned long failed;
+	unsigned long answered;
+
+	// Runs of shared chains; queries under the same evidence that arrive
+	// together share one
+	unsigned long batches;
+};
+
+// Thread-safe front for concurrent queries. The service answers from an
+// immutable snapshot of the network, so later changes to the network it
+// was built from do not reach it, and every worker reads the same copy
+// with its own evidence. Queries may be submitted from any thread and are
+// answered through futures. A dispatcher collects the queries that arrive
+// within a short window, groups them by evidence and answers each group
+// from one shared set of chains. Queries beyond max_pending are refused with
+// OverloadedException, and queries still waiting at their deadline fail
+// with DeadlineException; an answer already being computed is delivered
+// even if it completes late. Each query is checked against the network on
+// its own before its group runs: a marginal of an unknown node fails with
+// MissingNodeException and a probability naming an unknown node or value
+// with MissingNodeException or UnknownValueException, without failing the
+// queries batched with it.
+template <
+	typename NodeType = int,
+	typename ValueType = int,
+	typename DistType = std::map<ValueType, double>,
+	typename EngineType = Xoshiro256
+>
+class QueryService
+{
+public:
+	typedef NodeType node_type;
+	typedef ValueType value_type;
+	typedef DistType dist_type;
+	typedef BayesNet<NodeType, ValueType, DistType, EngineType> net_type;
+	typedef NetSnapshot<NodeType, ValueType, DistType, EngineType> snapshot_type;
+	typedef std::map<NodeType, ValueType> assignment_type;
+	typedef Evidence<NodeType, ValueType> evidence_type;
+	typedef std::chrono::steady_clock clock;
+
+	explicit QueryService(std::shared_ptr<const snapshot_type> snapshot,
+		const ServiceOptions& options = ServiceOptions());
+
+	// Serve the network's current snapshot
+	explicit QueryService(net_type& net, const ServiceOptions& options = ServiceOptions());
+
+	// Answers the queries already accepted before returning
+	~QueryService();
+
+	// Probability that every node of q holds its value given the evidence
+	std::future<double> probability(const assignment_type& q,
+		const evidence_type& evidence,
+		clock::time_point deadline = clock::time_point::max());
+
+	// Marginal distribution of one node given the evidence
+	std::future<DistType> marginal(NodeType node_id,
+		const evidence_type& evidence,
+		clock::time_point deadline = clock::time_point::max());
+
+	// Most probable assignment of every node given the evidence
+	std::future<assignment_type> most_probable(const evidence_type& evidence,
+		clock::time_point deadline = clock::time_point::max());
+
+	ServiceStats stats() const;
+private:
+	QueryService(const QueryService&);
+	QueryService& operator=(const QueryService&);
+
+	enum Kind { PROBABILITY, MARGINAL, MPE };
+
+	// One accepted query; only the promise of its kind is used
+	struct Request {
+		Kind kind;
+		assignment_type query;
+		NodeType node;
+		evidence_type evidence;
+		clock::time_point deadline;
+		std::promise<double> probability;
+		std::promise<DistType> marginal;
+		std::promise<assignment_type> mpe;
+	};
+	typedef std::shared_ptr<Request> request_ptr;
+
+	// Queue a request unless the service is full
+	template <typename T>
+	std::future<T> admit(request_ptr request, std::promise<T>& promise);
+
+	void dispatch();
+
+	// Throw what the request would throw against the snapshot's network
+	void check(const Request& request) const;
+
+	// Answer a group of requests that share their evidence
+	void answer(const std::vector<request_ptr>& group, std::uint64_t seed);
+
+	template <typename T>
+	static void fail(std::promise<T>& promise, std::exception_ptr error);
+	static void fail(Request& request, std::exception_ptr error);
+
+	ServiceOptions options_;
+	std::shared_ptr<const snapshot_type> snapshot_;
+
+	mutable std::mutex mutex_;
+	std::condition_variable arrived_;
+	std::condition_variable drained_;
+	std::vector<request_ptr> pending_;
+	std::size_t in_flight_;
+	bool stop_;
+	ServiceStats stats_;
+
+	// Declared last so that it stops before the state its tasks use goes
+	ThreadPool pool_;
+	std::thread dispatcher_;
+};
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+QueryService<NodeType, ValueType, DistType, EngineType>::QueryService(
+	std::shared_ptr<const snapshot_type> snapshot,
+	const ServiceOptions& options) :
+	options_(options),
+	snapshot_(snapshot),
+	in_flight_(0),
+	stop_(false),
+	pool_(std::max(1u, options.workers)) {
+	dispatcher_ = std::thread(&QueryService::dispatch, this);
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+QueryService<NodeType, ValueType, DistType, EngineType>::QueryService(net_type& net,
+	const ServiceOptions& options) :
+	QueryService(net.snapshot(), options) {}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+QueryService<NodeType, ValueType, DistType, EngineType>::~QueryService() {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stop_ = true;
+	}
+	arrived_.notify_all();
+	dispatcher_.join();
+	std::unique_lock<std::mutex> lock(mutex_);
+	drained_.wait(lock, [this]() { return in_flight_ == 0; });
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+std::future<double> QueryService<NodeType, ValueType, DistType, EngineType>::probability(
+	const assignment_type& q,
+	const evidence_type& evidence,
+	clock::time_point deadline) {
+	request_ptr request(new Request());
+	request->kind = PROBABILITY;
+	request->query = q;
+	request->evidence = evidence;
+	request->deadline = deadline;
+	return admit(request, request->probability);
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+std::future<DistType> QueryService<NodeType, ValueType, DistType, EngineType>::marginal(
+	NodeType node_id,
+	const evidence_type& evidence,
+	clock::time_point deadline) {
+	request_ptr request(new Request());
+	request->kind = MARGINAL;
+	request->node = node_id;
+	request->evidence = evidence;
+	request->deadline = deadline;
+	return admit(request, request->marginal);
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+std::future<typename QueryService<NodeType, ValueType, DistType, EngineType>::assignment_type>
+QueryService<NodeType, ValueType, DistType, EngineType>::most_probable(
+	const evidence_type& evidence,
+	clock::time_point deadline) {
+	request_ptr request(new Request());
+	request->kind = MPE;
+	request->evidence = evidence;
+	request->deadline = deadline;
+	return admit(request, request->mpe);
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+ServiceStats QueryService<NodeType, ValueType, DistType, EngineType>::stats() const {
+	std::lock_guard<std::mutex> lock(mutex_);
+	return stats_;
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+template <typename T>
+std::future<T> QueryService<NodeType, ValueType, DistType, EngineType>::admit(request_ptr request,
+	std::promise<T>& promise) {
+	std::future<T> result = promise.get_future();
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (stop_ || in_flight_ >= options_.max_pending) {
+			++stats_.rejected;
+			fail(promise, std::make_exception_ptr(OverloadedException()));
+			return result;
+		}
+		++stats_.accepted;
+		++in_flight_;
+		pending_.push_back(request);
+	}
+	arrived_.notify_one();
+	return result;
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+void QueryService<NodeType, ValueType, DistType, EngineType>::dispatch() {
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (true) {
+		arrived_.wait(lock, [this]() { return stop_ || !pending_.empty(); });
+		if (pending_.empty())
+			return;
+
+		// Let concurrent queries join the first before the batch closes
+		if (!stop_)
+			arrived_.wait_for(lock, options_.window, [this]() { return stop_; });
+		std::vector<request_ptr> batch;
+		batch.swap(pending_);
+
+		std::map<evidence_type, std::vector<request_ptr>> groups;
+		for (const request_ptr& request : batch)
+			groups[request->evidence].push_back(request);
+		std::uint64_t seed = options_.seed + stats_.batches;
+		stats_.batches += groups.size();
+		lock.unlock();
+		for (std::pair<const evidence_type, std::vector<request_ptr>>& group : groups) {
+			std::vector<request_ptr> members;
+			members.swap(group.second);
+			pool_.submit([this, members, seed]() { answer(members, seed); });
+			++seed;
+		}
+		lock.lock();
+	}
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+void QueryService<NodeType, ValueType, DistType, EngineType>::check(const Request& request) const {
+	const CompiledNet<NodeType, ValueType>& net = snapshot_->compiled();
+	if (request.kind == MARGINAL && !net.contains(request.node))
+		throw MissingNodeException();
+	if (request.kind == PROBABILITY)
+		for (std::pair<NodeType, ValueType> p : request.query) {
+			if (!net.contains(p.first))
+				throw MissingNodeException();
+			if (!net.in_domain(net.index_of(p.first), p.second))
+				throw UnknownValueException();
+		}
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+void QueryService<NodeType, ValueType, DistType, EngineType>::answer(const std::vector<request_ptr>& group,
+	std::uint64_t seed) {
+	// Drop what expired while queued and check each query on its own; the
+	// rest share one run
+	clock::time_point now = clock::now();
+	std::vector<bool> live(group.size(), false);
+	std::vector<std::exception_ptr> errors(group.size());
+	unsigned long expired = 0;
+	for (std::size_t i = 0; i < group.size(); i++) {
+		if (group[i]->deadline < now) {
+			errors[i] = std::make_exception_ptr(DeadlineException());
+			++expired;
+			continue;
+		}
+		try {
+			check(*group[i]);
+			live[i] = true;
+		} catch (...) {
+			errors[i] = std::current_exception();
+		}
+	}
+
+	// Every answer is computed before any is delivered, so that the counts
+	// are kept before a caller can see its own query
+	BatchAnswer<DistType> batch;
+	assignment_type explanation;
+	if (std::find(live.begin(), live.end(), true) != live.end()) {
+		const evidence_type& evidence = group.front()->evidence;
+		std::vector<assignment_type> queries;
+		std::vector<NodeType> nodes;
+		bool explain = false;
+		for (std::size_t i = 0; i < group.size(); i++) {
+			if (live[i] && group[i]->kind == PROBABILITY)
+				queries.push_back(group[i]->query);
+			else if (live[i] && group[i]->kind == MARGINAL)
+				nodes.push_back(group[i]->node);
+			else if (live[i])
+				explain = true;
+		}
+		std::exception_ptr batch_error;
+		try {
+			if (!queries.empty() || !nodes.empty())
+				batch = snapshot_->marginal_batch(queries, nodes, evidence, options_.count, options_.strategy, seed);
+		} catch (...) {
+			batch_error = std::current_exception();
+		}
+
+		// The explanation depends only on the evidence, so the group's MPE
+		// requests share one search and its failure
+		std::exception_ptr explain_error;
+		try {
+			if (explain)
+				explanation = snapshot_->most_probable_explanation(evidence, options_.count, seed);
+		} catch (...) {
+			explain_error = std::current_exception();
+		}
+		for (std::size_t i = 0; i < group.size(); i++)
+			if (live[i])
+				errors[i] = group[i]->kind == MPE ? explain_error : batch_error;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		unsigned long failed = std::count_if(errors.begin(), errors.end(),
+			[](const std::exception_ptr& error) { return bool(error); });
+		stats_.expired += expired;
+		stats_.failed += failed - expired;
+		stats_.answered += group.size() - failed;
+	}
+
+	// Batch answers follow the live queries in order
+	std::size_t q = 0, m = 0;
+	for (std::size_t i = 0; i < group.size(); i++) {
+		Request& request = *group[i];
+		if (errors[i])
+			fail(request, errors[i]);
+		else if (request.kind == PROBABILITY)
+			request.probability.set_value(batch.joint[q++]);
+		else if (request.kind == MARGINAL)
+			request.marginal.set_value(batch.marginals[m++]);
+		else
+			request.mpe.set_value(explanation);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		in_flight_ -= group.size();
+	}
+	drained_.notify_all();
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+template <typename T>
+void QueryService<NodeType, ValueType, DistType, EngineType>::fail(std::promise<T>& promise,
+	std::exception_ptr error) {
+	try {
+		promise.set_exception(error);
+	} catch (const std::future_error&) {
+		// Already answered
+	}
+}
+
+template <typename NodeType, typename ValueType, typename DistType, typename EngineType>
+void QueryService<NodeType, ValueType, DistType, EngineType>::fail(Request& request,
+	std::exception_ptr error) {
+	if (request.kind == PROBABILITY)
+		fail(request.probability, error);
+	else if (request.kind == MARGINAL)
+		fail(request.marginal, error);
+	else
+		fail(request.mpe, error);
+}
+
+#endif
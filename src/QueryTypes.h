@@ -0,0 +1,27 @@
+#ifndef QUERY_TYPES_H
+#define QUERY_TYPES_H
+
+#include "ChainExecutor.h"
+
+#include <vector>
+
+// Sampling strategies for methods that use
+// stochastic processes. EXACT answers from a junction tree when the
+// network's treewidth is within the limit and falls back to GIBBS otherwise.
+// TEMPERED runs replica exchange over a ladder of flattened copies of the
+// network, for networks whose deterministic CPTs trap single-site chains.
+enum class SampleStrategy { GIBBS, MH, LIKELIHOOD_WEIGHTING, EXACT, CHROMATIC_GIBBS, TEMPERED };
+
+// Answers of a batch of queries, in the order they were asked
+template <typename DistType>
+struct BatchAnswer
+{
+	// Probability of each joint query and the chains' report behind it
+	std::vector<double> joint;
+	std::vector<ChainReport> reports;
+
+	// Marginal distribution of each single node
+	std::vector<DistType> marginals;
+};
+
+#endif
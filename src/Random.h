@@ -0,0 +1,252 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <random>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// Engines used by the samplers. Every engine is constructed from a seed
+// and a stream id; engines sharing a seed but differing in stream produce
+// independent sequences, so chains and threads can each own one and the
+// whole run stays reproducible from a single seed.
+
+// SplitMix64, used to expand a 64-bit seed into engine state
+class SplitMix64
+{
+public:
+	typedef std::uint64_t result_type;
+
+	explicit SplitMix64(std::uint64_t seed = 0) : state_(seed) {}
+
+	static constexpr result_type min() { return 0; }
+	static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+	result_type operator()() {
+		std::uint64_t z = (state_ += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		return z ^ (z >> 31);
+	}
+private:
+	std::uint64_t state_;
+};
+
+// xoshiro256** by Blackman and Vigna. Streams are separated by the jump
+// polynomial, each jump advancing the sequence by 2^128 draws.
+class Xoshiro256
+{
+public:
+	typedef std::uint64_t result_type;
+
+	explicit Xoshiro256(std::uint64_t seed = 0, std::uint64_t stream = 0) {
+		this->seed(seed, stream);
+	}
+
+	static constexpr result_type min() { return 0; }
+	static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+	void seed(std::uint64_t seed, std::uint64_t stream = 0) {
+		SplitMix64 sm(seed);
+		for (int i = 0; i < 4; i++)
+			s_[i] = sm();
+		for (std::uint64_t i = 0; i < stream; i++)
+			jump();
+	}
+
+	result_type operator()() {
+		const std::uint64_t result = rotl(s_[1] * 5, 7) * 9;
+		const std::uint64_t t = s_[1] << 17;
+		s_[2] ^= s_[0];
+		s_[3] ^= s_[1];
+		s_[1] ^= s_[2];
+		s_[0] ^= s_[3];
+		s_[2] ^= t;
+		s_[3] = rotl(s_[3], 45);
+		return result;
+	}
+
+	// Advance by 2^128 draws
+	void jump() {
+		static const std::uint64_t poly[] = {
+			0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL,
+			0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL };
+		std::uint64_t s[4] = { 0, 0, 0, 0 };
+		for (int i = 0; i < 4; i++)
+			for (int b = 0; b < 64; b++) {
+				if (poly[i] & (1ULL << b))
+					for (int j = 0; j < 4; j++)
+						s[j] ^= s_[j];
+				(*this)();
+			}
+		for (int j = 0; j < 4; j++)
+			s_[j] = s[j];
+	}
+private:
+	friend class Xoshiro256x4;
+
+	static std::uint64_t rotl(std::uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+	std::uint64_t s_[4];
+};
+
+// Four xoshiro256** lanes advanced together for the batch samplers. Lane
+// j is stream 4 * stream + j of the seed. The state is stored word-major
+// so that each word of the four lanes fills one AVX2 register; without
+// AVX2 the same lanes are advanced by scalar code, bit for bit.
+class Xoshiro256x4
+{
+public:
+	explicit Xoshiro256x4(std::uint64_t seed = 0, std::uint64_t stream = 0) {
+		Xoshiro256 lane(seed, 4 * stream);
+		for (int j = 0; j < 4; j++) {
+			for (int i = 0; i < 4; i++)
+				s_[i][j] = lane.s_[i];
+			lane.jump();
+		}
+	}
+
+	// Four uniform doubles in [0, 1) with 52 bits of precision
+	void uniform(double* out) {
+#if defined(__AVX2__)
+		__m256i s0 = _mm256_loadu_si256((const __m256i*)s_[0]);
+		__m256i s1 = _mm256_loadu_si256((const __m256i*)s_[1]);
+		__m256i s2 = _mm256_loadu_si256((const __m256i*)s_[2]);
+		__m256i s3 = _mm256_loadu_si256((const __m256i*)s_[3]);
+		__m256i x5 = _mm256_add_epi64(_mm256_slli_epi64(s1, 2), s1);
+		__m256i r = _mm256_or_si256(_mm256_slli_epi64(x5, 7), _mm256_srli_epi64(x5, 57));
+		__m256i result = _mm256_add_epi64(_mm256_slli_epi64(r, 3), r);
+		__m256i t = _mm256_slli_epi64(s1, 17);
+		s2 = _mm256_xor_si256(s2, s0);
+		s3 = _mm256_xor_si256(s3, s1);
+		s1 = _mm256_xor_si256(s1, s2);
+		s0 = _mm256_xor_si256(s0, s3);
+		s2 = _mm256_xor_si256(s2, t);
+		s3 = _mm256_or_si256(_mm256_slli_epi64(s3, 45), _mm256_srli_epi64(s3, 19));
+		_mm256_storeu_si256((__m256i*)s_[0], s0);
+		_mm256_storeu_si256((__m256i*)s_[1], s1);
+		_mm256_storeu_si256((__m256i*)s_[2], s2);
+		_mm256_storeu_si256((__m256i*)s_[3], s3);
+		__m256i bits = _mm256_or_si256(_mm256_srli_epi64(result, 12),
+			_mm256_set1_epi64x(0x3FF0000000000000LL));
+		_mm256_storeu_pd(out, _mm256_sub_pd(_mm256_castsi256_pd(bits), _mm256_set1_pd(1.0)));
+#else
+		for (int j = 0; j < 4; j++) {
+			std::uint64_t result = Xoshiro256::rotl(s_[1][j] * 5, 7) * 9;
+			std::uint64_t t = s_[1][j] << 17;
+			s_[2][j] ^= s_[0][j];
+			s_[3][j] ^= s_[1][j];
+			s_[1][j] ^= s_[2][j];
+			s_[0][j] ^= s_[3][j];
+			s_[2][j] ^= t;
+			s_[3][j] = Xoshiro256::rotl(s_[3][j], 45);
+			std::uint64_t bits = (result >> 12) | 0x3FF0000000000000ULL;
+			std::memcpy(&out[j], &bits, sizeof(double));
+			out[j] -= 1.0;
+		}
+#endif
+	}
+private:
+	// Left at natural alignment so that heap-allocated chains stay plain
+	// new; the vector path uses unaligned loads
+	std::uint64_t s_[4][4];
+};
+
+// Philox4x32-10 by Salmon et al. A counter-based engine: the seed is the
+// key, the stream fills the upper half of the counter and every block of
+// four 32-bit words is a pure function of (key, counter).
+class Philox4x32
+{
+public:
+	typedef std::uint64_t result_type;
+
+	explicit Philox4x32(std::uint64_t seed = 0, std::uint64_t stream = 0) {
+		this->seed(seed, stream);
+	}
+
+	static constexpr result_type min() { return 0; }
+	static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+	void seed(std::uint64_t seed, std::uint64_t stream = 0) {
+		key_[0] = static_cast<std::uint32_t>(seed);
+		key_[1] = static_cast<std::uint32_t>(seed >> 32);
+		counter_ = 0;
+		stream_ = stream;
+		next_ = 2;
+	}
+
+	result_type operator()() {
+		if (next_ == 2) {
+			generate();
+			next_ = 0;
+		}
+		return block_[next_++];
+	}
+
+	// Skip ahead by n draws in constant time
+	void discard(unsigned long long n) {
+		std::uint64_t position = 2 * counter_ - 2 + next_ + n;
+		counter_ = position / 2;
+		next_ = 2;
+		if (position % 2) {
+			generate();
+			next_ = 1;
+		}
+	}
+private:
+	void generate() {
+		std::uint32_t c[4] = {
+			static_cast<std::uint32_t>(counter_),
+			static_cast<std::uint32_t>(counter_ >> 32),
+			static_cast<std::uint32_t>(stream_),
+			static_cast<std::uint32_t>(stream_ >> 32) };
+		std::uint32_t k[2] = { key_[0], key_[1] };
+		for (int round = 0; round < 10; round++) {
+			std::uint64_t p0 = 0xD2511F53ULL * c[0];
+			std::uint64_t p1 = 0xCD9E8D57ULL * c[2];
+			std::uint32_t d[4] = {
+				static_cast<std::uint32_t>(p1 >> 32) ^ c[1] ^ k[0],
+				static_cast<std::uint32_t>(p1),
+				static_cast<std::uint32_t>(p0 >> 32) ^ c[3] ^ k[1],
+				static_cast<std::uint32_t>(p0) };
+			for (int i = 0; i < 4; i++)
+				c[i] = d[i];
+			k[0] += 0x9E3779B9U;
+			k[1] += 0xBB67AE85U;
+		}
+		block_[0] = (static_cast<std::uint64_t>(c[1]) << 32) | c[0];
+		block_[1] = (static_cast<std::uint64_t>(c[3]) << 32) | c[2];
+		++counter_;
+	}
+
+	std::uint32_t key_[2];
+	std::uint64_t counter_;
+	std::uint64_t stream_;
+	std::uint64_t block_[2];
+	unsigned next_;
+};
+
+// 64-bit seed drawn from std::random_device
+inline std::uint64_t random_seed() {
+	std::random_device rd;
+	return (static_cast<std::uint64_t>(rd()) << 32) | rd();
+}
+
+// Uniform double in [0, 1) from the top 53 bits of a 64-bit draw
+template <typename Engine>
+inline double uniform_real(Engine& engine) {
+	return (engine() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Uniform integer in [0, n) by Lemire's multiply-shift reduction; the
+// bias is at most n / 2^32 and is not corrected
+template <typename Engine>
+inline unsigned uniform_index(Engine& engine, unsigned n) {
+	return static_cast<unsigned>(((engine() >> 32) * n) >> 32);
+}
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef RELEVANCE_H
+#define RELEVANCE_H
+
+#include "CompiledNet.h"
+#include "CondProb.h"
+#include "Instrument.h"
+
+#include <vector>
+#include <map>
+#include <set>
+#include <memory>
+#include <utility>
+
+// Bayes-ball marks of the nodes relevant to a query: CPD for nodes whose
+// CPD the query needs, EVIDENCE for observed nodes needed only as a
+// condition
+enum class Relevance { IRRELEVANT, EVIDENCE, CPD };
+
+// Mark every compiled node for a query on the given nodes under the
+// clamped values, by Shachter's Bayes-ball: a ball passes from an
+// unobserved node that a child sent it to both parents and children, from
+// an unobserved node that a parent sent it on to the children, and from an
+// observed node that a parent sent it back to the parents. Nodes passing
+// it to their parents need their CPDs; observed nodes it reaches are the
+// evidence.
+template <typename NodeType, typename ValueType>
+std::vector<Relevance> relevance(const CompiledNet<NodeType, ValueType>& net,
+	const std::vector<unsigned>& query,
+	const std::vector<int>& clamp) {
+	BN_PHASE("relevance");
+	std::vector<char> up(net.size(), 0), down(net.size(), 0), visited(net.size(), 0);
+	std::vector<std::pair<unsigned, bool>> stack;
+	for (unsigned node : query)
+		stack.push_back(std::make_pair(node, true));
+	while (!stack.empty()) {
+		unsigned node = stack.back().first;
+		bool from_child = stack.back().second;
+		stack.pop_back();
+		visited[node] = 1;
+		bool observed = clamp[node] >= 0;
+		bool to_parents = false, to_children = false;
+		if (from_child && !observed) {
+			to_parents = !up[node];
+			to_children = !down[node];
+		} else if (!from_child) {
+			to_parents = observed && !up[node];
+			to_children = !observed && !down[node];
+		}
+		if (to_parents) {
+			up[node] = 1;
+			for (const unsigned* p = net.parents_begin(node); p != net.parents_end(node); ++p)
+				stack.push_back(std::make_pair(*p, true));
+		}
+		if (to_children) {
+			down[node] = 1;
+			for (const unsigned* c = net.children_begin(node); c != net.children_end(node); ++c)
+				stack.push_back(std::make_pair(*c, false));
+		}
+	}
+
+	std::vector<Relevance> marks(net.size(), Relevance::IRRELEVANT);
+	for (unsigned node = 0; node < net.size(); node++)
+		if (up[node])
+			marks[node] = Relevance::CPD;
+		else if (visited[node] && clamp[node] >= 0)
+			marks[node] = Relevance::EVIDENCE;
+	return marks;
+}
+
+// Compiled subnetwork of the marked nodes: nodes marked CPD keep their
+// CPDs, and evidence needed only as a condition becomes a root certain of
+// its clamped value. Null when every node is marked.
+template <typename DistType, typename NodeType, typename ValueType>
+std::shared_ptr<const CompiledNet<NodeType, ValueType>> relevant_subnet(
+	const CompiledNet<NodeType, ValueType>& net,
+	const std::vector<Relevance>& marks,
+	const std::vector<int>& clamp) {
+	std::set<NodeType> nodes;
+	std::map<NodeType, std::set<NodeType>> parents;
+	std::map<NodeType, CondProb<NodeType, ValueType, DistType>> probabilities;
+	for (unsigned node = 0; node < net.size(); node++) {
+		if (marks[node] == Relevance::IRRELEVANT)
+			continue;
+		NodeType node_id = net.label(node);
+		nodes.insert(node_id);
+		if (marks[node] == Relevance::CPD) {
+			std::set<NodeType>& node_parents = parents[node_id];
+			for (const unsigned* p = net.parents_begin(node); p != net.parents_end(node); ++p)
+				node_parents.insert(net.label(*p));
+			probabilities.insert(std::make_pair(node_id, net.template cpd<DistType>(node)));
+		} else {
+			DistType certain;
+			for (unsigned v = 0; v < net.cardinality(node); v++)
+				certain[net.value(node, v)] = (int)v == clamp[node] ? 1.0 : 0.0;
+			probabilities.insert(std::make_pair(node_id, CondProb<NodeType, ValueType, DistType>(
+				std::map<std::vector<ValueType>, DistType> {{ std::vector<ValueType>(), certain }})));
+		}
+	}
+
+	if (nodes.size() == net.size())
+		return nullptr;
+	BN_PHASE("compile");
+	return std::make_shared<const CompiledNet<NodeType, ValueType>>(nodes, parents, probabilities);
+}
+
+#endif
@@ -0,0 +1,218 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <type_traits>
+
+// Work-stealing thread pool. Each worker owns a deque: it pops its own
+// newest task and, when empty, steals the oldest task of another worker.
+// Tasks submitted from a worker go to that worker's deque; tasks from
+// other threads are dealt round robin.
+class ThreadPool
+{
+public:
+	explicit ThreadPool(unsigned threads = std::thread::hardware_concurrency());
+	~ThreadPool();
+
+	// Shared pool with one worker per hardware thread
+	static ThreadPool& instance();
+
+	unsigned size() const;
+
+	template <typename F>
+	std::future<typename std::result_of<F()>::type> submit(F task);
+
+	// Run one queued task on the calling thread, if there is one
+	bool run_pending();
+
+	// Wait for a future of a task submitted to this pool, running queued
+	// tasks meanwhile so that tasks may wait on tasks they submitted, and
+	// sleeping while there is nothing to run
+	template <typename T>
+	void wait(const std::future<T>& result);
+private:
+	ThreadPool(const ThreadPool&);
+	ThreadPool& operator=(const ThreadPool&);
+
+	struct Queue {
+		std::mutex mutex;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	// Worker index of the calling thread in this pool, or -1
+	int worker_index() const;
+	static std::pair<const ThreadPool*, int>& current_worker();
+
+	void push(std::function<void()> task);
+	bool pop(int self, std::function<void()>& task);
+
+	// Run a popped task and wake the threads in wait()
+	void run(std::function<void()>& task);
+	void work(unsigned self);
+
+	std::vector<std::unique_ptr<Queue>> queues_;
+	std::vector<std::thread> workers_;
+	std::mutex mutex_;
+	std::condition_variable ready_;
+
+	// Signalled to the waiting_ threads in wait() when a task is queued or
+	// finishes
+	std::condition_variable idle_;
+	unsigned waiting_;
+	std::atomic<unsigned> pending_;
+	std::atomic<unsigned> next_;
+	bool stop_;
+};
+
+inline ThreadPool::ThreadPool(unsigned threads) :
+	waiting_(0), pending_(0), next_(0), stop_(false) {
+	if (threads == 0)
+		threads = 1;
+	for (unsigned i = 0; i < threads; i++)
+		queues_.push_back(std::unique_ptr<Queue>(new Queue()));
+	for (unsigned i = 0; i < threads; i++)
+		workers_.push_back(std::thread(&ThreadPool::work, this, i));
+}
+
+inline ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stop_ = true;
+	}
+	ready_.notify_all();
+	for (std::thread& worker : workers_)
+		worker.join();
+}
+
+inline ThreadPool& ThreadPool::instance() {
+	static ThreadPool pool;
+	return pool;
+}
+
+inline unsigned ThreadPool::size() const { return workers_.size(); }
+
+template <typename F>
+std::future<typename std::result_of<F()>::type> ThreadPool::submit(F task) {
+	typedef typename std::result_of<F()>::type Result;
+	std::shared_ptr<std::packaged_task<Result()>> packaged(
+		new std::packaged_task<Result()>(task));
+	std::future<Result> result = packaged->get_future();
+	push([packaged]() { (*packaged)(); });
+	return result;
+}
+
+inline bool ThreadPool::run_pending() {
+	std::function<void()> task;
+	if (!pop(worker_index(), task))
+		return false;
+	run(task);
+	return true;
+}
+
+template <typename T>
+void ThreadPool::wait(const std::future<T>& result) {
+	auto ready = [&result]() {
+		return result.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+	};
+	while (!ready()) {
+		if (run_pending())
+			continue;
+
+		// The task is running elsewhere; sleep until it or another
+		// finishes, or until there is work to steal
+		std::unique_lock<std::mutex> lock(mutex_);
+		++waiting_;
+		idle_.wait(lock, [this, &ready]() { return pending_ > 0 || ready(); });
+		--waiting_;
+	}
+}
+
+inline std::pair<const ThreadPool*, int>& ThreadPool::current_worker() {
+	static thread_local std::pair<const ThreadPool*, int> worker(nullptr, -1);
+	return worker;
+}
+
+inline int ThreadPool::worker_index() const {
+	const std::pair<const ThreadPool*, int>& worker = current_worker();
+	return worker.first == this ? worker.second : -1;
+}
+
+inline void ThreadPool::push(std::function<void()> task) {
+	int self = worker_index();
+	unsigned target = self >= 0 ? self : next_++ % queues_.size();
+	{
+		std::lock_guard<std::mutex> lock(queues_[target]->mutex);
+		queues_[target]->tasks.push_back(std::move(task));
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		++pending_;
+		if (waiting_)
+			idle_.notify_all();
+	}
+	ready_.notify_one();
+}
+
+inline bool ThreadPool::pop(int self, std::function<void()>& task) {
+	if (pending_ == 0)
+		return false;
+
+	// Own queue from the back, then steal from the front of the others
+	if (self >= 0) {
+		Queue& own = *queues_[self];
+		std::lock_guard<std::mutex> lock(own.mutex);
+		if (!own.tasks.empty()) {
+			task = std::move(own.tasks.back());
+			own.tasks.pop_back();
+			--pending_;
+			return true;
+		}
+	}
+	unsigned n = queues_.size();
+	unsigned start = self >= 0 ? self + 1 : next_.load();
+	for (unsigned i = 0; i < n; i++) {
+		Queue& victim = *queues_[(start + i) % n];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+		if (!victim.tasks.empty()) {
+			task = std::move(victim.tasks.front());
+			victim.tasks.pop_front();
+			--pending_;
+			return true;
+		}
+	}
+	return false;
+}
+
+inline void ThreadPool::run(std::function<void()>& task) {
+	task();
+	task = nullptr;
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (waiting_)
+		idle_.notify_all();
+}
+
+inline void ThreadPool::work(unsigned self) {
+	current_worker() = std::make_pair(this, (int)self);
+	std::function<void()> task;
+	while (true) {
+		if (pop(self, task)) {
+			run(task);
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(mutex_);
+		ready_.wait(lock, [this]() { return stop_ || pending_ > 0; });
+		if (stop_ && pending_ == 0)
+			return;
+	}
+}
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef WEIGHTING_H
+#define WEIGHTING_H
+
+#include "CompiledNet.h"
+#include "BatchSampler.h"
+#include "Random.h"
+
+#include <vector>
+
+// Likelihood weighting presented as a chain of independent particles, so
+// that the chain executor can run it on the pool like the MCMC chains.
+// Particles are drawn a batch at a time by the column sampler with the
+// evidence clamped, and each is weighted by the likelihood of the
+// evidence given its sampled parents. Each step moves to the next particle
+// of the batch; accumulators receive the state and its log weight.
+template <
+	typename NodeType = int,
+	typename ValueType = int
+>
+class WeightingChain
+{
+public:
+	typedef CompiledNet<NodeType, ValueType> net_type;
+	typedef Xoshiro256x4 engine_type;
+
+	WeightingChain(const CompiledNet<NodeType, ValueType>& net,
+		const std::vector<int>& clamp,
+		const Xoshiro256x4& engine,
+		unsigned batch_size = 256);
+
+	void step();
+
+	const std::vector<unsigned>& state() const;
+
+	// Log importance weight of the current state
+	double log_weight() const;
+
+	Xoshiro256x4& engine();
+private:
+	BatchSampler<NodeType, ValueType> sampler_;
+	SampleBatch<NodeType, ValueType> batch_;
+	std::vector<double> log_weights_;
+	unsigned next_;
+	std::vector<unsigned> state_;
+	Xoshiro256x4 engine_;
+};
+
+// Weighted chains pass the log weight along with the state
+template <typename Accumulator, typename NodeType, typename ValueType>
+void visit_state(Accumulator& accumulator, const WeightingChain<NodeType, ValueType>& chain) {
+	accumulator(chain.state(), chain.log_weight());
+}
+
+template <typename NodeType, typename ValueType>
+WeightingChain<NodeType, ValueType>::WeightingChain(const CompiledNet<NodeType, ValueType>& net,
+	const std::vector<int>& clamp,
+	const Xoshiro256x4& engine,
+	unsigned batch_size) :
+	sampler_(net, clamp),
+	batch_(net, batch_size ? batch_size : 1),
+	next_(batch_.size()),
+	state_(net.size()),
+	engine_(engine)
+{}
+
+template <typename NodeType, typename ValueType>
+void WeightingChain<NodeType, ValueType>::step() {
+	if (next_ == batch_.size()) {
+		sampler_.sample(batch_, engine_);
+		sampler_.log_likelihood(batch_, log_weights_);
+		next_ = 0;
+	}
+	for (unsigned node = 0; node < state_.size(); node++)
+		state_[node] = batch_.column(node)[next_];
+	++next_;
+}
+
+template <typename NodeType, typename ValueType>
+const std::vector<unsigned>& WeightingChain<NodeType, ValueType>::state() const { return state_; }
+
+template <typename NodeType, typename ValueType>
+double WeightingChain<NodeType, ValueType>::log_weight() const { return log_weights_[next_ - 1]; }
+
+template <typename NodeType, typename ValueType>
+Xoshiro256x4& WeightingChain<NodeType, ValueType>::engine() { return engine_; }
+
+#endif